@@ -1,12 +1,59 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <map>
+#include <queue>
+#include <set>
+#include <unordered_map>
+#include <tuple>
 #include <utility>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <iterator>
+#include <string_view>
+#include <charconv>
+#include <deque>
+#include <list>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define AUCTION_IO_URING 1
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 using std::cerr;
 using std::cin;
@@ -18,24 +65,120 @@ using std::unique_ptr;
 using std::vector;
 using std::map;
 using std::pair;
+using std::unordered_map;
+
+using UserId = uint32_t;
+const UserId kNoUser = UINT32_MAX;
+// Справочник выдаёт ID меньше kMaxUsers: ID участника хранится в слове
+// ставки лота рядом с ценой, и его старшее значение занято под «нет ставок».
+const UserId kMaxUsers = (UserId(1) << 28) - 1;
+
+// Общий на процесс справочник имён: каждому имени один раз выдаётся плотный
+// 32-битный ID, а лоты, сообщения и снимок хранят только его. Имена лежат в
+// страницах, которые никогда не перемещаются, поэтому получение имени по ID
+// обходится без блокировок; поиск ID по имени берёт разделяемую блокировку.
+class UserDirectory {
+private:
+    static constexpr size_t kPageBits = 12;
+    static constexpr size_t kPageSize = size_t(1) << kPageBits;
+    static constexpr size_t kMaxPages = size_t(1) << 16;
+
+    struct Page {
+        string names[kPageSize];
+    };
+
+    std::unique_ptr<std::atomic<Page *>[]> pages;
+    std::atomic<uint32_t> count{0};
+    mutable std::shared_mutex mutex;
+    unordered_map<std::string_view, UserId> ids;
+
+    UserDirectory() : pages(new std::atomic<Page *>[kMaxPages]()) {}
+
+public:
+    UserDirectory(const UserDirectory &) = delete;
+    UserDirectory &operator=(const UserDirectory &) = delete;
+
+    ~UserDirectory() {
+        for (size_t i = 0; i < kMaxPages; ++i) {
+            delete pages[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    static UserDirectory &instance() {
+        static UserDirectory directory;
+        return directory;
+    }
+
+    UserId find(std::string_view name) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = ids.find(name);
+        return it == ids.end() ? kNoUser : it->second;
+    }
+
+    // false — имени ещё нет, а места для нового уже нет: intern бросит исключение.
+    bool accepts(std::string_view name) const {
+        return count.load(std::memory_order_acquire) < kMaxUsers || find(name) != kNoUser;
+    }
+
+    UserId intern(std::string_view name) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = ids.find(name);
+            if (it != ids.end()) {
+                return it->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        UserId id = count.load(std::memory_order_relaxed);
+        if (id >= kMaxUsers) {
+            throw std::length_error("справочник пользователей переполнен");
+        }
+        std::atomic<Page *> &slot = pages[id >> kPageBits];
+        Page *page = slot.load(std::memory_order_relaxed);
+        if (!page) {
+            page = new Page();
+            slot.store(page, std::memory_order_release);
+        }
+        string &stored = page->names[id & (kPageSize - 1)];
+        stored.assign(name.data(), name.size());
+        ids.emplace(std::string_view(stored), id);
+        count.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    const string &name(UserId id) const {
+        static const string unknown;
+        if (id >= count.load(std::memory_order_acquire)) {
+            return unknown;
+        }
+        return pages[id >> kPageBits].load(std::memory_order_acquire)->names[id & (kPageSize - 1)];
+    }
+
+    size_t size() const { return count.load(std::memory_order_acquire); }
+};
 
 class User {
 protected:
-    string username;
+    UserId id;
     size_t passwordHash;
 
 public:
-    User(string name, const string &pass) : username(name) {
+    User(const string &name, const string &pass) : id(UserDirectory::instance().intern(name)) {
         passwordHash = hashPassword(pass);
     }
 
-    User(string name, size_t hash) : username(name), passwordHash(hash) {}
+    User(const string &name, size_t hash) : id(UserDirectory::instance().intern(name)), passwordHash(hash) {}
 
     virtual void displayInfo() const {
-        cout << "Пользователь: " << username << endl;
+        cout << "Пользователь: " << getUsername() << endl;
     }
 
-    string getUsername() const { return username; }
+    UserId getId() const { return id; }
+    const string &getUsername() const { return UserDirectory::instance().name(id); }
     size_t getPasswordHash() const { return passwordHash; }
 
     bool checkPassword(const string &pass) const {
@@ -57,7 +200,7 @@ public:
     Buyer(string name, size_t hash) : User(name, hash) {}
 
     void displayInfo() const override {
-        cout << "Покупатель: " << username << endl;
+        cout << "Покупатель: " << getUsername() << endl;
     }
 };
 
@@ -66,355 +209,12478 @@ public:
     Seller(string name, const string &pass) : User(name, pass) {}
 
     void displayInfo() const override {
-        cout << "Продавец: " << username << endl;
+        cout << "Продавец: " << getUsername() << endl;
     }
 };
 
-class Item {
-private:
-    static int idCounter;
-    int id;
-    string name;
-    double price;
-    string owner;
+// Текст ответов, собираемый без iostream. Когда буфер дорастает до
+// capacity, вызывается overflow(); по умолчанию буфер просто растёт.
+class OutputBuffer {
+protected:
+    string buffer;
+    size_t capacity;
+
+    virtual void overflow() {}
+
+    OutputBuffer &appended() {
+        if (buffer.size() >= capacity) {
+            overflow();
+        }
+        return *this;
+    }
 
 public:
-    Item(string itemName, double itemPrice, const string &itemOwner)
-        : id(idCounter++), name(itemName), price(itemPrice), owner(itemOwner) {}
+    explicit OutputBuffer(size_t limit = SIZE_MAX) : capacity(limit) {}
+    virtual ~OutputBuffer() = default;
 
-    int getId() const { return id; }
-    string getName() const { return name; }
-    double getPrice() const { return price; }
-    void setPrice(double newPrice) { price = newPrice; }
-    string getOwner() const { return owner; }
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
 
-    void setId(int newId) { id = newId; }
+    OutputBuffer &operator<<(std::string_view text) {
+        buffer.append(text);
+        return appended();
+    }
 
-    void displayInfo() const {
-        cout << "ID: " << id << ", Товар: " << name << ", Цена: " << price << ", Продавец: " << owner << endl;
+    OutputBuffer &operator<<(char c) {
+        buffer.push_back(c);
+        return appended();
     }
-};
 
-int Item::idCounter = 1;
+    OutputBuffer &operator<<(uint64_t value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        return *this << std::string_view(digits, static_cast<size_t>(result.ptr - digits));
+    }
 
-class Message {
+    OutputBuffer &operator<<(double value) {
+        char digits[32];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        return *this << std::string_view(digits, static_cast<size_t>(result.ptr - digits));
+    }
+
+    // Граница страницы: выводу, который пишет в файл или поток, пора
+    // отдать накопленное. Буфер в памяти ничего не делает.
+    virtual void flush() {}
+
+    const char *data() const { return buffer.data(); }
+    size_t size() const { return buffer.size(); }
+    bool empty() const { return buffer.empty(); }
+
+    // Отбрасывает уже отправленное начало буфера.
+    void consume(size_t bytes) { buffer.erase(0, bytes); }
+};
+
+// Накопительный вывод в файловый дескриптор: текст уходит одним write,
+// когда буфер заполнится, при flush или в деструкторе.
+class BufferedWriter : public OutputBuffer {
 private:
-    string fromUser ;
-    string content;
-    int itemId;
+    int fd;
 
-public:
-    Message(const string &from, const string &msg, int id)
-        : fromUser (from), content(msg), itemId(id) {}
+protected:
+    void overflow() override { flush(); }
 
-    void display() const {
-        cout << fromUser  << ": " << content << " (Товар ID: " << itemId << ")" << endl;
+public:
+    explicit BufferedWriter(int outFd, size_t bufferSize = 1 << 16) : OutputBuffer(bufferSize), fd(outFd) {
+        buffer.reserve(bufferSize);
     }
 
-    string getFromUser () const { return fromUser ; }
-    string getContent() const { return content; }
-    int getItemId() const { return itemId; }
+    ~BufferedWriter() override { flush(); }
+
+    void flush() override {
+        const char *data = buffer.data();
+        size_t left = buffer.size();
+        while (left > 0) {
+            ssize_t written = ::write(fd, data, left);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            data += written;
+            left -= static_cast<size_t>(written);
+        }
+        buffer.clear();
+    }
 };
 
-class Auction {
+// Тот же накопительный вывод поверх std::ostream — для меню, где подсказки
+// печатаются через cout и порядок вывода должен сохраняться. Страница
+// уходит в поток одним write и сбрасывается на flush().
+class StreamWriter : public OutputBuffer {
 private:
-    vector<unique_ptr<Item>> items;
-    map<pair<string, int>, vector<Message>> messages;
+    std::ostream &stream;
+
+protected:
+    void overflow() override {
+        stream.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+
+public:
+    explicit StreamWriter(std::ostream &target, size_t bufferSize = 1 << 16)
+        : OutputBuffer(bufferSize), stream(target) {
+        buffer.reserve(bufferSize);
+    }
+
+    ~StreamWriter() override { flush(); }
+
+    void flush() override {
+        overflow();
+        stream.flush();
+    }
+};
+
+using ItemId = uint64_t;
+const ItemId kNoItem = 0;
 
+// Ставки одного лота: история и книга заявок с автоповышением.
+// История хранится блоками, внутри блока колонками — [цены u64][участники u32]
+// [время u32], 16 байт на ставку. Первый блок растёт в полтора раза до
+// kBlockBids ставок, дальше добавляются полные блоки, так что запас на лот
+// меньше одного блока и на горячем лоте почти не виден. Новые ставки
+// дописываются в хвосты колонок последнего блока, поэтому последние ставки
+// горячего лота лежат в нескольких соседних кэш-линиях. Время — миллисекунды от первой ставки лота (до 49 суток,
+// дальше насыщается). Старший бит участника помечает ставку, сделанную
+// автоповышением. Методы вызываются под занятостью истории лота.
+class BidBook {
 public:
-    void addItem(unique_ptr<Item> item) { items.push_back(move(item)); }
+    static constexpr uint32_t kProxyFlag = 1u << 31;
+    static constexpr size_t kBytesPerBid = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    static constexpr uint32_t kBlockBids = 256;
+
+    struct Entry {
+        uint32_t bidder;
+        bool proxy;
+        uint64_t cents;
+        uint64_t time;
+    };
+
+    // Заявка: участник готов поднимать цену до max. seq — порядок подачи,
+    // при равных max выигрывает более ранняя заявка.
+    struct Proxy {
+        uint64_t max;
+        uint32_t bidder;
+        uint32_t seq;
+    };
 
-    void displayItems() const {
-        if (items.empty()) {
-            cout << "Нет доступных товаров." << endl;
+private:
+    vector<std::unique_ptr<char[]>> blocks;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    // Ёмкость первого блока; остальные всегда на kBlockBids ставок.
+    uint32_t firstCapacity = 0;
+    uint64_t base = 0;
+    // По убыванию max, при равенстве — по возрастанию seq; у участника одна заявка.
+    vector<Proxy> proxies;
+    uint32_t nextSeq = 0;
+
+    uint32_t capacityOf(size_t block) const { return block == 0 ? firstCapacity : kBlockBids; }
+    uint64_t *amounts(size_t block) const { return reinterpret_cast<uint64_t *>(blocks[block].get()); }
+    uint32_t *bidders(size_t block) const {
+        return reinterpret_cast<uint32_t *>(blocks[block].get() + capacityOf(block) * sizeof(uint64_t));
+    }
+    uint32_t *times(size_t block) const { return bidders(block) + capacityOf(block); }
+
+    void grow() {
+        if (firstCapacity == kBlockBids) {
+            blocks.emplace_back(new char[kBlockBids * kBytesPerBid]);
+            capacity += kBlockBids;
             return;
         }
-        for (const auto &item : items) {
-            item->displayInfo();
+        uint32_t wanted = firstCapacity < 4 ? 4 : std::min(firstCapacity + firstCapacity / 2, kBlockBids);
+        std::unique_ptr<char[]> next(new char[wanted * kBytesPerBid]);
+        if (count != 0) {
+            std::memcpy(next.get(), amounts(0), count * sizeof(uint64_t));
+            std::memcpy(next.get() + wanted * sizeof(uint64_t), bidders(0), count * sizeof(uint32_t));
+            std::memcpy(next.get() + wanted * (sizeof(uint64_t) + sizeof(uint32_t)), times(0), count * sizeof(uint32_t));
+            blocks[0] = std::move(next);
+        } else {
+            blocks.push_back(std::move(next));
         }
+        firstCapacity = wanted;
+        capacity = wanted;
     }
 
-    void buyItem(const string &itemName, Buyer *buyer) {
-        for (auto it = items.begin(); it != items.end(); ++it) {
-            if ((*it)->getName() == itemName) {
-                cout << "Покупатель " << buyer->getUsername() << " купил " << itemName
-                     << " за " << (*it)->getPrice() << endl;
-                items.erase(it);
-                return;
+    const Proxy *proxyOf(uint32_t bidder) const {
+        for (const Proxy &proxy : proxies) {
+            if (proxy.bidder == bidder) {
+                return &proxy;
             }
         }
-        cout << "Товар " << itemName << " не найден." << endl;
+        return nullptr;
     }
 
-    void bidItem(const string &itemName, double bidPrice, Buyer *buyer) {
-        for (auto &item : items) {
-            if (item->getName() == itemName) {
-                if (bidPrice > item->getPrice()) {
-                    item->setPrice(bidPrice);
-                    cout << "Покупатель " << buyer->getUsername() << " повысил цену на "
-                         << itemName << " до " << bidPrice << endl;
-                    return;
-                } else {
-                    cout << "Ставка слишком низкая. Текущая цена: " << item->getPrice() << endl;
-                    return;
-                }
+    void insertProxy(const Proxy &proxy) {
+        auto pos = std::find_if(proxies.begin(), proxies.end(), [&proxy](const Proxy &other) {
+            return other.max != proxy.max ? other.max < proxy.max : other.seq > proxy.seq;
+        });
+        proxies.insert(pos, proxy);
+    }
+
+    // false, если у участника уже есть заявка не ниже max.
+    bool upsertProxy(uint32_t bidder, uint64_t max) {
+        auto it = std::find_if(proxies.begin(), proxies.end(), [bidder](const Proxy &p) { return p.bidder == bidder; });
+        if (it != proxies.end()) {
+            if (it->max >= max) {
+                return false;
             }
+            proxies.erase(it);
         }
-        cout << "Товар " << itemName << " не найден." << endl;
+        insertProxy({max, bidder, nextSeq++});
+        return true;
     }
 
-    void sendMessage(const string &from, const string &content, int itemId) {
-        messages[{from, itemId}].emplace_back(from, content, itemId);
+    // Заявки, которые уже не могут перебить цену, больше не нужны; заявка
+    // лидера живёт, пока её max не ниже цены.
+    void pruneProxies(uint64_t price, uint32_t leader) {
+        proxies.erase(std::remove_if(proxies.begin(), proxies.end(),
+                                     [&](const Proxy &p) { return p.bidder == leader ? p.max < price : p.max <= price; }),
+                      proxies.end());
     }
 
-    void displayMessages() const {
-        cout << "Доступные чаты:\n";
-        for (const auto &pair : messages) {
-            cout << "Товар ID " << pair.first.second << " - " << pair.second.size() << " сообщений от " << pair.first.first << "\n";
+    static uint64_t increment(uint64_t cents) { return std::max<uint64_t>(1, cents / 100); }
+
+public:
+    void append(uint32_t bidder, uint64_t cents, uint64_t time, bool proxy) {
+        if (count == capacity) {
+            grow();
         }
+        if (count == 0) {
+            base = time;
+        }
+        uint64_t offset = time > base ? time - base : 0;
+        size_t block = count / kBlockBids;
+        size_t slot = count % kBlockBids;
+        amounts(block)[slot] = cents;
+        bidders(block)[slot] = bidder | (proxy ? kProxyFlag : 0);
+        times(block)[slot] = static_cast<uint32_t>(std::min<uint64_t>(offset, UINT32_MAX));
+        ++count;
     }
 
-    void displayChat(int itemId, const string &username) const {
-        cout << "Чат для товара ID " << itemId << ":\n";
-        for (const auto &pair : messages) {
-            if (pair.first.second == itemId) {
-                for (const auto &message : pair.second) {
-                    message.display();
+    // Принимает ставку (proxy == false) или заявку с автоповышением и
+    // разыгрывает ответы заявок, пока у кого-то из не лидирующих участников
+    // остаётся запас выше цены. price и leader — состояние лота до и после.
+    // Шаг перебивания — 1% от цены, но не меньше копейки. Если заявка лидера
+    // покрывает резервную цену, цена сразу поднимается до неё. false — ставка
+    // не выше цены или заявка не выше прежней заявки того же участника.
+    bool submit(uint64_t &price, uint32_t &leader, uint32_t bidder, uint64_t amount, bool proxy, uint64_t now,
+                uint64_t reserve) {
+        if (amount <= price) {
+            return false;
+        }
+        if (proxy) {
+            if (!upsertProxy(bidder, amount)) {
+                return false;
+            }
+        } else {
+            append(bidder, amount, now, false);
+            price = amount;
+            leader = bidder;
+        }
+        while (true) {
+            auto rival = std::find_if(proxies.begin(), proxies.end(),
+                                      [&](const Proxy &p) { return p.bidder != leader && p.max > price; });
+            if (rival == proxies.end()) {
+                break;
+            }
+            Proxy challenger = *rival;
+            const Proxy *held = proxyOf(leader);
+            if (held && (held->max > challenger.max || (held->max == challenger.max && held->seq < challenger.seq))) {
+                append(challenger.bidder, challenger.max, now, true);
+                price = std::min(held->max, challenger.max + increment(challenger.max));
+                append(leader, price, now, true);
+            } else {
+                if (held && held->max > price) {
+                    price = held->max;
+                    append(leader, price, now, true);
                 }
+                price = std::max(price, std::min(challenger.max, price + increment(price)));
+                leader = challenger.bidder;
+                append(leader, price, now, true);
             }
         }
+        const Proxy *held = proxyOf(leader);
+        if (held && reserve > price && held->max >= reserve) {
+            price = reserve;
+            append(leader, price, now, true);
+        }
+        pruneProxies(price, leader);
+        return true;
     }
 
-    void saveItemsToFile(const string &filename) const {
-        std::ofstream outFile(filename);
-        if (outFile.is_open()) {
-            for (const auto &item : items) {
-                outFile << item->getId() << "," << item->getName() << "," << item->getPrice() << ","
-                        << item->getOwner() << "\n";
-            }
-            outFile.close();
-        } else {
-            cout << "Не удалось открыть файл для записи." << endl;
+    // Восстановление из снимка: ставки в исходном порядке, заявки любым.
+    void restoreBid(uint32_t bidder, uint64_t cents, uint64_t time, bool proxy) {
+        append(bidder, cents, time, proxy);
+    }
+
+    void restoreProxy(const Proxy &proxy) {
+        insertProxy(proxy);
+        nextSeq = std::max(nextSeq, proxy.seq + 1);
+    }
+
+    size_t size() const { return count; }
+    size_t bytes() const {
+        return capacity * kBytesPerBid + blocks.capacity() * sizeof(blocks[0]) + proxies.capacity() * sizeof(Proxy);
+    }
+    const vector<Proxy> &openProxies() const { return proxies; }
+
+    Entry entry(size_t index) const {
+        size_t block = index / kBlockBids;
+        size_t slot = index % kBlockBids;
+        uint32_t bidder = bidders(block)[slot];
+        return {bidder & ~kProxyFlag, (bidder & kProxyFlag) != 0, amounts(block)[slot], base + times(block)[slot]};
+    }
+
+    // Не больше limit последних ставок, от новых к старым.
+    void recent(size_t limit, vector<Entry> &out) const {
+        for (size_t i = count; i > 0 && out.size() < limit; --i) {
+            out.push_back(entry(i - 1));
         }
     }
+};
 
-    void loadItemsFromFile(const string &filename) {
-        std::ifstream inFile(filename);
-        if (inFile.is_open()) {
-            string line;
-            while (std::getline(inFile, line)) {
-                size_t pos1 = line.find(',');
-                size_t pos2 = line.find(',', pos1 + 1);
-                size_t pos3 = line.find(',', pos2 + 1);
-                if (pos1 != string::npos && pos2 != string::npos && pos3 != string::npos) {
-                    int itemId = std::stoi(line.substr(0, pos1));
-                    string itemName = line.substr(pos1 + 1, pos2 - pos1 - 1);
-                    double itemPrice = std::stod(line.substr(pos2 + 1, pos3 - pos2 - 1));
-                    string itemOwner = line.substr(pos3 + 1);
-                    addItem(make_unique<Item>(itemName, itemPrice, itemOwner));
-                    items.back()->setId(itemId);
-                }
-            }
-            inFile.close();
-        } else {
-            cout << "Не удалось открыть файл для чтения." << endl;
+class Item {
+public:
+    // Цена хранится в копейках вместе с ID лидирующего участника в одном
+    // атомарном слове: старшие 36 бит — цена, младшие 28 — участник. Любой
+    // ID справочника меньше kNoBidder, так что участник хранится без потерь.
+    static constexpr int kBidderBits = 28;
+    static constexpr uint32_t kNoBidder = (1u << kBidderBits) - 1;
+    static constexpr uint64_t kMaxCents = (uint64_t(1) << (64 - kBidderBits)) - 1;
+    static_assert(kMaxUsers <= kNoBidder, "ID пользователя не помещается в слово ставки");
+
+private:
+    static std::atomic<ItemId> nextId;
+    // Всё, что читает ставка, лежит в начале лота: обычно это одна линия кэша.
+    std::atomic<uint64_t> bidState;
+    // Конец торгов в миллисекундах времени аукциона, 0 — бессрочный лот.
+    std::atomic<uint64_t> endsAt;
+    UserId owner;
+    // Занятость истории ставок: под ней принятая ставка дописывает историю
+    // и журнал. Лежит в выравнивании после owner и места не добавляет.
+    mutable std::atomic<bool> ledgerBusy{false};
+    // Цена или срок разошлись с индексами шарда, и ID лота уже стоит в
+    // очереди на их обновление. Тоже лежит в выравнивании.
+    std::atomic<bool> indexStale{false};
+    // История ставок и заявки; создаётся при первой принятой ставке и
+    // меняется под занятостью ledgerBusy.
+    std::unique_ptr<BidBook> book;
+    ItemId id;
+    string name;
+    // Ниже резервной цены лот не продаётся; 0 — резерва нет.
+    uint64_t reserveCents;
+    // Узлы лота в индексах шарда: по цене, по цене у продавца и по сроку
+    // (у бессрочного лота узла в индексе срока нет). Ключи узлов — цена и
+    // срок, под которыми лот там стоит. Меняются под мутексом индексов;
+    // по ним лот снимается с индексов без поиска по дереву.
+    using IndexNode = std::set<pair<uint64_t, ItemId>>::iterator;
+    IndexNode priceNode;
+    IndexNode sellerNode;
+    IndexNode deadlineNode;
+
+    friend class Auction;
+
+public:
+    static uint64_t toCents(double value) {
+        if (!(value > 0)) {
+            return 0;
         }
+        double cents = std::round(value * 100.0);
+        return cents >= static_cast<double>(kMaxCents) ? kMaxCents : static_cast<uint64_t>(cents);
     }
 
-    void saveMessagesToFile(const string &filename) const {
-        std::ofstream outFile(filename);
-        if (outFile.is_open()) {
-            for (const auto &pair : messages) {
-                for (const auto &message : pair.second) {
-                    outFile << message.getFromUser () << ","
-                            << message.getContent() << ","
-                            << message.getItemId() << "\n";
-                }
+    static double fromCents(uint64_t cents) { return static_cast<double>(cents) / 100.0; }
+
+private:
+    // bidderId — ID справочника или kNoBidder; он всегда меньше 2^kBidderBits.
+    static uint64_t pack(uint64_t cents, uint32_t bidderId) {
+        return cents << kBidderBits | bidderId;
+    }
+
+public:
+    Item(ItemId itemId, string itemName, double itemPrice, UserId itemOwner, uint32_t bidderId = kNoBidder,
+         uint64_t deadline = 0, double reservePrice = 0)
+        : bidState(pack(toCents(itemPrice), bidderId)), endsAt(deadline), owner(itemOwner), id(itemId),
+          name(std::move(itemName)), reserveCents(toCents(reservePrice)) {}
+
+    Item(const Item &) = delete;
+    Item &operator=(const Item &) = delete;
+
+    // ID лотов 64-битные, выдаются атомарно и не повторяются: загруженные из
+    // файлов и журнала ID сдвигают счётчик, а снимок сохраняет его значение,
+    // чтобы ID купленных лотов не достались новым после перезапуска.
+    static ItemId allocateId() { return nextId.fetch_add(1); }
+
+    static void reserveId(ItemId usedId) {
+        ItemId next = nextId.load();
+        while (next <= usedId && !nextId.compare_exchange_weak(next, usedId + 1)) {
+        }
+    }
+
+    static ItemId peekNextId() { return nextId.load(); }
+
+    ItemId getId() const { return id; }
+    const string &getName() const { return name; }
+    uint64_t getCents() const { return bidState.load(std::memory_order_acquire) >> kBidderBits; }
+    double getPrice() const { return fromCents(getCents()); }
+    uint32_t getBidder() const { return bidState.load(std::memory_order_acquire) & kNoBidder; }
+    UserId getOwnerId() const { return owner; }
+    const string &getOwner() const { return UserDirectory::instance().name(owner); }
+    uint64_t getEndsAt() const { return endsAt.load(std::memory_order_acquire); }
+
+    // Переносит конец торгов на deadline, если он позже текущего; true — перенесён.
+    bool extendTo(uint64_t deadline) {
+        uint64_t current = endsAt.load(std::memory_order_acquire);
+        while (current != 0 && current < deadline) {
+            if (endsAt.compare_exchange_weak(current, deadline, std::memory_order_acq_rel)) {
+                return true;
             }
-            outFile.close();
-        } else {
-            cout << "Не удалось открыть файл для записи сообщений." << endl;
         }
+        return false;
     }
 
-    void loadMessagesFromFile(const string &filename) {
-        std::ifstream inFile(filename);
-        if (inFile.is_open()) {
-            string line;
-            while (std::getline(inFile, line)) {
-                size_t pos1 = line.find(',');
-                size_t pos2 = line.find(',', pos1 + 1);
-                if (pos1 != string::npos && pos2 != string::npos) {
-                    string fromUser  = line.substr(0, pos1);
-                    string content = line.substr(pos1 + 1, pos2 - pos1 - 1);
-                    int itemId = std::stoi(line.substr(pos2 + 1));
-                    sendMessage(fromUser , content, itemId);
-                }
-            }
-            inFile.close();
+    uint64_t getReserveCents() const { return reserveCents; }
+    bool reserveMet() const { return getCents() >= reserveCents; }
+
+    void displayInfo() const {
+        cout << "ID: " << id << ", Товар: " << name << ", Цена: " << getPrice() << ", Продавец: " << getOwner() << endl;
+    }
+};
+
+std::atomic<ItemId> Item::nextId{1};
+
+// Описание лота для создания и загрузки; id == kNoItem — выдать новый ID.
+struct ItemRecord {
+    ItemId id = kNoItem;
+    string name;
+    double price = 0;
+    UserId owner = kNoUser;
+    uint32_t bidder = Item::kNoBidder;
+    uint64_t endsAt = 0;
+    double reserve = 0;
+};
+
+// Строка выдачи запросов по цене: копия полей лота на момент запроса.
+struct ItemListing {
+    ItemId id;
+    string name;
+    uint64_t cents;
+    UserId owner;
+    uint64_t endsAt = 0;
+
+    void display(OutputBuffer &out) const {
+        out << "ID: " << id << ", Товар: " << name << ", Цена: " << Item::fromCents(cents)
+            << ", Продавец: " << UserDirectory::instance().name(owner) << '\n';
+    }
+};
+
+struct ItemHandle {
+    uint32_t slot = 0;
+    uint32_t generation = 0;
+};
+
+// Хранилище лотов одного шарда. Лоты лежат в страницах по kPageSize слотов
+// и никогда не перемещаются. Освобождённый слот уходит в список свободных и
+// переиспользуется, а счётчик поколения слота растёт, поэтому устаревший
+// ItemHandle не найдёт в нём чужой лот. Страницы не возвращаются, так что в
+// установившемся режиме создание лота не выделяет память под сам лот.
+class ItemSlab {
+private:
+    static constexpr size_t kPageBits = 10;
+    static constexpr size_t kPageSize = size_t(1) << kPageBits;
+
+    // Поколение и признак занятости стоят перед лотом, рядом с его ценой.
+    struct Slot {
+        uint32_t generation;
+        bool live;
+        alignas(Item) unsigned char storage[sizeof(Item)];
+
+        Item *item() { return std::launder(reinterpret_cast<Item *>(storage)); }
+    };
+
+    vector<unique_ptr<Slot[]>> pages;
+    vector<uint32_t> freeSlots;
+    uint32_t used = 0;
+    size_t liveCount = 0;
+
+    Slot &slotAt(uint32_t index) const { return pages[index >> kPageBits][index & (kPageSize - 1)]; }
+
+    void grow() { pages.push_back(make_unique<Slot[]>(kPageSize)); }
+
+public:
+    ItemSlab() = default;
+    ItemSlab(const ItemSlab &) = delete;
+    ItemSlab &operator=(const ItemSlab &) = delete;
+
+    ~ItemSlab() {
+        for (uint32_t i = 0; i < used; ++i) {
+            if (slotAt(i).live) {
+                slotAt(i).item()->~Item();
+            }
+        }
+    }
+
+    void reserve(size_t count) {
+        size_t needed = used + (count > freeSlots.size() ? count - freeSlots.size() : 0);
+        while (pages.size() * kPageSize < needed) {
+            grow();
+        }
+    }
+
+    template <typename... Args> ItemHandle emplace(Args &&...args) {
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
         } else {
-            cout << "Не удалось открыть файл для чтения сообщений." << endl;
+            if (used == pages.size() * kPageSize) {
+                grow();
+            }
+            index = used++;
         }
+        Slot &slot = slotAt(index);
+        new (slot.storage) Item(std::forward<Args>(args)...);
+        slot.live = true;
+        ++liveCount;
+        return {index, slot.generation};
     }
-};
 
-void saveUsersToFile(const vector<unique_ptr<Buyer>> &buyers, const string &filename) {
-    std::ofstream outFile(filename);
-    if (outFile.is_open()) {
-        for (const auto &buyer : buyers) {
-            outFile << buyer->getUsername() << "," << buyer->getPasswordHash() << "\n";
+    Item *get(ItemHandle handle) const {
+        if (handle.slot >= used) {
+            return nullptr;
         }
-        outFile.close();
-    } else {
-        cout << "Не удалось открыть файл для записи пользователей." << endl;
+        Slot &slot = slotAt(handle.slot);
+        return slot.live && slot.generation == handle.generation ? slot.item() : nullptr;
+    }
+
+    bool erase(ItemHandle handle) {
+        if (!get(handle)) {
+            return false;
+        }
+        Slot &slot = slotAt(handle.slot);
+        slot.item()->~Item();
+        slot.live = false;
+        ++slot.generation;
+        --liveCount;
+        freeSlots.push_back(handle.slot);
+        return true;
     }
-}
 
-void loadUsersFromFile(vector<unique_ptr<Buyer>> &buyers, const string &filename) {
-    std::ifstream inFile(filename);
-    if (inFile.is_open()) {
-        string line;
-        while (std::getline(inFile, line)) {
-            size_t pos = line.find(',');
-            if (pos != string::npos) {
-                string username = line.substr(0, pos);
-                size_t passwordHash = std::stoull(line.substr(pos + 1));
-                buyers.push_back(make_unique<Buyer>(username, passwordHash));
+    size_t size() const { return liveCount; }
+
+    // Обход в порядке слотов: страницы идут подряд, без разыменования указателей на каждый лот.
+    template <typename Visit> void forEach(Visit visit) const {
+        for (uint32_t i = 0; i < used; ++i) {
+            Slot &slot = slotAt(i);
+            if (slot.live) {
+                visit(*slot.item());
             }
         }
-        inFile.close();
-    } else {
-        cout << "Не удалось открыть файл для чтения пользователей." << endl;
     }
-}
+};
 
-int main() {
-    srand(static_cast<unsigned int>(time(0)));
-    Auction auction;
-    vector<unique_ptr<Buyer>> buyers;
+// ID лота -> его слот в слэбе шарда, открытая адресация с линейным
+// пробированием. ID и дескриптор лежат в одной ячейке, поэтому поиск
+// обычно стоит одного промаха кэша, а не трёх, как корзина и узлы
+// unordered_map. Пустая ячейка — kNoItem. Удаление сдвигает хвост цепочки
+// назад, так что надгробий нет; таблица заполнена не больше чем наполовину.
+class SlotTable {
+private:
+    struct Cell {
+        ItemId id = kNoItem;
+        ItemHandle handle;
+    };
 
-    loadUsersFromFile(buyers, "users.txt");
-    auction.loadItemsFromFile("items.txt");
-    auction.loadMessagesFromFile("messages.txt");
+    vector<Cell> cells;
+    size_t count = 0;
+    unsigned shift = 64;
 
-    while (true) {
-        cout << "\nМеню:\n";
-        cout << "1. Войти\n";
-        cout << "2. Зарегистрироваться\n";
-        cout << "3. Выход\n";
-        cout << "Выберите действие: ";
+    size_t home(ItemId id) const { return static_cast<size_t>((id * 0x9E3779B97F4A7C15ull) >> shift); }
 
-        int mainChoice;
-        cin >> mainChoice;
+    size_t probe(ItemId id) const {
+        size_t mask = cells.size() - 1;
+        size_t pos = home(id);
+        while (cells[pos].id != id && cells[pos].id != kNoItem) {
+            pos = (pos + 1) & mask;
+        }
+        return pos;
+    }
 
-        if (mainChoice == 1) {
-            string username, password;
-            cout << "Введите имя пользователя: ";
-            cin >> username;
-            cout << "Введите пароль: ";
-            cin >> password;
+    void rehash(size_t capacity) {
+        vector<Cell> old(capacity);
+        old.swap(cells);
+        shift = 64 - static_cast<unsigned>(__builtin_ctzll(capacity));
+        for (const Cell &cell : old) {
+            if (cell.id != kNoItem) {
+                cells[probe(cell.id)] = cell;
+            }
+        }
+    }
 
-            bool loggedIn = false;
-            for (const auto &buyer : buyers) {
-                if (buyer->getUsername() == username && buyer->checkPassword(password)) {
-                    loggedIn = true;
-                    cout << "Вход выполнен!" << endl;
-
-                    while (loggedIn) {
-                        cout << "\nМеню:\n";
-                        cout << "1. Добавить товар\n";
-                        cout << "2. Просмотреть товары\n";
-                        cout << "3. Сделать ставку на товар\n";
-                        cout << "4. Купить товар\n";
-                        cout << "5. Отправить сообщение\n";
-                        cout << "6. Просмотреть чаты\n";
-                        cout << "7. Выход\n";
-                        cout << "Выберите действие: ";
-
-                        int choice;
-                        cin >> choice;
-
-                        if (choice == 1) {
-                            string itemName;
-                            double itemPrice;
-                            cout << "Введите название товара: ";
-                            cin >> itemName;
-                            cout << "Введите начальную цену товара: ";
-                            cin >> itemPrice;
-
-                            auction.addItem(make_unique<Item>(itemName, itemPrice, username));
-                            cout << "Товар добавлен!" << endl;
+public:
+    size_t size() const { return count; }
+
+    void reserve(size_t needed) {
+        size_t capacity = std::max<size_t>(cells.size(), 16);
+        while (capacity < needed * 2) {
+            capacity *= 2;
+        }
+        if (capacity != cells.size()) {
+            rehash(capacity);
+        }
+    }
 
-                        } else if (choice == 2) {
-                            auction.displayItems();
+    const ItemHandle *find(ItemId id) const {
+        if (cells.empty()) {
+            return nullptr;
+        }
+        const Cell &cell = cells[probe(id)];
+        return cell.id == kNoItem ? nullptr : &cell.handle;
+    }
 
-                        } else if (choice == 3) {
-                            string itemName;
-                            double bidPrice;
-                            cout << "Введите название товара для ставки: ";
-                            cin >> itemName;
-                            cout << "Введите вашу ставку: ";
-                            cin >> bidPrice;
+    bool contains(ItemId id) const { return find(id) != nullptr; }
 
-                            auction.bidItem(itemName, bidPrice, buyer.get());
+    // false — ID уже есть, его дескриптор не меняется.
+    bool emplace(ItemId id, ItemHandle handle) {
+        reserve(count + 1);
+        Cell &cell = cells[probe(id)];
+        if (cell.id != kNoItem) {
+            return false;
+        }
+        cell.id = id;
+        cell.handle = handle;
+        ++count;
+        return true;
+    }
 
-                        } else if (choice == 4) {
-                            string itemName;
-                            cout << "Введите название товара для покупки: ";
-                            cin >> itemName;
+    bool erase(ItemId id) {
+        if (cells.empty()) {
+            return false;
+        }
+        size_t mask = cells.size() - 1;
+        size_t hole = probe(id);
+        if (cells[hole].id == kNoItem) {
+            return false;
+        }
+        // Ячейка цепочки переезжает в дыру, если дыра лежит между её
+        // домашней позицией и ней самой.
+        for (size_t next = (hole + 1) & mask; cells[next].id != kNoItem; next = (next + 1) & mask) {
+            if (((next - home(cells[next].id)) & mask) >= ((next - hole) & mask)) {
+                cells[hole] = cells[next];
+                hole = next;
+            }
+        }
+        cells[hole].id = kNoItem;
+        --count;
+        return true;
+    }
 
-                            auction.buyItem(itemName, buyer.get());
+    template <typename Visit> void forEach(Visit visit) const {
+        for (const Cell &cell : cells) {
+            if (cell.id != kNoItem) {
+                visit(cell.id, cell.handle);
+            }
+        }
+    }
+};
 
-                        } else if (choice == 5) {
-                            int itemId;
-                            string messageContent;
-                            cout << "Введите ID товара, к которому хотите отправить сообщение: ";
-                            cin >> itemId;
-                            cout << "Введите ваше сообщение: ";
-                            cin.ignore();
-                            std::getline(cin, messageContent);
+// Название -> ID лотов с этим названием по возрастанию. Ячейки с хэшем
+// названия лежат плотно, с открытой адресацией, а название и самый ранний
+// ID — в записи рядом, так что поиск по имени стоит двух промахов кэша;
+// остальные ID с тем же названием, обычно их нет, лежат отдельно.
+class NameTable {
+private:
+    static constexpr uint32_t kEmpty = std::numeric_limits<uint32_t>::max();
 
-                            auction.sendMessage(buyer->getUsername(), messageContent, itemId);
-                            cout << "Сообщение отправлено!" << endl;
+    struct Cell {
+        uint64_t hash = 0;
+        uint32_t entry = kEmpty;
+    };
 
-                        } else if (choice == 6) {
-                            auction.displayMessages();
+    struct Entry {
+        string name;
+        ItemId first = kNoItem;
+        vector<ItemId> later;
+    };
 
-                            int chatChoice;
-                            cout << "Введите номер ID товара для открытия чата: ";
-                            cin >> chatChoice;
+    vector<Cell> cells;
+    vector<Entry> entries;
+    vector<uint32_t> freeEntries;
+    size_t count = 0;
+    unsigned shift = 64;
 
-                            auction.displayChat(chatChoice, buyer->getUsername());
+    size_t home(uint64_t hash) const { return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> shift); }
 
-                        } else if (choice == 7) {
-                            loggedIn = false;
-                        } else {
-                            cout << "Неверный выбор. Попробуйте снова." << endl;
-                        }
-                    }
-                    break;
+    // Ячейка названия или пустая ячейка, куда оно встанет.
+    size_t probe(std::string_view name, uint64_t hash) const {
+        size_t mask = cells.size() - 1;
+        size_t pos = home(hash);
+        while (cells[pos].entry != kEmpty && (cells[pos].hash != hash || entries[cells[pos].entry].name != name)) {
+            pos = (pos + 1) & mask;
+        }
+        return pos;
+    }
+
+    void grow() {
+        vector<Cell> old(std::max<size_t>(cells.size() * 2, 16));
+        old.swap(cells);
+        shift = 64 - static_cast<unsigned>(__builtin_ctzll(cells.size()));
+        size_t mask = cells.size() - 1;
+        for (const Cell &cell : old) {
+            if (cell.entry != kEmpty) {
+                size_t pos = home(cell.hash);
+                while (cells[pos].entry != kEmpty) {
+                    pos = (pos + 1) & mask;
                 }
+                cells[pos] = cell;
             }
-            if (!loggedIn) {
-                cout << "Неверное имя пользователя или пароль." << endl;
-            }
+        }
+    }
 
-        } else if (mainChoice == 2) {
-            string username, password;
-            cout << "Введите имя пользователя: ";
-            cin >> username;
-            cout << "Введите пароль: ";
-            cin >> password;
+    static uint64_t hashOf(std::string_view name) { return std::hash<std::string_view>()(name); }
+
+public:
+    // Самый ранний лот с таким названием или kNoItem.
+    ItemId first(std::string_view name) const {
+        if (cells.empty()) {
+            return kNoItem;
+        }
+        const Cell &cell = cells[probe(name, hashOf(name))];
+        return cell.entry == kEmpty ? kNoItem : entries[cell.entry].first;
+    }
 
-            buyers.push_back(make_unique<Buyer>(username, password));
-            cout << "Аккаунт создан!" << endl;
+    void add(const string &name, ItemId id) {
+        if ((count + 1) * 2 > cells.size()) {
+            grow();
+        }
+        uint64_t hash = hashOf(name);
+        Cell &cell = cells[probe(name, hash)];
+        if (cell.entry == kEmpty) {
+            if (freeEntries.empty()) {
+                cell.entry = static_cast<uint32_t>(entries.size());
+                entries.emplace_back();
+            } else {
+                cell.entry = freeEntries.back();
+                freeEntries.pop_back();
+            }
+            cell.hash = hash;
+            entries[cell.entry].name = name;
+            entries[cell.entry].first = id;
+            ++count;
+            return;
+        }
+        Entry &entry = entries[cell.entry];
+        if (id == entry.first) {
+            return;
+        }
+        ItemId later = std::max(id, entry.first);
+        entry.first = std::min(id, entry.first);
+        auto pos = std::lower_bound(entry.later.begin(), entry.later.end(), later);
+        if (pos == entry.later.end() || *pos != later) {
+            entry.later.insert(pos, later);
+        }
+    }
 
-            saveUsersToFile(buyers, "users.txt");
+    void remove(std::string_view name, ItemId id) {
+        if (cells.empty()) {
+            return;
+        }
+        size_t hole = probe(name, hashOf(name));
+        if (cells[hole].entry == kEmpty) {
+            return;
+        }
+        Entry &entry = entries[cells[hole].entry];
+        auto pos = std::lower_bound(entry.later.begin(), entry.later.end(), id);
+        if (pos != entry.later.end() && *pos == id) {
+            entry.later.erase(pos);
+            return;
+        }
+        if (id != entry.first) {
+            return;
+        }
+        if (!entry.later.empty()) {
+            entry.first = entry.later.front();
+            entry.later.erase(entry.later.begin());
+            return;
+        }
+        entry.name.clear();
+        entry.name.shrink_to_fit();
+        entry.later = vector<ItemId>();
+        freeEntries.push_back(cells[hole].entry);
+        --count;
+        // Сдвиг хвоста цепочки назад, как в SlotTable.
+        size_t mask = cells.size() - 1;
+        for (size_t next = (hole + 1) & mask; cells[next].entry != kEmpty; next = (next + 1) & mask) {
+            if (((next - home(cells[next].hash)) & mask) >= ((next - hole) & mask)) {
+                cells[hole] = cells[next];
+                hole = next;
+            }
+        }
+        cells[hole].entry = kEmpty;
+    }
+};
+
+class Message {
+private:
+    UserId fromUser ;
+    ItemId itemId;
+    string content;
+
+public:
+    Message(UserId from, string msg, ItemId id)
+        : fromUser (from), itemId(id), content(std::move(msg)) {}
+
+    Message(const string &from, const string &msg, ItemId id)
+        : Message(UserDirectory::instance().intern(from), msg, id) {}
+
+    void display(OutputBuffer &out) const {
+        out << getFromUser() << ": " << content << " (Товар ID: " << itemId << ")\n";
+    }
+
+    UserId getFromId() const { return fromUser; }
+    const string &getFromUser () const { return UserDirectory::instance().name(fromUser); }
+    const string &getContent() const { return content; }
+    ItemId getItemId() const { return itemId; }
+};
+
+// Строка списка чатов: сколько сообщений оставил в чате лота один отправитель.
+struct ChatSummary {
+    ItemId itemId;
+    UserId sender;
+    size_t count;
+
+    void display(OutputBuffer &out) const {
+        out << "Товар ID " << itemId << " - " << uint64_t(count) << " сообщений от "
+            << UserDirectory::instance().name(sender) << '\n';
+    }
+};
+
+// Встроенные метрики: счётчик и гистограмма задержек на каждую операцию и
+// датчики текущих величин. Каждый поток пишет в собственный блок простыми
+// load/store без атомарных read-modify-write: у блока один писатель, а
+// чтение суммирует блоки всех потоков. Время меряется тактами TSC (на x86
+// это дешевле steady_clock) и переводится в наносекунды только при чтении.
+// Timer считает каждое событие, а время меряет у каждого kSampleEvery-го в
+// потоке, начиная с первого: два чтения TSC дороже всего остального.
+namespace metrics {
+
+enum class Op : uint8_t {
+    AddItem, Bid, Buy, Message, ChatRead, Query, Login, Register, Load, Save, WalCommit, Settle, Search, Checkpoint,
+    List, Evict, Notify, Count
+};
+
+const char *const kOpNames[] = {"add_item", "bid",      "buy",  "message", "chat_read",  "query",  "login",
+                                "register", "load",     "save", "wal_commit", "settle",  "search", "checkpoint",
+                                "list",     "evict",    "notify"};
+
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+#endif
+}
+
+// Лог-линейные корзины, как в HDR Histogram: значения до 16 точные, дальше
+// на каждую степень двойки по 16 корзин, так что ошибка квантиля не больше
+// 1/16 значения, а вся гистограмма — меньше тысячи счётчиков.
+constexpr unsigned kSubBits = 4;
+constexpr size_t kSubBuckets = size_t(1) << kSubBits;
+constexpr size_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+inline size_t bucketOf(uint64_t value) {
+    if (value < kSubBuckets) {
+        return static_cast<size_t>(value);
+    }
+    unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(value)) - kSubBits;
+    return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+}
+
+// Верхняя граница значений корзины index.
+inline uint64_t bucketHigh(size_t index) {
+    if (index < kSubBuckets) {
+        return index;
+    }
+    size_t shift = index / kSubBuckets - 1;
+    uint64_t low = static_cast<uint64_t>(kSubBuckets + index % kSubBuckets) << shift;
+    return low + ((uint64_t(1) << shift) - 1);
+}
+
+constexpr uint64_t kSampleEvery = 8;
+
+struct OpCells {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> max{0};
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+};
+
+struct ThreadBlock {
+    OpCells ops[static_cast<size_t>(Op::Count)];
+    bool inUse = false;
+};
+
+// Единственный писатель ячейки — её поток, поэтому хватает load + store.
+inline void bump(std::atomic<uint64_t> &cell, uint64_t delta) {
+    cell.store(cell.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// Блоки потоков и датчики. Блок завершившегося потока не удаляется, а
+// достаётся следующему новому потоку, поэтому накопленное не теряется.
+// Реестр намеренно не разрушается: его блоки нужны до последнего потока.
+class Registry {
+private:
+    std::mutex blockMutex;
+    vector<unique_ptr<ThreadBlock>> blocks;
+    std::mutex gaugeMutex;
+    map<uint64_t, pair<string, std::function<double()>>> gauges;
+    uint64_t nextGauge = 0;
+
+    Registry() = default;
+
+public:
+    static Registry &instance() {
+        static Registry *registry = new Registry();
+        return *registry;
+    }
+
+    ThreadBlock *acquire() {
+        std::lock_guard<std::mutex> lock(blockMutex);
+        for (auto &block : blocks) {
+            if (!block->inUse) {
+                block->inUse = true;
+                return block.get();
+            }
+        }
+        blocks.push_back(make_unique<ThreadBlock>());
+        blocks.back()->inUse = true;
+        return blocks.back().get();
+    }
+
+    void release(ThreadBlock *block) {
+        std::lock_guard<std::mutex> lock(blockMutex);
+        block->inUse = false;
+    }
+
+    template <typename Visit> void forEachBlock(Visit visit) {
+        std::lock_guard<std::mutex> lock(blockMutex);
+        for (const auto &block : blocks) {
+            visit(*block);
+        }
+    }
+
+    uint64_t addGauge(string name, std::function<double()> read) {
+        std::lock_guard<std::mutex> lock(gaugeMutex);
+        gauges.emplace(nextGauge, std::make_pair(std::move(name), std::move(read)));
+        return nextGauge++;
+    }
+
+    void removeGauge(uint64_t id) {
+        std::lock_guard<std::mutex> lock(gaugeMutex);
+        gauges.erase(id);
+    }
+
+    // Датчики читаются под gaugeMutex, чтобы их владелец не исчез посреди
+    // чтения; сами функции датчиков не должны регистрировать новые.
+    vector<pair<string, double>> readGauges() {
+        std::lock_guard<std::mutex> lock(gaugeMutex);
+        vector<pair<string, double>> values;
+        values.reserve(gauges.size());
+        for (const auto &entry : gauges) {
+            values.emplace_back(entry.second.first, entry.second.second());
+        }
+        return values;
+    }
+};
+
+struct ThreadSlot {
+    ThreadBlock *block = Registry::instance().acquire();
+    ~ThreadSlot() { Registry::instance().release(block); }
+};
+
+inline ThreadBlock &local() {
+    thread_local ThreadSlot slot;
+    return *slot.block;
+}
+
+inline void recordTime(OpCells &cells, uint64_t elapsed) {
+    bump(cells.total, elapsed);
+    if (elapsed > cells.max.load(std::memory_order_relaxed)) {
+        cells.max.store(elapsed, std::memory_order_relaxed);
+    }
+    bump(cells.buckets[bucketOf(elapsed)], 1);
+}
+
+inline void record(Op op, uint64_t elapsed) {
+    OpCells &cells = local().ops[static_cast<size_t>(op)];
+    bump(cells.count, 1);
+    recordTime(cells, elapsed);
+}
+
+// Замеряет время жизни объекта, от конструктора до деструктора, у каждого
+// kSampleEvery-го события; считается каждое.
+class Timer {
+private:
+    OpCells &cells;
+    uint64_t start = 0;
+    bool timed;
+
+public:
+    explicit Timer(Op op) : cells(local().ops[static_cast<size_t>(op)]) {
+        uint64_t seen = cells.count.load(std::memory_order_relaxed);
+        cells.count.store(seen + 1, std::memory_order_relaxed);
+        timed = seen % kSampleEvery == 0;
+        if (timed) {
+            start = ticks();
+        }
+    }
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+    ~Timer() {
+        if (timed) {
+            recordTime(cells, ticks() - start);
+        }
+    }
+};
+
+// Датчик живёт вместе с объектом: read вызывается при каждом чтении метрик.
+class Gauge {
+private:
+    uint64_t id;
+
+public:
+    Gauge(string name, std::function<double()> read)
+        : id(Registry::instance().addGauge(std::move(name), std::move(read))) {}
+    Gauge(const Gauge &) = delete;
+    Gauge &operator=(const Gauge &) = delete;
+    ~Gauge() { Registry::instance().removeGauge(id); }
+};
+
+// Частота TSC в тактах на наносекунду: отношение тактов к steady_clock с
+// момента запуска процесса. Первое чтение раньше 20 мс после запуска
+// дожидается их, чтобы оценка не была грубой.
+struct Epoch {
+    std::chrono::steady_clock::time_point clock = std::chrono::steady_clock::now();
+    uint64_t tsc = ticks();
+};
+const Epoch kEpoch;
+
+inline double ticksPerNs() {
+#if defined(__x86_64__) || defined(__i386__)
+    auto minimum = std::chrono::milliseconds(20);
+    auto elapsed = std::chrono::steady_clock::now() - kEpoch.clock;
+    if (elapsed < minimum) {
+        std::this_thread::sleep_for(minimum - elapsed);
+    }
+    uint64_t tsc = ticks();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - kEpoch.clock);
+    return static_cast<double>(tsc - kEpoch.tsc) / static_cast<double>(ns.count());
+#else
+    return 1.0;
+#endif
+}
+
+struct OpSummary {
+    const char *name;
+    uint64_t count;
+    double meanUs;
+    double p50Us;
+    double p90Us;
+    double p99Us;
+    double p999Us;
+    double maxUs;
+};
+
+struct Summary {
+    vector<OpSummary> ops;
+    vector<pair<string, double>> gauges;
+};
+
+// Сводка по всем потокам; операции, которых не было, не попадают в неё.
+inline Summary collect() {
+    Summary summary;
+    double perUs = ticksPerNs() * 1000.0;
+    vector<uint64_t> buckets(kBuckets);
+    for (size_t op = 0; op < static_cast<size_t>(Op::Count); ++op) {
+        std::fill(buckets.begin(), buckets.end(), 0);
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t max = 0;
+        Registry::instance().forEachBlock([&](const ThreadBlock &block) {
+            const OpCells &cells = block.ops[op];
+            count += cells.count.load(std::memory_order_relaxed);
+            total += cells.total.load(std::memory_order_relaxed);
+            max = std::max(max, cells.max.load(std::memory_order_relaxed));
+            for (size_t i = 0; i < kBuckets; ++i) {
+                buckets[i] += cells.buckets[i].load(std::memory_order_relaxed);
+            }
+        });
+        if (count == 0) {
+            continue;
+        }
+        // В корзины попадают только замеренные события, и пишутся они без
+        // общей блокировки со счётчиком, поэтому ранг и среднее считаются от
+        // суммы корзин, а не от count.
+        uint64_t inBuckets = 0;
+        for (uint64_t value : buckets) {
+            inBuckets += value;
+        }
+        double mean = inBuckets ? static_cast<double>(total) / static_cast<double>(inBuckets) / perUs : 0;
+        auto quantile = [&](double q) {
+            uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(inBuckets)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; ++i) {
+                seen += buckets[i];
+                if (seen >= rank && seen > 0) {
+                    return static_cast<double>(std::min(bucketHigh(i), max)) / perUs;
+                }
+            }
+            return static_cast<double>(max) / perUs;
+        };
+        summary.ops.push_back({kOpNames[op], count, mean,
+                               quantile(0.5), quantile(0.9), quantile(0.99), quantile(0.999),
+                               static_cast<double>(max) / perUs});
+    }
+    summary.gauges = Registry::instance().readGauges();
+    return summary;
+}
+
+inline void appendNumber(string &out, double value) {
+    char buffer[32];
+    double rounded = std::round(value * 1000.0) / 1000.0;
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), rounded);
+    out.append(buffer, result.ptr);
+}
+
+inline void appendNumber(string &out, uint64_t value) {
+    char buffer[24];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+// Текст: строка на операцию "op <имя> count=... mean_us=... p50_us=..." и
+// строка на датчик "gauge <имя> <значение>".
+inline string formatText(const Summary &summary) {
+    string out;
+    for (const OpSummary &op : summary.ops) {
+        out += "op ";
+        out += op.name;
+        out += " count=";
+        appendNumber(out, op.count);
+        const pair<const char *, double> fields[] = {{" mean_us=", op.meanUs}, {" p50_us=", op.p50Us},
+                                                     {" p90_us=", op.p90Us},   {" p99_us=", op.p99Us},
+                                                     {" p999_us=", op.p999Us}, {" max_us=", op.maxUs}};
+        for (const auto &field : fields) {
+            out += field.first;
+            appendNumber(out, field.second);
+        }
+        out += '\n';
+    }
+    for (const auto &gauge : summary.gauges) {
+        out += "gauge ";
+        out += gauge.first;
+        out += ' ';
+        appendNumber(out, gauge.second);
+        out += '\n';
+    }
+    return out;
+}
+
+// JSON одной строкой: {"ops":{"bid":{"count":..,"mean_us":..},..},"gauges":{..}}.
+inline string formatJson(const Summary &summary) {
+    string out = "{\"ops\":{";
+    for (size_t i = 0; i < summary.ops.size(); ++i) {
+        const OpSummary &op = summary.ops[i];
+        out += i ? ",\"" : "\"";
+        out += op.name;
+        out += "\":{\"count\":";
+        appendNumber(out, op.count);
+        const pair<const char *, double> fields[] = {{",\"mean_us\":", op.meanUs}, {",\"p50_us\":", op.p50Us},
+                                                     {",\"p90_us\":", op.p90Us},   {",\"p99_us\":", op.p99Us},
+                                                     {",\"p999_us\":", op.p999Us}, {",\"max_us\":", op.maxUs}};
+        for (const auto &field : fields) {
+            out += field.first;
+            appendNumber(out, field.second);
+        }
+        out += '}';
+    }
+    out += "},\"gauges\":{";
+    for (size_t i = 0; i < summary.gauges.size(); ++i) {
+        out += i ? ",\"" : "\"";
+        out += summary.gauges[i].first;
+        out += "\":";
+        appendNumber(out, summary.gauges[i].second);
+    }
+    out += "}}\n";
+    return out;
+}
+
+// Фоновый поток раз в interval перезаписывает файл сводкой (через *.tmp и
+// rename, чтобы читатель не увидел файл наполовину) и делает последнюю
+// запись при остановке.
+class Dumper {
+private:
+    string path;
+    std::chrono::milliseconds interval;
+    bool json;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;
+
+    void dump() const {
+        string text = json ? formatJson(collect()) : formatText(collect());
+        string tmp = path + ".tmp";
+        {
+            std::ofstream outFile(tmp, std::ios::binary | std::ios::trunc);
+            if (!outFile.is_open()) {
+                return;
+            }
+            outFile.write(text.data(), static_cast<std::streamsize>(text.size()));
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            cerr << "Не удалось записать метрики в " << path << "." << endl;
+        }
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            wake.wait_for(lock, interval, [&] { return stopping; });
+            lock.unlock();
+            dump();
+            lock.lock();
+        }
+    }
+
+public:
+    Dumper(string file, std::chrono::milliseconds every, bool asJson)
+        : path(std::move(file)), interval(every), json(asJson) {
+        worker = std::thread(&Dumper::loop, this);
+    }
+    Dumper(const Dumper &) = delete;
+    Dumper &operator=(const Dumper &) = delete;
+    ~Dumper() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+};
+
+} // namespace metrics
+
+enum class FsyncPolicy { Never, Interval, Always };
+
+enum class WalRecordType : uint8_t { AddItem = 1, Bid = 2, Buy = 3, Message = 4, Register = 5, ProxyBid = 6 };
+
+// Одна мутация состояния. Поля, не нужные типу записи, не сериализуются.
+struct WalRecord {
+    WalRecordType type = WalRecordType::AddItem;
+    ItemId itemId = kNoItem;
+    uint64_t cents = 0;
+    uint32_t bidder = Item::kNoBidder;
+    uint64_t passwordHash = 0;
+    // Конец торгов для AddItem; для Bid — новый конец, если ставка его продлила.
+    uint64_t endsAt = 0;
+    // Резервная цена для AddItem.
+    uint64_t reserveCents = 0;
+    // Время аукциона для Bid и ProxyBid: по нему заявки разыгрываются заново
+    // при восстановлении, а история получает исходные отметки времени.
+    uint64_t time = 0;
+    // Номер записи в журнале; 0 у записей, сделанных до появления номеров.
+    uint64_t lsn = 0;
+    string name;
+    string text;
+
+    static WalRecord addItem(const Item &item) {
+        WalRecord record;
+        record.type = WalRecordType::AddItem;
+        record.itemId = item.getId();
+        record.cents = Item::toCents(item.getPrice());
+        record.endsAt = item.getEndsAt();
+        record.reserveCents = item.getReserveCents();
+        record.name = item.getName();
+        record.text = item.getOwner();
+        return record;
+    }
+
+    // В журнал идёт сама ставка (или максимум заявки), а не цена после
+    // ответов заявок: её воспроизводит проигрывание.
+    static WalRecord bid(ItemId itemId, uint64_t cents, uint32_t bidder, uint64_t time, uint64_t extendedTo = 0,
+                         bool proxy = false) {
+        WalRecord record;
+        record.type = proxy ? WalRecordType::ProxyBid : WalRecordType::Bid;
+        record.itemId = itemId;
+        record.cents = cents;
+        record.bidder = bidder;
+        record.time = time;
+        record.endsAt = extendedTo;
+        return record;
+    }
+
+    static WalRecord buy(ItemId itemId) {
+        WalRecord record;
+        record.type = WalRecordType::Buy;
+        record.itemId = itemId;
+        return record;
+    }
+
+    static WalRecord message(const string &from, const string &content, ItemId itemId) {
+        WalRecord record;
+        record.type = WalRecordType::Message;
+        record.itemId = itemId;
+        record.name = from;
+        record.text = content;
+        return record;
+    }
+
+    static WalRecord registration(const string &username, uint64_t passwordHash) {
+        WalRecord record;
+        record.type = WalRecordType::Register;
+        record.name = username;
+        record.passwordHash = passwordHash;
+        return record;
+    }
+};
+
+uint32_t crc32(const char *data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Чат одного лота: сообщения в порядке отправки, только дописываются.
+// Позиция сообщения в журнале служит курсором страниц истории; индекс по
+// отправителю хранит позиции его сообщений по возрастанию.
+class ChatLog {
+private:
+    vector<Message> log;
+    unordered_map<UserId, vector<uint32_t>> bySender;
+    // Отметка последнего обращения: вытесняются давно не тронутые чаты.
+    uint64_t lastUse = 0;
+
+public:
+    void reserve(size_t count) { log.reserve(log.size() + count); }
+
+    void append(Message message) {
+        bySender[message.getFromId()].push_back(static_cast<uint32_t>(log.size()));
+        log.push_back(std::move(message));
+    }
+
+    size_t size() const { return log.size(); }
+    const Message &at(size_t position) const { return log[position]; }
+
+    void touch(uint64_t tick) { lastUse = tick; }
+    uint64_t lastUsed() const { return lastUse; }
+
+    // Оценка памяти чата в куче: сообщения, тексты, не уместившиеся в
+    // саму строку, и индекс по отправителям.
+    size_t bytes() const {
+        const size_t inlineChars = string().capacity();
+        size_t total = log.capacity() * sizeof(Message);
+        for (const auto &message : log) {
+            size_t capacity = message.getContent().capacity();
+            total += capacity > inlineChars ? capacity + 1 : 0;
+        }
+        for (const auto &sender : bySender) {
+            total += sizeof(sender) + 2 * sizeof(void *) + sender.second.capacity() * sizeof(uint32_t);
+        }
+        return total;
+    }
+    const vector<Message> &messages() const { return log; }
+    const unordered_map<UserId, vector<uint32_t>> &senders() const { return bySender; }
+
+    // Последние limit сообщений с позициями меньше before, от старых к новым.
+    // Возвращает курсор следующей, более старой страницы; 0 — её нет.
+    size_t page(size_t before, size_t limit, vector<Message> &out) const {
+        size_t end = std::min(before, log.size());
+        size_t begin = end - std::min(limit, end);
+        out.insert(out.end(), log.begin() + static_cast<std::ptrdiff_t>(begin),
+                   log.begin() + static_cast<std::ptrdiff_t>(end));
+        return begin;
+    }
+
+    // Не больше limit сообщений начиная с позиции from, от старых к новым.
+    // Возвращает позицию следующей страницы; size() — чат прочитан до конца.
+    size_t pageAfter(size_t from, size_t limit, vector<Message> &out) const {
+        size_t begin = std::min(from, log.size());
+        size_t end = begin + std::min(limit, log.size() - begin);
+        out.insert(out.end(), log.begin() + static_cast<std::ptrdiff_t>(begin),
+                   log.begin() + static_cast<std::ptrdiff_t>(end));
+        return end;
+    }
+
+    size_t pageFrom(UserId sender, size_t before, size_t limit, vector<Message> &out) const {
+        auto it = bySender.find(sender);
+        if (it == bySender.end()) {
+            return 0;
+        }
+        const vector<uint32_t> &positions = it->second;
+        size_t end = static_cast<size_t>(std::lower_bound(positions.begin(), positions.end(), before) - positions.begin());
+        size_t begin = end - std::min(limit, end);
+        for (size_t i = begin; i < end; ++i) {
+            out.push_back(log[positions[i]]);
+        }
+        return begin > 0 ? positions[begin] : 0;
+    }
+};
+
+// Блочное сжатие в духе LZ4 для холодных данных: последовательности
+// [токен][литералы][смещение u16][добавка длины], в токене по четыре бита на
+// длину литералов и длину совпадения минус kMinMatch; 15 — длина
+// продолжается байтами, пока они равны 255. Последняя последовательность
+// состоит из одних литералов. Совпадения ищутся по хэшу четырёх байт в
+// окне 64 КБ, так что сжатие идёт за один проход без выделения памяти.
+namespace lz {
+
+constexpr size_t kMinMatch = 4;
+constexpr size_t kHashBits = 12;
+
+inline uint32_t read32(const char *p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline void putLength(string &out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        out.push_back(static_cast<char>(255));
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+inline void putSequence(string &out, const char *literals, size_t literalCount, size_t offset, size_t match) {
+    size_t matchCode = match ? match - kMinMatch : 0;
+    out.push_back(static_cast<char>((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(matchCode, 15)));
+    if (literalCount >= 15) {
+        putLength(out, literalCount - 15);
+    }
+    out.append(literals, literalCount);
+    if (match) {
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15) {
+            putLength(out, matchCode - 15);
+        }
+    }
+}
+
+// Дописывает сжатое data[0, size) в out.
+inline void compress(const char *data, size_t size, string &out) {
+    uint32_t table[size_t(1) << kHashBits] = {};
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + kMinMatch <= size) {
+        uint32_t sequence = read32(data + i);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - kHashBits);
+        size_t candidate = table[hash];
+        table[hash] = static_cast<uint32_t>(i + 1);
+        if (candidate == 0 || i - (candidate - 1) > 0xFFFF || read32(data + candidate - 1) != sequence) {
+            ++i;
+            continue;
+        }
+        size_t ref = candidate - 1;
+        size_t match = kMinMatch;
+        while (i + match < size && data[ref + match] == data[i + match]) {
+            ++match;
+        }
+        putSequence(out, data + anchor, i - anchor, i - ref, match);
+        i += match;
+        anchor = i;
+    }
+    putSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+inline bool getLength(const char *&pos, const char *end, size_t &length) {
+    uint8_t byte;
+    do {
+        if (pos == end) {
+            return false;
+        }
+        byte = static_cast<uint8_t>(*pos++);
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Разжимает data[0, size) ровно в rawSize байт out; false — данные повреждены.
+inline bool decompress(const char *data, size_t size, char *out, size_t rawSize) {
+    const char *pos = data;
+    const char *end = data + size;
+    size_t written = 0;
+    while (pos < end) {
+        uint8_t token = static_cast<uint8_t>(*pos++);
+        size_t literals = token >> 4;
+        if (literals == 15 && !getLength(pos, end, literals)) {
+            return false;
+        }
+        if (literals > static_cast<size_t>(end - pos) || literals > rawSize - written) {
+            return false;
+        }
+        std::memcpy(out + written, pos, literals);
+        pos += literals;
+        written += literals;
+        if (pos == end) {
+            break;
+        }
+        if (end - pos < 2) {
+            return false;
+        }
+        size_t offset = static_cast<uint8_t>(pos[0]) | size_t(static_cast<uint8_t>(pos[1])) << 8;
+        pos += 2;
+        size_t match = token & 15;
+        if (match == 15 && !getLength(pos, end, match)) {
+            return false;
+        }
+        match += kMinMatch;
+        if (offset == 0 || offset > written || match > rawSize - written) {
+            return false;
+        }
+        // Источник может перекрываться с приёмником: копирование побайтное.
+        for (size_t k = 0; k < match; ++k, ++written) {
+            out[written] = out[written - offset];
+        }
+    }
+    return written == rawSize;
+}
+
+} // namespace lz
+
+// Холодный ярус истории чатов. Вытесненные из памяти чаты сериализуются
+// подряд в блоки до kBlockBytes, блоки сжимаются lz и пишутся в
+// неизменяемый сегмент <dir>/chats-<номер>.seg кадрами [сжато u32][исходно
+// u32][данные]. Индекс по ID лота хранит сегмент, смещение блока и место
+// чата в разжатом блоке, поэтому чтение одного чата разжимает один блок;
+// последний разжатый блок держится под рукой для соседних чатов.
+// Сегменты — рабочие файлы процесса: при открытии каталог очищается, а
+// сохранность истории, как и прежде, дают снимок, точки и журнал. Чат,
+// вернувшийся в память, в сегменте становится мёртвым; сегмент без живых
+// чатов удаляется. Методы вызываются под блокировкой сообщений аукциона.
+class ColdChatStore {
+public:
+    static constexpr size_t kBlockBytes = 64 * 1024;
+
+private:
+    struct Ref {
+        uint32_t segment;
+        uint32_t rawOffset;
+        uint64_t blockOffset;
+        uint32_t rawLength;
+        uint32_t count;
+    };
+
+    struct Segment {
+        int fd;
+        uint64_t size;
+        size_t live;
+    };
+
+    string dir;
+    unordered_map<ItemId, Ref> index;
+    map<uint32_t, Segment> segments;
+    uint32_t nextSegment = 0;
+    uint64_t storedBytes = 0;
+    uint64_t rawBytes = 0;
+    mutable string block;
+    mutable string packed;
+    mutable pair<uint32_t, uint64_t> cachedBlock{UINT32_MAX, 0};
+
+    string segmentPath(uint32_t segment) const { return dir + "/chats-" + std::to_string(segment) + ".seg"; }
+
+    static void putVarint(string &out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static bool getVarint(const char *&pos, const char *end, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; pos < end && shift < 64; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*pos++);
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool readFully(int fd, char *out, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t got = ::pread(fd, out, size, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            out += got;
+            size -= static_cast<size_t>(got);
+            offset += static_cast<uint64_t>(got);
+        }
+        return true;
+    }
+
+    // Разжатый блок в block; повторное чтение того же блока бесплатно.
+    bool loadBlock(uint32_t segment, uint64_t offset) const {
+        if (cachedBlock == pair<uint32_t, uint64_t>(segment, offset)) {
+            return true;
+        }
+        auto it = segments.find(segment);
+        uint32_t header[2];
+        if (it == segments.end() || offset + sizeof(header) > it->second.size ||
+            !readFully(it->second.fd, reinterpret_cast<char *>(header), sizeof(header), offset)) {
+            return false;
+        }
+        // Испорченный заголовок не должен выделить лишнего: сжатое лежит в
+        // пределах сегмента, а сжатие не даёт больше 255 байт на байт.
+        if (header[0] > it->second.size - offset - sizeof(header) || header[1] > uint64_t(header[0]) * 255) {
+            return false;
+        }
+        packed.resize(header[0]);
+        block.resize(header[1]);
+        cachedBlock = {UINT32_MAX, 0};
+        if (!readFully(it->second.fd, &packed[0], packed.size(), offset + sizeof(header)) ||
+            !lz::decompress(packed.data(), packed.size(), &block[0], block.size())) {
+            return false;
+        }
+        cachedBlock = {segment, offset};
+        return true;
+    }
+
+    // Сообщения чата из разжатого блока: [отправитель][длина][текст].
+    static bool parseChat(const char *pos, const char *end, ItemId itemId, uint32_t count, ChatLog &out) {
+        out.reserve(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t from = 0;
+            uint64_t length = 0;
+            if (!getVarint(pos, end, from) || !getVarint(pos, end, length) ||
+                length > static_cast<uint64_t>(end - pos)) {
+                return false;
+            }
+            out.append(Message(static_cast<UserId>(from), string(pos, length), itemId));
+            pos += length;
+        }
+        return true;
+    }
+
+    void release(const Ref &ref) {
+        auto segment = segments.find(ref.segment);
+        if (segment != segments.end() && --segment->second.live == 0) {
+            ::close(segment->second.fd);
+            ::unlink(segmentPath(ref.segment).c_str());
+            storedBytes -= segment->second.size;
+            segments.erase(segment);
+            if (cachedBlock.first == ref.segment) {
+                cachedBlock = {UINT32_MAX, 0};
+            }
+        }
+    }
+
+public:
+    explicit ColdChatStore(string directory) : dir(move(directory)) {
+        ::mkdir(dir.c_str(), 0755);
+        if (DIR *listing = ::opendir(dir.c_str())) {
+            while (dirent *entry = ::readdir(listing)) {
+                string name = entry->d_name;
+                if (name.compare(0, 6, "chats-") == 0) {
+                    ::unlink((dir + "/" + name).c_str());
+                }
+            }
+            ::closedir(listing);
+        }
+    }
+
+    ColdChatStore(const ColdChatStore &) = delete;
+    ColdChatStore &operator=(const ColdChatStore &) = delete;
+
+    ~ColdChatStore() {
+        for (const auto &segment : segments) {
+            ::close(segment.second.fd);
+            ::unlink(segmentPath(segment.first).c_str());
+        }
+    }
+
+    bool contains(ItemId itemId) const { return index.count(itemId) != 0; }
+    size_t chats() const { return index.size(); }
+    uint64_t diskBytes() const { return storedBytes; }
+    uint64_t originalBytes() const { return rawBytes; }
+
+    // Число сообщений холодного чата или 0.
+    size_t length(ItemId itemId) const {
+        auto it = index.find(itemId);
+        return it == index.end() ? 0 : it->second.count;
+    }
+
+    // ID холодных чатов в порядке хранения: read() по ним подряд разжимает
+    // каждый блок один раз.
+    vector<ItemId> idsInStorageOrder() const {
+        vector<pair<const Ref *, ItemId>> refs;
+        refs.reserve(index.size());
+        for (const auto &entry : index) {
+            refs.emplace_back(&entry.second, entry.first);
+        }
+        std::sort(refs.begin(), refs.end(), [](const auto &a, const auto &b) {
+            return std::tie(a.first->segment, a.first->blockOffset, a.first->rawOffset) <
+                   std::tie(b.first->segment, b.first->blockOffset, b.first->rawOffset);
+        });
+        vector<ItemId> ids;
+        ids.reserve(refs.size());
+        for (const auto &ref : refs) {
+            ids.push_back(ref.second);
+        }
+        return ids;
+    }
+
+    // Пишет чаты одним новым сегментом. При ошибке записи сегмент удаляется
+    // и возвращается false: чаты остаются в памяти.
+    bool freeze(const vector<pair<ItemId, const ChatLog *>> &victims) {
+        uint32_t segment = nextSegment++;
+        string path = segmentPath(segment);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        string file;
+        string raw;
+        vector<pair<ItemId, Ref>> refs;
+        size_t blockStart = 0;
+        uint64_t original = 0;
+        auto flush = [&] {
+            uint32_t header[2] = {0, static_cast<uint32_t>(raw.size())};
+            size_t headerAt = file.size();
+            file.append(reinterpret_cast<const char *>(header), sizeof(header));
+            lz::compress(raw.data(), raw.size(), file);
+            header[0] = static_cast<uint32_t>(file.size() - headerAt - sizeof(header));
+            std::memcpy(&file[headerAt], header, sizeof(header));
+            for (size_t k = blockStart; k < refs.size(); ++k) {
+                refs[k].second.blockOffset = headerAt;
+            }
+            blockStart = refs.size();
+            original += raw.size();
+            raw.clear();
+        };
+        for (const auto &victim : victims) {
+            const ChatLog &log = *victim.second;
+            size_t start = raw.size();
+            for (const auto &message : log.messages()) {
+                putVarint(raw, message.getFromId());
+                putVarint(raw, message.getContent().size());
+                raw.append(message.getContent());
+            }
+            refs.push_back({victim.first, {segment, static_cast<uint32_t>(start), 0,
+                                           static_cast<uint32_t>(raw.size() - start),
+                                           static_cast<uint32_t>(log.size())}});
+            if (raw.size() >= kBlockBytes) {
+                flush();
+            }
+        }
+        if (!raw.empty()) {
+            flush();
+        }
+        const char *data = file.data();
+        size_t left = file.size();
+        while (left > 0) {
+            ssize_t written = ::write(fd, data, left);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                ::close(fd);
+                ::unlink(path.c_str());
+                return false;
+            }
+            data += written;
+            left -= static_cast<size_t>(written);
+        }
+        segments[segment] = {fd, file.size(), refs.size()};
+        storedBytes += file.size();
+        rawBytes += original;
+        for (const auto &ref : refs) {
+            index[ref.first] = ref.second;
+        }
+        return true;
+    }
+
+    // Дописывает сообщения холодного чата в out; false — чата нет или
+    // сегмент не читается.
+    bool read(ItemId itemId, ChatLog &out) const {
+        auto it = index.find(itemId);
+        if (it == index.end() || !loadBlock(it->second.segment, it->second.blockOffset)) {
+            return false;
+        }
+        const Ref &ref = it->second;
+        if (size_t(ref.rawOffset) + ref.rawLength > block.size()) {
+            return false;
+        }
+        const char *pos = block.data() + ref.rawOffset;
+        return parseChat(pos, pos + ref.rawLength, itemId, ref.count, out);
+    }
+
+    // Чат вернулся в память: холодная копия больше не нужна.
+    void drop(ItemId itemId) {
+        auto it = index.find(itemId);
+        if (it == index.end()) {
+            return;
+        }
+        Ref ref = it->second;
+        index.erase(it);
+        release(ref);
+    }
+};
+
+// fsync каталога, в котором лежит path: без него rename или создание файла
+// может не пережить сбой питания.
+void syncDirectory(const string &path) {
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : path.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+// Асинхронный ввод-вывод файлов состояния. Движок принимает запись, чтение
+// и fsync и сообщает о завершении обратным вызовом, так что поток, который
+// форматирует данные, не ждёт диска. Основной движок — io_uring через
+// системные вызовы: операции копятся в очереди отправки и уходят пачкой
+// одним io_uring_enter, а запись идёт из буферов пула, один раз
+// зарегистрированных в ядре (WRITE_FIXED), так что ядро не закрепляет их
+// страницы заново на каждую операцию. Где io_uring нет или он запрещён, те
+// же операции выполняет пул потоков через pwrite/pread. Обратные вызовы
+// приходят из потоков движка и не должны надолго блокироваться.
+namespace aio {
+
+// Число байт или -errno.
+using Completion = std::function<void(int64_t result)>;
+
+enum class Backend { Auto, Uring, Threads };
+
+class Engine {
+public:
+    static constexpr size_t kBufferSize = size_t(1) << 20;
+    static constexpr size_t kBuffers = 8;
+
+private:
+    inline static Backend preferred = Backend::Auto;
+
+    char *pool = nullptr;
+    std::mutex poolMutex;
+    std::condition_variable poolFree;
+    vector<size_t> freeBuffers;
+
+protected:
+    Engine() {
+        void *mapped =
+            ::mmap(nullptr, kBufferSize * kBuffers, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        pool = static_cast<char *>(mapped);
+        for (size_t i = kBuffers; i-- > 0;) {
+            freeBuffers.push_back(i);
+        }
+    }
+
+    void release(size_t index) {
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            freeBuffers.push_back(index);
+        }
+        poolFree.notify_one();
+    }
+
+public:
+    Engine(const Engine &) = delete;
+    Engine &operator=(const Engine &) = delete;
+    virtual ~Engine() { ::munmap(pool, kBufferSize * kBuffers); }
+
+    virtual const char *name() const = 0;
+
+    // Свободный буфер пула; если все в полёте, отправляет очередь и ждёт.
+    size_t acquire() {
+        std::unique_lock<std::mutex> lock(poolMutex);
+        if (freeBuffers.empty()) {
+            lock.unlock();
+            submit();
+            lock.lock();
+            poolFree.wait(lock, [this] { return !freeBuffers.empty(); });
+        }
+        size_t index = freeBuffers.back();
+        freeBuffers.pop_back();
+        return index;
+    }
+
+    char *buffer(size_t index) const { return pool + index * kBufferSize; }
+
+    // Пишет length байт буфера index по смещению offset; буфер возвращается
+    // в пул до вызова done.
+    virtual void write(int fd, size_t index, size_t length, uint64_t offset, Completion done) = 0;
+    virtual void read(int fd, char *into, size_t length, uint64_t offset, Completion done) = 0;
+    // Не упорядочен с записями: fsync ставят, когда записи файла завершились.
+    virtual void fsync(int fd, Completion done) = 0;
+    // Отправляет накопленные операции.
+    virtual void submit() {}
+
+    // Выбор движка для instance(); действует до первого обращения к нему.
+    static void prefer(Backend backend) { preferred = backend; }
+    static Engine &instance();
+    static unique_ptr<Engine> create(Backend backend);
+};
+
+// Запасной движок: очередь заданий и несколько потоков с pwrite/pread,
+// чтобы записи разных файлов и их fsync шли одновременно.
+class ThreadPoolEngine : public Engine {
+private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    vector<std::thread> workers;
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(move(task));
+        }
+        wake.notify_one();
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            std::function<void()> task = move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    static int64_t transfer(bool writing, int fd, char *data, size_t length, uint64_t offset) {
+        size_t done = 0;
+        while (done < length) {
+            off_t at = static_cast<off_t>(offset + done);
+            ssize_t n = writing ? ::pwrite(fd, data + done, length - done, at) : ::pread(fd, data + done, length - done, at);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            if (n == 0) {
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        return static_cast<int64_t>(done);
+    }
+
+public:
+    explicit ThreadPoolEngine(size_t threads = 4) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back(&ThreadPoolEngine::loop, this);
+        }
+    }
+    ~ThreadPoolEngine() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    const char *name() const override { return "threads"; }
+
+    void write(int fd, size_t index, size_t length, uint64_t offset, Completion done) override {
+        post([this, fd, index, length, offset, done] {
+            int64_t result = transfer(true, fd, buffer(index), length, offset);
+            release(index);
+            done(result);
+        });
+    }
+
+    void read(int fd, char *into, size_t length, uint64_t offset, Completion done) override {
+        post([fd, into, length, offset, done] { done(transfer(false, fd, into, length, offset)); });
+    }
+
+    void fsync(int fd, Completion done) override {
+        post([fd, done] { done(::fsync(fd) == 0 ? 0 : -errno); });
+    }
+};
+
+#if defined(AUCTION_IO_URING)
+// io_uring без liburing. Кольца отправки и завершения отображены в память
+// процесса; головы и хвосты общие с ядром, поэтому читаются с acquire и
+// пишутся с release. В очередь отправки пишут вызывающие потоки под
+// sqMutex, завершения разбирает один поток reaper. Операции, поставленные
+// из обратных вызовов (fsync после последней записи, дозапись короткой
+// записи), он отправляет одним вызовом после разбора всей пачки.
+class UringEngine : public Engine {
+private:
+    static constexpr unsigned kDepth = 64;
+    static constexpr uint64_t kWakeup = 0;
+
+    struct Request {
+        Completion done;
+        uint8_t opcode;
+        int fd;
+        char *data;
+        size_t length;
+        uint64_t offset;
+        size_t transferred;
+        int buffer;
+        iovec vec;
+    };
+
+    int ring = -1;
+    void *sqMap = MAP_FAILED;
+    size_t sqMapSize = 0;
+    void *cqMap = MAP_FAILED;
+    size_t cqMapSize = 0;
+    void *sqeMap = MAP_FAILED;
+    size_t sqeMapSize = 0;
+    unsigned *sqHead = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned *sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+    bool fixed = false;
+    std::mutex sqMutex;
+    unsigned queued = 0;
+    std::thread reaper;
+
+    UringEngine() = default;
+
+    static int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    bool map(const io_uring_params &params) {
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+        }
+        sqMap = ::mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED) {
+            return false;
+        }
+        cqMap = single ? sqMap
+                       : ::mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                                IORING_OFF_CQ_RING);
+        sqeMapSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqeMap = ::mmap(nullptr, sqeMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+        if (cqMap == MAP_FAILED || sqeMap == MAP_FAILED) {
+            return false;
+        }
+        char *sq = static_cast<char *>(sqMap);
+        sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqes = static_cast<io_uring_sqe *>(sqeMap);
+        char *cq = static_cast<char *>(cqMap);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Под sqMutex. Без SQPOLL ядро забирает записи очереди прямо в вызове.
+    // 0 или -errno, если ядро отказалось их принимать.
+    int flushLocked() {
+        while (queued > 0) {
+            int submitted = enter(ring, queued, 0, 0);
+            if (submitted < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                cerr << "io_uring_enter: " << std::strerror(errno) << endl;
+                return -errno;
+            }
+            queued -= static_cast<unsigned>(submitted);
+        }
+        return 0;
+    }
+
+    // nullptr — пустая операция, по которой reaper завершается. Полная
+    // очередь сначала отправляется ядру; 0 или -errno, если места в ней
+    // так и не нашлось.
+    int push(Request *request) {
+        std::lock_guard<std::mutex> lock(sqMutex);
+        unsigned tail = *sqTail;
+        while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            if (int error = flushLocked()) {
+                return error;
+            }
+            std::this_thread::yield();
+        }
+        unsigned slot = tail & sqMask;
+        io_uring_sqe &sqe = sqes[slot];
+        std::memset(&sqe, 0, sizeof(sqe));
+        if (!request) {
+            sqe.opcode = IORING_OP_NOP;
+            sqe.user_data = kWakeup;
+        } else {
+            sqe.opcode = request->opcode;
+            sqe.fd = request->fd;
+            sqe.user_data = reinterpret_cast<uint64_t>(request);
+            if (request->opcode != IORING_OP_FSYNC) {
+                char *data = request->data + request->transferred;
+                size_t length = request->length - request->transferred;
+                sqe.off = request->offset + request->transferred;
+                if (request->opcode == IORING_OP_WRITE_FIXED) {
+                    sqe.addr = reinterpret_cast<uint64_t>(data);
+                    sqe.len = static_cast<uint32_t>(length);
+                    sqe.buf_index = static_cast<uint16_t>(request->buffer);
+                } else {
+                    request->vec = {data, length};
+                    sqe.addr = reinterpret_cast<uint64_t>(&request->vec);
+                    sqe.len = 1;
+                }
+            }
+        }
+        sqArray[slot] = slot;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++queued;
+        return 0;
+    }
+
+    // Недописанный остаток отправляется снова; не ушедший в очередь
+    // завершается её ошибкой.
+    void complete(Request *request, int result) {
+        if (result > 0 && request->opcode != IORING_OP_FSYNC) {
+            request->transferred += static_cast<size_t>(result);
+            if (request->transferred < request->length) {
+                result = push(request);
+                if (result == 0) {
+                    return;
+                }
+            }
+        }
+        if (request->buffer >= 0) {
+            release(static_cast<size_t>(request->buffer));
+        }
+        Completion done = move(request->done);
+        int64_t value = result < 0 ? result : static_cast<int64_t>(request->transferred);
+        delete request;
+        done(value);
+    }
+
+    void reap() {
+        vector<pair<Request *, int>> finished;
+        bool running = true;
+        while (running) {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                if (enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                    std::this_thread::yield();
+                }
+                continue;
+            }
+            finished.clear();
+            for (; head != tail; ++head) {
+                const io_uring_cqe &cqe = cqes[head & cqMask];
+                if (cqe.user_data == kWakeup) {
+                    running = false;
+                } else {
+                    finished.push_back({reinterpret_cast<Request *>(cqe.user_data), cqe.res});
+                }
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            for (const auto &entry : finished) {
+                complete(entry.first, entry.second);
+            }
+            submit();
+        }
+    }
+
+    void start(uint8_t opcode, int fd, char *data, size_t length, uint64_t offset, int buffer, Completion done) {
+        Request *request = new Request{move(done), opcode, fd, data, length, offset, 0, buffer, {}};
+        if (int error = push(request)) {
+            complete(request, error);
+        }
+    }
+
+public:
+    // nullptr, если ядро не даёт io_uring: тогда работает пул потоков.
+    static unique_ptr<Engine> open() {
+        io_uring_params params{};
+        int fd = static_cast<int>(::syscall(__NR_io_uring_setup, kDepth, &params));
+        if (fd < 0) {
+            return nullptr;
+        }
+        unique_ptr<UringEngine> engine(new UringEngine());
+        engine->ring = fd;
+        // Без NODROP переполненная очередь завершений теряла бы операции.
+        if (!(params.features & IORING_FEAT_NODROP) || !engine->map(params)) {
+            return nullptr;
+        }
+        iovec vecs[kBuffers];
+        for (size_t i = 0; i < kBuffers; ++i) {
+            vecs[i] = {engine->buffer(i), kBufferSize};
+        }
+        // Не хватило RLIMIT_MEMLOCK — пишем обычным writev.
+        engine->fixed = ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, vecs, kBuffers) == 0;
+        engine->reaper = std::thread(&UringEngine::reap, engine.get());
+        return engine;
+    }
+
+    ~UringEngine() override {
+        if (reaper.joinable()) {
+            push(nullptr);
+            submit();
+            reaper.join();
+        }
+        if (sqeMap != MAP_FAILED) {
+            ::munmap(sqeMap, sqeMapSize);
+        }
+        if (cqMap != MAP_FAILED && cqMap != sqMap) {
+            ::munmap(cqMap, cqMapSize);
+        }
+        if (sqMap != MAP_FAILED) {
+            ::munmap(sqMap, sqMapSize);
+        }
+        if (ring >= 0) {
+            ::close(ring);
+        }
+    }
+
+    const char *name() const override { return fixed ? "io_uring" : "io_uring-writev"; }
+
+    void write(int fd, size_t index, size_t length, uint64_t offset, Completion done) override {
+        start(fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITEV, fd, buffer(index), length, offset,
+              static_cast<int>(index), move(done));
+    }
+
+    void read(int fd, char *into, size_t length, uint64_t offset, Completion done) override {
+        start(IORING_OP_READV, fd, into, length, offset, -1, move(done));
+    }
+
+    void fsync(int fd, Completion done) override { start(IORING_OP_FSYNC, fd, nullptr, 0, 0, -1, move(done)); }
+
+    void submit() override {
+        std::lock_guard<std::mutex> lock(sqMutex);
+        flushLocked();
+    }
+};
+#endif
+
+unique_ptr<Engine> Engine::create(Backend backend) {
+#if defined(AUCTION_IO_URING)
+    if (backend != Backend::Threads) {
+        if (unique_ptr<Engine> engine = UringEngine::open()) {
+            return engine;
+        }
+        if (backend == Backend::Uring) {
+            cerr << "io_uring недоступен, файлы пишутся через пул потоков." << endl;
+        }
+    }
+#else
+    (void)backend;
+#endif
+    return make_unique<ThreadPoolEngine>();
+}
+
+Engine &Engine::instance() {
+    static unique_ptr<Engine> engine = create(preferred);
+    return *engine;
+}
+
+// Счётчик операций, результата которых ждёт вызывающий поток.
+class Wait {
+private:
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t outstanding = 0;
+    int64_t error = 0;
+    uint64_t bytes = 0;
+
+public:
+    Completion add() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++outstanding;
+        return [this](int64_t result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (result < 0 && error == 0) {
+                error = result;
+            } else if (result > 0) {
+                bytes += static_cast<uint64_t>(result);
+            }
+            if (--outstanding == 0) {
+                finished.notify_all();
+            }
+        };
+    }
+
+    // Первая ошибка (-errno) или сумма результатов всех операций.
+    int64_t wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return outstanding == 0; });
+        return error < 0 ? error : static_cast<int64_t>(bytes);
+    }
+};
+
+// Файл, который пишется через движок: std::ostream поверх него форматирует
+// прямо в буфер пула, полный буфер уходит на запись, и следующий
+// заполняется, пока предыдущий летит на диск. Пишется path + ".tmp";
+// commit() дожидается всех записей, делает fsync, подменяет path через
+// rename и синхронизирует каталог, как commitFile. Без commit()
+// недописанный .tmp удаляется.
+class File : public std::streambuf {
+private:
+    static constexpr size_t kNoBuffer = SIZE_MAX;
+
+    // Общее с обратными вызовами: сам File может умереть раньше них.
+    struct State {
+        Engine *engine = nullptr;
+        string path;
+        int fd = -1;
+        std::mutex mutex;
+        size_t pending = 0;
+        uint64_t bytes = 0;
+        int64_t error = 0;
+        bool closing = false;
+        bool discard = false;
+        Completion done;
+    };
+
+    Engine &engine;
+    string path;
+    std::shared_ptr<State> state;
+    size_t current = kNoBuffer;
+    uint64_t offset = 0;
+    bool committed = false;
+
+    // Все записи завершились и commit() уже вызван.
+    static void finish(const std::shared_ptr<State> &state) {
+        if (state->discard || state->error < 0) {
+            ::close(state->fd);
+            ::unlink((state->path + ".tmp").c_str());
+            if (state->done) {
+                state->done(state->error < 0 ? state->error : -ECANCELED);
+            }
+            return;
+        }
+        state->engine->fsync(state->fd, [state](int64_t result) {
+            ::close(state->fd);
+            string tmp = state->path + ".tmp";
+            if (result >= 0 && std::rename(tmp.c_str(), state->path.c_str()) != 0) {
+                result = -errno;
+            }
+            if (result < 0) {
+                ::unlink(tmp.c_str());
+            } else {
+                syncDirectory(state->path);
+            }
+            if (state->done) {
+                state->done(result < 0 ? result : static_cast<int64_t>(state->bytes));
+            }
+        });
+        state->engine->submit();
+    }
+
+    static void written(const std::shared_ptr<State> &state, int64_t result) {
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (result < 0 && state->error == 0) {
+                state->error = result;
+            } else if (result > 0) {
+                state->bytes += static_cast<uint64_t>(result);
+            }
+            last = --state->pending == 0 && state->closing;
+        }
+        if (last) {
+            finish(state);
+        }
+    }
+
+    void handOff() {
+        if (current == kNoBuffer) {
+            return;
+        }
+        size_t length = static_cast<size_t>(pptr() - pbase());
+        size_t index = current;
+        current = kNoBuffer;
+        setp(nullptr, nullptr);
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            ++state->pending;
+        }
+        std::shared_ptr<State> shared = state;
+        engine.write(state->fd, index, length, offset, [shared](int64_t result) { written(shared, result); });
+        offset += length;
+        engine.submit();
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (!state) {
+            return traits_type::eof();
+        }
+        handOff();
+        if (traits_type::eq_int_type(ch, traits_type::eof())) {
+            return traits_type::not_eof(ch);
+        }
+        current = engine.acquire();
+        char *begin = engine.buffer(current);
+        setp(begin, begin + Engine::kBufferSize);
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+        return ch;
+    }
+
+public:
+    explicit File(string filename, Engine &target = Engine::instance()) : engine(target), path(move(filename)) {
+        int fd = ::open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            state = std::make_shared<State>();
+            state->engine = &engine;
+            state->path = path;
+            state->fd = fd;
+        }
+    }
+    File(const File &) = delete;
+    File &operator=(const File &) = delete;
+    ~File() override {
+        if (state && !committed) {
+            state->discard = true;
+            commit(nullptr);
+        }
+    }
+
+    bool isOpen() const { return state != nullptr; }
+
+    // done получает число записанных байт или -errno, когда файл уже на
+    // диске под своим именем.
+    void commit(Completion done) {
+        if (!state) {
+            if (done) {
+                done(-EBADF);
+            }
+            return;
+        }
+        handOff();
+        committed = true;
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->closing = true;
+            state->done = move(done);
+            last = state->pending == 0;
+        }
+        if (last) {
+            finish(state);
+        }
+    }
+
+    bool commit() {
+        Wait wait;
+        commit(wait.add());
+        if (wait.wait() < 0) {
+            cout << "Не удалось сохранить файл " << path << "." << endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Читает файл целиком кусками по размеру буфера; все куски уходят одной пачкой.
+bool readFile(const string &path, string &data, Engine &engine = Engine::instance()) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    data.assign(static_cast<size_t>(st.st_size), '\0');
+    Wait wait;
+    for (size_t offset = 0; offset < data.size(); offset += Engine::kBufferSize) {
+        engine.read(fd, &data[offset], std::min(Engine::kBufferSize, data.size() - offset), offset, wait.add());
+    }
+    engine.submit();
+    bool ok = wait.wait() >= 0;
+    ::close(fd);
+    return ok;
+}
+
+} // namespace aio
+
+// Журнал упреждающей записи. Каждая мутация дописывается в конец файла
+// кадром [длина u32][crc32 u32][тело]; тело кодируется varint-ами.
+// Потоки только копируют кадр в общий буфер, а фоновый поток пишет накопленную
+// пачку одним write() и синхронизирует её с диском согласно FsyncPolicy.
+// Для контрольных точек журнал режется на сегменты: rotate() закрывает
+// текущий файл под именем <path>.<номер>, и запись продолжается в новый path.
+class WriteAheadLog {
+private:
+    int fd = -1;
+    string path;
+    FsyncPolicy policy;
+    std::chrono::milliseconds syncInterval;
+    std::mutex mutex;
+    std::condition_variable pendingCv;
+    std::condition_variable durableCv;
+    string pending;
+    uint64_t appendedLsn = 0;
+    uint64_t writtenLsn = 0;
+    uint64_t syncedLsn = 0;
+    bool syncRequested = false;
+    bool stopping = false;
+    // После неудачного write() или fdatasync в файле может остаться
+    // оборванный кадр, и дописывать за ним нельзя: журнал отказывает
+    // насовсем, LSN больше не растут, а commit() возвращает false.
+    std::atomic<bool> failed{false};
+    // Первые rotateBytes байт pending (записи до rotateLsn) ещё относятся к
+    // закрываемому сегменту. sealedSegment — номер последнего закрытого.
+    bool rotateRequested = false;
+    size_t rotateBytes = 0;
+    uint64_t rotateLsn = 0;
+    uint64_t sealedSegment = 0;
+    std::thread writer;
+
+    static void putVarint(string &out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static void putString(string &out, const string &value) {
+        putVarint(out, value.size());
+        out.append(value);
+    }
+
+    static bool getVarint(const char *&pos, const char *end, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; pos < end && shift < 64; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*pos++);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool getString(const char *&pos, const char *end, string &value) {
+        uint64_t size;
+        if (!getVarint(pos, end, size) || size > static_cast<uint64_t>(end - pos)) {
+            return false;
+        }
+        value.assign(pos, size);
+        pos += size;
+        return true;
+    }
+
+    static void putFixed32(string &out, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    static uint32_t getFixed32(const char *pos) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            value |= static_cast<uint32_t>(static_cast<uint8_t>(pos[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    // Старший бит байта типа: за ним идёт номер записи.
+    static constexpr uint8_t kLsnFlag = 0x80;
+
+    static void encode(string &out, const WalRecord &record, uint64_t lsn) {
+        string body;
+        body.push_back(static_cast<char>(static_cast<uint8_t>(record.type) | kLsnFlag));
+        putVarint(body, lsn);
+        switch (record.type) {
+        case WalRecordType::AddItem:
+            putVarint(body, record.itemId);
+            putVarint(body, record.cents);
+            putString(body, record.name);
+            putString(body, record.text);
+            putVarint(body, record.endsAt);
+            putVarint(body, record.reserveCents);
+            break;
+        case WalRecordType::Bid:
+        case WalRecordType::ProxyBid:
+            putVarint(body, record.itemId);
+            putVarint(body, record.cents);
+            putVarint(body, record.bidder);
+            putVarint(body, record.endsAt);
+            putVarint(body, record.time);
+            break;
+        case WalRecordType::Buy:
+            putVarint(body, record.itemId);
+            break;
+        case WalRecordType::Message:
+            putVarint(body, record.itemId);
+            putString(body, record.name);
+            putString(body, record.text);
+            break;
+        case WalRecordType::Register:
+            putString(body, record.name);
+            putVarint(body, record.passwordHash);
+            break;
+        }
+        putFixed32(out, static_cast<uint32_t>(body.size()));
+        putFixed32(out, crc32(body.data(), body.size()));
+        out.append(body);
+    }
+
+    static bool decode(const char *pos, const char *end, WalRecord &record) {
+        if (pos == end) {
+            return false;
+        }
+        record = WalRecord();
+        uint8_t type = static_cast<uint8_t>(*pos++);
+        if ((type & kLsnFlag) && !getVarint(pos, end, record.lsn)) {
+            return false;
+        }
+        record.type = static_cast<WalRecordType>(type & ~kLsnFlag);
+        uint64_t id = 0;
+        uint64_t bidder = 0;
+        switch (record.type) {
+        case WalRecordType::AddItem:
+            if (!getVarint(pos, end, id) || !getVarint(pos, end, record.cents) ||
+                !getString(pos, end, record.name) || !getString(pos, end, record.text)) {
+                return false;
+            }
+            // Записи, сделанные до появления сроков торгов, кончаются на тексте,
+            // а до появления резервной цены — на сроке.
+            if ((pos != end && !getVarint(pos, end, record.endsAt)) ||
+                (pos != end && !getVarint(pos, end, record.reserveCents))) {
+                return false;
+            }
+            break;
+        case WalRecordType::Bid:
+        case WalRecordType::ProxyBid:
+            if (!getVarint(pos, end, id) || !getVarint(pos, end, record.cents) || !getVarint(pos, end, bidder)) {
+                return false;
+            }
+            if ((pos != end && !getVarint(pos, end, record.endsAt)) || (pos != end && !getVarint(pos, end, record.time))) {
+                return false;
+            }
+            record.bidder = static_cast<uint32_t>(bidder);
+            break;
+        case WalRecordType::Buy:
+            if (!getVarint(pos, end, id)) {
+                return false;
+            }
+            break;
+        case WalRecordType::Message:
+            if (!getVarint(pos, end, id) || !getString(pos, end, record.name) || !getString(pos, end, record.text)) {
+                return false;
+            }
+            break;
+        case WalRecordType::Register:
+            if (!getString(pos, end, record.name) || !getVarint(pos, end, record.passwordHash)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+        record.itemId = id;
+        return pos == end;
+    }
+
+    bool writeAll(const char *data, size_t left) {
+        while (left > 0) {
+            ssize_t written = ::write(fd, data, left);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                cerr << "Ошибка записи журнала: " << std::strerror(errno) << endl;
+                return false;
+            }
+            data += written;
+            left -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    bool syncFile() {
+        if (::fdatasync(fd) != 0) {
+            cerr << "Ошибка синхронизации журнала: " << std::strerror(errno) << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Дописанный и синхронизированный сегмент переименовывается, а новый
+    // файл подставляется под тот же дескриптор через dup2, так что append()
+    // продолжает видеть прежний fd. false — сегмент не закрыт и запись
+    // по-прежнему идёт в path; если вернуть файл на место не удалось,
+    // журнал отказывает.
+    bool seal(uint64_t segment) {
+        string sealed = segmentPath(path, segment);
+        if (std::rename(path.c_str(), sealed.c_str()) != 0) {
+            cerr << "Не удалось закрыть сегмент журнала: " << std::strerror(errno) << endl;
+            return false;
+        }
+        int next = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (next < 0 || ::dup3(next, fd, O_CLOEXEC) < 0) {
+            cerr << "Не удалось открыть новый сегмент журнала: " << std::strerror(errno) << endl;
+            if (next >= 0) {
+                ::close(next);
+            }
+            // fd всё ещё смотрит в закрываемый сегмент: он возвращается под
+            // имя path, иначе следующие записи попали бы в сегмент.
+            if (std::rename(sealed.c_str(), path.c_str()) != 0) {
+                cerr << "Не удалось вернуть сегмент журнала: " << std::strerror(errno) << endl;
+                failed = true;
+            }
+            return false;
+        }
+        ::close(next);
+        syncDirectory(path);
+        return true;
+    }
+
+    void writerLoop() {
+        // Неудачная ротация повторяется через syncInterval, пока записи
+        // после среза ждут в pending; после kSealAttempts попыток журнал
+        // отказывает, и rotate() возвращает 0.
+        static constexpr unsigned kSealAttempts = 20;
+        std::unique_lock<std::mutex> lock(mutex);
+        auto lastSync = std::chrono::steady_clock::now();
+        string batch;
+        unsigned sealFailures = 0;
+        while (true) {
+            if (sealFailures > 0) {
+                pendingCv.wait_for(lock, syncInterval, [&] { return stopping; });
+            } else {
+                pendingCv.wait_for(lock, syncInterval,
+                                   [&] { return stopping || syncRequested || rotateRequested || !pending.empty(); });
+            }
+            bool stop = stopping && pending.empty() && !rotateRequested;
+            batch.swap(pending);
+            uint64_t batchLsn = appendedLsn;
+            bool rotating = rotateRequested;
+            size_t sealedBytes = rotating ? rotateBytes : 0;
+            uint64_t sealedLsn = rotateLsn;
+            uint64_t segment = sealedSegment + 1;
+            rotateRequested = false;
+            auto now = std::chrono::steady_clock::now();
+            bool unsynced = batchLsn > std::max(syncedLsn, rotating ? sealedLsn : 0);
+            bool sync = unsynced && (policy == FsyncPolicy::Always || syncRequested || stop ||
+                                     (policy == FsyncPolicy::Interval && now - lastSync >= syncInterval));
+            syncRequested = false;
+            lock.unlock();
+
+            bool ok = true;
+            bool sealed = true;
+            if (rotating) {
+                ok = writeAll(batch.data(), sealedBytes) && syncFile();
+                sealed = ok && seal(segment);
+                ok = ok && !failed;
+            }
+            if (ok && !sealed) {
+                lock.lock();
+                if (++sealFailures >= kSealAttempts) {
+                    failed = true;
+                    pending.clear();
+                    durableCv.notify_all();
+                    return;
+                }
+                // Закрываемая часть уже в path; остальное вернётся в начало
+                // очереди и ляжет в новый сегмент после удачной ротации.
+                pending.insert(0, batch, sealedBytes, string::npos);
+                batch.clear();
+                rotateRequested = true;
+                rotateBytes = 0;
+                syncRequested = syncRequested || sync;
+                continue;
+            }
+            ok = ok && writeAll(batch.data() + sealedBytes, batch.size() - sealedBytes);
+            batch.clear();
+            if (ok && sync) {
+                ok = syncFile();
+                lastSync = now;
+            }
+
+            lock.lock();
+            if (!ok) {
+                failed = true;
+                pending.clear();
+                durableCv.notify_all();
+                return;
+            }
+            writtenLsn = batchLsn;
+            if (rotating) {
+                syncedLsn = std::max(syncedLsn, sealedLsn);
+                sealedSegment = segment;
+                sealFailures = 0;
+            }
+            if (sync) {
+                syncedLsn = batchLsn;
+            }
+            durableCv.notify_all();
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+public:
+    // Новые сегменты нумеруются после lastSegment и после уже лежащих на
+    // диске, записи — после lastLsn, который вернуло проигрывание журнала.
+    WriteAheadLog(const string &logPath, FsyncPolicy fsyncPolicy,
+                  std::chrono::milliseconds interval = std::chrono::milliseconds(50), uint64_t lastSegment = 0,
+                  uint64_t lastLsn = 0)
+        : path(logPath), policy(fsyncPolicy), syncInterval(interval), appendedLsn(lastLsn), writtenLsn(lastLsn),
+          syncedLsn(lastLsn) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            cout << "Не удалось открыть журнал " << path << "." << endl;
+            return;
+        }
+        vector<uint64_t> sealed = segments(path);
+        sealedSegment = std::max(lastSegment, sealed.empty() ? 0 : sealed.back());
+        writer = std::thread(&WriteAheadLog::writerLoop, this);
+    }
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    ~WriteAheadLog() {
+        if (fd < 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        pendingCv.notify_one();
+        writer.join();
+        ::close(fd);
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Возвращает номер записи (LSN); дожидаться записи на диск не обязательно.
+    uint64_t append(const WalRecord &record) {
+        if (fd < 0) {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!failed) {
+            encode(pending, record, appendedLsn + 1);
+            pendingCv.notify_one();
+        }
+        return ++appendedLsn;
+    }
+
+    // При политике Always ждёт, пока пачка с записью lsn окажется на диске;
+    // параллельные ожидающие делят один fdatasync. false — журнал отказал,
+    // и запись на диск не попала или может не попасть.
+    bool commit(uint64_t lsn) {
+        if (lsn == 0) {
+            return true;
+        }
+        if (policy != FsyncPolicy::Always) {
+            return !failed;
+        }
+        metrics::Timer timer(metrics::Op::WalCommit);
+        std::unique_lock<std::mutex> lock(mutex);
+        durableCv.wait(lock, [&] { return failed || syncedLsn >= lsn; });
+        return syncedLsn >= lsn;
+    }
+
+    bool hasFailed() const { return failed; }
+
+    // Номер последней принятой записи: снимок, снятый после этого вызова,
+    // отражает все записи до него включительно.
+    uint64_t lastLsn() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return appendedLsn;
+    }
+
+    // Записи, ещё не отданные в write(): глубина очереди фонового писателя.
+    uint64_t backlog() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return appendedLsn - writtenLsn;
+    }
+
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (fd < 0 || syncedLsn == appendedLsn) {
+            return;
+        }
+        uint64_t target = appendedLsn;
+        syncRequested = true;
+        pendingCv.notify_one();
+        durableCv.wait(lock, [&] { return failed || syncedLsn >= target; });
+    }
+
+    // Закрывает текущий сегмент: всё, что append() вернул до вызова, ложится
+    // в сегмент с возвращённым номером и синхронизируется, всё последующее —
+    // в новый файл. Писатели на время ротации не останавливаются.
+    // 0 — журнал отказал, сегмент не закрыт.
+    uint64_t rotate() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (fd < 0) {
+            return 0;
+        }
+        uint64_t target = sealedSegment + 1;
+        rotateRequested = true;
+        rotateBytes = pending.size();
+        rotateLsn = appendedLsn;
+        pendingCv.notify_one();
+        durableCv.wait(lock, [&] { return failed || sealedSegment >= target; });
+        return sealedSegment >= target ? target : 0;
+    }
+
+    static string segmentPath(const string &path, uint64_t segment) { return path + "." + std::to_string(segment); }
+
+    // Номера закрытых сегментов журнала path по возрастанию.
+    static vector<uint64_t> segments(const string &path) {
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? "." : path.substr(0, slash);
+        string prefix = (slash == string::npos ? path : path.substr(slash + 1)) + ".";
+        vector<uint64_t> found;
+        DIR *dir = ::opendir(directory.c_str());
+        if (!dir) {
+            return found;
+        }
+        while (dirent *entry = ::readdir(dir)) {
+            std::string_view name(entry->d_name);
+            uint64_t segment = 0;
+            if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0) {
+                auto result = std::from_chars(name.data() + prefix.size(), name.data() + name.size(), segment);
+                if (result.ec == std::errc() && result.ptr == name.data() + name.size()) {
+                    found.push_back(segment);
+                }
+            }
+        }
+        ::closedir(dir);
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+
+    // Удаляет сегменты с номерами не больше upTo: их записи уже в контрольной точке.
+    static void dropSegments(const string &path, uint64_t upTo) {
+        for (uint64_t segment : segments(path)) {
+            if (segment <= upTo) {
+                ::unlink(segmentPath(path, segment).c_str());
+            }
+        }
+    }
+
+    // Вызывается после того, как снимок состояния надёжно записан.
+    void reset() {
+        flush();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd >= 0 && !failed && pending.empty() && writtenLsn == appendedLsn) {
+            if (::ftruncate(fd, 0) == 0) {
+                ::fdatasync(fd);
+            }
+        }
+    }
+
+    // Проигрывает журнал и обрезает его по последней целой записи, чтобы
+    // оборванный при сбое хвост не оказался перед новыми записями.
+    // Если lsn задан, на входе это номер последней записи, уже отражённой в
+    // снимке: записи с номерами не больше него пропускаются, так что сбой
+    // между записью снимка и очисткой журнала ничего не применит дважды.
+    // На выходе там наибольший встреченный номер.
+    static size_t replay(const string &path, const std::function<void(const WalRecord &)> &apply,
+                         uint64_t *lsn = nullptr) {
+        string data;
+        if (!aio::readFile(path, data)) {
+            return 0;
+        }
+
+        size_t offset = 0;
+        size_t count = 0;
+        WalRecord record;
+        while (data.size() - offset >= 8) {
+            uint32_t size = getFixed32(data.data() + offset);
+            uint32_t crc = getFixed32(data.data() + offset + 4);
+            if (size > data.size() - offset - 8) {
+                break;
+            }
+            const char *body = data.data() + offset + 8;
+            if (crc32(body, size) != crc || !decode(body, body + size, record)) {
+                break;
+            }
+            offset += 8 + size;
+            if (lsn && record.lsn != 0) {
+                if (record.lsn <= *lsn) {
+                    continue;
+                }
+                *lsn = record.lsn;
+            }
+            apply(record);
+            ++count;
+        }
+        if (offset < data.size()) {
+            cerr << "Журнал " << path << " обрезан после " << count << " записей." << endl;
+            if (::truncate(path.c_str(), static_cast<off_t>(offset)) != 0) {
+                cerr << "Не удалось обрезать журнал: " << std::strerror(errno) << endl;
+            }
+        }
+        return count;
+    }
+    // Закрытые сегменты с номерами больше after по порядку, затем текущий файл.
+    static size_t replaySegments(const string &path, uint64_t after,
+                                 const std::function<void(const WalRecord &)> &apply, uint64_t *lsn = nullptr) {
+        size_t count = 0;
+        for (uint64_t segment : segments(path)) {
+            if (segment > after) {
+                count += replay(segmentPath(path, segment), apply, lsn);
+            }
+        }
+        return count + replay(path, apply, lsn);
+    }
+};
+
+// Учётные записи покупателей с уникальными именами. Индекс — вектор по ID из
+// UserDirectory: ID плотные, поэтому вход стоит один поиск имени и одно
+// обращение по индексу при любом числе аккаунтов. Поиск берёт разделяемую
+// блокировку, регистрация — исключительную только на вставку. Новый аккаунт
+// сохраняется одной записью журнала; целиком список пишет только снимок.
+class Accounts {
+private:
+    mutable std::shared_mutex mutex;
+    vector<unique_ptr<Buyer>> buyers;
+    vector<const Buyer *> byId;
+    WriteAheadLog *log = nullptr;
+
+    // Вызывается под исключительной блокировкой; nullptr — имя занято.
+    const Buyer *insert(unique_ptr<Buyer> buyer) {
+        UserId id = buyer->getId();
+        if (id < byId.size() && byId[id]) {
+            return nullptr;
+        }
+        if (id >= byId.size()) {
+            byId.resize(std::max<size_t>(id + 1, byId.size() * 2));
+        }
+        byId[id] = buyer.get();
+        buyers.push_back(std::move(buyer));
+        return byId[id];
+    }
+
+public:
+    Accounts() = default;
+    Accounts(const Accounts &) = delete;
+    Accounts &operator=(const Accounts &) = delete;
+
+    void attachLog(WriteAheadLog *wal) { log = wal; }
+
+    void reserve(size_t count) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        buyers.reserve(count);
+    }
+
+    // Загрузка без записи в журнал; nullptr, если такое имя уже есть.
+    const Buyer *add(unique_ptr<Buyer> buyer) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return insert(std::move(buyer));
+    }
+
+    // Хэш пароля считается до блокировки; запись в журнал идёт под ней,
+    // чтобы порядок записей совпадал с порядком вставки.
+    const Buyer *registerUser(const string &name, const string &password) {
+        metrics::Timer timer(metrics::Op::Register);
+        auto buyer = make_unique<Buyer>(name, password);
+        uint64_t lsn = 0;
+        const Buyer *added;
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            added = insert(std::move(buyer));
+            if (added && log) {
+                lsn = log->append(WalRecord::registration(name, added->getPasswordHash()));
+            }
+        }
+        if (log) {
+            log->commit(lsn);
+        }
+        return added;
+    }
+
+    const Buyer *find(std::string_view name) const {
+        UserId id = UserDirectory::instance().find(name);
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return id < byId.size() ? byId[id] : nullptr;
+    }
+
+    const Buyer *login(const string &name, const string &password) const {
+        metrics::Timer timer(metrics::Op::Login);
+        const Buyer *buyer = find(name);
+        return buyer && buyer->checkPassword(password) ? buyer : nullptr;
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return buyers.size();
+    }
+
+    // Обход в порядке регистрации.
+    void forEach(const std::function<void(const Buyer &)> &visit) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (const auto &buyer : buyers) {
+            visit(*buyer);
+        }
+    }
+
+    // Покупатели с номерами регистрации из [begin, end).
+    void forRange(size_t begin, size_t end, const std::function<void(const Buyer &)> &visit) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (size_t i = begin; i < std::min(end, buyers.size()); ++i) {
+            visit(*buyers[i]);
+        }
+    }
+};
+
+// Файл, целиком отображённый в память только для чтения.
+class MappedFile {
+private:
+    const char *base = nullptr;
+    size_t length = 0;
+
+    MappedFile() = default;
+
+public:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (base) {
+            ::munmap(const_cast<char *>(base), length);
+        }
+    }
+
+    // nullptr, если файл не открывается; пустой файл даёт пустое отображение.
+    static std::unique_ptr<MappedFile> open(const string &path, bool sequential = false) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        std::unique_ptr<MappedFile> file(new MappedFile());
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            file->length = static_cast<size_t>(st.st_size);
+            void *mapped = ::mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = mapped != MAP_FAILED;
+            if (ok) {
+                file->base = static_cast<const char *>(mapped);
+                if (sequential) {
+                    ::madvise(mapped, file->length, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        ::close(fd);
+        return ok ? move(file) : nullptr;
+    }
+
+    const char *data() const { return base; }
+    size_t size() const { return length; }
+};
+
+// Бинарный снимок: заголовок, секции записей фиксированной ширины и общая
+// куча строк, на которую записи ссылаются смещениями. Файл читается через
+// mmap без разбора; сообщения отсортированы по ID лота, а секция chats
+// хранит для каждого лота диапазон его сообщений. Секция names — справочник
+// имён в порядке ID; остальные записи ссылаются на пользователей по ID.
+const char kSnapshotMagic[8] = {'A', 'U', 'C', 'S', 'N', 'A', 'P', '1'};
+const uint32_t kSnapshotVersion = 5;
+
+struct SnapshotString {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct SnapshotUser {
+    uint32_t name;
+    uint32_t reserved;
+    uint64_t passwordHash;
+};
+
+struct SnapshotItem {
+    uint64_t id;
+    uint64_t cents;
+    uint32_t bidder;
+    uint32_t owner;
+    SnapshotString name;
+    uint64_t endsAt;
+    uint64_t reserveCents;
+    // Ставки и заявки лота идут в секциях bids и proxies подряд, в порядке лотов.
+    uint32_t bids;
+    uint32_t proxies;
+};
+
+struct SnapshotBid {
+    uint64_t cents;
+    uint64_t time;
+    // Старший бит — ставка автоповышения, как в BidBook.
+    uint32_t bidder;
+    uint32_t reserved;
+};
+
+struct SnapshotProxy {
+    uint64_t max;
+    uint32_t bidder;
+    uint32_t seq;
+};
+
+struct SnapshotMessage {
+    uint64_t itemId;
+    uint32_t from;
+    uint32_t reserved;
+    SnapshotString content;
+};
+
+struct SnapshotChat {
+    uint64_t itemId;
+    uint64_t first;
+    uint64_t count;
+};
+
+struct SnapshotSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t nextItemId;
+    // Номер последней записи журнала, отражённой в снимке.
+    uint64_t walLsn;
+    SnapshotSection names;
+    SnapshotSection users;
+    SnapshotSection items;
+    SnapshotSection messages;
+    SnapshotSection chats;
+    SnapshotSection heap;
+    SnapshotSection bids;
+    SnapshotSection proxies;
+};
+
+static_assert(sizeof(SnapshotUser) == 16 && sizeof(SnapshotItem) == 64 && sizeof(SnapshotMessage) == 32 &&
+                  sizeof(SnapshotChat) == 24 && sizeof(SnapshotBid) == 24 && sizeof(SnapshotProxy) == 16 &&
+                  sizeof(SnapshotHeader) == 160,
+              "формат снимка зависит от раскладки структур");
+
+class SnapshotFile {
+private:
+    std::unique_ptr<MappedFile> mapping;
+    const char *base = nullptr;
+    size_t size = 0;
+    SnapshotHeader header{};
+
+    SnapshotFile() = default;
+
+    bool sectionFits(const SnapshotSection &section, size_t recordSize) const {
+        return section.offset <= size && section.count <= (size - section.offset) / recordSize &&
+               section.offset % alignof(uint64_t) == 0;
+    }
+
+    template <typename T> const T *records(const SnapshotSection &section) const {
+        return reinterpret_cast<const T *>(base + section.offset);
+    }
+
+public:
+    // nullptr, если файла нет или он повреждён.
+    static std::shared_ptr<const SnapshotFile> open(const string &path) {
+        std::shared_ptr<SnapshotFile> file(new SnapshotFile());
+        file->mapping = MappedFile::open(path);
+        if (!file->mapping) {
+            return nullptr;
+        }
+        file->base = file->mapping->data();
+        file->size = file->mapping->size();
+        if (file->size < sizeof(SnapshotHeader)) {
+            cout << "Снимок " << path << " повреждён или имеет другую версию." << endl;
+            return nullptr;
+        }
+        std::memcpy(&file->header, file->base, sizeof(SnapshotHeader));
+        const SnapshotHeader &h = file->header;
+        if (std::memcmp(h.magic, kSnapshotMagic, sizeof(h.magic)) != 0 || h.version != kSnapshotVersion ||
+            h.headerSize != sizeof(SnapshotHeader) || !file->sectionFits(h.names, sizeof(SnapshotString)) ||
+            !file->sectionFits(h.users, sizeof(SnapshotUser)) ||
+            !file->sectionFits(h.items, sizeof(SnapshotItem)) ||
+            !file->sectionFits(h.messages, sizeof(SnapshotMessage)) ||
+            !file->sectionFits(h.chats, sizeof(SnapshotChat)) || !file->sectionFits(h.heap, 1) ||
+            !file->sectionFits(h.bids, sizeof(SnapshotBid)) || !file->sectionFits(h.proxies, sizeof(SnapshotProxy))) {
+            cout << "Снимок " << path << " повреждён или имеет другую версию." << endl;
+            return nullptr;
+        }
+        return file;
+    }
+
+    ItemId nextItemId() const { return header.nextItemId; }
+    uint64_t walLsn() const { return header.walLsn; }
+    size_t nameCount() const { return header.names.count; }
+    size_t userCount() const { return header.users.count; }
+    size_t itemCount() const { return header.items.count; }
+    size_t messageCount() const { return header.messages.count; }
+    size_t chatCount() const { return header.chats.count; }
+    size_t bidCount() const { return header.bids.count; }
+    size_t proxyCount() const { return header.proxies.count; }
+
+    const SnapshotString &name(size_t index) const { return records<SnapshotString>(header.names)[index]; }
+    const SnapshotUser &user(size_t index) const { return records<SnapshotUser>(header.users)[index]; }
+    const SnapshotItem &item(size_t index) const { return records<SnapshotItem>(header.items)[index]; }
+    const SnapshotMessage &message(size_t index) const { return records<SnapshotMessage>(header.messages)[index]; }
+    const SnapshotChat &chat(size_t index) const { return records<SnapshotChat>(header.chats)[index]; }
+    const SnapshotBid &bid(size_t index) const { return records<SnapshotBid>(header.bids)[index]; }
+    const SnapshotProxy &proxy(size_t index) const { return records<SnapshotProxy>(header.proxies)[index]; }
+
+    // Позиция лота в секции chats или chatCount(), если сообщений по нему нет.
+    size_t findChat(ItemId itemId) const {
+        const SnapshotChat *first = records<SnapshotChat>(header.chats);
+        const SnapshotChat *last = first + header.chats.count;
+        const SnapshotChat *it = std::lower_bound(
+            first, last, itemId, [](const SnapshotChat &chat, ItemId id) { return chat.itemId < id; });
+        return it != last && it->itemId == itemId && it->first + it->count <= header.messages.count
+                   ? static_cast<size_t>(it - first)
+                   : header.chats.count;
+    }
+
+    // Позиция первого чата с ID лота больше after.
+    size_t chatsAfter(ItemId after) const {
+        const SnapshotChat *first = records<SnapshotChat>(header.chats);
+        const SnapshotChat *last = first + header.chats.count;
+        return static_cast<size_t>(std::upper_bound(first, last, after, [](ItemId id, const SnapshotChat &chat) {
+                                       return id < chat.itemId;
+                                   }) - first);
+    }
+
+    std::string_view str(const SnapshotString &ref) const {
+        if (ref.offset > header.heap.count || ref.length > header.heap.count - ref.offset) {
+            return {};
+        }
+        return std::string_view(base + header.heap.offset + ref.offset, ref.length);
+    }
+};
+
+// Содержимое файла снимка, собираемое в памяти. Записи ссылаются на
+// пользователей индексами секции names: полный снимок кладёт туда весь
+// справочник как есть, а раздел контрольной точки — только встретившиеся в
+// нём имена, чтобы размер раздела не зависел от числа пользователей.
+class SnapshotBuilder {
+private:
+    string heap;
+    bool wholeDirectory = false;
+    uint64_t walLsn = 0;
+    unordered_map<UserId, uint32_t> local;
+    vector<SnapshotString> names;
+    vector<SnapshotUser> users;
+    vector<SnapshotItem> items;
+    vector<SnapshotBid> bids;
+    vector<SnapshotProxy> proxies;
+    vector<SnapshotMessage> messages;
+
+    SnapshotString intern(std::string_view value) {
+        SnapshotString ref{heap.size(), static_cast<uint32_t>(value.size()), 0};
+        heap.append(value);
+        return ref;
+    }
+
+    uint32_t user(UserId id) {
+        if (wholeDirectory || id == kNoUser) {
+            return id;
+        }
+        auto inserted = local.emplace(id, static_cast<uint32_t>(names.size()));
+        if (inserted.second) {
+            names.push_back(intern(UserDirectory::instance().name(id)));
+        }
+        return inserted.first->second;
+    }
+
+public:
+    // Весь справочник имён в порядке ID; вызывается до остальных add*.
+    void addDirectory() {
+        const UserDirectory &directory = UserDirectory::instance();
+        names.reserve(directory.size());
+        for (UserId id = 0; id < directory.size(); ++id) {
+            names.push_back(intern(directory.name(id)));
+        }
+        wholeDirectory = true;
+    }
+
+    void addUser(const Buyer &buyer) { users.push_back({user(buyer.getId()), 0, buyer.getPasswordHash()}); }
+
+    void addItem(const Item &item, const BidBook *book) {
+        uint32_t bidder = item.getBidder() == Item::kNoBidder ? Item::kNoBidder : user(item.getBidder());
+        items.push_back({item.getId(), item.getCents(), bidder, user(item.getOwnerId()), intern(item.getName()),
+                         item.getEndsAt(), item.getReserveCents(), 0, 0});
+        if (!book) {
+            return;
+        }
+        for (size_t i = 0; i < book->size(); ++i) {
+            BidBook::Entry entry = book->entry(i);
+            bids.push_back({entry.cents, entry.time, user(entry.bidder) | (entry.proxy ? BidBook::kProxyFlag : 0), 0});
+        }
+        for (const auto &proxy : book->openProxies()) {
+            proxies.push_back({proxy.max, user(proxy.bidder), proxy.seq});
+        }
+        items.back().bids = static_cast<uint32_t>(book->size());
+        items.back().proxies = static_cast<uint32_t>(book->openProxies().size());
+    }
+
+    void addMessage(const Message &message) {
+        messages.push_back({message.getItemId(), user(message.getFromId()), 0, intern(message.getContent())});
+    }
+
+    bool empty() const { return users.empty() && items.empty() && messages.empty(); }
+
+    // Номер последней записи журнала, которую отражает содержимое.
+    void setWalLsn(uint64_t lsn) { walLsn = lsn; }
+
+    // Пишет снимок в filename + ".tmp" и подменяет им прежний файл после
+    // fsync. Данные уходят в буферы движка до возврата, так что builder
+    // можно сразу разрушить; done получает размер файла или -errno.
+    void write(const string &filename, ItemId nextItemId, aio::Completion done) {
+        std::stable_sort(messages.begin(), messages.end(),
+                         [](const SnapshotMessage &a, const SnapshotMessage &b) { return a.itemId < b.itemId; });
+        vector<SnapshotChat> chats;
+        for (uint64_t i = 0; i < messages.size(); ++i) {
+            if (chats.empty() || chats.back().itemId != messages[i].itemId) {
+                chats.push_back({messages[i].itemId, i, 0});
+            }
+            ++chats.back().count;
+        }
+
+        SnapshotHeader header{};
+        std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+        header.version = kSnapshotVersion;
+        header.headerSize = sizeof(SnapshotHeader);
+        header.nextItemId = nextItemId;
+        header.walLsn = walLsn;
+        uint64_t offset = sizeof(SnapshotHeader);
+        auto place = [&offset](SnapshotSection &section, uint64_t count, uint64_t recordSize) {
+            section = {offset, count};
+            offset += (count * recordSize + 7) / 8 * 8;
+        };
+        place(header.names, names.size(), sizeof(SnapshotString));
+        place(header.users, users.size(), sizeof(SnapshotUser));
+        place(header.items, items.size(), sizeof(SnapshotItem));
+        place(header.messages, messages.size(), sizeof(SnapshotMessage));
+        place(header.chats, chats.size(), sizeof(SnapshotChat));
+        place(header.heap, heap.size(), 1);
+        place(header.bids, bids.size(), sizeof(SnapshotBid));
+        place(header.proxies, proxies.size(), sizeof(SnapshotProxy));
+
+        aio::File file(filename);
+        if (!file.isOpen()) {
+            done(-errno);
+            return;
+        }
+        std::ostream outFile(&file);
+        auto writeSection = [&outFile](const void *data, uint64_t bytes) {
+            static const char padding[8] = {};
+            outFile.write(static_cast<const char *>(data), static_cast<std::streamsize>(bytes));
+            outFile.write(padding, static_cast<std::streamsize>((8 - bytes % 8) % 8));
+        };
+        writeSection(&header, sizeof(header));
+        writeSection(names.data(), names.size() * sizeof(SnapshotString));
+        writeSection(users.data(), users.size() * sizeof(SnapshotUser));
+        writeSection(items.data(), items.size() * sizeof(SnapshotItem));
+        writeSection(messages.data(), messages.size() * sizeof(SnapshotMessage));
+        writeSection(chats.data(), chats.size() * sizeof(SnapshotChat));
+        writeSection(heap.data(), heap.size());
+        writeSection(bids.data(), bids.size() * sizeof(SnapshotBid));
+        writeSection(proxies.data(), proxies.size() * sizeof(SnapshotProxy));
+        if (!outFile) {
+            done(-EIO);
+            return;
+        }
+        file.commit(move(done));
+    }
+
+    bool write(const string &filename, ItemId nextItemId) {
+        aio::Wait wait;
+        write(filename, nextItemId, wait.add());
+        return wait.wait() >= 0;
+    }
+};
+
+// Текстовый обмен в формате CSV: поле с запятой, кавычкой или переводом
+// строки берётся в кавычки, кавычки внутри удваиваются. Поле в кавычках может
+// занимать несколько строк: файл режется на куски по '\n' для параллельного
+// разбора наугад, а кусок, начало которого попало внутрь такого поля,
+// разбирается заново с конца предыдущего.
+namespace csv {
+
+inline bool needsQuotes(std::string_view field) {
+    return field.find_first_of(",\"\r\n") != std::string_view::npos;
+}
+
+void writeField(std::ostream &out, std::string_view field) {
+    if (!needsQuotes(field)) {
+        out << field;
+        return;
+    }
+    out << '"';
+    for (char c : field) {
+        if (c == '"') {
+            out << '"';
+        }
+        out << c;
+    }
+    out << '"';
+}
+
+// Кратчайшая запись числа, которую from_chars прочитает обратно без потерь.
+void writeNumber(std::ostream &out, double value) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.write(buffer, result.ptr - buffer);
+}
+
+// Ближайший из ',', '"' или '\n', начиная с pos; end, если таких нет.
+inline const char *findSpecial(const char *pos, const char *end) {
+#if defined(__SSE2__)
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - pos >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, comma), _mm_cmpeq_epi8(block, quote)),
+                                    _mm_cmpeq_epi8(block, newline));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return pos + __builtin_ctz(static_cast<unsigned>(mask));
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < end && *pos != ',' && *pos != '"' && *pos != '\n') {
+        ++pos;
+    }
+    return pos;
+}
+
+// Разбирает записи, которые начинаются в куске [begin, stop). Последняя
+// запись может закончиться за stop — поле в кавычках читается до закрывающей
+// кавычки, где бы она ни была до конца файла. Поля без кавычек указывают
+// прямо в буфер файла; раскрытые поля с удвоенными кавычками складываются в
+// storage.
+class RecordReader {
+private:
+    const char *pos;
+    const char *stop;
+    const char *end;
+    std::deque<string> &storage;
+
+    static std::string_view trimCr(const char *begin, const char *stop) {
+        if (stop > begin && stop[-1] == '\r') {
+            --stop;
+        }
+        return std::string_view(begin, static_cast<size_t>(stop - begin));
+    }
+
+    // pos стоит на открывающей кавычке. false, если кавычка не закрыта до
+    // конца файла или поле на несколько строк закрыто кавычкой, за которой
+    // не конец поля, — скорее всего, это открывающая кавычка из следующих
+    // строк. Тогда pos встаёт на конец строки открывающей кавычки, и пропадает
+    // только эта строка, а не остаток файла.
+    bool readQuoted(std::string_view &field) {
+        const char *start = ++pos;
+        bool escaped = false;
+        while (true) {
+            const char *q = static_cast<const char *>(std::memchr(pos, '"', static_cast<size_t>(end - pos)));
+            if (q && q + 1 < end && q[1] == '"') {
+                escaped = true;
+                pos = q + 2;
+                continue;
+            }
+            bool closed = q && (q + 1 == end || q[1] == ',' || q[1] == '\r' || q[1] == '\n');
+            const char *lineEnd =
+                closed ? nullptr : static_cast<const char *>(std::memchr(start, '\n', static_cast<size_t>(end - start)));
+            if (!q || (lineEnd && lineEnd < q)) {
+                pos = lineEnd ? lineEnd : end;
+                return false;
+            }
+            pos = q + 1;
+            if (!escaped) {
+                field = std::string_view(start, static_cast<size_t>(q - start));
+                return true;
+            }
+            storage.emplace_back();
+            string &unescaped = storage.back();
+            unescaped.reserve(static_cast<size_t>(q - start));
+            for (const char *c = start; c < q; ++c) {
+                unescaped.push_back(*c);
+                if (*c == '"') {
+                    ++c;
+                }
+            }
+            field = unescaped;
+            return true;
+        }
+    }
+
+public:
+    RecordReader(const char *begin, const char *chunkEnd, const char *fileEnd, std::deque<string> &unescaped)
+        : pos(begin), stop(chunkEnd), end(fileEnd), storage(unescaped) {}
+
+    // Где кончилась последняя прочитанная запись; stop или дальше.
+    const char *position() const { return pos; }
+
+    // Читает следующую запись. quoted сообщает, были ли в ней поля в кавычках;
+    // valid == false для строки с незакрытой кавычкой или мусором после неё.
+    bool next(vector<std::string_view> &fields, bool &quoted, bool &valid) {
+        fields.clear();
+        quoted = false;
+        valid = true;
+        if (pos >= stop) {
+            return false;
+        }
+        while (true) {
+            if (*pos == '"') {
+                quoted = true;
+                std::string_view field;
+                if (!readQuoted(field)) {
+                    valid = false;
+                }
+                fields.push_back(field);
+                if (pos < end && *pos == '\r') {
+                    ++pos;
+                }
+                if (pos >= end || *pos == '\n') {
+                    pos = pos < end ? pos + 1 : end;
+                    return true;
+                }
+                if (*pos != ',') {
+                    valid = false;
+                    const char *lineEnd = static_cast<const char *>(std::memchr(pos, '\n', static_cast<size_t>(end - pos)));
+                    pos = lineEnd ? lineEnd + 1 : end;
+                    return true;
+                }
+                ++pos;
+                continue;
+            }
+            // Кавычка внутри поля без кавычек считается обычным символом,
+            // как в файлах, записанных старыми версиями.
+            const char *start = pos;
+            const char *stop = findSpecial(pos, end);
+            while (stop < end && *stop == '"') {
+                stop = findSpecial(stop + 1, end);
+            }
+            fields.push_back(stop < end && *stop == ',' ? std::string_view(start, static_cast<size_t>(stop - start))
+                                                         : trimCr(start, stop));
+            if (stop >= end || *stop == '\n') {
+                pos = stop < end ? stop + 1 : end;
+                return true;
+            }
+            pos = stop + 1;
+            if (pos >= end || *pos == '\n') {
+                fields.push_back(std::string_view());
+                pos = pos < end ? pos + 1 : end;
+                return true;
+            }
+        }
+    }
+};
+
+// Поля first..last одной записи без кавычек как один срез исходной строки:
+// так старые файлы с запятыми в тексте читаются целиком.
+inline std::string_view joinRaw(const vector<std::string_view> &fields, size_t first, size_t last) {
+    const char *begin = fields[first].data();
+    const char *stop = fields[last].data() + fields[last].size();
+    return std::string_view(begin, static_cast<size_t>(stop - begin));
+}
+
+template <typename T> bool parseNumber(std::string_view text, T &value) {
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+struct ItemRow {
+    ItemId id;
+    double price;
+    std::string_view name;
+    std::string_view owner;
+};
+
+struct MessageRow {
+    ItemId itemId;
+    std::string_view from;
+    std::string_view content;
+};
+
+struct UserRow {
+    std::string_view name;
+    uint64_t passwordHash;
+};
+
+// id,название,цена,продавец; лишние запятые без кавычек относятся к названию.
+bool parseItem(const vector<std::string_view> &fields, bool quoted, ItemRow &row) {
+    size_t n = fields.size();
+    if (n < 4 || (quoted && n != 4)) {
+        return false;
+    }
+    row.name = n == 4 ? fields[1] : joinRaw(fields, 1, n - 3);
+    row.owner = fields[n - 1];
+    return parseNumber(fields[0], row.id) && parseNumber(fields[n - 2], row.price);
+}
+
+// отправитель,текст,ID лота; лишние запятые без кавычек относятся к тексту.
+bool parseMessage(const vector<std::string_view> &fields, bool quoted, MessageRow &row) {
+    size_t n = fields.size();
+    if (n < 3 || (quoted && n != 3)) {
+        return false;
+    }
+    row.from = fields[0];
+    row.content = n == 3 ? fields[1] : joinRaw(fields, 1, n - 2);
+    return parseNumber(fields[n - 1], row.itemId);
+}
+
+bool parseUser(const vector<std::string_view> &fields, bool quoted, UserRow &row) {
+    size_t n = fields.size();
+    if (n < 2 || (quoted && n != 2)) {
+        return false;
+    }
+    row.name = n == 2 ? fields[0] : joinRaw(fields, 0, n - 2);
+    return parseNumber(fields[n - 1], row.passwordHash);
+}
+
+// Результат разбора: строки кусков в исходном порядке. Поля строк ссылаются
+// на отображённый файл и на unescaped, поэтому живут вместе с ними.
+template <typename Row> struct Import {
+    std::unique_ptr<MappedFile> file;
+    vector<vector<Row>> chunks;
+    vector<std::deque<string>> unescaped;
+    size_t rejected = 0;
+    // Куски, разобранные заново: их начало попало внутрь поля в кавычках.
+    size_t reparsed = 0;
+
+    size_t rows() const {
+        size_t total = 0;
+        for (const auto &chunk : chunks) {
+            total += chunk.size();
+        }
+        return total;
+    }
+
+    template <typename Visit> void forEach(Visit visit) const {
+        for (const auto &chunk : chunks) {
+            for (const auto &row : chunk) {
+                visit(row);
+            }
+        }
+    }
+};
+
+// Делит файл на куски по границам строк и разбирает их параллельно.
+// Граница строки может оказаться внутри поля в кавычках; тогда запись
+// дочитывает кусок слева, а кусок справа потом разбирается заново с того
+// места, где она кончилась, — такие поля редки, и повтор обычно не нужен.
+// Пустые строки пропускаются, непонятные считаются в rejected.
+template <typename Row, typename ParseRow>
+bool importFile(const string &filename, ParseRow parseRow, Import<Row> &result, size_t threads = 0) {
+    result.file = MappedFile::open(filename, true);
+    if (!result.file) {
+        return false;
+    }
+    const char *data = result.file->data();
+    size_t size = result.file->size();
+    const size_t minChunk = size_t(1) << 20;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min(threads, size / minChunk));
+
+    vector<const char *> bounds{data};
+    for (size_t i = 1; i < threads; ++i) {
+        const char *cut = std::max(data + size * i / threads, bounds.back());
+        const char *newline = static_cast<const char *>(std::memchr(cut, '\n', static_cast<size_t>(data + size - cut)));
+        bounds.push_back(newline ? newline + 1 : data + size);
+    }
+    bounds.push_back(data + size);
+
+    size_t chunkCount = bounds.size() - 1;
+    result.chunks.assign(chunkCount, {});
+    result.unescaped.assign(chunkCount, {});
+    vector<size_t> rejected(chunkCount, 0);
+    vector<const char *> ends(chunkCount, nullptr);
+    auto parseChunk = [&](size_t index, const char *begin) {
+        const char *stop = bounds[index + 1];
+        vector<Row> &rows = result.chunks[index];
+        rows.clear();
+        result.unescaped[index].clear();
+        rejected[index] = 0;
+        rows.reserve(static_cast<size_t>(std::max(stop, begin) - begin) / 32);
+        RecordReader reader(begin, stop, data + size, result.unescaped[index]);
+        vector<std::string_view> fields;
+        bool quoted;
+        bool valid;
+        Row row;
+        while (reader.next(fields, quoted, valid)) {
+            if (fields.size() == 1 && fields[0].empty() && !quoted) {
+                continue;
+            }
+            if (valid && parseRow(fields, quoted, row)) {
+                rows.push_back(row);
+            } else {
+                ++rejected[index];
+            }
+        }
+        ends[index] = std::max(reader.position(), stop);
+    };
+    vector<std::thread> workers;
+    for (size_t i = 1; i < chunkCount; ++i) {
+        workers.emplace_back(parseChunk, i, bounds[i]);
+    }
+    if (chunkCount > 0) {
+        parseChunk(0, bounds[0]);
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    for (size_t i = 1; i < chunkCount; ++i) {
+        if (ends[i - 1] != bounds[i]) {
+            parseChunk(i, ends[i - 1]);
+            ++result.reparsed;
+        }
+    }
+    for (size_t count : rejected) {
+        result.rejected += count;
+    }
+    if (result.rejected > 0) {
+        cerr << "Файл " << filename << ": пропущено строк: " << result.rejected << endl;
+    }
+    return true;
+}
+
+} // namespace csv
+
+// Файл снимка пишется рядом под именем *.tmp и подменяет прежний через
+// rename, поэтому при сбое на диске остаётся старая или новая версия целиком.
+// Каталог синхронизируется до возврата: иначе после сбоя питания rename
+// может пропасть, а очистка журнала, сделанная вслед за ним, — нет.
+bool commitFile(const string &filename) {
+    string tmpName = filename + ".tmp";
+    int fd = ::open(tmpName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+    if (std::rename(tmpName.c_str(), filename.c_str()) != 0) {
+        cout << "Не удалось сохранить файл " << filename << "." << endl;
+        return false;
+    }
+    syncDirectory(filename);
+    return true;
+}
+
+// Иерархическое колесо таймеров: kLevels уровней по 64 ячейки, ячейка уровня
+// L покрывает 64^L миллисекунд. Таймер лежит на уровне старшей шестёрки
+// битов, в которой его срок отличается от текущего времени, и спускается
+// ниже, когда время доходит до его ячейки, так что за жизнь он переносится
+// не больше kLevels раз. Ближайшая непустая ячейка ищется по битовым маскам
+// уровней, поэтому время сразу перескакивает через пустые промежутки.
+class TimerWheel {
+public:
+    struct Timer {
+        uint64_t deadline;
+        ItemId id;
+    };
+
+private:
+    static constexpr unsigned kBits = 6;
+    static constexpr size_t kSlots = size_t(1) << kBits;
+    static constexpr unsigned kLevels = 6;
+    static constexpr unsigned kSpan = kBits * kLevels;
+
+    uint64_t now = 0;
+    size_t count = 0;
+    uint64_t occupied[kLevels] = {};
+    vector<Timer> slots[kLevels][kSlots];
+    // Срок уже наступил к моменту постановки.
+    vector<Timer> due;
+    // Срок дальше, чем покрывают уровни (больше 2^36 мс вперёд).
+    vector<Timer> overflow;
+    uint64_t overflowMin = UINT64_MAX;
+    vector<Timer> scratch;
+
+    void place(const Timer &timer) {
+        if (timer.deadline <= now) {
+            due.push_back(timer);
+            return;
+        }
+        unsigned level = static_cast<unsigned>(63 - __builtin_clzll(timer.deadline ^ now)) / kBits;
+        if (level >= kLevels) {
+            overflow.push_back(timer);
+            overflowMin = std::min(overflowMin, timer.deadline);
+            return;
+        }
+        size_t slot = (timer.deadline >> (level * kBits)) & (kSlots - 1);
+        slots[level][slot].push_back(timer);
+        occupied[level] |= uint64_t(1) << slot;
+    }
+
+    // Момент, когда откроется ближайшая непустая ячейка; level == kLevels —
+    // пора разбирать overflow. Ячейки уровня всегда впереди его текущей.
+    uint64_t nextEvent(unsigned &level, size_t &slot) const {
+        uint64_t best = UINT64_MAX;
+        for (unsigned l = 0; l < kLevels; ++l) {
+            size_t digit = (now >> (l * kBits)) & (kSlots - 1);
+            uint64_t ahead = digit + 1 < kSlots ? occupied[l] & ~((uint64_t(2) << digit) - 1) : 0;
+            if (!ahead) {
+                continue;
+            }
+            size_t first = static_cast<size_t>(__builtin_ctzll(ahead));
+            uint64_t start = (now >> ((l + 1) * kBits) << ((l + 1) * kBits)) | (uint64_t(first) << (l * kBits));
+            if (start < best) {
+                best = start;
+                level = l;
+                slot = first;
+            }
+        }
+        if (!overflow.empty()) {
+            uint64_t start = overflowMin >> kSpan << kSpan;
+            if (start < best) {
+                best = start;
+                level = kLevels;
+            }
+        }
+        return best;
+    }
+
+public:
+    uint64_t time() const { return now; }
+    size_t size() const { return count; }
+
+    void schedule(uint64_t deadline, ItemId id) {
+        ++count;
+        place({deadline, id});
+    }
+
+    // Двигает время к target и отдаёт истёкшие таймеры в expire по
+    // возрастанию срока. Время назад не идёт.
+    template <typename Expire> void advance(uint64_t target, Expire expire) {
+        scratch.swap(due);
+        for (const Timer &timer : scratch) {
+            --count;
+            expire(timer);
+        }
+        scratch.clear();
+        while (true) {
+            unsigned level = 0;
+            size_t slot = 0;
+            uint64_t next = nextEvent(level, slot);
+            if (next > target) {
+                break;
+            }
+            now = std::max(now, next);
+            if (level == kLevels) {
+                scratch.swap(overflow);
+                overflowMin = UINT64_MAX;
+            } else {
+                scratch.swap(slots[level][slot]);
+                occupied[level] &= ~(uint64_t(1) << slot);
+            }
+            for (const Timer &timer : scratch) {
+                if (timer.deadline <= now) {
+                    --count;
+                    expire(timer);
+                } else {
+                    place(timer);
+                }
+            }
+            scratch.clear();
+        }
+        now = std::max(now, target);
+    }
+};
+
+// Полнотекстовый поиск по названиям лотов. Название режется на слова по
+// пробелам и знакам препинания, буквы приводятся к нижнему регистру
+// (латиница и кириллица, «ё» считается за «е»). Слово с двумя метками
+// начала даёт триграммы кодовых точек: для «лампа» это «^^л», «^ла», «лам»,
+// «амп», «мпа». Каждая триграмма ведёт к сжатому списку ID лотов.
+// Слово запроса ищется как начало слова в названии, а со звёздочкой впереди
+// (*ампа) — как подстрока слова не короче трёх букв. Лоты, у которых
+// триграммы совпали, но в разных словах, отсеиваются сверкой с названием.
+namespace search {
+
+using Word = vector<char32_t>;
+
+constexpr char32_t kWordStart = 1;
+constexpr char32_t kBadCodepoint = 0xFFFD;
+
+// Следующая кодовая точка UTF-8; испорченная последовательность даёт kBadCodepoint.
+inline char32_t nextCodepoint(std::string_view text, size_t &pos) {
+    unsigned char lead = static_cast<unsigned char>(text[pos++]);
+    if (lead < 0x80) {
+        return lead;
+    }
+    int extra = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    if (extra == 0 || lead > 0xF4) {
+        return kBadCodepoint;
+    }
+    char32_t cp = lead & (0x3F >> extra);
+    for (int i = 0; i < extra; ++i) {
+        if (pos == text.size() || (static_cast<unsigned char>(text[pos]) & 0xC0) != 0x80) {
+            return kBadCodepoint;
+        }
+        cp = cp << 6 | (static_cast<unsigned char>(text[pos++]) & 0x3F);
+    }
+    return cp;
+}
+
+// Буква в нижнем регистре или 0, если кодовая точка разделяет слова.
+inline char32_t fold(char32_t cp) {
+    if (cp < 0x80) {
+        if (cp >= 'A' && cp <= 'Z') {
+            return cp + ('a' - 'A');
+        }
+        return (cp >= 'a' && cp <= 'z') || (cp >= '0' && cp <= '9') ? cp : 0;
+    }
+    if (cp == 0x401 || cp == 0x451) {
+        return 0x435;
+    }
+    if (cp >= 0x410 && cp <= 0x42F) {
+        return cp + 0x20;
+    }
+    if (cp >= 0x400 && cp <= 0x40F) {
+        return cp + 0x50;
+    }
+    // Знаки Latin-1, общая пунктуация («—», «…», кавычки) и испорченные байты.
+    if (cp < 0xC0 || (cp >= 0x2000 && cp <= 0x206F) || cp == kBadCodepoint) {
+        return 0;
+    }
+    return cp;
+}
+
+template <typename Visit> void forEachWord(std::string_view text, Visit visit) {
+    Word word;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        char32_t cp = fold(nextCodepoint(text, pos));
+        if (cp) {
+            word.push_back(cp);
+        } else if (!word.empty()) {
+            visit(word);
+            word.clear();
+        }
+    }
+    if (!word.empty()) {
+        visit(word);
+    }
+}
+
+inline void appendUtf8(string &out, char32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | cp >> 6));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | cp >> 12));
+        out.push_back(static_cast<char>(0x80 | (cp >> 6 & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | cp >> 18));
+        out.push_back(static_cast<char>(0x80 | (cp >> 12 & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp >> 6 & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+// Слова текста в нижнем регистре, каждое с пробелом впереди: « красная лампа».
+inline void normalize(std::string_view text, string &out) {
+    out.clear();
+    bool inWord = false;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        char32_t cp = fold(nextCodepoint(text, pos));
+        if (cp && !inWord) {
+            out.push_back(' ');
+        }
+        if (cp) {
+            appendUtf8(out, cp);
+        }
+        inWord = cp != 0;
+    }
+}
+
+inline uint64_t gram(char32_t a, char32_t b, char32_t c) {
+    return uint64_t(a) << 42 | uint64_t(b) << 21 | c;
+}
+
+// Триграммы слова; anchored == false — только те, что целиком внутри слова.
+inline void appendGrams(const Word &word, bool anchored, vector<uint64_t> &out) {
+    char32_t a = kWordStart;
+    char32_t b = kWordStart;
+    for (size_t i = 0; i < word.size(); ++i) {
+        if (anchored || i >= 2) {
+            out.push_back(gram(a, b, word[i]));
+        }
+        a = b;
+        b = word[i];
+    }
+}
+
+// Пересечение отсортированных массивов без повторов. out может совпадать
+// с a: запись никогда не обгоняет чтение. Блоки сравниваются векторно
+// «каждый с каждым» (4×4 на AVX2, 2×2 на SSE2), хвосты — слиянием.
+inline size_t intersect(const ItemId *a, size_t na, const ItemId *b, size_t nb, ItemId *out) {
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+#if defined(__AVX2__)
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi64(va, vb), _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39))),
+            _mm256_or_si256(_mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4E)),
+                            _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93))));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(hits)));
+        ItemId lastA = a[i + 3];
+        ItemId lastB = b[j + 3];
+        while (mask) {
+            out[k++] = a[i + static_cast<size_t>(__builtin_ctz(mask))];
+            mask &= mask - 1;
+        }
+        i += lastA <= lastB ? 4 : 0;
+        j += lastB <= lastA ? 4 : 0;
+    }
+#elif defined(__SSE2__)
+    while (i + 2 <= na && j + 2 <= nb) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+        // 64-битное равенство из 32-битного: совпасть должны обе половины.
+        __m128i straight = _mm_cmpeq_epi32(va, vb);
+        __m128i crossed = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4E));
+        straight = _mm_and_si128(straight, _mm_shuffle_epi32(straight, 0xB1));
+        crossed = _mm_and_si128(crossed, _mm_shuffle_epi32(crossed, 0xB1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_pd(_mm_castsi128_pd(_mm_or_si128(straight, crossed))));
+        ItemId lastA = a[i + 1];
+        ItemId lastB = b[j + 1];
+        while (mask) {
+            out[k++] = a[i + static_cast<size_t>(__builtin_ctz(mask))];
+            mask &= mask - 1;
+        }
+        i += lastA <= lastB ? 2 : 0;
+        j += lastB <= lastA ? 2 : 0;
+    }
+#endif
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (b[j] < a[i]) {
+            ++j;
+        } else {
+            out[k++] = a[i++];
+            ++j;
+        }
+    }
+    return k;
+}
+
+// Отсортированный список ID без повторов. Полные блоки хранят первый ID и
+// разности соседних ID в varint, так что плотный список занимает около байта
+// на лот; последние добавления копятся несжатыми в хвосте, пока не наберётся
+// блок. Новые лоты получают растущие ID и ложатся в хвост за O(1); вставка
+// в середину перекодирует только свой блок, удаление правит его байты на месте.
+class PostingList {
+public:
+    static constexpr size_t kBlock = 128;
+    // Блок растёт вставками до kMaxBlock и тогда делится пополам.
+    static constexpr size_t kMaxBlock = 2 * kBlock;
+
+private:
+    struct Block {
+        ItemId first;
+        ItemId last;
+        uint32_t count;
+        uint32_t bytes;
+        unique_ptr<uint8_t[]> data;
+    };
+
+    vector<Block> blocks;
+    vector<ItemId> tail;
+    size_t total = 0;
+    size_t encodedBytes = 0;
+
+    Block encode(const ItemId *ids, size_t count) {
+        uint8_t buffer[kMaxBlock * 10];
+        size_t size = 0;
+        for (size_t i = 1; i < count; ++i) {
+            uint64_t delta = ids[i] - ids[i - 1];
+            while (delta >= 0x80) {
+                buffer[size++] = static_cast<uint8_t>(delta | 0x80);
+                delta >>= 7;
+            }
+            buffer[size++] = static_cast<uint8_t>(delta);
+        }
+        Block block{ids[0], ids[count - 1], static_cast<uint32_t>(count), static_cast<uint32_t>(size),
+                    unique_ptr<uint8_t[]>(new uint8_t[size])};
+        std::memcpy(block.data.get(), buffer, size);
+        encodedBytes += size;
+        return block;
+    }
+
+    void replace(Block &block, const ItemId *ids, size_t count) {
+        encodedBytes -= block.bytes;
+        block = encode(ids, count);
+    }
+
+    // Разжимает блок до первого ID больше upTo включительно; возвращает число ID.
+    static size_t decode(const Block &block, ItemId *out, ItemId upTo = std::numeric_limits<ItemId>::max()) {
+        const uint8_t *pos = block.data.get();
+        ItemId id = block.first;
+        out[0] = id;
+        for (uint32_t i = 1; i < block.count; ++i) {
+            if (id > upTo) {
+                return i;
+            }
+            uint64_t delta = 0;
+            int shift = 0;
+            while (*pos & 0x80) {
+                delta |= uint64_t(*pos++ & 0x7F) << shift;
+                shift += 7;
+            }
+            delta |= uint64_t(*pos++) << shift;
+            id += delta;
+            out[i] = id;
+        }
+        return block.count;
+    }
+
+    // Первый блок, в котором может лежать id.
+    vector<Block>::iterator blockFor(ItemId id) {
+        return std::lower_bound(blocks.begin(), blocks.end(), id,
+                                [](const Block &block, ItemId value) { return block.last < value; });
+    }
+
+public:
+    size_t size() const { return total; }
+    bool empty() const { return total == 0; }
+
+    size_t bytes() const {
+        return blocks.capacity() * sizeof(Block) + encodedBytes + tail.capacity() * sizeof(ItemId);
+    }
+
+    void add(ItemId id) {
+        if (blocks.empty() || id > blocks.back().last) {
+            auto pos = std::lower_bound(tail.begin(), tail.end(), id);
+            if (pos != tail.end() && *pos == id) {
+                return;
+            }
+            tail.insert(pos, id);
+            ++total;
+            if (tail.size() == kBlock) {
+                blocks.push_back(encode(tail.data(), tail.size()));
+                tail.clear();
+            }
+            return;
+        }
+        auto block = blockFor(id);
+        ItemId ids[kMaxBlock];
+        decode(*block, ids);
+        ItemId *end = ids + block->count;
+        ItemId *pos = std::lower_bound(ids, end, id);
+        if (pos != end && *pos == id) {
+            return;
+        }
+        std::copy_backward(pos, end, end + 1);
+        *pos = id;
+        ++total;
+        size_t count = block->count + 1;
+        if (count < kMaxBlock) {
+            replace(*block, ids, count);
+        } else {
+            size_t index = static_cast<size_t>(block - blocks.begin());
+            replace(*block, ids, kBlock);
+            blocks.insert(blocks.begin() + static_cast<std::ptrdiff_t>(index) + 1,
+                          encode(ids + kBlock, count - kBlock));
+        }
+    }
+
+    void remove(ItemId id) {
+        if (blocks.empty() || id > blocks.back().last) {
+            auto pos = std::lower_bound(tail.begin(), tail.end(), id);
+            if (pos != tail.end() && *pos == id) {
+                tail.erase(pos);
+                --total;
+            }
+            return;
+        }
+        auto block = blockFor(id);
+        if (id < block->first) {
+            return;
+        }
+        if (block->count == 1) {
+            encodedBytes -= block->bytes;
+            blocks.erase(block);
+            --total;
+            return;
+        }
+        // Удаление не разжимает блок: разности соседей id сливаются в одну,
+        // и хвост байтов сдвигается на месте. Слитая разность в varint не
+        // длиннее двух исходных, так что блок не растёт.
+        uint8_t *data = block->data.get();
+        size_t bytes = block->bytes;
+        size_t start = 0;
+        size_t pos = 0;
+        ItemId previous = block->first;
+        ItemId current = block->first;
+        uint64_t delta = 0;
+        auto read = [data, &pos] {
+            uint64_t value = 0;
+            int shift = 0;
+            while (data[pos] & 0x80) {
+                value |= uint64_t(data[pos++] & 0x7F) << shift;
+                shift += 7;
+            }
+            return value | uint64_t(data[pos++]) << shift;
+        };
+        while (current < id && pos < bytes) {
+            start = pos;
+            delta = read();
+            previous = current;
+            current += delta;
+        }
+        if (current != id) {
+            return;
+        }
+        if (id == block->first) {
+            block->first += read();
+            start = 0;
+        } else if (pos == bytes) {
+            block->last = previous;
+        } else {
+            uint64_t merged = delta + read();
+            while (merged >= 0x80) {
+                data[start++] = static_cast<uint8_t>(merged | 0x80);
+                merged >>= 7;
+            }
+            data[start++] = static_cast<uint8_t>(merged);
+        }
+        std::memmove(data + start, data + pos, bytes - pos);
+        block->bytes = static_cast<uint32_t>(start + bytes - pos);
+        encodedBytes -= bytes - block->bytes;
+        --block->count;
+        --total;
+    }
+
+    // Обходит список кусками по возрастанию ID, начиная с первого ID больше
+    // after: visit(ids, count) получает не больше kMaxBlock ID и возвращает
+    // false, чтобы остановить обход. Блоки до after не разжимаются.
+    template <typename Visit> void forEachChunk(Visit visit, ItemId after = 0) const {
+        ItemId ids[kMaxBlock];
+        auto block = std::upper_bound(blocks.begin(), blocks.end(), after,
+                                      [](ItemId value, const Block &b) { return value < b.last; });
+        for (; block != blocks.end(); ++block) {
+            size_t count = decode(*block, ids);
+            const ItemId *from = std::upper_bound(ids, ids + count, after);
+            if (!visit(from, static_cast<size_t>(ids + count - from))) {
+                return;
+            }
+        }
+        auto from = std::upper_bound(tail.begin(), tail.end(), after);
+        if (from != tail.end()) {
+            visit(&*from, static_cast<size_t>(tail.end() - from));
+        }
+    }
+
+    // Оставляет в отсортированном cand[0, n) только ID из списка и
+    // возвращает их число. Разжимаются лишь блоки, в диапазон которых попал
+    // хотя бы один кандидат, поэтому короткий список против длинного стоит
+    // O(n) блоков, а не длины длинного.
+    size_t retain(ItemId *cand, size_t n) const {
+        ItemId ids[kMaxBlock];
+        size_t kept = 0;
+        size_t i = 0;
+        auto block = blocks.begin();
+        while (i < n) {
+            block = std::lower_bound(block, blocks.end(), cand[i],
+                                     [](const Block &b, ItemId value) { return b.last < value; });
+            if (block == blocks.end()) {
+                break;
+            }
+            if (cand[i] < block->first) {
+                i = static_cast<size_t>(std::lower_bound(cand + i, cand + n, block->first) - cand);
+                continue;
+            }
+            size_t j = static_cast<size_t>(std::upper_bound(cand + i, cand + n, block->last) - cand);
+            size_t decoded = decode(*block, ids, cand[j - 1]);
+            kept += intersect(cand + i, j - i, ids, decoded, cand + kept);
+            i = j;
+            ++block;
+        }
+        if (i < n && !tail.empty()) {
+            kept += intersect(cand + i, n - i, tail.data(), tail.size(), cand + kept);
+        }
+        return kept;
+    }
+};
+
+// Разобранный запрос; разбирается один раз на все шарды.
+class Query {
+private:
+    // Слова запроса в виде normalize: начало слова ищется с пробелом
+    // впереди, подстрока — без него.
+    vector<string> patterns;
+    // Триграммы каждого слова запроса.
+    vector<vector<uint64_t>> termGrams;
+    // Совпадение триграмм ещё не значит совпадения слова: нужна сверка с названием.
+    bool needsCheck = false;
+
+public:
+    explicit Query(std::string_view text) {
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find_first_of(" \t", pos);
+            std::string_view token = text.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+            pos = end == std::string_view::npos ? text.size() : end + 1;
+            bool substring = !token.empty() && token[0] == '*';
+            forEachWord(token.substr(substring ? 1 : 0), [&](const Word &word) {
+                bool inside = substring && word.size() >= 3;
+                termGrams.emplace_back();
+                appendGrams(word, !inside, termGrams.back());
+                needsCheck = needsCheck || word.size() > (inside ? 3 : 2);
+                string pattern = inside ? "" : " ";
+                for (char32_t cp : word) {
+                    appendUtf8(pattern, cp);
+                }
+                patterns.push_back(move(pattern));
+            });
+        }
+    }
+
+    bool empty() const { return patterns.empty(); }
+    const vector<vector<uint64_t>> &grams() const { return termGrams; }
+    bool exact() const { return !needsCheck; }
+
+    bool matches(std::string_view name) const {
+        thread_local string normalized;
+        normalize(name, normalized);
+        return std::all_of(patterns.begin(), patterns.end(),
+                           [](const string &pattern) { return normalized.find(pattern) != string::npos; });
+    }
+};
+
+// Индекс названий одного шарда: триграмма -> список ID лотов.
+class NameIndex {
+private:
+    unordered_map<uint64_t, PostingList> lists;
+
+    static vector<uint64_t> gramsOf(std::string_view name) {
+        vector<uint64_t> grams;
+        forEachWord(name, [&grams](const Word &word) { appendGrams(word, true, grams); });
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+public:
+    void add(ItemId id, std::string_view name) {
+        for (uint64_t key : gramsOf(name)) {
+            lists[key].add(id);
+        }
+    }
+
+    void remove(ItemId id, std::string_view name) {
+        for (uint64_t key : gramsOf(name)) {
+            auto it = lists.find(key);
+            if (it != lists.end()) {
+                it->second.remove(id);
+                if (it->second.empty()) {
+                    lists.erase(it);
+                }
+            }
+        }
+    }
+
+    size_t bytes() const {
+        size_t total = lists.bucket_count() * sizeof(void *);
+        for (const auto &list : lists) {
+            total += sizeof(list) + sizeof(void *) + list.second.bytes();
+        }
+        return total;
+    }
+
+    size_t postings() const {
+        size_t total = 0;
+        for (const auto &list : lists) {
+            total += list.second.size();
+        }
+        return total;
+    }
+
+    // Первые limit ID меньше below по возрастанию, прошедших check
+    // (вызывается, только если запрос не точный). Соседние триграммы слова
+    // почти всегда встречаются вместе, поэтому от каждого слова запроса
+    // пересекаются только два самых коротких списка, а остальное отсеивает
+    // сверка с названием. Самый короткий список ведёт: его блоки по очереди
+    // пересекаются с остальными, и обход кончается, как только набран limit
+    // или ID дошли до below.
+    template <typename Check>
+    void find(const Query &query, size_t limit, ItemId below, Check check, vector<ItemId> &out) const {
+        const size_t kPerTerm = 2;
+        auto shorter = [](const PostingList *a, const PostingList *b) { return a->size() < b->size(); };
+        vector<const PostingList *> used;
+        vector<const PostingList *> term;
+        for (const auto &grams : query.grams()) {
+            term.clear();
+            for (uint64_t key : grams) {
+                auto it = lists.find(key);
+                if (it == lists.end()) {
+                    return;
+                }
+                term.push_back(&it->second);
+            }
+            std::sort(term.begin(), term.end(), shorter);
+            used.insert(used.end(), term.begin(), term.begin() + static_cast<std::ptrdiff_t>(std::min(kPerTerm, term.size())));
+        }
+        if (used.empty() || limit == 0) {
+            return;
+        }
+        std::sort(used.begin(), used.end(), [](const PostingList *a, const PostingList *b) {
+            return a->size() != b->size() ? a->size() < b->size() : a < b;
+        });
+        used.erase(std::unique(used.begin(), used.end()), used.end());
+        // Кандидаты идут окнами чуть больше недостающего до limit, чтобы
+        // ради первых результатов не разжимать блоки остальных списков целиком.
+        ItemId cand[PostingList::kMaxBlock];
+        used[0]->forEachChunk([&](const ItemId *ids, size_t total) {
+            size_t end = static_cast<size_t>(std::lower_bound(ids, ids + total, below) - ids);
+            for (size_t from = 0; from < end;) {
+                size_t count = std::min(end - from, std::max<size_t>(16, 2 * (limit - out.size())));
+                std::copy(ids + from, ids + from + count, cand);
+                from += count;
+                for (size_t k = 1; k < used.size() && count; ++k) {
+                    count = used[k]->retain(cand, count);
+                }
+                for (size_t i = 0; i < count; ++i) {
+                    if (query.exact() || check(cand[i])) {
+                        out.push_back(cand[i]);
+                        if (out.size() >= limit) {
+                            return false;
+                        }
+                    }
+                }
+            }
+            return end == total;
+        });
+    }
+};
+
+} // namespace search
+
+// Отметки разделов, изменившихся с последней контрольной точки. Раздел —
+// kSpan подряд идущих ID лотов вместе со ставками и чатами этих лотов; ID за
+// пределами таблицы попадают в последний раздел. Страницы отметок заводятся
+// по мере роста ID и не перемещаются, как в UserDirectory, поэтому отметка на
+// пути ставки — одно чтение и, если раздел ещё чист, одна запись.
+class DirtyPartitions {
+private:
+    static constexpr size_t kPageBits = 12;
+    static constexpr size_t kPageSize = size_t(1) << kPageBits;
+    static constexpr size_t kMaxPages = size_t(1) << 12;
+
+    struct Page {
+        std::atomic<uint8_t> flags[kPageSize];
+    };
+
+    std::unique_ptr<std::atomic<Page *>[]> pages;
+    std::mutex growMutex;
+
+public:
+    static constexpr ItemId kSpan = 4096;
+    static constexpr uint64_t kLast = kPageSize * kMaxPages - 1;
+
+    DirtyPartitions() : pages(new std::atomic<Page *>[kMaxPages]()) {}
+    DirtyPartitions(const DirtyPartitions &) = delete;
+    DirtyPartitions &operator=(const DirtyPartitions &) = delete;
+
+    ~DirtyPartitions() {
+        for (size_t i = 0; i < kMaxPages; ++i) {
+            delete pages[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    static uint64_t partitionOf(ItemId itemId) { return std::min<uint64_t>(itemId / kSpan, kLast); }
+    static ItemId firstId(uint64_t partition) { return partition * kSpan; }
+    // Последний ID раздела включительно.
+    static ItemId lastId(uint64_t partition) {
+        return partition == kLast ? std::numeric_limits<ItemId>::max() : firstId(partition) + kSpan - 1;
+    }
+
+    void mark(ItemId itemId) {
+        uint64_t partition = partitionOf(itemId);
+        std::atomic<Page *> &slot = pages[partition >> kPageBits];
+        Page *page = slot.load(std::memory_order_acquire);
+        if (!page) {
+            std::lock_guard<std::mutex> lock(growMutex);
+            page = slot.load(std::memory_order_relaxed);
+            if (!page) {
+                page = new Page();
+                slot.store(page, std::memory_order_release);
+            }
+        }
+        std::atomic<uint8_t> &flag = page->flags[partition & (kPageSize - 1)];
+        if (!flag.load(std::memory_order_relaxed)) {
+            flag.store(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool any() const {
+        for (size_t i = 0; i < kMaxPages; ++i) {
+            Page *page = pages[i].load(std::memory_order_acquire);
+            for (size_t j = 0; page && j < kPageSize; ++j) {
+                if (page->flags[j].load(std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Снимает отметки и возвращает отмеченные разделы по возрастанию.
+    vector<uint64_t> take() {
+        vector<uint64_t> taken;
+        for (size_t i = 0; i < kMaxPages; ++i) {
+            Page *page = pages[i].load(std::memory_order_acquire);
+            for (size_t j = 0; page && j < kPageSize; ++j) {
+                if (page->flags[j].load(std::memory_order_relaxed) && page->flags[j].exchange(0)) {
+                    taken.push_back((uint64_t(i) << kPageBits) | j);
+                }
+            }
+        }
+        return taken;
+    }
+};
+
+// Подписки на лоты и продавцов и рассылка событий подписчикам. Торговые
+// потоки только кладут событие в общую очередь и никогда не ждут; раздачей
+// по ящикам подписчиков занимается один поток Dispatcher.
+namespace watch {
+
+enum class Kind : uint8_t { Price, Sold, Closed, Message };
+
+// Событие по лоту: новая цена и лидер, продажа или закрытие торгов (leader
+// — победитель или kNoUser), сообщение в чате (actor — отправитель).
+// merged — сколько событий слито в это, пока подписчик не успевал читать.
+struct Event {
+    uint64_t published = 0;
+    ItemId itemId = kNoItem;
+    uint64_t cents = 0;
+    UserId seller = kNoUser;
+    UserId leader = kNoUser;
+    UserId actor = kNoUser;
+    uint32_t merged = 1;
+    Kind kind = Kind::Price;
+};
+
+// Ограниченная очередь без блокировок для многих писателей и одного
+// читателя по схеме Вьюкова: у каждой ячейки свой номер круга, писатель
+// занимает ячейку CAS-ом по хвосту. Переполненная очередь не ждёт, а
+// отказывает. Ёмкость — степень двойки. Align разносит голову и хвост по
+// строкам кэша; маленьким ящикам выгоднее держать их рядом.
+template <typename T, size_t Align = 64> class BoundedQueue {
+private:
+    struct Cell {
+        std::atomic<uint64_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(Align) std::atomic<uint64_t> tail{0};
+    alignas(Align) std::atomic<uint64_t> head{0};
+
+public:
+    explicit BoundedQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const T &value) {
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            int64_t lag = static_cast<int64_t>(cell.sequence.load(std::memory_order_acquire) - pos);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lag < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Вызывается только читателем.
+    bool pop(T &out) {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        Cell &cell = cells[pos & mask];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        out = cell.value;
+        cell.sequence.store(pos + mask + 1, std::memory_order_release);
+        head.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool empty() const {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    // Подтягивают в кэш ячейку, которую тронет следующая запись или чтение.
+    void prefetchTail() const { __builtin_prefetch(&cells[tail.load(std::memory_order_relaxed) & mask], 1); }
+    void prefetchHead() const { __builtin_prefetch(&cells[head.load(std::memory_order_relaxed) & mask]); }
+
+    // Оценка свободного места; точна, пока пишет один поток.
+    size_t room() const {
+        uint64_t used = tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+        return used > mask ? 0 : mask + 1 - used;
+    }
+};
+
+// Ключ подписки -> подписчики, открытая адресация с линейным пробированием,
+// как SlotTable: ключ и заголовок списка лежат в одной ячейке, так что поиск
+// стоит двух промахов — ячейки и самого списка. Пустая ячейка — kNoKey, его
+// не бывает ни у лота, ни у продавца. Полосу Dispatcher выбирает по шести
+// старшим битам того же хэша, поэтому ячейка берётся по следующим за ними.
+class WatchTable {
+private:
+    static constexpr uint64_t kNoKey = ~uint64_t(0);
+
+    struct Cell {
+        uint64_t key = kNoKey;
+        vector<UserId> users;
+    };
+
+    vector<Cell> cells;
+    size_t count = 0;
+    unsigned shift = 64;
+
+    size_t home(uint64_t key) const { return static_cast<size_t>(((key * 0x9E3779B97F4A7C15ull) << 6) >> shift); }
+
+    size_t probe(uint64_t key) const {
+        size_t mask = cells.size() - 1;
+        size_t pos = home(key);
+        while (cells[pos].key != key && cells[pos].key != kNoKey) {
+            pos = (pos + 1) & mask;
+        }
+        return pos;
+    }
+
+    void grow() {
+        vector<Cell> old(std::max<size_t>(cells.size() * 2, 16));
+        old.swap(cells);
+        shift = 64 - static_cast<unsigned>(__builtin_ctzll(cells.size()));
+        for (Cell &cell : old) {
+            if (cell.key != kNoKey) {
+                cells[probe(cell.key)] = std::move(cell);
+            }
+        }
+    }
+
+public:
+    vector<UserId> *find(uint64_t key) {
+        if (cells.empty()) {
+            return nullptr;
+        }
+        Cell &cell = cells[probe(key)];
+        return cell.key == kNoKey ? nullptr : &cell.users;
+    }
+
+    // Список подписчиков ключа; пустой, если ключа не было.
+    vector<UserId> &get(uint64_t key) {
+        if ((count + 1) * 2 > cells.size()) {
+            grow();
+        }
+        Cell &cell = cells[probe(key)];
+        if (cell.key == kNoKey) {
+            cell.key = key;
+            ++count;
+        }
+        return cell.users;
+    }
+
+    bool erase(uint64_t key) {
+        if (cells.empty()) {
+            return false;
+        }
+        size_t mask = cells.size() - 1;
+        size_t hole = probe(key);
+        if (cells[hole].key == kNoKey) {
+            return false;
+        }
+        for (size_t next = (hole + 1) & mask; cells[next].key != kNoKey; next = (next + 1) & mask) {
+            if (((next - home(cells[next].key)) & mask) >= ((next - hole) & mask)) {
+                cells[hole] = std::move(cells[next]);
+                hole = next;
+            }
+        }
+        cells[hole].key = kNoKey;
+        cells[hole].users = vector<UserId>();
+        --count;
+        return true;
+    }
+};
+
+// Рассылка событий. Подписки лежат в полосах по ключу — ID лота или ID
+// продавца с меткой в старшем бите. У каждого подписчика ограниченный ящик
+// на kInbox событий; если ящик полон, события копятся у рассылающего потока
+// по одному на лот и вид: повторные изменения цены сливаются в последнее, а
+// когда ящик освободится, слитые события уходят по порядку публикации.
+// Ничего не обходится целиком: подписчик, в ящике которого появились
+// события, один раз попадает в список готовых для читателей (ready), а
+// читатель, освободивший место в ящике с придержанными событиями, ставит
+// подписчика в очередь на досылку рассылающему потоку.
+// Участник, сделавший ставку, сам подписывается на лот — так он узнает, что
+// его перебили. После продажи или закрытия лота подписки на него снимаются.
+// Ящики находятся по ID пользователя через страницы указателей, как в
+// UserDirectory, поэтому чтение ящика обходится без блокировок.
+class Dispatcher {
+public:
+    static constexpr size_t kInbox = 16;
+
+    struct Stats {
+        uint64_t handled = 0;
+        uint64_t rejected = 0;
+        uint64_t delivered = 0;
+        uint64_t coalesced = 0;
+        size_t subscriptions = 0;
+    };
+
+private:
+    static constexpr size_t kStripes = 64;
+    static constexpr size_t kPageBits = 12;
+    static constexpr size_t kPageSize = size_t(1) << kPageBits;
+    static constexpr size_t kMaxPages = size_t(1) << 16;
+
+    // Всё, что трогают доставка и чтение, лежит в одной строке кэша:
+    // подписчиков много, и каждый промах на них дороже самой доставки.
+    struct alignas(64) Subscriber {
+        BoundedQueue<Event, 8> inbox{kInbox};
+        std::atomic_flag reading = ATOMIC_FLAG_INIT;
+        // Подписчик уже стоит в списке готовых и ещё не прочитан.
+        std::atomic<bool> queued{false};
+        // held не пуст; пишет только рассылающий поток.
+        std::atomic<bool> holding{false};
+        // Не поместившиеся в ящик события в порядке последнего обновления и
+        // индекс к ним по ключу лот*4+вид; только для рассылающего потока.
+        // Слитое событие переезжает в конец, так что досылка берёт начало
+        // списка и не сортирует.
+        std::list<Event> heldOrder;
+        unordered_map<uint64_t, std::list<Event>::iterator> held;
+    };
+
+    static uint64_t heldKey(const Event &event) { return event.itemId * 4 + static_cast<uint64_t>(event.kind); }
+
+    struct Page {
+        std::atomic<Subscriber *> subscribers[kPageSize] = {};
+    };
+
+    struct Stripe {
+        mutable std::shared_mutex mutex;
+        WatchTable watchers;
+    };
+
+    BoundedQueue<Event> intake;
+    std::array<Stripe, kStripes> stripes;
+    unique_ptr<std::atomic<Page *>[]> pages;
+    std::mutex createMutex;
+    std::atomic<size_t> subscriptionCount{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> handled{0};
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> coalesced{0};
+    // Подписчики с новыми событиями в ящике, пока их не забрал читатель.
+    // Рассылающий поток копит их в woken и выкладывает пачкой. Список
+    // ведётся с первого вызова ready: меню и пакетный режим читают ящики
+    // своих пользователей напрямую, и список у них только бы рос.
+    std::atomic<bool> tracking{false};
+    std::mutex readyMutex;
+    vector<UserId> readyUsers;
+    vector<UserId> woken;
+    uint64_t pushed = 0;
+    // Подписчики с придержанными событиями, в ящиках которых читатель
+    // освободил место.
+    std::mutex freedMutex;
+    vector<UserId> freedUsers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> stopping{false};
+    std::thread worker;
+
+    static uint64_t itemKey(ItemId itemId) { return itemId & ~(uint64_t(1) << 63); }
+    static uint64_t sellerKey(UserId seller) { return (uint64_t(1) << 63) | seller; }
+    Stripe &stripeFor(uint64_t key) { return stripes[(key * 0x9E3779B97F4A7C15ull) >> 58]; }
+
+    Subscriber *find(UserId user) const {
+        if ((user >> kPageBits) >= kMaxPages) {
+            return nullptr;
+        }
+        Page *page = pages[user >> kPageBits].load(std::memory_order_acquire);
+        return page ? page->subscribers[user & (kPageSize - 1)].load(std::memory_order_acquire) : nullptr;
+    }
+
+    Subscriber *create(UserId user) {
+        Subscriber *subscriber = find(user);
+        if (subscriber || (user >> kPageBits) >= kMaxPages) {
+            return subscriber;
+        }
+        std::lock_guard<std::mutex> lock(createMutex);
+        std::atomic<Page *> &slot = pages[user >> kPageBits];
+        Page *page = slot.load(std::memory_order_relaxed);
+        if (!page) {
+            page = new Page();
+            slot.store(page, std::memory_order_release);
+        }
+        std::atomic<Subscriber *> &entry = page->subscribers[user & (kPageSize - 1)];
+        subscriber = entry.load(std::memory_order_relaxed);
+        if (!subscriber) {
+            subscriber = new Subscriber();
+            entry.store(subscriber, std::memory_order_release);
+        }
+        return subscriber;
+    }
+
+    bool subscribe(UserId user, uint64_t key) {
+        if (!create(user)) {
+            return false;
+        }
+        Stripe &stripe = stripeFor(key);
+        std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+        vector<UserId> &users = stripe.watchers.get(key);
+        if (std::find(users.begin(), users.end(), user) != users.end()) {
+            return false;
+        }
+        users.push_back(user);
+        subscriptionCount.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool unsubscribe(UserId user, uint64_t key) {
+        Stripe &stripe = stripeFor(key);
+        std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+        vector<UserId> *users = stripe.watchers.find(key);
+        if (!users) {
+            return false;
+        }
+        auto pos = std::find(users->begin(), users->end(), user);
+        if (pos == users->end()) {
+            return false;
+        }
+        *pos = users->back();
+        users->pop_back();
+        if (users->empty()) {
+            stripe.watchers.erase(key);
+        }
+        subscriptionCount.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void collect(uint64_t key, vector<UserId> &out) {
+        Stripe &stripe = stripeFor(key);
+        std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+        if (const vector<UserId> *users = stripe.watchers.find(key)) {
+            out.insert(out.end(), users->begin(), users->end());
+        }
+    }
+
+    // Кладёт событие в ящик; первое непрочитанное ставит подписчика в
+    // woken. Только для рассылающего потока.
+    bool push(UserId user, Subscriber &subscriber, const Event &event) {
+        if (!subscriber.inbox.push(event)) {
+            return false;
+        }
+        ++pushed;
+        if (tracking.load(std::memory_order_relaxed) && !subscriber.queued.exchange(true, std::memory_order_acq_rel)) {
+            woken.push_back(user);
+        }
+        return true;
+    }
+
+    void publishReady() {
+        delivered.fetch_add(pushed, std::memory_order_relaxed);
+        pushed = 0;
+        if (woken.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(readyMutex);
+        if (readyUsers.empty()) {
+            readyUsers.swap(woken);
+        } else {
+            readyUsers.insert(readyUsers.end(), woken.begin(), woken.end());
+            woken.clear();
+        }
+    }
+
+    // Ставит подписчика в очередь на досылку и будит рассылающий поток.
+    void requestFlush(UserId user) {
+        {
+            std::lock_guard<std::mutex> lock(freedMutex);
+            freedUsers.push_back(user);
+        }
+        if (sleeping.load(std::memory_order_relaxed)) {
+            wake.notify_one();
+        }
+    }
+
+    void hold(UserId user, Subscriber &subscriber, const Event &event) {
+        if (subscriber.held.empty()) {
+            // Читатель мог освободить место, ещё не видя holding: тогда
+            // досылку заказывает сам рассылающий поток. Барьеры в паре с
+            // барьером в poll гарантируют, что хотя бы один из них увидит
+            // запись другого.
+            subscriber.holding.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (subscriber.inbox.room() != 0) {
+                requestFlush(user);
+            }
+        }
+        auto slot = subscriber.held.try_emplace(heldKey(event));
+        if (slot.second) {
+            slot.first->second = subscriber.heldOrder.insert(subscriber.heldOrder.end(), event);
+            return;
+        }
+        Event &kept = *slot.first->second;
+        uint32_t merged = kept.merged + event.merged;
+        kept = event;
+        kept.merged = merged;
+        subscriber.heldOrder.splice(subscriber.heldOrder.end(), subscriber.heldOrder, slot.first->second);
+        coalesced.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void deliver(UserId user, Subscriber &subscriber, const Event &event) {
+        if (subscriber.holding.load(std::memory_order_relaxed) || !push(user, subscriber, event)) {
+            hold(user, subscriber, event);
+        }
+    }
+
+    // Подписчики одного события разбросаны по памяти, и доставка упирается в
+    // промахи кэша: сначала для всех подтягиваются строки подписчиков, затем
+    // ячейки их ящиков, и только потом идёт запись — промахи перекрываются.
+    void fanOut(const Event &event, vector<UserId> &recipients, vector<pair<UserId, Subscriber *>> &targets) {
+        recipients.clear();
+        collect(itemKey(event.itemId), recipients);
+        size_t itemWatchers = recipients.size();
+        if (event.seller != kNoUser) {
+            collect(sellerKey(event.seller), recipients);
+        }
+        if (itemWatchers != 0 && itemWatchers != recipients.size()) {
+            std::sort(recipients.begin(), recipients.end());
+            recipients.erase(std::unique(recipients.begin(), recipients.end()), recipients.end());
+        }
+        targets.clear();
+        for (UserId user : recipients) {
+            Subscriber *subscriber = user != event.actor ? find(user) : nullptr;
+            if (subscriber) {
+                __builtin_prefetch(subscriber, 1);
+                targets.emplace_back(user, subscriber);
+            }
+        }
+        for (const auto &target : targets) {
+            target.second->inbox.prefetchTail();
+        }
+        for (const auto &target : targets) {
+            deliver(target.first, *target.second, event);
+        }
+        if (event.kind == Kind::Price && event.actor != kNoUser) {
+            subscribe(event.actor, itemKey(event.itemId));
+        } else if (event.kind == Kind::Sold || event.kind == Kind::Closed) {
+            Stripe &stripe = stripeFor(itemKey(event.itemId));
+            std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+            if (const vector<UserId> *users = stripe.watchers.find(itemKey(event.itemId))) {
+                subscriptionCount.fetch_sub(users->size(), std::memory_order_relaxed);
+                stripe.watchers.erase(itemKey(event.itemId));
+            }
+        }
+        handled.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Досылает придержанные события подписчикам, в ящиках которых читатели
+    // освободили место: в каждый столько самых старых, сколько в нём места.
+    // Обходятся только они, а не все подписчики с придержанными событиями, и
+    // у каждого — только досылаемые события.
+    void flushHeld(vector<UserId> &freed) {
+        freed.clear();
+        {
+            std::lock_guard<std::mutex> lock(freedMutex);
+            freed.swap(freedUsers);
+        }
+        for (UserId user : freed) {
+            Subscriber *found = find(user);
+            if (!found) {
+                continue;
+            }
+            Subscriber &subscriber = *found;
+            while (!subscriber.heldOrder.empty() && push(user, subscriber, subscriber.heldOrder.front())) {
+                subscriber.held.erase(heldKey(subscriber.heldOrder.front()));
+                subscriber.heldOrder.pop_front();
+            }
+            if (subscriber.held.empty()) {
+                subscriber.holding.store(false, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void loop() {
+        const size_t kBatch = 256;
+        vector<UserId> recipients;
+        vector<pair<UserId, Subscriber *>> targets;
+        vector<UserId> freed;
+        Event event;
+        while (true) {
+            size_t count = 0;
+            while (count < kBatch && intake.pop(event)) {
+                fanOut(event, recipients, targets);
+                ++count;
+            }
+            flushHeld(freed);
+            publishReady();
+            if (count > 0) {
+                continue;
+            }
+            if (stopping.load(std::memory_order_acquire)) {
+                return;
+            }
+            // Писатель будит поток, только увидев sleeping; пропущенное
+            // пробуждение ограничено таймаутом.
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping.store(true, std::memory_order_seq_cst);
+            bool idle = intake.empty();
+            if (idle) {
+                std::lock_guard<std::mutex> freedLock(freedMutex);
+                idle = freedUsers.empty();
+            }
+            if (idle) {
+                wake.wait_for(lock, std::chrono::milliseconds(1));
+            }
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    explicit Dispatcher(size_t intakeCapacity = size_t(1) << 16)
+        : intake(intakeCapacity), pages(new std::atomic<Page *>[kMaxPages]()) {
+        worker = std::thread(&Dispatcher::loop, this);
+    }
+
+    Dispatcher(const Dispatcher &) = delete;
+    Dispatcher &operator=(const Dispatcher &) = delete;
+
+    ~Dispatcher() {
+        stopping.store(true, std::memory_order_release);
+        wake.notify_one();
+        worker.join();
+        for (size_t i = 0; i < kMaxPages; ++i) {
+            Page *page = pages[i].load(std::memory_order_relaxed);
+            for (size_t j = 0; page && j < kPageSize; ++j) {
+                delete page->subscribers[j].load(std::memory_order_relaxed);
+            }
+            delete page;
+        }
+    }
+
+    // Вызывается торговыми потоками: не ждёт ни блокировок, ни места в
+    // очереди. false — очередь переполнена и событие отброшено.
+    bool publish(const Event &event) {
+        if (!intake.push(event)) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            wake.notify_one();
+        }
+        return true;
+    }
+
+    bool watchItem(UserId user, ItemId itemId) { return subscribe(user, itemKey(itemId)); }
+    bool watchSeller(UserId user, UserId seller) { return subscribe(user, sellerKey(seller)); }
+    bool unwatchItem(UserId user, ItemId itemId) { return unsubscribe(user, itemKey(itemId)); }
+    bool unwatchSeller(UserId user, UserId seller) { return unsubscribe(user, sellerKey(seller)); }
+
+    // Забирает подписчиков, в ящиках которых появились события с прошлого
+    // чтения, — их и стоит опрашивать через poll вместо обхода всех.
+    // Первый вызов только включает список: события, пришедшие раньше,
+    // в него не попадают.
+    size_t ready(vector<UserId> &out) {
+        out.clear();
+        tracking.store(true, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(readyMutex);
+        out.swap(readyUsers);
+        return out.size();
+    }
+
+    // Подсказка читателю, который обходит список из ready: каждый шаг
+    // подтягивает в кэш то, что понадобится следующему, — указатель на
+    // подписчика (0), его строку (1) и ячейку ящика (2). Шаги стоит делать за
+    // несколько подписчиков до poll, чтобы промахи перекрывались.
+    void prefetch(UserId user, int step) const {
+        if (step == 0) {
+            Page *page = (user >> kPageBits) < kMaxPages ? pages[user >> kPageBits].load(std::memory_order_acquire)
+                                                         : nullptr;
+            if (page) {
+                __builtin_prefetch(&page->subscribers[user & (kPageSize - 1)]);
+            }
+        } else if (Subscriber *subscriber = find(user)) {
+            if (step == 1) {
+                __builtin_prefetch(subscriber);
+            } else {
+                subscriber->inbox.prefetchHead();
+            }
+        }
+    }
+
+    // Забирает не больше limit событий из ящика user в out. Читатель у
+    // ящика один: если его сейчас читает другой поток, возвращается 0.
+    // Если в ящике остались события, подписчик снова попадает в ready.
+    // Задержка от публикации до чтения пишется в метрику notify.
+    size_t poll(UserId user, vector<Event> &out, size_t limit) {
+        Subscriber *subscriber = find(user);
+        if (!subscriber || subscriber->inbox.empty() || subscriber->reading.test_and_set(std::memory_order_acquire)) {
+            return 0;
+        }
+        subscriber->queued.exchange(false, std::memory_order_acq_rel);
+        size_t count = 0;
+        Event event;
+        uint64_t now = metrics::ticks();
+        while (count < limit && subscriber->inbox.pop(event)) {
+            metrics::record(metrics::Op::Notify, now > event.published ? now - event.published : 0);
+            out.push_back(event);
+            ++count;
+        }
+        bool left = !subscriber->inbox.empty();
+        subscriber->reading.clear(std::memory_order_release);
+        if (left && tracking.load(std::memory_order_relaxed) &&
+            !subscriber->queued.exchange(true, std::memory_order_acq_rel)) {
+            std::lock_guard<std::mutex> lock(readyMutex);
+            readyUsers.push_back(user);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (count != 0 && subscriber->holding.load(std::memory_order_relaxed)) {
+            requestFlush(user);
+        }
+        return count;
+    }
+
+    Stats stats() const {
+        Stats result;
+        result.handled = handled.load(std::memory_order_relaxed);
+        result.rejected = rejected.load(std::memory_order_relaxed);
+        result.delivered = delivered.load(std::memory_order_relaxed);
+        result.coalesced = coalesced.load(std::memory_order_relaxed);
+        result.subscriptions = subscriptionCount.load(std::memory_order_relaxed);
+        return result;
+    }
+};
+
+inline const char *kindName(Kind kind) {
+    switch (kind) {
+    case Kind::Price:
+        return "price";
+    case Kind::Sold:
+        return "sold";
+    case Kind::Closed:
+        return "closed";
+    case Kind::Message:
+        return "message";
+    }
+    return "?";
+}
+
+// Строка уведомления для меню.
+inline void display(OutputBuffer &out, const Event &event) {
+    const UserDirectory &directory = UserDirectory::instance();
+    out << "Товар ID " << event.itemId << ": ";
+    switch (event.kind) {
+    case Kind::Price:
+        out << "новая цена " << static_cast<double>(event.cents) / 100.0 << ", лидирует "
+            << directory.name(event.leader);
+        break;
+    case Kind::Sold:
+        out << "куплен за " << static_cast<double>(event.cents) / 100.0;
+        break;
+    case Kind::Closed:
+        out << "торги завершены, " << (event.leader != kNoUser ? "победил " + directory.name(event.leader)
+                                                               : string("без продажи"));
+        break;
+    case Kind::Message:
+        out << "сообщение от " << directory.name(event.actor);
+        break;
+    }
+    if (event.merged > 1) {
+        out << " (изменений: " << uint64_t(event.merged) << ")";
+    }
+    out << '\n';
+}
+
+} // namespace watch
+
+// Итог торгов по лоту. winner — лидер торгов, kNoUser — ставок не было или
+// цена не дошла до резервной, и лот снимается без продажи; closedAt — срок
+// торгов с учётом продлений. bids — история ставок для разбора споров,
+// nullptr, если ставок не было.
+struct Settlement {
+    ItemId id;
+    string name;
+    UserId seller;
+    UserId winner;
+    uint64_t cents;
+    uint64_t closedAt;
+    std::shared_ptr<const BidBook> bids;
+};
+
+// Outbid — ставка принята, но заявка другого участника её перебила.
+enum class BidStatus { Accepted, Outbid, TooLow, NotFound, Closed };
+
+class Auction {
+private:
+    using PriceIndex = std::set<pair<uint64_t, ItemId>>;
+    using DeadlineIndex = PriceIndex;
+
+    // Каталог разбит на шарды по ID лота: операции над лотами разных шардов
+    // не делят блокировок. Лоты шарда лежат в его слэбе, slots переводит ID
+    // лота в дескриптор слота.
+    // Индексы шарда по цене (по всем лотам и по лотам каждого продавца) и по
+    // сроку догоняют ставки лениво: принятая ставка только ставит ID лота в
+    // очередь staleIds, один раз до ближайшего запроса, а запрос сначала
+    // переставляет лоты из очереди под мутексом индексов. Так ставка не
+    // платит за перестройку дерева, а запросы видят текущие цены. Принятые ставки на один лот
+    // сериализуются занятостью его истории (LedgerLock); заявки с
+    // автоповышением разыгрываются ещё и под полосой bidMutexes по ID лота,
+    // чтобы долгий розыгрыш ждал на мутексе, а не крутился. Порядок захвата:
+    // шард, полоса ставок, история лота; индекс и очередь берутся уже без
+    // них, очередь — после индекса.
+    // Вставка и удаление лота идут под эксклюзивной блокировкой шарда и
+    // остальных мутексов не берут. Поисковый индекс названий меняется только
+    // ими, поэтому поиск читает его под разделяемой блокировкой шарда.
+    static constexpr size_t kBidStripes = 64;
+
+    struct Shard {
+        mutable std::shared_mutex mutex;
+        ItemSlab items;
+        SlotTable slots;
+        mutable std::array<std::mutex, kBidStripes> bidMutexes;
+        mutable std::mutex indexMutex;
+        PriceIndex byPrice;
+        unordered_map<UserId, PriceIndex> bySeller;
+        // Лоты с конечным сроком по (endsAt, ID).
+        DeadlineIndex byDeadline;
+        std::mutex staleMutex;
+        vector<ItemId> staleIds;
+        search::NameIndex names;
+        // ID лотов шарда по возрастанию — курсор постраничного обхода каталога.
+        search::PostingList catalog;
+    };
+
+    // Индекс по названию разбит на полосы по хэшу имени. Лоты с одинаковым
+    // названием хранятся по возрастанию ID; операции по имени всегда выбирают
+    // самый ранний лот. Порядок захвата: полоса имени, затем шард.
+    struct NameStripe {
+        mutable std::shared_mutex mutex;
+        NameTable ids;
+    };
+
+    // Занятость истории ставок одного лота. Держится на время дописывания
+    // истории и записи в журнал, поэтому ожидающий сначала крутится.
+    class LedgerLock {
+    private:
+        const Item &item;
+        bool held = false;
+
+    public:
+        explicit LedgerLock(const Item &target) : item(target) { lock(); }
+        LedgerLock(const LedgerLock &) = delete;
+        LedgerLock &operator=(const LedgerLock &) = delete;
+        ~LedgerLock() {
+            if (held) {
+                unlock();
+            }
+        }
+
+        void lock() {
+            for (unsigned spins = 0; item.ledgerBusy.exchange(true, std::memory_order_acquire); ++spins) {
+                if (spins < 64) {
+#if defined(__SSE2__)
+                    _mm_pause();
+#endif
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+            held = true;
+        }
+
+        void unlock() {
+            item.ledgerBusy.store(false, std::memory_order_release);
+            held = false;
+        }
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    vector<unique_ptr<NameStripe>> nameStripes;
+    mutable std::mutex messagesMutex;
+    // Чаты по ID лота. История из снимка переносится сюда при первом
+    // обращении к лоту; до этого она читается прямо из отображённого файла.
+    mutable unordered_map<ItemId, ChatLog> chats;
+    // ID чатов из chats и холодного яруса по возрастанию — курсор списка чатов.
+    mutable search::PostingList chatIds;
+    // Холодный ярус чатов; nullptr — вся история держится в памяти.
+    unique_ptr<ColdChatStore> cold;
+    // Часы обращений к чатам: по отметкам вытесняются давно не тронутые.
+    mutable uint64_t chatClock = 0;
+    // Файлы, из которых подняты лоты: полный снимок или разделы контрольной
+    // точки. Диапазоны ID их чатов не пересекаются; users переводит ID
+    // пользователя в файле в ID справочника этого процесса.
+    struct ChatSource {
+        std::shared_ptr<const SnapshotFile> file;
+        vector<UserId> users;
+        mutable vector<bool> loaded;
+    };
+    vector<ChatSource> chatSources;
+    DirtyPartitions dirty;
+    WriteAheadLog *log = nullptr;
+    watch::Dispatcher *events = nullptr;
+    // Сроки торгов. Время аукциона — миллисекунды, до которых продвинуто
+    // колесо: в работе это системные часы, в замерах — модельное время.
+    // timerMutex берётся последним и ничего под собой не захватывает.
+    // Продление торгов не трогает колесо: сработавший таймер сверяется со
+    // сроком лота и при необходимости ставится заново.
+    std::mutex timerMutex;
+    TimerWheel deadlines;
+    std::atomic<uint64_t> clock{0};
+    uint64_t snipeWindow = 0;
+    uint64_t snipeExtension = 0;
+    std::function<void(const Settlement &)> settlementSink;
+
+    static UserId fileUser(const vector<UserId> &users, uint32_t id) { return id < users.size() ? users[id] : kNoUser; }
+
+    static UserId bidderUser(uint32_t bidder) { return bidder != Item::kNoBidder ? bidder : kNoUser; }
+
+    // Публикует событие подписчикам; не ждёт и не берёт блокировок, поэтому
+    // безопасно и под блокировками шарда.
+    void publish(watch::Kind kind, ItemId itemId, uint64_t cents, UserId seller, UserId leader, UserId actor) {
+        if (!events) {
+            return;
+        }
+        watch::Event event;
+        event.published = metrics::ticks();
+        event.itemId = itemId;
+        event.cents = cents;
+        event.seller = seller;
+        event.leader = leader;
+        event.actor = actor;
+        event.kind = kind;
+        events->publish(event);
+    }
+
+    // Чат лота, при необходимости новый; вызывается под messagesMutex.
+    ChatLog &openChat(ItemId itemId) const {
+        auto chat = chats.try_emplace(itemId);
+        if (chat.second) {
+            chatIds.add(itemId);
+            chat.first->second.touch(++chatClock);
+        }
+        return chat.first->second;
+    }
+
+    // Чат из снимка при первом обращении; вызывается под messagesMutex.
+    void loadSourceChat(ItemId itemId) const {
+        auto source = std::upper_bound(chatSources.begin(), chatSources.end(), itemId,
+                                       [](ItemId id, const ChatSource &s) { return id < s.file->chat(0).itemId; });
+        if (source == chatSources.begin()) {
+            return;
+        }
+        --source;
+        const SnapshotFile &file = *source->file;
+        size_t index = file.findChat(itemId);
+        if (index == file.chatCount() || source->loaded[index]) {
+            return;
+        }
+        source->loaded[index] = true;
+        const SnapshotChat &chat = file.chat(index);
+        ChatLog &log = openChat(itemId);
+        log.reserve(chat.count);
+        for (uint64_t i = chat.first; i < chat.first + chat.count; ++i) {
+            const SnapshotMessage &record = file.message(i);
+            log.append(Message(fileUser(source->users, record.from), string(file.str(record.content)), itemId));
+        }
+    }
+
+    // Переносит чат лота в память — из снимка или из холодного яруса — и
+    // отмечает обращение. false — холодная копия не читается: чат остаётся
+    // в холодном ярусе, дописывать его нельзя. Вызывается под messagesMutex.
+    bool materializeChat(ItemId itemId) const {
+        if (cold && cold->contains(itemId)) {
+            ChatLog log;
+            if (!cold->read(itemId, log)) {
+                return false;
+            }
+            cold->drop(itemId);
+            chats.emplace(itemId, std::move(log));
+        } else {
+            loadSourceChat(itemId);
+        }
+        auto it = chats.find(itemId);
+        if (it != chats.end()) {
+            it->second.touch(++chatClock);
+        }
+        return true;
+    }
+
+    // Чат для чтения без переноса в память: горячий — как есть, холодный —
+    // разжатым в scratch. nullptr — чата нет. Вызывается под messagesMutex.
+    const ChatLog *peekChat(ItemId itemId, ChatLog &scratch) const {
+        loadSourceChat(itemId);
+        auto it = chats.find(itemId);
+        if (it != chats.end()) {
+            return &it->second;
+        }
+        scratch = ChatLog();
+        return cold && cold->read(itemId, scratch) ? &scratch : nullptr;
+    }
+
+    size_t chatLength(ItemId itemId) const {
+        auto it = chats.find(itemId);
+        return it != chats.end() ? it->second.size() : cold ? cold->length(itemId) : 0;
+    }
+
+    void materializeAllChats() const {
+        for (const auto &source : chatSources) {
+            for (size_t i = 0; i < source.file->chatCount(); ++i) {
+                loadSourceChat(source.file->chat(i).itemId);
+            }
+        }
+    }
+
+    // Все чаты, горячие и холодные; холодные читаются в порядке хранения и в
+    // память не возвращаются. Вызывается под messagesMutex.
+    template <typename Visit> void forEachChat(Visit visit) const {
+        materializeAllChats();
+        for (const auto &chat : chats) {
+            visit(chat.first, chat.second);
+        }
+        if (cold) {
+            ChatLog scratch;
+            for (ItemId id : cold->idsInStorageOrder()) {
+                scratch = ChatLog();
+                if (cold->read(id, scratch)) {
+                    visit(id, scratch);
+                }
+            }
+        }
+    }
+
+    // ID чатов раздела по возрастанию; вызывается под messagesMutex.
+    vector<ItemId> chatsIn(uint64_t partition) const {
+        ItemId first = DirtyPartitions::firstId(partition);
+        ItemId last = DirtyPartitions::lastId(partition);
+        vector<ItemId> ids;
+        if (last - first < DirtyPartitions::kSpan) {
+            for (ItemId id = first; id <= last; ++id) {
+                loadSourceChat(id);
+                if (chats.count(id) || (cold && cold->contains(id))) {
+                    ids.push_back(id);
+                }
+            }
+            return ids;
+        }
+        materializeAllChats();
+        chatIds.forEachChunk([&ids](const ItemId *chunk, size_t count) {
+            ids.insert(ids.end(), chunk, chunk + count);
+            return true;
+        }, first - 1);
+        return ids;
+    }
+
+    // Запись в журнал делается под той же блокировкой, что и мутация, чтобы
+    // порядок записей по одному лоту совпадал с порядком изменений.
+    uint64_t logRecord(const WalRecord &record) { return log ? log->append(record) : 0; }
+
+    void commitLog(uint64_t lsn) {
+        if (log) {
+            log->commit(lsn);
+        }
+    }
+
+    Shard &shardFor(ItemId itemId) const {
+        return *shards[itemId % shards.size()];
+    }
+
+    NameStripe &stripeFor(const string &name) const {
+        return *nameStripes[std::hash<string>()(name) % nameStripes.size()];
+    }
+
+    static Item *findInShard(const Shard &shard, ItemId itemId) {
+        const ItemHandle *handle = shard.slots.find(itemId);
+        return handle ? shard.items.get(*handle) : nullptr;
+    }
+
+    static void indexName(NameStripe &stripe, const string &name, ItemId id) { stripe.ids.add(name, id); }
+
+    static void unindexName(NameStripe &stripe, const string &name, ItemId id) { stripe.ids.remove(name, id); }
+
+    static void indexPrice(Shard &shard, Item &item) {
+        uint64_t cents = item.getCents();
+        item.priceNode = shard.byPrice.emplace(cents, item.getId()).first;
+        item.sellerNode = shard.bySeller[item.getOwnerId()].emplace(cents, item.getId()).first;
+        if (uint64_t endsAt = item.getEndsAt()) {
+            item.deadlineNode = shard.byDeadline.emplace(endsAt, item.getId()).first;
+        }
+    }
+
+    // Срок только продлевается, а бессрочный лот сроком не обзаводится,
+    // поэтому узел в индексе срока есть ровно у лотов с ненулевым endsAt.
+    static void unindexPrice(Shard &shard, const Item &item) {
+        shard.byPrice.erase(item.priceNode);
+        auto seller = shard.bySeller.find(item.getOwnerId());
+        seller->second.erase(item.sellerNode);
+        if (seller->second.empty()) {
+            shard.bySeller.erase(seller);
+        }
+        if (item.getEndsAt()) {
+            shard.byDeadline.erase(item.deadlineNode);
+        }
+    }
+
+    // Вызывается под мутексом индексов. Узлы переставляются без выделения памяти.
+    static void repriceIndex(Shard &shard, Item &item) {
+        auto shift = [](PriceIndex &index, Item::IndexNode &at, uint64_t key) {
+            auto node = index.extract(at);
+            node.value().first = key;
+            at = index.insert(std::move(node)).position;
+        };
+        uint64_t cents = item.getCents();
+        if (cents != item.priceNode->first) {
+            shift(shard.byPrice, item.priceNode, cents);
+            shift(shard.bySeller.at(item.getOwnerId()), item.sellerNode, cents);
+        }
+        uint64_t endsAt = item.getEndsAt();
+        if (endsAt && endsAt != item.deadlineNode->first) {
+            shift(shard.byDeadline, item.deadlineNode, endsAt);
+        }
+    }
+
+    // Ставит лот в очередь на обновление индексов, если его там ещё нет.
+    // Вызывается после того, как новая цена или срок уже записаны в лот.
+    static void markStale(Shard &shard, Item &item) {
+        if (!item.indexStale.exchange(true, std::memory_order_acq_rel)) {
+            std::lock_guard<std::mutex> staleLock(shard.staleMutex);
+            shard.staleIds.push_back(item.getId());
+        }
+    }
+
+    // Переставляет в индексах лоты из очереди. Вызывается под разделяемой
+    // блокировкой шарда и мутексом индексов. Флаг снимается до чтения цены:
+    // ставка, записавшая цену позже, снова поставит лот в очередь. Снятые
+    // лоты пропускаются — их ID могли остаться в очереди.
+    static void catchUp(Shard &shard, vector<ItemId> &pending) {
+        {
+            std::lock_guard<std::mutex> staleLock(shard.staleMutex);
+            pending.swap(shard.staleIds);
+        }
+        for (ItemId id : pending) {
+            Item *item = findInShard(shard, id);
+            if (item && item->indexStale.exchange(false, std::memory_order_acq_rel)) {
+                repriceIndex(shard, *item);
+            }
+        }
+        pending.clear();
+    }
+
+    // Вызывается под блокировками шарда и его индекса.
+    static void appendListing(const Shard &shard, const pair<uint64_t, ItemId> &entry, vector<ItemListing> &out) {
+        const Item &item = *findInShard(shard, entry.second);
+        out.push_back({entry.second, item.getName(), item.priceNode->first, item.getOwnerId(),
+                       item.getEndsAt() ? item.deadlineNode->first : 0});
+    }
+
+    // Каждый шард отдаёт не больше limit строк уже в порядке order, затем
+    // списки сливаются через кучу из их голов: O(S (log n + k) + k log S).
+    template <typename Collect, typename Order>
+    vector<ItemListing> queryIndex(size_t limit, Collect collect, Order order) const {
+        vector<vector<ItemListing>> parts(shards.size());
+        vector<ItemId> pending;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            Shard &shard = *shards[i];
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            std::lock_guard<std::mutex> indexLock(shard.indexMutex);
+            catchUp(shard, pending);
+            collect(shard, parts[i]);
+        }
+        using Head = pair<size_t, size_t>;
+        auto later = [&parts, &order](const Head &a, const Head &b) {
+            return order(parts[b.first][b.second], parts[a.first][a.second]);
+        };
+        std::priority_queue<Head, vector<Head>, decltype(later)> heads(later);
+        for (size_t i = 0; i < parts.size(); ++i) {
+            if (!parts[i].empty()) {
+                heads.push({i, 0});
+            }
+        }
+        vector<ItemListing> result;
+        while (!heads.empty() && result.size() < limit) {
+            Head head = heads.top();
+            heads.pop();
+            result.push_back(std::move(parts[head.first][head.second]));
+            if (head.second + 1 < parts[head.first].size()) {
+                heads.push({head.first, head.second + 1});
+            }
+        }
+        return result;
+    }
+
+    static bool cheaperFirst(const ItemListing &a, const ItemListing &b) {
+        return a.cents != b.cents ? a.cents < b.cents : a.id < b.id;
+    }
+
+    static bool dearerFirst(const ItemListing &a, const ItemListing &b) {
+        return a.cents != b.cents ? a.cents > b.cents : a.id > b.id;
+    }
+
+    static bool olderFirst(const ItemListing &a, const ItemListing &b) { return a.id < b.id; }
+
+    static bool soonerFirst(const ItemListing &a, const ItemListing &b) {
+        return a.endsAt != b.endsAt ? a.endsAt < b.endsAt : a.id < b.id;
+    }
+
+    // Вызываются под эксклюзивными блокировками полосы имени и шарда.
+    uint64_t insertIntoShard(Shard &shard, NameStripe &stripe, ItemRecord &record) {
+        ItemHandle handle = shard.items.emplace(record.id, move(record.name), record.price, record.owner, record.bidder,
+                                                  record.endsAt, record.reserve);
+        Item &item = *shard.items.get(handle);
+        shard.slots.emplace(record.id, handle);
+        indexName(stripe, item.getName(), record.id);
+        indexPrice(shard, item);
+        shard.names.add(record.id, item.getName());
+        shard.catalog.add(record.id);
+        if (record.endsAt) {
+            std::lock_guard<std::mutex> timerLock(timerMutex);
+            deadlines.schedule(record.endsAt, record.id);
+        }
+        dirty.mark(record.id);
+        return logRecord(WalRecord::addItem(item));
+    }
+
+    // Закрывает лот, у которого сработал таймер. Под эксклюзивной блокировкой
+    // шарда ставки идти не могут, поэтому проверка срока там окончательна.
+    void settle(ItemId itemId, uint64_t now) {
+        metrics::Timer timer(metrics::Op::Settle);
+        Shard &shard = shardFor(itemId);
+        string name;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            Item *item = findInShard(shard, itemId);
+            if (!item) {
+                return;
+            }
+            name = item->getName();
+        }
+        NameStripe &stripe = stripeFor(name);
+        std::unique_lock<std::shared_mutex> nameLock(stripe.mutex);
+        std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+        Item *item = findInShard(shard, itemId);
+        if (!item) {
+            return;
+        }
+        uint64_t endsAt = item->getEndsAt();
+        if (endsAt > now) {
+            std::lock_guard<std::mutex> timerLock(timerMutex);
+            deadlines.schedule(endsAt, itemId);
+            return;
+        }
+        uint32_t bidder = item->getBidder();
+        bool sold = bidder != Item::kNoBidder && item->reserveMet();
+        Settlement settlement{itemId, move(name), item->getOwnerId(), sold ? bidder : kNoUser, item->getCents(), endsAt,
+                              std::move(item->book)};
+        uint64_t lsn = eraseFromShard(shard, stripe, itemId, nullptr);
+        shardLock.unlock();
+        nameLock.unlock();
+        publish(watch::Kind::Closed, itemId, settlement.cents, settlement.seller, settlement.winner, kNoUser);
+        commitLog(lsn);
+        if (settlementSink) {
+            settlementSink(settlement);
+        }
+    }
+
+    uint64_t eraseFromShard(Shard &shard, NameStripe &stripe, ItemId itemId, double *finalPrice) {
+        ItemHandle handle = *shard.slots.find(itemId);
+        Item &item = *shard.items.get(handle);
+        dirty.mark(itemId);
+        uint64_t lsn = logRecord(WalRecord::buy(itemId));
+        if (finalPrice) {
+            *finalPrice = item.getPrice();
+        }
+        unindexName(stripe, item.getName(), itemId);
+        unindexPrice(shard, item);
+        shard.names.remove(itemId, item.getName());
+        shard.catalog.remove(itemId);
+        shard.items.erase(handle);
+        shard.slots.erase(itemId);
+        return lsn;
+    }
+
+    // Ставки и заявки из снимка; лоты уже вставлены, других потоков ещё нет.
+    // Лот с диапазоном за пределами секций остаётся без истории.
+    void restoreBids(const SnapshotFile &snapshot, const vector<UserId> &users) {
+        uint64_t bid = 0;
+        uint64_t proxy = 0;
+        for (size_t i = 0; i < snapshot.itemCount(); ++i) {
+            const SnapshotItem &record = snapshot.item(i);
+            uint64_t bidEnd = bid + record.bids;
+            uint64_t proxyEnd = proxy + record.proxies;
+            Item *item = findInShard(shardFor(record.id), record.id);
+            if ((record.bids || record.proxies) && item && bidEnd <= snapshot.bidCount() &&
+                proxyEnd <= snapshot.proxyCount()) {
+                item->book = make_unique<BidBook>();
+                for (uint64_t k = bid; k < bidEnd; ++k) {
+                    const SnapshotBid &entry = snapshot.bid(k);
+                    item->book->restoreBid(fileUser(users, entry.bidder & ~BidBook::kProxyFlag), entry.cents, entry.time,
+                                           (entry.bidder & BidBook::kProxyFlag) != 0);
+                }
+                for (uint64_t k = proxy; k < proxyEnd; ++k) {
+                    const SnapshotProxy &entry = snapshot.proxy(k);
+                    item->book->restoreProxy({entry.max, fileUser(users, entry.bidder), entry.seq});
+                }
+            }
+            bid = bidEnd;
+            proxy = proxyEnd;
+        }
+    }
+
+public:
+    // Один шард подходит для интерактивного режима; для параллельной работы
+    // стоит брать число шардов в несколько раз больше числа ядер.
+    explicit Auction(size_t shardCount = 1) {
+        shardCount = std::max<size_t>(shardCount, 1);
+        for (size_t i = 0; i < shardCount; ++i) {
+            shards.push_back(make_unique<Shard>());
+            nameStripes.push_back(make_unique<NameStripe>());
+        }
+    }
+
+    // Журнал подключается после восстановления, чтобы проигрывание не
+    // дописывало записи повторно.
+    void attachLog(WriteAheadLog *wal) { log = wal; }
+
+    // Журнал отказал: изменения больше не становятся долговечными.
+    bool logFailed() const { return log && log->hasFailed(); }
+
+    // Рассылка событий подключается, как и журнал, после восстановления.
+    void attachEvents(watch::Dispatcher *dispatcher) { events = dispatcher; }
+    watch::Dispatcher *eventDispatcher() const { return events; }
+
+    // Ставка, принятая меньше чем за window мс до конца торгов, переносит
+    // конец на момент ставки плюс extension мс; нули отключают продление.
+    void setAntiSniping(uint64_t windowMs, uint64_t extensionMs) {
+        snipeWindow = windowMs;
+        snipeExtension = extensionMs;
+    }
+
+    // Вызывается из advanceClock без блокировок аукциона.
+    void onSettlement(std::function<void(const Settlement &)> sink) { settlementSink = move(sink); }
+
+    uint64_t now() const { return clock.load(std::memory_order_acquire); }
+
+    // Двигает время аукциона к nowMs и закрывает лоты с истёкшим сроком в
+    // порядке сроков. Возвращает число сработавших таймеров.
+    size_t advanceClock(uint64_t nowMs) {
+        vector<TimerWheel::Timer> expired;
+        uint64_t reached;
+        {
+            std::lock_guard<std::mutex> timerLock(timerMutex);
+            deadlines.advance(nowMs, [&expired](const TimerWheel::Timer &timer) { expired.push_back(timer); });
+            reached = deadlines.time();
+            clock.store(reached, std::memory_order_release);
+        }
+        for (const auto &timer : expired) {
+            settle(timer.id, reached);
+        }
+        return expired.size();
+    }
+
+    size_t pendingDeadlines() {
+        std::lock_guard<std::mutex> timerLock(timerMutex);
+        return deadlines.size();
+    }
+
+    // Продление из журнала: проигранная ставка сама срок не двигает.
+    void extendDeadline(ItemId itemId, uint64_t endsAt) {
+        Shard &shard = shardFor(itemId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        Item *item = findInShard(shard, itemId);
+        if (item && item->extendTo(endsAt)) {
+            markStale(shard, *item);
+        }
+    }
+
+    // Возвращает ID созданного лота или kNoItem, если лот с заданным ID уже есть.
+    ItemId addItem(ItemRecord record) {
+        metrics::Timer timer(metrics::Op::AddItem);
+        if (record.id == kNoItem) {
+            record.id = Item::allocateId();
+        } else {
+            Item::reserveId(record.id);
+        }
+        ItemId id = record.id;
+        NameStripe &stripe = stripeFor(record.name);
+        Shard &shard = shardFor(id);
+        std::unique_lock<std::shared_mutex> nameLock(stripe.mutex);
+        std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+        if (shard.slots.contains(id)) {
+            cerr << "Товар с ID " << id << " уже существует." << endl;
+            return kNoItem;
+        }
+        uint64_t lsn = insertIntoShard(shard, stripe, record);
+        shardLock.unlock();
+        nameLock.unlock();
+        commitLog(lsn);
+        return id;
+    }
+
+    // Пакетная вставка при загрузке: все блокировки берутся один раз, место
+    // в шардах резервируется заранее. Полосы и шарды захватываются по
+    // возрастанию номера, как и везде, сначала полосы, потом шарды. Лоты
+    // вставляются по возрастанию ID, чтобы списки поискового индекса
+    // росли с хвоста.
+    void addItems(vector<ItemRecord> batch) {
+        for (auto &record : batch) {
+            if (record.id == kNoItem) {
+                record.id = Item::allocateId();
+            } else {
+                Item::reserveId(record.id);
+            }
+        }
+        auto byId = [](const ItemRecord &a, const ItemRecord &b) { return a.id < b.id; };
+        if (!std::is_sorted(batch.begin(), batch.end(), byId)) {
+            std::sort(batch.begin(), batch.end(), byId);
+        }
+        vector<std::unique_lock<std::shared_mutex>> locks;
+        for (const auto &stripe : nameStripes) {
+            locks.emplace_back(stripe->mutex);
+        }
+        for (const auto &shard : shards) {
+            locks.emplace_back(shard->mutex);
+        }
+        for (const auto &shard : shards) {
+            shard->items.reserve(batch.size() / shards.size() + 1);
+            shard->slots.reserve(shard->items.size() + batch.size() / shards.size() + 1);
+        }
+        uint64_t lsn = 0;
+        for (auto &record : batch) {
+            Shard &shard = shardFor(record.id);
+            if (shard.slots.contains(record.id)) {
+                cerr << "Товар с ID " << record.id << " уже существует." << endl;
+                continue;
+            }
+            lsn = insertIntoShard(shard, stripeFor(record.name), record);
+        }
+        locks.clear();
+        commitLog(lsn);
+    }
+
+    size_t itemCount() const {
+        size_t count = 0;
+        for (const auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            count += shard->items.size();
+        }
+        return count;
+    }
+
+    bool readPrice(ItemId itemId, double *price) const {
+        Shard &shard = shardFor(itemId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        Item *item = findInShard(shard, itemId);
+        if (item) {
+            *price = item->getPrice();
+        }
+        return item != nullptr;
+    }
+
+    bool hasItem(ItemId itemId) const {
+        Shard &shard = shardFor(itemId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        return findInShard(shard, itemId) != nullptr;
+    }
+
+    ItemId findItemId(const string &itemName) const {
+        NameStripe &stripe = stripeFor(itemName);
+        std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+        return stripe.ids.first(itemName);
+    }
+
+    // Ставка берёт разделяемую блокировку шарда только для того, чтобы лот
+    // не удалили из-под неё. Цена и лидер публикуются атомарным словом лота:
+    // ставку не выше цены отклоняет одно его чтение, без блокировок.
+    // Принятая ставка дописывает историю и журнал под занятостью истории
+    // своего лота, так что их порядок совпадает с порядком цен, а ставки на
+    // разные лоты друг друга не ждут. Полосу bidMutexes берут только
+    // заявки с автоповышением и ставки на лоты, где такие заявки открыты.
+    // time задаёт время ставки при проигрывании журнала.
+    BidStatus submitBid(ItemId itemId, uint64_t cents, uint32_t bidderId, bool proxy, uint64_t time,
+                        double *currentPrice) {
+        metrics::Timer timer(metrics::Op::Bid);
+        Shard &shard = shardFor(itemId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        Item *item = findInShard(shard, itemId);
+        if (!item) {
+            return BidStatus::NotFound;
+        }
+        uint64_t now = clock.load(std::memory_order_acquire);
+        uint64_t endsAt = item->getEndsAt();
+        if (endsAt != 0 && now >= endsAt) {
+            if (currentPrice) {
+                *currentPrice = item->getPrice();
+            }
+            return BidStatus::Closed;
+        }
+        uint64_t seen = item->getCents();
+        if (cents <= seen) {
+            if (currentPrice) {
+                *currentPrice = Item::fromCents(seen);
+            }
+            return BidStatus::TooLow;
+        }
+        std::unique_lock<std::mutex> bidLock(shard.bidMutexes[itemId / shards.size() % kBidStripes], std::defer_lock);
+        if (proxy) {
+            bidLock.lock();
+        }
+        LedgerLock ledger(*item);
+        if (!bidLock.owns_lock() && item->book && !item->book->openProxies().empty()) {
+            ledger.unlock();
+            bidLock.lock();
+            ledger.lock();
+        }
+        uint64_t price = item->getCents();
+        uint32_t leader = item->getBidder();
+        bool accepted = cents > price;
+        if (accepted) {
+            if (!item->book) {
+                item->book = make_unique<BidBook>();
+            }
+            accepted = item->book->submit(price, leader, bidderId, std::min(cents, Item::kMaxCents), proxy, time,
+                                          item->reserveCents);
+        }
+        if (currentPrice) {
+            *currentPrice = Item::fromCents(price);
+        }
+        if (!accepted) {
+            return BidStatus::TooLow;
+        }
+        item->bidState.store(Item::pack(price, leader), std::memory_order_release);
+        uint64_t extendedTo = 0;
+        if (endsAt != 0 && snipeWindow != 0 && endsAt - now < snipeWindow && item->extendTo(now + snipeExtension)) {
+            extendedTo = now + snipeExtension;
+        }
+        dirty.mark(itemId);
+        uint64_t lsn = logRecord(WalRecord::bid(itemId, cents, bidderId, time, extendedTo, proxy));
+        ledger.unlock();
+        if (bidLock.owns_lock()) {
+            bidLock.unlock();
+        }
+        markStale(shard, *item);
+        UserId seller = item->getOwnerId();
+        lock.unlock();
+        publish(watch::Kind::Price, itemId, price, seller, bidderUser(leader), bidderUser(bidderId));
+        commitLog(lsn);
+        return leader == bidderId ? BidStatus::Accepted : BidStatus::Outbid;
+    }
+
+    BidStatus placeBid(ItemId itemId, double bidPrice, double *currentPrice = nullptr,
+                       uint32_t bidderId = Item::kNoBidder) {
+        return submitBid(itemId, Item::toCents(bidPrice), bidderId, false, now(), currentPrice);
+    }
+
+    // Заявка с автоповышением: участник перебивает чужие ставки минимальным
+    // шагом, пока цена не дойдёт до maxPrice. Повторная заявка участника
+    // принимается, только если она выше прежней.
+    BidStatus placeProxyBid(ItemId itemId, double maxPrice, double *currentPrice = nullptr,
+                            uint32_t bidderId = Item::kNoBidder) {
+        return submitBid(itemId, Item::toCents(maxPrice), bidderId, true, now(), currentPrice);
+    }
+
+    // Не больше limit последних ставок по лоту, от новых к старым.
+    vector<BidBook::Entry> bidHistory(ItemId itemId, size_t limit) const {
+        metrics::Timer timer(metrics::Op::Query);
+        vector<BidBook::Entry> entries;
+        Shard &shard = shardFor(itemId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        Item *item = findInShard(shard, itemId);
+        if (!item) {
+            return entries;
+        }
+        LedgerLock ledger(*item);
+        if (item->book) {
+            entries.reserve(std::min(limit, item->book->size()));
+            item->book->recent(limit, entries);
+        }
+        return entries;
+    }
+
+    // Память историй и заявок всех лотов и число ставок в них. Для замеров:
+    // истории не занимаются, параллельных ставок быть не должно.
+    pair<size_t, size_t> bidLedgerUsage() const {
+        pair<size_t, size_t> usage(0, 0);
+        forEachItem([&usage](const Item &item) {
+            if (item.book) {
+                usage.first += item.book->bytes();
+                usage.second += item.book->size();
+            }
+        });
+        return usage;
+    }
+
+    // Если лот купили между поиском по имени и ставкой, ставка уходит на
+    // следующий лот с тем же названием.
+    BidStatus placeBid(const string &itemName, double bidPrice, double *currentPrice = nullptr,
+                       uint32_t bidderId = Item::kNoBidder, bool proxy = false) {
+        while (true) {
+            ItemId itemId = findItemId(itemName);
+            if (itemId == kNoItem) {
+                return BidStatus::NotFound;
+            }
+            BidStatus status = submitBid(itemId, Item::toCents(bidPrice), bidderId, proxy, now(), currentPrice);
+            if (status != BidStatus::NotFound) {
+                return status;
+            }
+        }
+    }
+
+    BidStatus placeProxyBid(const string &itemName, double maxPrice, double *currentPrice = nullptr,
+                            uint32_t bidderId = Item::kNoBidder) {
+        return placeBid(itemName, maxPrice, currentPrice, bidderId, true);
+    }
+
+    bool removeItem(ItemId itemId, double *finalPrice = nullptr) {
+        metrics::Timer timer(metrics::Op::Buy);
+        Shard &shard = shardFor(itemId);
+        string name;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            Item *item = findInShard(shard, itemId);
+            if (!item) {
+                return false;
+            }
+            name = item->getName();
+        }
+        NameStripe &stripe = stripeFor(name);
+        std::unique_lock<std::shared_mutex> nameLock(stripe.mutex);
+        std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+        Item *item = findInShard(shard, itemId);
+        if (!item) {
+            return false;
+        }
+        uint64_t cents = item->getCents();
+        UserId seller = item->getOwnerId();
+        uint64_t lsn = eraseFromShard(shard, stripe, itemId, finalPrice);
+        shardLock.unlock();
+        nameLock.unlock();
+        publish(watch::Kind::Sold, itemId, cents, seller, kNoUser, kNoUser);
+        commitLog(lsn);
+        return true;
+    }
+
+    bool removeItem(const string &itemName, double *finalPrice = nullptr) {
+        metrics::Timer timer(metrics::Op::Buy);
+        NameStripe &stripe = stripeFor(itemName);
+        std::unique_lock<std::shared_mutex> nameLock(stripe.mutex);
+        ItemId itemId = stripe.ids.first(itemName);
+        if (itemId == kNoItem) {
+            return false;
+        }
+        Shard &shard = shardFor(itemId);
+        std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+        const Item &item = *findInShard(shard, itemId);
+        uint64_t cents = item.getCents();
+        UserId seller = item.getOwnerId();
+        uint64_t lsn = eraseFromShard(shard, stripe, itemId, finalPrice);
+        shardLock.unlock();
+        nameLock.unlock();
+        publish(watch::Kind::Sold, itemId, cents, seller, kNoUser, kNoUser);
+        commitLog(lsn);
+        return true;
+    }
+
+    // Лоты с ценой от minPrice до maxPrice включительно, от дешёвых к дорогим.
+    vector<ItemListing> itemsInPriceRange(double minPrice, double maxPrice, size_t limit = SIZE_MAX) const {
+        metrics::Timer timer(metrics::Op::Query);
+        uint64_t low = Item::toCents(minPrice);
+        uint64_t high = Item::toCents(maxPrice);
+        return queryIndex(limit, [&](const Shard &shard, vector<ItemListing> &out) {
+            for (auto it = shard.byPrice.lower_bound({low, kNoItem});
+                 it != shard.byPrice.end() && it->first <= high && out.size() < limit; ++it) {
+                appendListing(shard, *it, out);
+            }
+        }, cheaperFirst);
+    }
+
+    vector<ItemListing> mostExpensive(size_t count) const {
+        metrics::Timer timer(metrics::Op::Query);
+        return queryIndex(count, [&](const Shard &shard, vector<ItemListing> &out) {
+            for (auto it = shard.byPrice.rbegin(); it != shard.byPrice.rend() && out.size() < count; ++it) {
+                appendListing(shard, *it, out);
+            }
+        }, dearerFirst);
+    }
+
+    vector<ItemListing> cheapestBySeller(const string &seller, size_t count) const {
+        metrics::Timer timer(metrics::Op::Query);
+        UserId owner = UserDirectory::instance().find(seller);
+        if (owner == kNoUser) {
+            return {};
+        }
+        return queryIndex(count, [&](const Shard &shard, vector<ItemListing> &out) {
+            auto index = shard.bySeller.find(owner);
+            if (index == shard.bySeller.end()) {
+                return;
+            }
+            for (auto it = index->second.begin(); it != index->second.end() && out.size() < count; ++it) {
+                appendListing(shard, *it, out);
+            }
+        }, cheaperFirst);
+    }
+
+    // Не больше count лотов, торги по которым ещё идут, от ближайшего конца
+    // торгов к дальнему. Бессрочные лоты сюда не попадают.
+    vector<ItemListing> endingSoonest(size_t count) const {
+        metrics::Timer timer(metrics::Op::Query);
+        uint64_t from = clock.load(std::memory_order_acquire) + 1;
+        return queryIndex(count, [&](const Shard &shard, vector<ItemListing> &out) {
+            for (auto it = shard.byDeadline.lower_bound({from, kNoItem});
+                 it != shard.byDeadline.end() && out.size() < count; ++it) {
+                appendListing(shard, *it, out);
+            }
+        }, soonerFirst);
+    }
+
+    // Поиск по словам названия: первые limit подходящих лотов по возрастанию ID.
+    vector<ItemListing> searchItems(std::string_view text, size_t limit) const {
+        metrics::Timer timer(metrics::Op::Search);
+        search::Query query(text);
+        if (query.empty()) {
+            return {};
+        }
+        // Шарды обходятся по очереди, и каждый следующий ищет только ID
+        // меньше limit-го из уже найденных: ID шардов перемежаются, поэтому
+        // сверок с названиями выходит O(limit log S), а не limit на шард.
+        vector<ItemListing> result;
+        vector<ItemId> ids;
+        for (const auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            ids.clear();
+            ItemId below = result.size() < limit ? std::numeric_limits<ItemId>::max() : result.back().id;
+            shard->names.find(query, limit, below,
+                              [&](ItemId id) { return query.matches(findInShard(*shard, id)->getName()); }, ids);
+            size_t middle = result.size();
+            for (ItemId id : ids) {
+                const Item &item = *findInShard(*shard, id);
+                result.push_back({id, item.getName(), item.getCents(), item.getOwnerId()});
+            }
+            std::inplace_merge(result.begin(), result.begin() + static_cast<std::ptrdiff_t>(middle), result.end(),
+                               olderFirst);
+            if (result.size() > limit) {
+                result.resize(limit);
+            }
+        }
+        return result;
+    }
+
+    static constexpr size_t kListPage = 500;
+
+    // Страница каталога по возрастанию ID: не больше limit лотов с ID больше
+    // after (kNoItem — с начала). Возвращает курсор следующей страницы или
+    // kNoItem, если каталог пройден. Курсор — ID, а не позиция, поэтому
+    // вставки и удаления между страницами ничего не сдвигают.
+    // Сначала из списков шардов сливаются только ID — каждый шард отдаёт ID
+    // меньше limit-го из уже отобранных, блоки до курсора не разжимаются, —
+    // и лишь потом строки заполняются для limit победителей. Строки пишутся
+    // поверх прежних строк page, так что буфер, который вызывающий держит
+    // между страницами, не выделяет память заново.
+    ItemId listItems(ItemId after, size_t limit, vector<ItemListing> &page) const {
+        metrics::Timer timer(metrics::Op::List);
+        vector<ItemId> ids;
+        vector<ItemId> part;
+        vector<ItemId> merged;
+        for (const auto &shard : shards) {
+            part.clear();
+            {
+                std::shared_lock<std::shared_mutex> lock(shard->mutex);
+                ItemId below = ids.size() < limit ? std::numeric_limits<ItemId>::max() : ids.back();
+                shard->catalog.forEachChunk([&](const ItemId *chunk, size_t count) {
+                    for (size_t i = 0; i < count; ++i) {
+                        if (chunk[i] >= below || part.size() == limit) {
+                            return false;
+                        }
+                        part.push_back(chunk[i]);
+                    }
+                    return true;
+                }, after);
+            }
+            merged.clear();
+            std::merge(ids.begin(), ids.end(), part.begin(), part.end(), std::back_inserter(merged));
+            if (merged.size() > limit) {
+                merged.resize(limit);
+            }
+            ids.swap(merged);
+        }
+        // Лот, удалённый между проходами, оставляет пустую строку, которая
+        // потом выбрасывается; курсор от этого не меняется.
+        page.resize(ids.size());
+        for (size_t s = 0; s < shards.size() && !ids.empty(); ++s) {
+            const Shard &shard = *shards[s];
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (size_t k = 0; k < ids.size(); ++k) {
+                if (ids[k] % shards.size() != s) {
+                    continue;
+                }
+                const Item *item = findInShard(shard, ids[k]);
+                ItemListing &row = page[k];
+                row.id = item ? ids[k] : kNoItem;
+                if (item) {
+                    row.name.assign(item->getName());
+                    row.cents = item->getCents();
+                    row.owner = item->getOwnerId();
+                }
+            }
+        }
+        page.erase(std::remove_if(page.begin(), page.end(), [](const ItemListing &row) { return row.id == kNoItem; }),
+                   page.end());
+        return ids.size() < limit || ids.empty() ? kNoItem : ids.back();
+    }
+
+    // Память поискового индекса и число записей в его списках.
+    pair<size_t, size_t> searchIndexUsage() const {
+        pair<size_t, size_t> usage(0, 0);
+        for (const auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            usage.first += shard->names.bytes();
+            usage.second += shard->names.postings();
+        }
+        return usage;
+    }
+
+    // Вывод меню идёт в общий буфер out и сбрасывается только на границах
+    // страниц, а не построчно.
+    static void displayListings(const vector<ItemListing> &listings, OutputBuffer &out) {
+        if (listings.empty()) {
+            out << "Нет подходящих товаров.\n";
+        }
+        for (const auto &listing : listings) {
+            listing.display(out);
+        }
+        out.flush();
+    }
+
+    void displayItems(OutputBuffer &out) const {
+        vector<ItemListing> page;
+        ItemId cursor = kNoItem;
+        bool empty = true;
+        do {
+            cursor = listItems(cursor, kListPage, page);
+            for (const auto &listing : page) {
+                listing.display(out);
+            }
+            empty = empty && page.empty();
+            out.flush();
+        } while (cursor != kNoItem);
+        if (empty) {
+            out << "Нет доступных товаров.\n";
+            out.flush();
+        }
+    }
+
+    void buyItem(const string &itemName, const Buyer *buyer) {
+        double price;
+        if (removeItem(itemName, &price)) {
+            cout << "Покупатель " << buyer->getUsername() << " купил " << itemName
+                 << " за " << price << endl;
+        } else {
+            cout << "Товар " << itemName << " не найден." << endl;
+        }
+    }
+
+    void bidItem(const string &itemName, double bidPrice, const Buyer *buyer, bool proxy = false) {
+        double currentPrice;
+        switch (placeBid(itemName, bidPrice, &currentPrice, buyer->getId(), proxy)) {
+        case BidStatus::Accepted:
+            cout << "Покупатель " << buyer->getUsername() << " лидирует по " << itemName << " с ценой "
+                 << currentPrice << endl;
+            break;
+        case BidStatus::Outbid:
+            cout << "Ставку перебила заявка с автоповышением. Текущая цена: " << currentPrice << endl;
+            break;
+        case BidStatus::TooLow:
+            cout << "Ставка слишком низкая. Текущая цена: " << currentPrice << endl;
+            break;
+        case BidStatus::NotFound:
+            cout << "Товар " << itemName << " не найден." << endl;
+            break;
+        case BidStatus::Closed:
+            cout << "Торги по товару " << itemName << " уже завершены." << endl;
+            break;
+        }
+    }
+
+    void displayBids(const string &itemName, size_t limit, OutputBuffer &out) const {
+        ItemId itemId = findItemId(itemName);
+        if (itemId == kNoItem) {
+            out << "Товар " << itemName << " не найден.\n";
+            out.flush();
+            return;
+        }
+        vector<BidBook::Entry> entries = bidHistory(itemId, limit);
+        if (entries.empty()) {
+            out << "Ставок по товару " << itemName << " нет.\n";
+        }
+        const UserDirectory &directory = UserDirectory::instance();
+        for (const auto &entry : entries) {
+            out << uint64_t(entry.time) << " мс: " << directory.name(entry.bidder) << " - "
+                << Item::fromCents(entry.cents) << (entry.proxy ? " (автоповышение)\n" : "\n");
+        }
+        out.flush();
+    }
+
+    // false — чат лота в холодном ярусе не читается, сообщение не принято.
+    bool sendMessage(const string &from, const string &content, ItemId itemId) {
+        metrics::Timer timer(metrics::Op::Message);
+        std::unique_lock<std::mutex> lock(messagesMutex);
+        if (!materializeChat(itemId)) {
+            return false;
+        }
+        dirty.mark(itemId);
+        uint64_t lsn = logRecord(WalRecord::message(from, content, itemId));
+        openChat(itemId).append(Message(from, content, itemId));
+        lock.unlock();
+        publish(watch::Kind::Message, itemId, 0, kNoUser, kNoUser, UserDirectory::instance().find(from));
+        commitLog(lsn);
+        return true;
+    }
+
+    // Применяет запись журнала при восстановлении. Повторное применение
+    // безопасно для лотов, ставок и покупок, но не для сообщений: их
+    // дописало бы заново. Поэтому записи, уже отражённые в снимке,
+    // отсеивает по номеру WriteAheadLog::replay.
+    void applyLogRecord(const WalRecord &record) {
+        switch (record.type) {
+        case WalRecordType::AddItem:
+            if (!hasItem(record.itemId)) {
+                addItem({record.itemId, record.name, Item::fromCents(record.cents),
+                         UserDirectory::instance().intern(record.text), Item::kNoBidder, record.endsAt,
+                         Item::fromCents(record.reserveCents)});
+            }
+            break;
+        case WalRecordType::Bid:
+        case WalRecordType::ProxyBid:
+            submitBid(record.itemId, record.cents, record.bidder, record.type == WalRecordType::ProxyBid, record.time,
+                      nullptr);
+            if (record.endsAt) {
+                extendDeadline(record.itemId, record.endsAt);
+            }
+            break;
+        case WalRecordType::Buy:
+            removeItem(record.itemId);
+            break;
+        case WalRecordType::Message:
+            sendMessage(record.name, record.text, record.itemId);
+            break;
+        case WalRecordType::Register:
+            break;
+        }
+    }
+
+    // Лоты поднимаются из снимка сразу: по каждой записи строится Item с
+    // историей ставок и встаёт во все индексы шарда, как при загрузке
+    // текстовых файлов, только без разбора. Поэтому время запуска и память
+    // растут с числом лотов; отображённый файл читается лениво лишь для
+    // истории чатов — до первого обращения к чату. Вызывается для полного
+    // снимка или по разу на каждый раздел контрольной точки.
+    void attachSnapshot(std::shared_ptr<const SnapshotFile> snapshot, vector<UserId> users) {
+        Item::reserveId(snapshot->nextItemId() - 1);
+        vector<ItemRecord> batch;
+        batch.reserve(snapshot->itemCount());
+        for (size_t i = 0; i < snapshot->itemCount(); ++i) {
+            const SnapshotItem &record = snapshot->item(i);
+            uint32_t bidder = record.bidder == Item::kNoBidder ? Item::kNoBidder : fileUser(users, record.bidder);
+            batch.push_back({record.id, string(snapshot->str(record.name)), Item::fromCents(record.cents),
+                             fileUser(users, record.owner), bidder, record.endsAt,
+                             Item::fromCents(record.reserveCents)});
+        }
+        addItems(move(batch));
+        restoreBids(*snapshot, users);
+        if (snapshot->chatCount() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        ItemId first = snapshot->chat(0).itemId;
+        auto at = std::upper_bound(chatSources.begin(), chatSources.end(), first,
+                                   [](ItemId id, const ChatSource &s) { return id < s.file->chat(0).itemId; });
+        ChatSource &source = *chatSources.insert(at, ChatSource{move(snapshot), move(users), {}});
+        source.loaded.assign(source.file->chatCount(), false);
+    }
+
+    // Переносит лоты, для которых moves(ID) истинно, вместе со ставками и
+    // чатами в out и удаляет их отсюда без уведомлений подписчикам; удаление
+    // лота пишется в журнал, как покупка. Удаляются они, только если
+    // publish() сохранил out; иначе всё остаётся на месте и возвращается
+    // {0, 0}. Возвращает число лотов и чатов.
+    pair<size_t, size_t> extract(const std::function<bool(ItemId)> &moves, SnapshotBuilder &out,
+                                 const std::function<bool()> &publish) {
+        vector<ItemId> ids;
+        for (const auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            shard->slots.forEach([&](ItemId id, ItemHandle) {
+                if (moves(id)) {
+                    ids.push_back(id);
+                }
+            });
+        }
+        std::sort(ids.begin(), ids.end());
+        vector<pair<ItemId, string>> items;
+        for (ItemId id : ids) {
+            Shard &shard = shardFor(id);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            Item *item = findInShard(shard, id);
+            if (item) {
+                out.addItem(*item, item->book.get());
+                items.emplace_back(id, item->getName());
+            }
+        }
+        vector<ItemId> chatList;
+        {
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            materializeAllChats();
+            chatIds.forEachChunk([&](const ItemId *chunk, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    if (moves(chunk[i])) {
+                        chatList.push_back(chunk[i]);
+                    }
+                }
+                return true;
+            });
+            // Нечитаемый холодный чат остаётся здесь.
+            auto unread = std::remove_if(chatList.begin(), chatList.end(), [this](ItemId id) {
+                return !materializeChat(id) || chats.find(id) == chats.end();
+            });
+            chatList.erase(unread, chatList.end());
+            for (ItemId id : chatList) {
+                const ChatLog &chat = chats.find(id)->second;
+                for (size_t i = 0; i < chat.size(); ++i) {
+                    out.addMessage(chat.at(i));
+                }
+            }
+        }
+        if (!publish()) {
+            return {0, 0};
+        }
+
+        uint64_t lsn = 0;
+        for (const auto &moved : items) {
+            Shard &shard = shardFor(moved.first);
+            NameStripe &stripe = stripeFor(moved.second);
+            std::unique_lock<std::shared_mutex> nameLock(stripe.mutex);
+            std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+            if (findInShard(shard, moved.first)) {
+                lsn = eraseFromShard(shard, stripe, moved.first, nullptr);
+            }
+        }
+        commitLog(lsn);
+
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        for (ItemId id : chatList) {
+            chats.erase(id);
+            chatIds.remove(id);
+            dirty.mark(id);
+        }
+        return {items.size(), chatList.size()};
+    }
+
+    // Принимает лоты, ставки и чаты, вынутые extract в другом процессе. В
+    // отличие от attachSnapshot чаты сразу переносятся в память: диапазон
+    // их ID может пересечься с файлами, из которых подняты свои чаты. Все
+    // затронутые разделы отмечаются для следующей контрольной точки.
+    void adopt(const SnapshotFile &file, const vector<UserId> &users) {
+        vector<ItemRecord> batch;
+        batch.reserve(file.itemCount());
+        for (size_t i = 0; i < file.itemCount(); ++i) {
+            const SnapshotItem &record = file.item(i);
+            uint32_t bidder = record.bidder == Item::kNoBidder ? Item::kNoBidder : fileUser(users, record.bidder);
+            batch.push_back({record.id, string(file.str(record.name)), Item::fromCents(record.cents),
+                             fileUser(users, record.owner), bidder, record.endsAt,
+                             Item::fromCents(record.reserveCents)});
+            dirty.mark(record.id);
+        }
+        addItems(move(batch));
+        restoreBids(file, users);
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        for (size_t c = 0; c < file.chatCount(); ++c) {
+            const SnapshotChat &chat = file.chat(c);
+            if (!materializeChat(chat.itemId)) {
+                cerr << "Чат лота " << chat.itemId << " не читается, принятые сообщения пропущены." << endl;
+                continue;
+            }
+            ChatLog &log = openChat(chat.itemId);
+            for (uint64_t i = chat.first; i < chat.first + chat.count && i < file.messageCount(); ++i) {
+                const SnapshotMessage &record = file.message(i);
+                log.append(Message(fileUser(users, record.from), string(file.str(record.content)), chat.itemId));
+            }
+            dirty.mark(chat.itemId);
+        }
+    }
+
+    // Срез контрольной точки: закрытый на нём сегмент журнала, изменённые
+    // с прошлой точки разделы и длины их чатов в момент среза.
+    struct CheckpointCut {
+        uint64_t segment = 0;
+        ItemId nextItemId = 0;
+        vector<uint64_t> partitions;
+        vector<pair<ItemId, size_t>> chatLengths;
+    };
+
+    // cut закрывает сегмент журнала. Он вызывается под messagesMutex, поэтому
+    // сообщения делятся срезом точно: всё до него уже в чатах, всё после —
+    // в новом сегменте. Отметки снимаются после ротации: изменение, чья
+    // запись ушла в закрытый сегмент, отметило раздел раньше неё.
+    CheckpointCut beginCheckpoint(const std::function<uint64_t()> &cut) {
+        CheckpointCut result;
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        result.segment = cut();
+        result.nextItemId = Item::peekNextId();
+        result.partitions = dirty.take();
+        for (uint64_t partition : result.partitions) {
+            for (ItemId id : chatsIn(partition)) {
+                result.chatLengths.emplace_back(id, chatLength(id));
+            }
+        }
+        return result;
+    }
+
+    // Копия раздела cut.partitions[index]: каждый лот копируется под своей
+    // полосой ставок и разделяемой блокировкой шарда, каждый чат — под
+    // messagesMutex и только до длины на срезе. Ставки, пришедшие после
+    // среза, могут попасть в копию: повтор их записей из журнала безопасен.
+    void capturePartition(const CheckpointCut &cut, size_t index, SnapshotBuilder &out) const {
+        ItemId first = DirtyPartitions::firstId(cut.partitions[index]);
+        ItemId last = DirtyPartitions::lastId(cut.partitions[index]);
+        vector<ItemId> ids;
+        if (last - first < DirtyPartitions::kSpan) {
+            for (ItemId id = first; id <= last; ++id) {
+                ids.push_back(id);
+            }
+        } else {
+            for (const auto &shard : shards) {
+                std::shared_lock<std::shared_mutex> lock(shard->mutex);
+                shard->slots.forEach([&](ItemId id, ItemHandle) {
+                    if (id >= first) {
+                        ids.push_back(id);
+                    }
+                });
+            }
+            std::sort(ids.begin(), ids.end());
+        }
+        for (ItemId id : ids) {
+            Shard &shard = shardFor(id);
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            const Item *item = findInShard(shard, id);
+            if (item) {
+                LedgerLock ledger(*item);
+                out.addItem(*item, item->book.get());
+            }
+        }
+        // Чат, вытесненный в холодный ярус после среза, читается оттуда:
+        // холодная копия не меняется, а дописанное после среза не нужно.
+        ChatLog scratch;
+        auto chat = std::lower_bound(cut.chatLengths.begin(), cut.chatLengths.end(), pair<ItemId, size_t>(first, 0));
+        for (; chat != cut.chatLengths.end() && chat->first <= last; ++chat) {
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            const ChatLog *log = peekChat(chat->first, scratch);
+            for (size_t i = 0; log && i < std::min(chat->second, log->size()); ++i) {
+                out.addMessage(log->at(i));
+            }
+        }
+    }
+
+    // Возвращает отметки разделам среза, который не удалось опубликовать.
+    void abandonCheckpoint(const CheckpointCut &cut) {
+        for (uint64_t partition : cut.partitions) {
+            dirty.mark(DirtyPartitions::firstId(partition));
+        }
+    }
+
+    // После загрузки контрольной точки её разделы совпадают с памятью.
+    void forgetChanges() { dirty.take(); }
+
+    bool hasChanges() const { return dirty.any(); }
+
+    // Первая контрольная точка после загрузки из полного снимка или .txt
+    // должна записать всё: отмечаются разделы всех лотов и чатов.
+    void markAllChanged() {
+        forEachItem([this](const Item &item) { dirty.mark(item.getId()); });
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        for (const auto &source : chatSources) {
+            for (size_t i = 0; i < source.file->chatCount(); ++i) {
+                dirty.mark(source.file->chat(i).itemId);
+            }
+        }
+        chatIds.forEachChunk([this](const ItemId *ids, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                dirty.mark(ids[i]);
+            }
+            return true;
+        });
+    }
+
+    void forEachItem(const std::function<void(const Item &)> &visit) const {
+        for (const auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            shard->items.forEach(visit);
+        }
+    }
+
+    // Как forEachItem, но вместе со ставками лота (nullptr — ставок не было).
+    void forEachItemWithBids(const std::function<void(const Item &, const BidBook *)> &visit) const {
+        for (const auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            shard->items.forEach([&](const Item &item) {
+                LedgerLock ledger(item);
+                visit(item, item.book.get());
+            });
+        }
+    }
+
+    // Включает холодный ярус чатов с сегментами в каталоге dir.
+    void enableColdChats(const string &dir) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        cold = make_unique<ColdChatStore>(dir);
+    }
+
+    struct ChatTiers {
+        size_t hotChats = 0;
+        size_t coldChats = 0;
+        uint64_t coldDiskBytes = 0;
+        uint64_t coldOriginalBytes = 0;
+    };
+
+    ChatTiers chatTiers() const {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        ChatTiers tiers;
+        tiers.hotChats = chats.size();
+        if (cold) {
+            tiers.coldChats = cold->chats();
+            tiers.coldDiskBytes = cold->diskBytes();
+            tiers.coldOriginalBytes = cold->originalBytes();
+        }
+        return tiers;
+    }
+
+    // Текущая отметка часов обращений к чатам.
+    uint64_t chatTick() const {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        return chatClock;
+    }
+
+    static constexpr size_t kFreezeBytes = 4 << 20;
+
+    // Вытесняет в холодный ярус чаты, к которым не обращались с отметки
+    // olderThan, начиная с самых давних, пока оценка освобождённой памяти не
+    // наберёт bytes. Сегменты пишутся порциями до kFreezeBytes, и между
+    // порциями блокировка сообщений отпускается. Возвращает оценку
+    // освобождённого.
+    size_t freezeChats(size_t bytes, uint64_t olderThan) {
+        vector<pair<uint64_t, ItemId>> candidates;
+        {
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            if (!cold) {
+                return 0;
+            }
+            for (const auto &chat : chats) {
+                if (chat.second.lastUsed() < olderThan) {
+                    candidates.emplace_back(chat.second.lastUsed(), chat.first);
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        size_t freed = 0;
+        size_t next = 0;
+        while (freed < bytes && next < candidates.size()) {
+            metrics::Timer timer(metrics::Op::Evict);
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            vector<pair<ItemId, const ChatLog *>> victims;
+            size_t batch = 0;
+            for (; next < candidates.size() && batch < kFreezeBytes && freed + batch < bytes; ++next) {
+                auto it = chats.find(candidates[next].second);
+                if (it != chats.end() && it->second.lastUsed() < olderThan) {
+                    victims.emplace_back(it->first, &it->second);
+                    batch += it->second.bytes();
+                }
+            }
+            if (victims.empty() || !cold->freeze(victims)) {
+                continue;
+            }
+            for (const auto &victim : victims) {
+                chats.erase(victim.first);
+            }
+            freed += batch;
+        }
+        return freed;
+    }
+
+    void forEachMessage(const std::function<void(const Message &)> &visit) const {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        forEachChat([&visit](ItemId, const ChatLog &log) {
+            for (const auto &message : log.messages()) {
+                visit(message);
+            }
+        });
+    }
+
+    static constexpr size_t kChatEnd = SIZE_MAX;
+
+    // Страница истории чата: не больше limit сообщений с позициями меньше
+    // before (kChatEnd — с самого конца), от старых к новым. Возвращает курсор
+    // следующей, более старой страницы; 0 — её нет. Стоимость зависит только
+    // от размера страницы, а не от числа сообщений в хранилище.
+    size_t chatHistory(ItemId itemId, size_t before, size_t limit, vector<Message> &page) const {
+        metrics::Timer timer(metrics::Op::ChatRead);
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        materializeChat(itemId);
+        auto it = chats.find(itemId);
+        return it == chats.end() ? 0 : it->second.page(before, limit, page);
+    }
+
+    // Обход чата вперёд: не больше limit сообщений с позиции from, от старых
+    // к новым. Возвращает курсор следующей страницы или kChatEnd, если чат
+    // прочитан до конца; позиции не сдвигаются, чат только дописывается.
+    size_t chatPage(ItemId itemId, size_t from, size_t limit, vector<Message> &page) const {
+        metrics::Timer timer(metrics::Op::ChatRead);
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        materializeChat(itemId);
+        auto it = chats.find(itemId);
+        if (it == chats.end()) {
+            return kChatEnd;
+        }
+        size_t next = it->second.pageAfter(from, limit, page);
+        return next < it->second.size() ? next : kChatEnd;
+    }
+
+    // Страница списка чатов по возрастанию ID лота: не больше limit чатов с
+    // ID больше after, по строке на отправителя, отправители по имени.
+    // Возвращает курсор следующей страницы или kNoItem. Чаты из снимка
+    // переносятся в память только по мере того, как попадают на страницу.
+    ItemId listChats(ItemId after, size_t limit, vector<ChatSummary> &page) const {
+        metrics::Timer timer(metrics::Op::List);
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        vector<ItemId> ids;
+        chatIds.forEachChunk([&](const ItemId *chunk, size_t count) {
+            size_t taken = std::min(count, limit - ids.size());
+            ids.insert(ids.end(), chunk, chunk + taken);
+            return ids.size() < limit;
+        }, after);
+        for (const auto &source : chatSources) {
+            const SnapshotFile &file = *source.file;
+            size_t end = std::min(file.chatCount(), file.chatsAfter(after) + limit);
+            for (size_t i = file.chatsAfter(after); i < end; ++i) {
+                ids.push_back(file.chat(i).itemId);
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        if (ids.size() > limit) {
+            ids.resize(limit);
+        }
+        page.clear();
+        const UserDirectory &directory = UserDirectory::instance();
+        ChatLog scratch;
+        for (ItemId id : ids) {
+            const ChatLog *log = peekChat(id, scratch);
+            if (!log) {
+                continue;
+            }
+            size_t first = page.size();
+            for (const auto &sender : log->senders()) {
+                page.push_back({id, sender.first, sender.second.size()});
+            }
+            std::sort(page.begin() + static_cast<std::ptrdiff_t>(first), page.end(),
+                      [&directory](const ChatSummary &a, const ChatSummary &b) {
+                          return directory.name(a.sender) < directory.name(b.sender);
+                      });
+        }
+        return ids.size() < limit || ids.empty() ? kNoItem : ids.back();
+    }
+
+    size_t chatHistoryFrom(ItemId itemId, const string &sender, size_t before, size_t limit,
+                           vector<Message> &page) const {
+        metrics::Timer timer(metrics::Op::ChatRead);
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        materializeChat(itemId);
+        auto it = chats.find(itemId);
+        return it == chats.end() ? 0 : it->second.pageFrom(UserDirectory::instance().find(sender), before, limit, page);
+    }
+
+    void displayMessages(OutputBuffer &out) const {
+        out << "Доступные чаты:\n";
+        vector<ChatSummary> page;
+        ItemId cursor = kNoItem;
+        do {
+            cursor = listChats(cursor, kListPage, page);
+            for (const auto &row : page) {
+                row.display(out);
+            }
+            out.flush();
+        } while (cursor != kNoItem);
+    }
+
+    void displayChat(ItemId itemId, OutputBuffer &out) const {
+        out << "Чат для товара ID " << itemId << ":\n";
+        vector<Message> page;
+        size_t cursor = 0;
+        do {
+            page.clear();
+            cursor = chatPage(itemId, cursor, kListPage, page);
+            for (const auto &message : page) {
+                message.display(out);
+            }
+            out.flush();
+        } while (cursor != kChatEnd);
+    }
+
+    // false, если файл не удалось записать целиком: прежняя версия остаётся.
+    bool saveItemsToFile(const string &filename) const {
+        metrics::Timer timer(metrics::Op::Save);
+        aio::File file(filename);
+        std::ostream outFile(&file);
+        if (file.isOpen()) {
+            for (const auto &shard : shards) {
+                std::shared_lock<std::shared_mutex> lock(shard->mutex);
+                shard->items.forEach([&outFile](const Item &item) {
+                    outFile << item.getId() << ",";
+                    csv::writeField(outFile, item.getName());
+                    outFile << ",";
+                    csv::writeNumber(outFile, item.getPrice());
+                    outFile << ",";
+                    csv::writeField(outFile, item.getOwner());
+                    outFile << "\n";
+                });
+            }
+            return outFile && file.commit();
+        }
+        cout << "Не удалось открыть файл для записи." << endl;
+        return false;
+    }
+
+    void loadItemsFromFile(const string &filename) {
+        metrics::Timer timer(metrics::Op::Load);
+        csv::Import<csv::ItemRow> import;
+        if (!csv::importFile(filename, csv::parseItem, import)) {
+            cout << "Не удалось открыть файл для чтения." << endl;
+            return;
+        }
+        vector<ItemRecord> batch;
+        batch.reserve(import.rows());
+        import.forEach([&batch](const csv::ItemRow &row) {
+            batch.push_back({row.id, string(row.name), row.price, UserDirectory::instance().intern(row.owner)});
+        });
+        addItems(move(batch));
+    }
+
+    bool saveMessagesToFile(const string &filename) const {
+        metrics::Timer timer(metrics::Op::Save);
+        aio::File file(filename);
+        std::ostream outFile(&file);
+        if (file.isOpen()) {
+            std::lock_guard<std::mutex> lock(messagesMutex);
+            forEachChat([&outFile](ItemId, const ChatLog &log) {
+                for (const auto &message : log.messages()) {
+                    csv::writeField(outFile, message.getFromUser());
+                    outFile << ",";
+                    csv::writeField(outFile, message.getContent());
+                    outFile << "," << message.getItemId() << "\n";
+                }
+            });
+            return outFile && file.commit();
+        }
+        cout << "Не удалось открыть файл для записи сообщений." << endl;
+        return false;
+    }
+
+    void loadMessagesFromFile(const string &filename) {
+        metrics::Timer timer(metrics::Op::Load);
+        csv::Import<csv::MessageRow> import;
+        if (!csv::importFile(filename, csv::parseMessage, import)) {
+            cout << "Не удалось открыть файл для чтения сообщений." << endl;
+            return;
+        }
+        std::unique_lock<std::mutex> lock(messagesMutex);
+        import.forEach([this](const csv::MessageRow &row) {
+            if (!materializeChat(row.itemId)) {
+                return;
+            }
+            openChat(row.itemId).append(Message(UserDirectory::instance().intern(row.from), string(row.content), row.itemId));
+        });
+    }
+};
+
+bool saveUsersToFile(const Accounts &accounts, const string &filename) {
+    metrics::Timer timer(metrics::Op::Save);
+    aio::File file(filename);
+    std::ostream outFile(&file);
+    if (file.isOpen()) {
+        accounts.forEach([&outFile](const Buyer &buyer) {
+            csv::writeField(outFile, buyer.getUsername());
+            outFile << "," << buyer.getPasswordHash() << "\n";
+        });
+        return outFile && file.commit();
+    }
+    cout << "Не удалось открыть файл для записи пользователей." << endl;
+    return false;
+}
+
+// Повторы имени в файле пропускаются: остаётся первая запись.
+void loadUsersFromFile(Accounts &accounts, const string &filename) {
+    metrics::Timer timer(metrics::Op::Load);
+    csv::Import<csv::UserRow> import;
+    if (!csv::importFile(filename, csv::parseUser, import)) {
+        cout << "Не удалось открыть файл для чтения пользователей." << endl;
+        return;
+    }
+    accounts.reserve(accounts.size() + import.rows());
+    import.forEach([&accounts](const csv::UserRow &row) {
+        accounts.add(make_unique<Buyer>(string(row.name), static_cast<size_t>(row.passwordHash)));
+    });
+}
+
+// false, если снимок не записан: тогда журнал нельзя очищать, в нём всё,
+// что изменилось после прежнего снимка. walLsn — номер последней записи
+// журнала, взятый до обхода состояния.
+bool saveSnapshot(const Auction &auction, const Accounts &accounts, const string &filename, uint64_t walLsn = 0) {
+    metrics::Timer timer(metrics::Op::Save);
+    SnapshotBuilder builder;
+    builder.setWalLsn(walLsn);
+    builder.addDirectory();
+    accounts.forEach([&builder](const Buyer &buyer) { builder.addUser(buyer); });
+    auction.forEachItemWithBids([&builder](const Item &item, const BidBook *book) { builder.addItem(item, book); });
+    auction.forEachMessage([&builder](const Message &message) { builder.addMessage(message); });
+    if (!builder.write(filename, Item::peekNextId())) {
+        cout << "Не удалось записать снимок." << endl;
+        return false;
+    }
+    return true;
+}
+
+// Пользователи и лоты одного файла снимка: полного или раздела контрольной точки.
+void attachSnapshotFile(Auction &auction, Accounts &accounts, std::shared_ptr<const SnapshotFile> snapshot) {
+    // В новом процессе справочник пуст, и ID из снимка совпадают с новыми;
+    // таблица перекодировки нужна, если имена уже успели появиться.
+    UserDirectory &directory = UserDirectory::instance();
+    vector<UserId> remap;
+    remap.reserve(snapshot->nameCount());
+    for (size_t i = 0; i < snapshot->nameCount(); ++i) {
+        remap.push_back(directory.intern(snapshot->str(snapshot->name(i))));
+    }
+    accounts.reserve(accounts.size() + snapshot->userCount());
+    for (size_t i = 0; i < snapshot->userCount(); ++i) {
+        const SnapshotUser &user = snapshot->user(i);
+        if (user.name < remap.size()) {
+            accounts.add(make_unique<Buyer>(directory.name(remap[user.name]), static_cast<size_t>(user.passwordHash)));
+        }
+    }
+    auction.attachSnapshot(move(snapshot), move(remap));
+}
+
+// Лоты и пользователи, переданные другим процессом при перебалансировке;
+// уже известные имена пропускаются.
+void adoptSnapshotFile(Auction &auction, Accounts &accounts, const SnapshotFile &snapshot) {
+    UserDirectory &directory = UserDirectory::instance();
+    vector<UserId> remap;
+    remap.reserve(snapshot.nameCount());
+    for (size_t i = 0; i < snapshot.nameCount(); ++i) {
+        remap.push_back(directory.intern(snapshot.str(snapshot.name(i))));
+    }
+    for (size_t i = 0; i < snapshot.userCount(); ++i) {
+        const SnapshotUser &user = snapshot.user(i);
+        if (user.name < remap.size()) {
+            accounts.add(make_unique<Buyer>(directory.name(remap[user.name]), static_cast<size_t>(user.passwordHash)));
+        }
+    }
+    auction.adopt(snapshot, remap);
+}
+
+// false, если снимка нет или он не читается: тогда состояние грузится из .txt.
+// В walLsn — номер последней записи журнала, которую снимок уже отражает.
+bool loadSnapshot(Auction &auction, Accounts &accounts, const string &filename, uint64_t *walLsn = nullptr) {
+    metrics::Timer timer(metrics::Op::Load);
+    std::shared_ptr<const SnapshotFile> snapshot = SnapshotFile::open(filename);
+    if (!snapshot) {
+        return false;
+    }
+    if (walLsn) {
+        *walLsn = snapshot->walLsn();
+    }
+    attachSnapshotFile(auction, accounts, move(snapshot));
+    return true;
+}
+
+// Опубликованная контрольная точка: поколения файлов разделов в каталоге и
+// сегмент журнала, после которого продолжается восстановление. Хранится
+// текстом в <каталог>/manifest:
+//
+//   auction-checkpoint 1
+//   generation <N>    segment <N>    next-item <ID>    users <число>
+//   items <раздел> <поколение>       (по строке на раздел лотов)
+//   users-part <раздел> <поколение>  (по строке на раздел пользователей)
+struct CheckpointManifest {
+    uint64_t generation = 0;
+    uint64_t segment = 0;
+    ItemId nextItemId = 1;
+    uint64_t users = 0;
+    std::map<uint64_t, uint64_t> items;
+    std::map<uint64_t, uint64_t> userParts;
+};
+
+// Фоновые контрольные точки в каталоге dir вместо полного снимка при выходе.
+// Точка закрывает сегмент журнала, забирает отметки изменённых разделов и
+// переписывает только их, так что объём записи зависит от числа изменений,
+// а не от размера каталога. Раздел лотов копируется под короткими
+// блокировками отдельных лотов, а файл пишется уже без блокировок: ставки
+// не останавливаются. Пользователи только добавляются, поэтому их разделы
+// (kSpan регистраций подряд) переписываются начиная с последнего неполного.
+// Разделы пишутся под именами нового поколения, затем через rename
+// подменяется manifest, и только после этого удаляются прежние файлы и
+// закрытые сегменты журнала: при сбое на диске остаётся прежняя точка целиком.
+class Checkpointer {
+private:
+    static constexpr uint64_t kSpan = DirtyPartitions::kSpan;
+
+    Auction &auction;
+    const Accounts &accounts;
+    WriteAheadLog &wal;
+    string dir;
+    string walPath;
+    std::chrono::milliseconds period;
+    // Одна точка за раз: фоновая или последняя при выходе.
+    std::mutex runMutex;
+    CheckpointManifest published;
+    std::atomic<uint64_t> lastBytes{0};
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;
+
+    static string partPath(const string &dir, const char *kind, uint64_t partition, uint64_t generation) {
+        return dir + "/" + kind + "-" + std::to_string(partition) + "." + std::to_string(generation);
+    }
+
+    static bool readManifest(const string &path, CheckpointManifest &manifest) {
+        std::ifstream inFile(path);
+        string magic;
+        unsigned version = 0;
+        if (!(inFile >> magic >> version) || magic != "auction-checkpoint" || version != 1) {
+            return false;
+        }
+        string key;
+        while (inFile >> key) {
+            uint64_t partition = 0;
+            uint64_t generation = 0;
+            if (key == "generation") {
+                inFile >> manifest.generation;
+            } else if (key == "segment") {
+                inFile >> manifest.segment;
+            } else if (key == "next-item") {
+                inFile >> manifest.nextItemId;
+            } else if (key == "users") {
+                inFile >> manifest.users;
+            } else if (key == "items" && inFile >> partition >> generation) {
+                manifest.items[partition] = generation;
+            } else if (key == "users-part" && inFile >> partition >> generation) {
+                manifest.userParts[partition] = generation;
+            } else {
+                return false;
+            }
+        }
+        return inFile.eof() && !inFile.bad();
+    }
+
+    bool writeManifest(const CheckpointManifest &manifest) const {
+        string path = dir + "/manifest";
+        aio::File file(path);
+        std::ostream outFile(&file);
+        outFile << "auction-checkpoint 1\n"
+                << "generation " << manifest.generation << "\nsegment " << manifest.segment << "\nnext-item "
+                << manifest.nextItemId << "\nusers " << manifest.users << "\n";
+        for (const auto &part : manifest.items) {
+            outFile << "items " << part.first << ' ' << part.second << "\n";
+        }
+        for (const auto &part : manifest.userParts) {
+            outFile << "users-part " << part.first << ' ' << part.second << "\n";
+        }
+        return file.isOpen() && outFile && file.commit();
+    }
+
+    // Удаляет из каталога файлы, не упомянутые в manifest: разделы точки,
+    // которую не успели опубликовать, и недописанные .tmp.
+    static void sweep(const string &dir, const CheckpointManifest &manifest) {
+        std::set<string> keep = {"manifest"};
+        for (const auto &part : manifest.items) {
+            keep.insert("items-" + std::to_string(part.first) + "." + std::to_string(part.second));
+        }
+        for (const auto &part : manifest.userParts) {
+            keep.insert("users-" + std::to_string(part.first) + "." + std::to_string(part.second));
+        }
+        DIR *listing = ::opendir(dir.c_str());
+        if (!listing) {
+            return;
+        }
+        while (dirent *entry = ::readdir(listing)) {
+            string name = entry->d_name;
+            if (name != "." && name != ".." && !keep.count(name)) {
+                ::unlink((dir + "/" + name).c_str());
+            }
+        }
+        ::closedir(listing);
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, period, [this] { return stopping; })) {
+            lock.unlock();
+            checkpoint();
+            lock.lock();
+        }
+    }
+
+public:
+    static bool exists(const string &dir) { return ::access((dir + "/manifest").c_str(), F_OK) == 0; }
+
+    // Поднимает разделы точки; журнал после manifest.segment проигрывает
+    // вызывающий. false — manifest или раздел не читается.
+    static bool load(Auction &auction, Accounts &accounts, const string &dir, CheckpointManifest &manifest) {
+        metrics::Timer timer(metrics::Op::Load);
+        if (!readManifest(dir + "/manifest", manifest)) {
+            return false;
+        }
+        accounts.reserve(manifest.users);
+        for (const auto &part : manifest.userParts) {
+            std::shared_ptr<const SnapshotFile> file = SnapshotFile::open(partPath(dir, "users", part.first, part.second));
+            if (!file) {
+                return false;
+            }
+            attachSnapshotFile(auction, accounts, move(file));
+        }
+        for (const auto &part : manifest.items) {
+            std::shared_ptr<const SnapshotFile> file = SnapshotFile::open(partPath(dir, "items", part.first, part.second));
+            if (!file) {
+                return false;
+            }
+            attachSnapshotFile(auction, accounts, move(file));
+        }
+        Item::reserveId(manifest.nextItemId - 1);
+        auction.forgetChanges();
+        sweep(dir, manifest);
+        return true;
+    }
+
+    // every == 0 — без фонового потока, точки только по вызову checkpoint().
+    Checkpointer(Auction &target, const Accounts &users, WriteAheadLog &log, string directory, string logPath,
+                 CheckpointManifest manifest, std::chrono::milliseconds every)
+        : auction(target), accounts(users), wal(log), dir(std::move(directory)), walPath(std::move(logPath)),
+          period(every), published(std::move(manifest)) {
+        ::mkdir(dir.c_str(), 0755);
+        if (period.count() > 0) {
+            worker = std::thread(&Checkpointer::loop, this);
+        }
+    }
+    Checkpointer(const Checkpointer &) = delete;
+    Checkpointer &operator=(const Checkpointer &) = delete;
+    ~Checkpointer() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // Байт в файлах разделов последней опубликованной точки.
+    uint64_t lastWrittenBytes() const { return lastBytes.load(); }
+
+    // false, если точку не удалось опубликовать; тогда её разделы остаются
+    // отмеченными, а журнал — нетронутым до следующей попытки.
+    bool checkpoint() {
+        std::lock_guard<std::mutex> run(runMutex);
+        if (!auction.hasChanges() && accounts.size() == published.users) {
+            return true;
+        }
+        metrics::Timer timer(metrics::Op::Checkpoint);
+        CheckpointManifest next = published;
+        ++next.generation;
+        Auction::CheckpointCut cut = auction.beginCheckpoint([this] { return wal.rotate(); });
+        if (cut.segment == 0 && wal.isOpen()) {
+            cerr << "Журнал недоступен, контрольная точка отложена." << endl;
+            auction.abandonCheckpoint(cut);
+            return false;
+        }
+        next.segment = cut.segment;
+        next.nextItemId = cut.nextItemId;
+        next.users = accounts.size();
+        // Разделы пишутся асинхронно: следующий раздел копируется, пока
+        // предыдущий уходит на диск, а их fsync идут одновременно. manifest
+        // пишется только после того, как все разделы легли под свои имена.
+        aio::Wait written;
+        for (size_t i = 0; i < cut.partitions.size(); ++i) {
+            uint64_t partition = cut.partitions[i];
+            SnapshotBuilder builder;
+            auction.capturePartition(cut, i, builder);
+            if (builder.empty()) {
+                next.items.erase(partition);
+                continue;
+            }
+            builder.write(partPath(dir, "items", partition, next.generation), cut.nextItemId, written.add());
+            next.items[partition] = next.generation;
+        }
+        for (uint64_t part = published.users / kSpan; next.users > published.users && part * kSpan < next.users;
+             ++part) {
+            SnapshotBuilder builder;
+            accounts.forRange(part * kSpan, (part + 1) * kSpan, [&builder](const Buyer &buyer) { builder.addUser(buyer); });
+            builder.write(partPath(dir, "users", part, next.generation), cut.nextItemId, written.add());
+            next.userParts[part] = next.generation;
+        }
+        int64_t bytes = written.wait();
+        if (bytes < 0 || !writeManifest(next)) {
+            cerr << "Не удалось записать контрольную точку в " << dir << "." << endl;
+            auction.abandonCheckpoint(cut);
+            sweep(dir, published);
+            return false;
+        }
+        for (const auto &part : published.items) {
+            auto it = next.items.find(part.first);
+            if (it == next.items.end() || it->second != part.second) {
+                ::unlink(partPath(dir, "items", part.first, part.second).c_str());
+            }
+        }
+        for (const auto &part : published.userParts) {
+            if (next.userParts[part.first] != part.second) {
+                ::unlink(partPath(dir, "users", part.first, part.second).c_str());
+            }
+        }
+        WriteAheadLog::dropSegments(walPath, cut.segment);
+        published = std::move(next);
+        lastBytes.store(static_cast<uint64_t>(bytes));
+        return true;
+    }
+};
+
+// Ведёт время аукциона по системным часам: сразу при создании и затем
+// каждые period миллисекунд, пока объект жив.
+class Ticker {
+private:
+    Auction &auction;
+    std::chrono::milliseconds period;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, period, [this] { return stopping; })) {
+            lock.unlock();
+            auction.advanceClock(wallMs());
+            lock.lock();
+        }
+    }
+
+public:
+    static uint64_t wallMs() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                         std::chrono::system_clock::now().time_since_epoch())
+                                         .count());
+    }
+
+    Ticker(Auction &target, std::chrono::milliseconds every = std::chrono::milliseconds(10))
+        : auction(target), period(every) {
+        auction.advanceClock(wallMs());
+        worker = std::thread(&Ticker::loop, this);
+    }
+    Ticker(const Ticker &) = delete;
+    Ticker &operator=(const Ticker &) = delete;
+    ~Ticker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+};
+
+size_t residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+}
+
+// Держит размер процесса в бюджете: раз в period сверяет RSS с budget и
+// при превышении вытесняет в холодный ярус чаты, не тронутые с прошлой
+// проверки, на величину превышения с запасом в десятую часть бюджета.
+// Освобождённая куча возвращается системе через malloc_trim. Если память
+// занята не чатами, вытеснять становится нечего и проверки просто идут дальше.
+class ChatBudget {
+private:
+    Auction &auction;
+    size_t budget;
+    std::chrono::milliseconds period;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;
+
+    void loop() {
+        uint64_t previous = auction.chatTick();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, period, [this] { return stopping; })) {
+            lock.unlock();
+            uint64_t now = auction.chatTick();
+            enforce(previous);
+            previous = now;
+            lock.lock();
+        }
+    }
+
+public:
+    ChatBudget(Auction &target, size_t bytes, std::chrono::milliseconds every = std::chrono::seconds(1))
+        : auction(target), budget(bytes), period(every) {
+        worker = std::thread(&ChatBudget::loop, this);
+    }
+    ChatBudget(const ChatBudget &) = delete;
+    ChatBudget &operator=(const ChatBudget &) = delete;
+    ~ChatBudget() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // Одна проверка: чаты с отметкой обращения меньше olderThan могут уйти
+    // в холодный ярус. Возвращает оценку освобождённой памяти.
+    size_t enforce(uint64_t olderThan) {
+        size_t rss = residentBytes();
+        if (rss <= budget) {
+            return 0;
+        }
+        size_t freed = auction.freezeChats(rss - budget + budget / 10, olderThan);
+        if (freed) {
+            ::malloc_trim(0);
+        }
+        return freed;
+    }
+};
+
+// Кольцо согласованного хеширования лотов по процессам-шардам: у каждого
+// шарда kVnodes точек на кольце, лот принадлежит шарду первой точки не
+// меньше хеша его ID. При добавлении шарда к нему переходит около 1/N лотов,
+// и только от прежних владельцев. Кольцо зависит лишь от числа шардов,
+// поэтому маршрутизатор и шарды строят его одинаково.
+class HashRing {
+private:
+    vector<pair<uint64_t, uint32_t>> points;
+    size_t shardCount = 0;
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+public:
+    static constexpr size_t kVnodes = 128;
+
+    explicit HashRing(size_t shards) : shardCount(shards) {
+        points.reserve(shards * kVnodes);
+        for (uint32_t shard = 0; shard < shards; ++shard) {
+            for (uint64_t v = 0; v < kVnodes; ++v) {
+                points.emplace_back(mix(uint64_t(shard) << 32 | v | uint64_t(1) << 63), shard);
+            }
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    size_t size() const { return shardCount; }
+
+    size_t owner(ItemId itemId) const {
+        auto it = std::lower_bound(points.begin(), points.end(), pair<uint64_t, uint32_t>(mix(itemId), 0));
+        return it == points.end() ? points.front().second : it->second;
+    }
+};
+
+// Пакетный режим: поток текстовых команд, по одной на строку, без меню и
+// подсказок. Разбор идёт в отдельном потоке и опережает исполнение на
+// несколько пачек; ответы пишутся через один буферизованный вывод.
+//
+//   register <имя> <пароль>      login <имя> <пароль>      logout
+//   add <название> <цена> [секунд до конца торгов] [резервная цена]
+//   bid <название|#ID> <цена>    proxy <название|#ID> <максимум>    buy <название|#ID>
+//   msg <ID> <текст до конца строки>
+//   list [после ID] [сколько]    range <от> <до> [сколько]    top <сколько>
+//   seller <имя> <сколько>       chats [после ID] [сколько]   ending <сколько>
+//   chat <ID> [сколько]          bids <ID> [сколько]      stats [json]
+//   search <сколько> <запрос до конца строки>
+//   watch <ID|@продавец>        unwatch <ID|@продавец>    events [сколько]
+//
+// Процесс-шард за маршрутизатором (serve --shard) понимает ещё служебные
+// команды; клиентам они не нужны:
+//
+//   as <имя|->                   — действовать от имени пользователя без пароля
+//   put <ID> <название> <цена> [секунд] [резерв]  — add с ID от маршрутизатора
+//   lookup <название>            — "ok <ID>" первого лота с таким названием
+//   next                         — "ok <ID>", следующий свободный ID лота
+//   export <файл> users          — пользователи в файл
+//   export <файл> <шардов> <номер> — вынуть в файл лоты, которые в кольце из
+//                                  <шардов> принадлежат шарду <номер>
+//   import <файл>                — принять вынутое export
+//
+// На каждую команду одна строка ответа: "ok ...", "low <цена>" или
+// "err <причина>"; на ставку "ok <цена>" — участник лидирует, "low <цена>" —
+// ставка ниже цены или её перебила заявка с автоповышением. Выдачи списков
+// идут строками "item <ID> <цена> <продавец> <название>", "ends <ID> <мс до
+// конца торгов> <цена> <продавец> <название>", "chat <ID>
+// <отправитель> <число сообщений>", "msg <отправитель> <текст>", "bid
+// <участник> <цена> <мс> <manual|auto>" (от новых к старым) или строками
+// метрик и заканчиваются "end <число>". list и chats идут по возрастанию ID
+// лота; продолжение выдачи — та же команда с последним полученным ID.
+// events забирает накопившиеся уведомления по лотам и продавцам, на
+// которые подписан участник, строками "event <price|sold|closed|message>
+// <ID> <цена> <лидер|-> <слито событий>"; ставка сама подписывает участника
+// на лот.
+// Пустые строки и строки, начинающиеся с '#', пропускаются.
+namespace batch {
+
+enum class Op : uint8_t {
+    Register, Login, Logout, Add, Bid, Proxy, Buy, Message, List, Chats, Range, Top, Seller, Ending, Chat, Bids,
+    Search, Watch, Unwatch, Events, Stats, As, Put, Lookup, Next, Export, Import, Invalid
+};
+
+// Строковые поля указывают в текст пачки, из которой команда разобрана.
+struct Command {
+    Op op = Op::Invalid;
+    std::string_view name;
+    std::string_view text;
+    ItemId id = kNoItem;
+    double price = 0;
+    double maxPrice = 0;
+    size_t count = 0;
+};
+
+struct Batch {
+    string text;
+    vector<Command> commands;
+};
+
+std::string_view nextToken(std::string_view &rest) {
+    size_t begin = rest.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos) {
+        rest = {};
+        return {};
+    }
+    size_t end = rest.find_first_of(" \t\r", begin);
+    std::string_view token = rest.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+    rest.remove_prefix(end == std::string_view::npos ? rest.size() : end);
+    return token;
+}
+
+bool parseTarget(std::string_view token, Command &command) {
+    if (token.size() > 1 && token[0] == '#') {
+        return csv::parseNumber(token.substr(1), command.id);
+    }
+    command.name = token;
+    return !token.empty();
+}
+
+Command parse(std::string_view line) {
+    Command command;
+    std::string_view rest = line;
+    std::string_view verb = nextToken(rest);
+    bool ok = true;
+    auto next = [&rest] { return nextToken(rest); };
+    if (verb == "register" || verb == "login") {
+        command.op = verb == "login" ? Op::Login : Op::Register;
+        command.name = next();
+        command.text = next();
+        ok = !command.name.empty() && !command.text.empty();
+    } else if (verb == "logout") {
+        command.op = Op::Logout;
+    } else if (verb == "add" || verb == "put") {
+        command.op = verb == "add" ? Op::Add : Op::Put;
+        ok = command.op == Op::Add || csv::parseNumber(next(), command.id);
+        command.name = next();
+        ok = ok && !command.name.empty() && csv::parseNumber(next(), command.price);
+        std::string_view duration = next();
+        ok = ok && (duration.empty() || csv::parseNumber(duration, command.count));
+        std::string_view reserve = next();
+        ok = ok && (reserve.empty() || csv::parseNumber(reserve, command.maxPrice));
+    } else if (verb == "bid" || verb == "proxy") {
+        command.op = verb == "bid" ? Op::Bid : Op::Proxy;
+        ok = parseTarget(next(), command) && csv::parseNumber(next(), command.price);
+    } else if (verb == "buy") {
+        command.op = Op::Buy;
+        ok = parseTarget(next(), command);
+    } else if (verb == "msg" || verb == "search") {
+        command.op = verb == "msg" ? Op::Message : Op::Search;
+        ok = verb == "msg" ? csv::parseNumber(next(), command.id) : csv::parseNumber(next(), command.count);
+        size_t begin = rest.find_first_not_of(" \t");
+        command.text = begin == std::string_view::npos ? std::string_view() : rest.substr(begin);
+        if (!command.text.empty() && command.text.back() == '\r') {
+            command.text.remove_suffix(1);
+        }
+    } else if (verb == "list" || verb == "chats") {
+        command.op = verb == "list" ? Op::List : Op::Chats;
+        command.count = SIZE_MAX;
+        std::string_view after = next();
+        ok = after.empty() || csv::parseNumber(after, command.id);
+        std::string_view limit = next();
+        ok = ok && (limit.empty() || csv::parseNumber(limit, command.count));
+    } else if (verb == "range") {
+        command.op = Op::Range;
+        command.count = SIZE_MAX;
+        ok = csv::parseNumber(next(), command.price) && csv::parseNumber(next(), command.maxPrice);
+        std::string_view limit = next();
+        ok = ok && (limit.empty() || csv::parseNumber(limit, command.count));
+    } else if (verb == "top") {
+        command.op = Op::Top;
+        ok = csv::parseNumber(next(), command.count);
+    } else if (verb == "seller") {
+        command.op = Op::Seller;
+        command.name = next();
+        ok = !command.name.empty() && csv::parseNumber(next(), command.count);
+    } else if (verb == "ending") {
+        command.op = Op::Ending;
+        ok = csv::parseNumber(next(), command.count);
+    } else if (verb == "chat" || verb == "bids") {
+        command.op = verb == "chat" ? Op::Chat : Op::Bids;
+        command.count = 20;
+        ok = csv::parseNumber(next(), command.id);
+        std::string_view limit = next();
+        ok = ok && (limit.empty() || csv::parseNumber(limit, command.count));
+    } else if (verb == "watch" || verb == "unwatch") {
+        command.op = verb == "watch" ? Op::Watch : Op::Unwatch;
+        std::string_view target = next();
+        if (target.size() > 1 && target[0] == '@') {
+            command.name = target.substr(1);
+        } else {
+            ok = csv::parseNumber(target, command.id);
+        }
+    } else if (verb == "events") {
+        command.op = Op::Events;
+        command.count = 20;
+        std::string_view limit = next();
+        ok = limit.empty() || csv::parseNumber(limit, command.count);
+    } else if (verb == "stats") {
+        command.op = Op::Stats;
+        command.name = next();
+        ok = command.name.empty() || command.name == "json";
+    } else if (verb == "as" || verb == "lookup" || verb == "import") {
+        command.op = verb == "as" ? Op::As : verb == "lookup" ? Op::Lookup : Op::Import;
+        command.name = next();
+        ok = !command.name.empty();
+    } else if (verb == "next") {
+        command.op = Op::Next;
+    } else if (verb == "export") {
+        command.op = Op::Export;
+        command.name = next();
+        command.text = next();
+        ok = !command.name.empty() &&
+             (command.text == "users" || (csv::parseNumber(command.text, command.count) &&
+                                          csv::parseNumber(next(), command.id) && command.id < command.count));
+    }
+    if (!ok) {
+        command.op = Op::Invalid;
+    }
+    if (command.op == Op::Invalid) {
+        command.text = line;
+    }
+    return command;
+}
+
+// Перебирает строки text без ведущих пробелов; text должен кончаться
+// переводом строки или целой командой. Пустые строки и комментарии пропускаются.
+template <typename Visit> void forEachLine(std::string_view text, Visit visit) {
+    while (!text.empty()) {
+        size_t newline = text.find('\n');
+        std::string_view line = text.substr(0, newline);
+        text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin != std::string_view::npos && line[begin] != '#') {
+            visit(line.substr(begin));
+        }
+    }
+}
+
+template <typename Visit> void forEachCommand(std::string_view text, Visit visit) {
+    forEachLine(text, [&visit](std::string_view line) { visit(parse(line)); });
+}
+
+// Ограниченная очередь пачек между потоком разбора и исполнителем.
+class BatchQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<unique_ptr<Batch>> batches;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit BatchQueue(size_t maxBatches) : capacity(maxBatches) {}
+
+    void push(unique_ptr<Batch> batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return batches.size() < capacity; });
+        batches.push_back(move(batch));
+        notEmpty.notify_one();
+    }
+
+    // nullptr — поток команд закончился.
+    unique_ptr<Batch> pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !batches.empty(); });
+        if (batches.empty()) {
+            return nullptr;
+        }
+        unique_ptr<Batch> batch = move(batches.front());
+        batches.pop_front();
+        notFull.notify_one();
+        return batch;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_one();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return batches.size();
+    }
+};
+
+// Читает вход кусками и режет их по последнему переводу строки; хвост
+// незаконченной строки переходит в следующую пачку.
+void readCommands(int fd, BatchQueue &queue) {
+    const size_t kChunkSize = 1 << 20;
+    string carry;
+    bool eof = false;
+    while (!eof) {
+        auto batch = make_unique<Batch>();
+        string &text = batch->text;
+        text.swap(carry);
+        size_t old = text.size();
+        text.resize(old + kChunkSize);
+        ssize_t got;
+        do {
+            got = ::read(fd, &text[old], kChunkSize);
+        } while (got < 0 && errno == EINTR);
+        eof = got <= 0;
+        text.resize(old + (eof ? 0 : static_cast<size_t>(got)));
+        size_t cut = text.size();
+        if (!eof) {
+            size_t newline = text.rfind('\n');
+            cut = newline == string::npos ? 0 : newline + 1;
+        }
+        carry.assign(text, cut, string::npos);
+        text.resize(cut);
+
+        forEachCommand(text, [&batch](const Command &command) { batch->commands.push_back(command); });
+        if (!batch->commands.empty()) {
+            queue.push(move(batch));
+        }
+    }
+    queue.close();
+}
+
+struct Result {
+    size_t commands = 0;
+    size_t failures = 0;
+};
+
+// Состояние одного клиента: вошедший пользователь и счётчики команд.
+// Маршрутизатор учётных записей не держит и помнит только имя.
+struct Session {
+    const Buyer *user = nullptr;
+    string name;
+    Result result;
+};
+
+// Обработчик строк протокола для сервера: исполнитель в этом процессе или
+// маршрутизатор к процессам-шардам. Ответ дописывается в out сразу или в
+// finish(), который сервер вызывает, разобрав все готовые соединения;
+// до finish() сервер соединений не закрывает.
+class Handler {
+public:
+    virtual ~Handler() = default;
+    virtual void handle(std::string_view line, Session &session, OutputBuffer &out) = 0;
+    virtual void finish() {}
+};
+
+// Исполняет команды всех сеансов над общим аукционом и списком
+// пользователей. Буферы страниц у исполнителя общие, поэтому он
+// вызывается из одного потока.
+class Executor : public Handler {
+private:
+    Auction &auction;
+    Accounts &accounts;
+    // Служебные команды шарда; persist сохраняет состояние после переноса лотов.
+    bool internal = false;
+    std::function<bool()> persist;
+    vector<Message> page;
+    vector<ItemListing> rows;
+    vector<ChatSummary> chatRows;
+    vector<watch::Event> notices;
+
+    static void fail(Session &session, OutputBuffer &out, std::string_view reason) {
+        out << "err " << reason << '\n';
+        ++session.result.failures;
+    }
+
+    // Изменение нельзя подтверждать, если журнал отказал: при
+    // --fsync=always оно могло не попасть на диск, а следующие не попадут
+    // точно. Accounts и Auction пишут в один журнал.
+    bool durable(Session &session, OutputBuffer &out) {
+        if (auction.logFailed()) {
+            fail(session, out, "журнал не записан");
+            return false;
+        }
+        return true;
+    }
+
+    static void row(OutputBuffer &out, const ItemListing &item) {
+        out << "item " << item.id << ' ' << Item::fromCents(item.cents) << ' '
+            << UserDirectory::instance().name(item.owner) << ' ' << item.name << '\n';
+    }
+
+    static void listing(OutputBuffer &out, const vector<ItemListing> &listings) {
+        for (const auto &item : listings) {
+            row(out, item);
+        }
+        out << "end " << uint64_t(listings.size()) << '\n';
+    }
+
+    void exportFile(const Command &command, Session &session, OutputBuffer &out) {
+        SnapshotBuilder builder;
+        size_t items = 0;
+        size_t chats = 0;
+        string path(command.name);
+        bool written = false;
+        if (command.text == "users") {
+            accounts.forEach([&builder](const Buyer &buyer) { builder.addUser(buyer); });
+            written = builder.write(path, 1);
+        } else {
+            HashRing ring(command.count);
+            size_t target = command.id;
+            std::tie(items, chats) = auction.extract([&ring, target](ItemId id) { return ring.owner(id) == target; },
+                                                     builder, [&builder, &path, &written] {
+                                                         written = builder.write(path, 1);
+                                                         return written;
+                                                     });
+        }
+        if (!written) {
+            fail(session, out, "не удалось записать файл");
+            return;
+        }
+        if ((items || chats) && !persist()) {
+            fail(session, out, "не удалось сохранить состояние");
+            return;
+        }
+        out << "ok " << uint64_t(items) << ' ' << uint64_t(chats) << '\n';
+    }
+
+    void importFile(const Command &command, Session &session, OutputBuffer &out) {
+        std::shared_ptr<const SnapshotFile> file = SnapshotFile::open(string(command.name));
+        if (!file) {
+            fail(session, out, "файл не читается");
+            return;
+        }
+        adoptSnapshotFile(auction, accounts, *file);
+        if (!persist()) {
+            fail(session, out, "не удалось сохранить состояние");
+            return;
+        }
+        out << "ok " << uint64_t(file->itemCount()) << ' ' << uint64_t(file->chatCount()) << '\n';
+    }
+
+public:
+    Executor(Auction &target, Accounts &users) : auction(target), accounts(users) {}
+
+    // Включает служебные команды шарда; save делает состояние долговечным.
+    void allowInternal(std::function<bool()> save) {
+        internal = true;
+        persist = move(save);
+    }
+
+    void handle(std::string_view line, Session &session, OutputBuffer &out) override {
+        execute(parse(line), session, out);
+    }
+
+    void execute(const Command &command, Session &session, OutputBuffer &out) {
+        ++session.result.commands;
+        const Buyer *&user = session.user;
+        if (!internal && command.op >= Op::As && command.op < Op::Invalid) {
+            fail(session, out, "служебная команда шарда");
+            return;
+        }
+        bool needsUser = command.op == Op::Add || command.op == Op::Put || command.op == Op::Bid ||
+                         command.op == Op::Proxy || command.op == Op::Buy || command.op == Op::Message ||
+                         command.op == Op::Watch || command.op == Op::Unwatch || command.op == Op::Events;
+        if (needsUser && !user) {
+            fail(session, out, "требуется вход");
+            return;
+        }
+        bool mutates = command.op == Op::Register || command.op == Op::Add || command.op == Op::Put ||
+                       command.op == Op::Bid || command.op == Op::Proxy || command.op == Op::Buy ||
+                       command.op == Op::Message;
+        if (mutates && !durable(session, out)) {
+            return;
+        }
+        switch (command.op) {
+        case Op::Register:
+            if (!UserDirectory::instance().accepts(command.name)) {
+                fail(session, out, "справочник пользователей переполнен");
+                return;
+            }
+            if (!accounts.registerUser(string(command.name), string(command.text))) {
+                fail(session, out, "имя занято");
+                return;
+            }
+            if (!durable(session, out)) {
+                return;
+            }
+            out << "ok\n";
+            break;
+        case Op::Login: {
+            const Buyer *found = accounts.login(string(command.name), string(command.text));
+            if (!found) {
+                fail(session, out, "неверное имя пользователя или пароль");
+                return;
+            }
+            user = found;
+            out << "ok\n";
+            break;
+        }
+        case Op::Logout:
+            user = nullptr;
+            out << "ok\n";
+            break;
+        case Op::Add:
+        case Op::Put: {
+            uint64_t endsAt = command.count ? auction.now() + command.count * 1000 : 0;
+            ItemId id = auction.addItem({command.id, string(command.name), command.price, user->getId(),
+                                         Item::kNoBidder, endsAt, command.maxPrice});
+            if (id == kNoItem) {
+                fail(session, out, "ID занят");
+                return;
+            }
+            if (!durable(session, out)) {
+                return;
+            }
+            out << "ok " << id << '\n';
+            break;
+        }
+        case Op::Bid:
+        case Op::Proxy: {
+            double current = 0;
+            bool proxy = command.op == Op::Proxy;
+            BidStatus status =
+                command.id == kNoItem
+                    ? auction.placeBid(string(command.name), command.price, &current, user->getId(), proxy)
+                : proxy ? auction.placeProxyBid(command.id, command.price, &current, user->getId())
+                        : auction.placeBid(command.id, command.price, &current, user->getId());
+            if (status == BidStatus::NotFound) {
+                fail(session, out, "товар не найден");
+            } else if (status == BidStatus::Closed) {
+                fail(session, out, "торги завершены");
+            } else if (durable(session, out)) {
+                out << (status == BidStatus::Accepted ? "ok " : "low ") << current << '\n';
+            }
+            break;
+        }
+        case Op::Buy: {
+            double price = 0;
+            bool bought = command.id != kNoItem ? auction.removeItem(command.id, &price)
+                                                : auction.removeItem(string(command.name), &price);
+            if (!bought) {
+                fail(session, out, "товар не найден");
+            } else if (durable(session, out)) {
+                out << "ok " << price << '\n';
+            }
+            break;
+        }
+        case Op::Message:
+            if (!auction.sendMessage(user->getUsername(), string(command.text), command.id)) {
+                fail(session, out, "чат не читается");
+                return;
+            }
+            if (durable(session, out)) {
+                out << "ok\n";
+            }
+            break;
+        case Op::List: {
+            size_t count = 0;
+            ItemId cursor = command.id;
+            do {
+                cursor = auction.listItems(cursor, std::min(Auction::kListPage, command.count - count), rows);
+                for (const auto &item : rows) {
+                    row(out, item);
+                }
+                count += rows.size();
+            } while (cursor != kNoItem && count < command.count);
+            out << "end " << uint64_t(count) << '\n';
+            break;
+        }
+        case Op::Chats: {
+            // Предел считается в чатах, а строк в чате по числу отправителей.
+            size_t chats = 0;
+            uint64_t lines = 0;
+            ItemId cursor = command.id;
+            do {
+                cursor = auction.listChats(cursor, std::min(Auction::kListPage, command.count - chats), chatRows);
+                for (size_t i = 0; i < chatRows.size(); ++i) {
+                    const ChatSummary &chat = chatRows[i];
+                    chats += i == 0 || chat.itemId != chatRows[i - 1].itemId;
+                    out << "chat " << chat.itemId << ' ' << UserDirectory::instance().name(chat.sender) << ' '
+                        << uint64_t(chat.count) << '\n';
+                }
+                lines += chatRows.size();
+            } while (cursor != kNoItem && chats < command.count);
+            out << "end " << lines << '\n';
+            break;
+        }
+        case Op::Range:
+            listing(out, auction.itemsInPriceRange(command.price, command.maxPrice, command.count));
+            break;
+        case Op::Top:
+            listing(out, auction.mostExpensive(command.count));
+            break;
+        case Op::Seller:
+            listing(out, auction.cheapestBySeller(string(command.name), command.count));
+            break;
+        case Op::Ending: {
+            vector<ItemListing> listings = auction.endingSoonest(command.count);
+            uint64_t now = auction.now();
+            for (const auto &item : listings) {
+                out << "ends " << item.id << ' ' << (item.endsAt > now ? item.endsAt - now : 0) << ' '
+                    << Item::fromCents(item.cents) << ' ' << UserDirectory::instance().name(item.owner) << ' '
+                    << item.name << '\n';
+            }
+            out << "end " << uint64_t(listings.size()) << '\n';
+            break;
+        }
+        case Op::Search:
+            listing(out, auction.searchItems(command.text, command.count));
+            break;
+        case Op::Chat:
+            page.clear();
+            auction.chatHistory(command.id, Auction::kChatEnd, command.count, page);
+            for (const auto &message : page) {
+                out << "msg " << message.getFromUser() << ' ' << message.getContent() << '\n';
+            }
+            out << "end " << uint64_t(page.size()) << '\n';
+            break;
+        case Op::Bids: {
+            vector<BidBook::Entry> entries = auction.bidHistory(command.id, command.count);
+            for (const auto &entry : entries) {
+                out << "bid " << UserDirectory::instance().name(entry.bidder) << ' ' << Item::fromCents(entry.cents)
+                    << ' ' << entry.time << (entry.proxy ? " auto" : " manual") << '\n';
+            }
+            out << "end " << uint64_t(entries.size()) << '\n';
+            break;
+        }
+        case Op::Watch:
+        case Op::Unwatch: {
+            watch::Dispatcher *events = auction.eventDispatcher();
+            if (!events) {
+                fail(session, out, "уведомления отключены");
+                return;
+            }
+            bool on = command.op == Op::Watch;
+            bool changed = false;
+            if (command.name.empty()) {
+                // Отписаться от уже проданного лота можно, подписаться — нет.
+                if (on && !auction.hasItem(command.id)) {
+                    fail(session, out, "товар не найден");
+                    return;
+                }
+                changed = on ? events->watchItem(user->getId(), command.id)
+                             : events->unwatchItem(user->getId(), command.id);
+                if (!changed && !on && !auction.hasItem(command.id)) {
+                    fail(session, out, "товар не найден");
+                    return;
+                }
+            } else {
+                UserId seller = UserDirectory::instance().find(command.name);
+                if (seller == kNoUser) {
+                    fail(session, out, "продавец не найден");
+                    return;
+                }
+                changed = on ? events->watchSeller(user->getId(), seller) : events->unwatchSeller(user->getId(), seller);
+            }
+            out << (changed ? "ok\n" : "ok без изменений\n");
+            break;
+        }
+        case Op::Events: {
+            watch::Dispatcher *events = auction.eventDispatcher();
+            if (!events) {
+                fail(session, out, "уведомления отключены");
+                return;
+            }
+            notices.clear();
+            events->poll(user->getId(), notices, command.count);
+            for (const auto &event : notices) {
+                out << "event " << watch::kindName(event.kind) << ' ' << event.itemId << ' '
+                    << Item::fromCents(event.cents) << ' '
+                    << (event.leader != kNoUser ? std::string_view(UserDirectory::instance().name(event.leader))
+                                                : std::string_view("-"))
+                    << ' ' << uint64_t(event.merged) << '\n';
+            }
+            out << "end " << uint64_t(notices.size()) << '\n';
+            break;
+        }
+        case Op::Stats: {
+            metrics::Summary summary = metrics::collect();
+            string text = command.name == "json" ? metrics::formatJson(summary) : metrics::formatText(summary);
+            out << text << "end " << uint64_t(std::count(text.begin(), text.end(), '\n')) << '\n';
+            break;
+        }
+        case Op::As:
+            user = command.name == "-" ? nullptr : accounts.find(command.name);
+            if (!user && command.name != "-") {
+                fail(session, out, "пользователь не найден");
+                return;
+            }
+            out << "ok\n";
+            break;
+        case Op::Lookup: {
+            ItemId id = auction.findItemId(string(command.name));
+            if (id == kNoItem) {
+                fail(session, out, "товар не найден");
+                return;
+            }
+            out << "ok " << id << '\n';
+            break;
+        }
+        case Op::Next:
+            out << "ok " << Item::peekNextId() << '\n';
+            break;
+        case Op::Export:
+            exportFile(command, session, out);
+            break;
+        case Op::Import:
+            importFile(command, session, out);
+            break;
+        case Op::Invalid:
+            out << "err неизвестная команда: " << command.text << '\n';
+            ++session.result.failures;
+            break;
+        }
+    }
+};
+
+// Разбор в отдельном потоке, исполнение в вызывающем.
+Result run(Auction &auction, Accounts &accounts, int inFd, int outFd) {
+    BatchQueue queue(4);
+    metrics::Gauge depth("batch_queue_depth", [&queue] { return static_cast<double>(queue.size()); });
+    std::thread reader(readCommands, inFd, std::ref(queue));
+    BufferedWriter out(outFd);
+    Executor executor(auction, accounts);
+    Session session;
+    while (unique_ptr<Batch> batch = queue.pop()) {
+        for (const Command &command : batch->commands) {
+            executor.execute(command, session, out);
+        }
+    }
+    reader.join();
+    return session.result;
+}
+
+} // namespace batch
+
+// Сервер на Unix-сокете: один реактор на epoll обслуживает все соединения.
+// Запросы — строки того же протокола, что и в пакетном режиме, у каждого
+// соединения свой сеанс, поэтому клиенты входят независимо друг от друга.
+// Клиент может слать запросы, не дожидаясь ответов: они исполняются и
+// отвечаются по порядку. Реактор один, так как исполнитель однопоточный;
+// простаивающее соединение стоит только дескриптора и пустых буферов.
+namespace server {
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) { stopRequested = 1; }
+
+// Каждое соединение — дескриптор, поэтому мягкий лимит поднимается до жёсткого.
+void raiseFileLimit() {
+    rlimit limit{};
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+struct Connection {
+    int fd;
+    string input;
+    OutputBuffer output;
+    batch::Session session;
+    uint32_t events = 0;
+    // Клиент закрыл свою сторону: дописываем ответы и закрываем соединение.
+    bool closing = false;
+};
+
+class Reactor {
+private:
+    // Строка длиннее kMaxLine без перевода строки закрывает соединение; при
+    // неотправленных ответах больше kMaxBacklog новые запросы не читаются.
+    static constexpr size_t kMaxLine = 1 << 20;
+    static constexpr size_t kMaxBacklog = 1 << 20;
+
+    batch::Handler &handler;
+    string socketPath;
+    int listenFd = -1;
+    int epollFd = -1;
+    // Запасной дескриптор: при исчерпании лимита он освобождается, чтобы
+    // принять и сразу закрыть соединение, иначе listen-сокет будет будить цикл вечно.
+    int spareFd = -1;
+    unordered_map<int, unique_ptr<Connection>> connections;
+    // Соединения, получившие запросы в этом проходе цикла: ответы на них
+    // отправляются после handler.finish().
+    vector<int> touched;
+    // Копия connections.size() для датчика: его читают из другого потока.
+    std::atomic<uint64_t> openConnections{0};
+    metrics::Gauge connectionsGauge{"server_connections", [this] {
+                                        return static_cast<double>(openConnections.load(std::memory_order_relaxed));
+                                    }};
+
+    void watch(Connection &connection, uint32_t events) {
+        if (connection.events == events) {
+            return;
+        }
+        epoll_event event{};
+        event.events = events;
+        event.data.ptr = &connection;
+        ::epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+        connection.events = events;
+    }
+
+    void close(Connection &connection) {
+        ::epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.fd, nullptr);
+        ::close(connection.fd);
+        connections.erase(connection.fd);
+        openConnections.store(connections.size(), std::memory_order_relaxed);
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if ((errno == EMFILE || errno == ENFILE) && spareFd >= 0) {
+                    ::close(spareFd);
+                    fd = ::accept(listenFd, nullptr, nullptr);
+                    if (fd >= 0) {
+                        ::close(fd);
+                    }
+                    spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    continue;
+                }
+                return;
+            }
+            auto connection = make_unique<Connection>();
+            connection->fd = fd;
+            connection->events = EPOLLIN;
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.ptr = connection.get();
+            ::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+            connections.emplace(fd, move(connection));
+            openConnections.store(connections.size(), std::memory_order_relaxed);
+        }
+    }
+
+    // Передаёт обработчику все полные строки из входного буфера.
+    void process(Connection &connection) {
+        size_t end = connection.input.rfind('\n');
+        if (end == string::npos) {
+            return;
+        }
+        batch::forEachLine(std::string_view(connection.input.data(), end + 1), [&](std::string_view line) {
+            handler.handle(line, connection.session, connection.output);
+        });
+        connection.input.erase(0, end + 1);
+        touched.push_back(connection.fd);
+    }
+
+    // false — соединение закрыто.
+    bool flush(Connection &connection) {
+        size_t sent = 0;
+        while (sent < connection.output.size()) {
+            ssize_t written = ::send(connection.fd, connection.output.data() + sent, connection.output.size() - sent,
+                                     MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                close(connection);
+                return false;
+            }
+            sent += static_cast<size_t>(written);
+        }
+        connection.output.consume(sent);
+        if (connection.output.empty()) {
+            if (connection.closing) {
+                close(connection);
+                return false;
+            }
+            watch(connection, EPOLLIN);
+        } else {
+            bool reading = !connection.closing && connection.output.size() <= kMaxBacklog;
+            watch(connection, reading ? EPOLLIN | EPOLLOUT : EPOLLOUT);
+        }
+        return true;
+    }
+
+    // Закрывать соединение здесь нельзя: у обработчика могут быть
+    // отложенные ответы в его буфер. Оно закроется при отправке.
+    void onReadable(Connection &connection) {
+        char chunk[16384];
+        bool peerClosed = false;
+        while (connection.output.size() <= kMaxBacklog && !connection.closing) {
+            ssize_t got = ::read(connection.fd, chunk, sizeof(chunk));
+            if (got > 0) {
+                connection.input.append(chunk, static_cast<size_t>(got));
+                process(connection);
+                if (connection.input.size() > kMaxLine) {
+                    connection.input.clear();
+                    peerClosed = true;
+                    break;
+                }
+                continue;
+            }
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            peerClosed = got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+        connection.closing = connection.closing || peerClosed;
+        touched.push_back(connection.fd);
+    }
+
+    void onWritable(Connection &connection) {
+        if (flush(connection) && connection.output.empty() && !connection.input.empty()) {
+            process(connection);
+        }
+    }
+
+public:
+    explicit Reactor(batch::Handler &target) : handler(target) {}
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    ~Reactor() {
+        for (const auto &connection : connections) {
+            ::close(connection.first);
+        }
+        for (int fd : {listenFd, epollFd, spareFd}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        if (listenFd >= 0) {
+            ::unlink(socketPath.c_str());
+        }
+    }
+
+    bool listen(const string &path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            cerr << "Слишком длинный путь сокета: " << path << endl;
+            return false;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        ::unlink(path.c_str());
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listenFd, SOMAXCONN) != 0) {
+            cerr << "Не удалось открыть сокет " << path << ": " << std::strerror(errno) << endl;
+            return false;
+        }
+        socketPath = path;
+        epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        ::epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return true;
+    }
+
+    size_t connectionCount() const { return connections.size(); }
+
+    // Цикл событий; проверяет stop не реже раза в 200 мс.
+    void run(const volatile std::sig_atomic_t &stop) {
+        vector<epoll_event> events(1024);
+        while (!stop) {
+            int ready = ::epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 200);
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                cerr << "Ошибка epoll_wait: " << std::strerror(errno) << endl;
+                return;
+            }
+            for (int i = 0; i < ready; ++i) {
+                if (!events[i].data.ptr) {
+                    acceptAll();
+                    continue;
+                }
+                Connection &connection = *static_cast<Connection *>(events[i].data.ptr);
+                if (events[i].events & EPOLLOUT) {
+                    int fd = connection.fd;
+                    onWritable(connection);
+                    if (!connections.count(fd)) {
+                        continue;
+                    }
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    onReadable(connection);
+                }
+            }
+            handler.finish();
+            for (int fd : touched) {
+                auto it = connections.find(fd);
+                if (it != connections.end()) {
+                    flush(*it->second);
+                }
+            }
+            touched.clear();
+        }
+    }
+};
+
+} // namespace server
+
+// Горизонтальное деление аукциона по процессам на одной машине. Процесс-
+// маршрутизатор (./auction route) запускает N процессов-шардов, каждый —
+// обычный serve --shard в своём каталоге shard-<номер>, и делит между ними
+// лоты и чаты по ID через HashRing. Клиенты говорят с маршрутизатором на
+// том же протоколе, что и с сервером.
+//
+// Запросы одного прохода реактора копятся и уходят в каждый шард одной
+// записью, ответы собираются по порядку; запросы по ID идут в шард-владелец,
+// выдачи списков — во все шарды и сливаются по ID или цене. ID лотов выдаёт
+// маршрутизатор. Учётные записи есть в каждом шарде: регистрация рассылается
+// всем, вход проверяет шард 0, а в остальные запросы идут с "as <имя>".
+// Вход, регистрация и ставки по названию исполняются отдельно от пачки:
+// следующим запросам нужен их результат.
+//
+// "shard add" добавляет шард на ходу: маршрутизатор перестаёт принимать
+// запросы, новый шард получает пользователей и по кольцу из N+1 шардов
+// забирает свои лоты с чатами у прежних, после чего запросы идут по новому
+// кольцу. Число шардов хранится в router.shards.
+namespace shard {
+
+// Процесс-шард и соединение с ним. Ответы приходят в порядке запросов;
+// waiting — куда положить каждый из ещё не пришедших.
+struct Worker {
+    struct Reply {
+        string *text;
+        // Выдача списка: строки до "end ..." или "err ...".
+        bool listing;
+    };
+
+    pid_t pid = -1;
+    int fd = -1;
+    string pending;
+    string received;
+    std::deque<Reply> waiting;
+    // От чьего имени сейчас действует соединение.
+    string as;
+    bool failed = false;
+};
+
+class Router : public batch::Handler {
+private:
+    // Как собрать ответ клиенту из ответов шардов. All — ответ первого
+    // шарда, если все ответили успехом, иначе первая ошибка.
+    enum class Merge : uint8_t { Local, Single, First, All, ById, ByChat, Cheapest, Dearest, Concat, Stats };
+
+    struct Request {
+        OutputBuffer *out;
+        Merge merge = Merge::Local;
+        size_t limit = SIZE_MAX;
+        vector<string> parts;
+    };
+
+    static constexpr const char *kCountFile = "router.shards";
+
+    string home;
+    vector<Worker> workers;
+    HashRing ring{1};
+    ItemId nextId = 1;
+    std::deque<Request> round;
+    string discard;
+    metrics::Gauge shardsGauge{"shards", [this] { return static_cast<double>(ring.size()); }};
+
+    static string shardDir(size_t index) { return "shard-" + std::to_string(index); }
+
+    bool spawn(size_t index) {
+        string dir = shardDir(index);
+        ::mkdir(dir.c_str(), 0755);
+        pid_t pid = ::fork();
+        if (pid < 0) {
+            return false;
+        }
+        if (pid == 0) {
+            ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+            int log = ::open((dir + "/shard.log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (::chdir(dir.c_str()) != 0 || log < 0) {
+                ::_exit(127);
+            }
+            ::dup2(log, STDOUT_FILENO);
+            ::dup2(log, STDERR_FILENO);
+            ::execl("/proc/self/exe", "auction", "serve", "auction.sock", "--shard", static_cast<char *>(nullptr));
+            ::_exit(127);
+        }
+        Worker worker;
+        worker.pid = pid;
+        string path = dir + "/auction.sock";
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), std::min(path.size() + 1, sizeof(address.sun_path) - 1));
+        // Шард поднимает своё состояние и только потом слушает сокет.
+        for (int attempt = 0; attempt < 3000 && worker.fd < 0; ++attempt) {
+            int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0) {
+                ::fcntl(fd, F_SETFL, O_NONBLOCK);
+                worker.fd = fd;
+            } else {
+                ::close(fd);
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        if (worker.fd < 0) {
+            cerr << "Шард " << index << " не запустился, см. " << dir << "/shard.log" << endl;
+            ::kill(pid, SIGTERM);
+            ::waitpid(pid, nullptr, 0);
+            return false;
+        }
+        workers.push_back(std::move(worker));
+        return true;
+    }
+
+    void send(size_t shard, std::string_view line, string *reply, bool listing) {
+        Worker &worker = workers[shard];
+        worker.pending.append(line);
+        worker.pending.push_back('\n');
+        worker.waiting.push_back({reply, listing});
+    }
+
+    // Запрос от имени пользователя: сначала переключает соединение шарда.
+    void sendAs(size_t shard, const string &user, std::string_view line, string *reply, bool listing) {
+        if (workers[shard].as != user) {
+            workers[shard].as = user;
+            send(shard, "as " + (user.empty() ? string("-") : user), &discard, false);
+        }
+        send(shard, line, reply, listing);
+    }
+
+    // Раскладывает пришедшие строки по ожидающим ответам.
+    void consume(Worker &worker) {
+        size_t start = 0;
+        size_t newline;
+        while (!worker.waiting.empty() && (newline = worker.received.find('\n', start)) != string::npos) {
+            std::string_view line(worker.received.data() + start, newline + 1 - start);
+            Worker::Reply &reply = worker.waiting.front();
+            reply.text->append(line);
+            start = newline + 1;
+            if (!reply.listing || line.compare(0, 4, "end ") == 0 || line.compare(0, 4, "err ") == 0) {
+                worker.waiting.pop_front();
+            }
+        }
+        worker.received.erase(0, start);
+    }
+
+    // Отправляет накопленное во все шарды и ждёт всех ответов. Шарды пишут
+    // и читают параллельно, поэтому большая пачка не упирается во встречный
+    // буфер сокета.
+    void exchange() {
+        vector<pollfd> fds(workers.size());
+        while (true) {
+            size_t active = 0;
+            for (size_t i = 0; i < workers.size(); ++i) {
+                Worker &worker = workers[i];
+                fds[i] = {worker.fd, 0, 0};
+                if (worker.failed) {
+                    continue;
+                }
+                if (!worker.pending.empty()) {
+                    fds[i].events |= POLLOUT;
+                }
+                if (!worker.waiting.empty()) {
+                    fds[i].events |= POLLIN;
+                }
+                active += fds[i].events != 0;
+            }
+            if (active == 0) {
+                break;
+            }
+            if (::poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            char chunk[65536];
+            for (size_t i = 0; i < workers.size(); ++i) {
+                Worker &worker = workers[i];
+                if (fds[i].revents & POLLOUT) {
+                    ssize_t written = ::send(worker.fd, worker.pending.data(), worker.pending.size(), MSG_NOSIGNAL);
+                    if (written > 0) {
+                        worker.pending.erase(0, static_cast<size_t>(written));
+                    } else if (written < 0 && errno != EAGAIN && errno != EINTR) {
+                        worker.failed = true;
+                    }
+                }
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    ssize_t got = ::read(worker.fd, chunk, sizeof(chunk));
+                    if (got > 0) {
+                        worker.received.append(chunk, static_cast<size_t>(got));
+                        consume(worker);
+                    } else if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+                        worker.failed = true;
+                    }
+                }
+            }
+        }
+        // Упавший шард: недополученные ответы становятся ошибками.
+        for (Worker &worker : workers) {
+            if (!worker.failed) {
+                continue;
+            }
+            for (const Worker::Reply &reply : worker.waiting) {
+                reply.text->append("err шард недоступен\n");
+            }
+            worker.waiting.clear();
+            worker.pending.clear();
+        }
+    }
+
+    // Строки выдачи без завершающей "end N".
+    static void rows(const string &part, vector<std::string_view> &out) {
+        size_t start = 0;
+        size_t newline;
+        while ((newline = part.find('\n', start)) != string::npos) {
+            std::string_view line(part.data() + start, newline + 1 - start);
+            if (line.compare(0, 4, "end ") != 0) {
+                out.push_back(line);
+            }
+            start = newline + 1;
+        }
+    }
+
+    // Поле строки выдачи по номеру от нуля: у "item <ID> <цена> ..." и "ends
+    // <ID> <мс> ..." второе поле — ключ сортировки при слиянии.
+    static std::string_view field(std::string_view line, size_t index) {
+        for (size_t i = 0; i < index; ++i) {
+            batch::nextToken(line);
+        }
+        return batch::nextToken(line);
+    }
+
+    static ItemId idOf(std::string_view line) {
+        ItemId id = kNoItem;
+        csv::parseNumber(field(line, 1), id);
+        return id;
+    }
+
+    static double priceOf(std::string_view line) {
+        double price = 0;
+        csv::parseNumber(field(line, 2), price);
+        return price;
+    }
+
+    void render(Request &request) {
+        OutputBuffer &out = *request.out;
+        if (request.merge == Merge::Local || request.merge == Merge::Single || request.merge == Merge::First) {
+            out << request.parts.front();
+            return;
+        }
+        for (const string &part : request.parts) {
+            if (part.compare(0, 4, "err ") == 0) {
+                out << part;
+                return;
+            }
+        }
+        if (request.merge == Merge::All) {
+            out << request.parts.front();
+            return;
+        }
+        vector<std::string_view> lines;
+        if (request.merge == Merge::Stats) {
+            for (size_t i = 0; i < request.parts.size(); ++i) {
+                out << "shard " << uint64_t(i) << '\n';
+                size_t before = lines.size();
+                rows(request.parts[i], lines);
+                for (size_t k = before; k < lines.size(); ++k) {
+                    out << lines[k];
+                }
+            }
+            out << "end " << uint64_t(lines.size() + request.parts.size()) << '\n';
+            return;
+        }
+        for (const string &part : request.parts) {
+            rows(part, lines);
+        }
+        // Выдачи шардов уже упорядочены, поэтому устойчивая сортировка
+        // сохраняет их порядок при равных ключах.
+        switch (request.merge) {
+        case Merge::ById:
+        case Merge::ByChat:
+            std::stable_sort(lines.begin(), lines.end(),
+                             [](std::string_view a, std::string_view b) { return idOf(a) < idOf(b); });
+            break;
+        case Merge::Cheapest:
+            std::stable_sort(lines.begin(), lines.end(),
+                             [](std::string_view a, std::string_view b) { return priceOf(a) < priceOf(b); });
+            break;
+        case Merge::Dearest:
+            std::stable_sort(lines.begin(), lines.end(),
+                             [](std::string_view a, std::string_view b) { return priceOf(a) > priceOf(b); });
+            break;
+        default:
+            break;
+        }
+        // У chats предел считается в чатах, а не в строках.
+        size_t count = 0;
+        size_t units = 0;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            bool next = request.merge != Merge::ByChat || i == 0 || idOf(lines[i]) != idOf(lines[i - 1]);
+            if (next && units == request.limit) {
+                break;
+            }
+            units += next;
+            out << lines[i];
+            ++count;
+        }
+        out << "end " << uint64_t(count) << '\n';
+    }
+
+    Request &enqueue(OutputBuffer &out, Merge merge, size_t parts) {
+        round.push_back({&out, merge, SIZE_MAX, vector<string>(parts)});
+        return round.back();
+    }
+
+    void reply(OutputBuffer &out, string text) { enqueue(out, Merge::Local, 1).parts[0] = move(text); }
+
+    void forward(const string &user, size_t shard, std::string_view line, OutputBuffer &out, bool listing = false) {
+        Request &request = enqueue(out, Merge::Single, 1);
+        sendAs(shard, user, line, &request.parts[0], listing);
+    }
+
+    void broadcast(const string &user, std::string_view line, OutputBuffer &out, Merge merge, size_t limit,
+                   bool listing) {
+        Request &request = enqueue(out, merge, workers.size());
+        request.limit = limit;
+        for (size_t i = 0; i < workers.size(); ++i) {
+            sendAs(i, user, line, &request.parts[i], listing);
+        }
+    }
+
+    // Один запрос вне пачки: накопленное уходит первым, чтобы сохранить порядок.
+    string call(size_t shard, const string &user, std::string_view line) {
+        finish();
+        string answer;
+        sendAs(shard, user, line, &answer, false);
+        exchange();
+        return answer;
+    }
+
+    static bool ok(const string &answer) { return answer.compare(0, 2, "ok") == 0; }
+
+    // Первый лот с таким названием по всем шардам; kNoItem — нет нигде.
+    ItemId lookup(std::string_view name) {
+        finish();
+        vector<string> answers(workers.size());
+        for (size_t i = 0; i < workers.size(); ++i) {
+            send(i, "lookup " + string(name), &answers[i], false);
+        }
+        exchange();
+        ItemId best = kNoItem;
+        for (const string &answer : answers) {
+            ItemId id = kNoItem;
+            if (ok(answer) && csv::parseNumber(std::string_view(answer).substr(3, answer.size() - 4), id) &&
+                (best == kNoItem || id < best)) {
+                best = id;
+            }
+        }
+        return best;
+    }
+
+    void saveCount() {
+        std::ofstream file(string(kCountFile) + ".tmp", std::ios::trunc);
+        file << workers.size() << '\n';
+        file.close();
+        if (file) {
+            commitFile(kCountFile);
+        }
+    }
+
+    // Стирает каталог шарда вместе с вложенными каталогами.
+    static void removeTree(const string &path) {
+        if (DIR *dir = ::opendir(path.c_str())) {
+            while (dirent *entry = ::readdir(dir)) {
+                string name = entry->d_name;
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                string child = path + "/" + name;
+                if (::unlink(child.c_str()) != 0 && errno == EISDIR) {
+                    removeTree(child);
+                }
+            }
+            ::closedir(dir);
+        }
+        ::rmdir(path.c_str());
+    }
+
+    // Останавливает последний шард и стирает его каталог: его состояние
+    // отброшено, и при следующем добавлении он не должен поднять чужие лоты.
+    void dropShard() {
+        Worker &worker = workers.back();
+        size_t index = workers.size() - 1;
+        ::close(worker.fd);
+        ::kill(worker.pid, SIGKILL);
+        ::waitpid(worker.pid, nullptr, 0);
+        workers.pop_back();
+        removeTree(shardDir(index));
+    }
+
+    string moveFile(size_t shard) const { return home + "/move-" + std::to_string(shard) + ".snap"; }
+
+    // Новый шард забирает у прежних лоты, которые ему отдаёт кольцо из N+1
+    // шардов. Файлы переноса лежат в каталоге маршрутизатора. При любой
+    // ошибке лоты возвращаются владельцам, новый шард останавливается,
+    // а число шардов остаётся прежним.
+    string addShard() {
+        finish();
+        size_t index = workers.size();
+        if (!spawn(index)) {
+            return "err не удалось запустить шард\n";
+        }
+        string failure;
+        string usersFile = home + "/move-users.snap";
+        if (!ok(call(0, "", "export " + usersFile + " users")) || !ok(call(index, "", "import " + usersFile))) {
+            failure = "err не удалось передать пользователей\n";
+        }
+        std::remove(usersFile.c_str());
+        // Шарды, чьи лоты лежат в файлах переноса.
+        vector<size_t> exported;
+        uint64_t moved = 0;
+        for (size_t i = 0; i < index && failure.empty(); ++i) {
+            string file = moveFile(i);
+            std::remove(file.c_str());
+            string answer = call(i, "", "export " + file + " " + std::to_string(index + 1) + " " + std::to_string(index));
+            // Экспорт мог вынуть лоты и не сохранить состояние: файл уже записан.
+            struct stat written{};
+            if (ok(answer) || (::stat(file.c_str(), &written) == 0 && S_ISREG(written.st_mode))) {
+                exported.push_back(i);
+            }
+            if (!ok(answer)) {
+                failure = "err шард " + std::to_string(i) + ": " + answer;
+                break;
+            }
+            uint64_t items = 0;
+            csv::parseNumber(field(answer, 1), items);
+            if (!ok(call(index, "", "import " + file))) {
+                failure = "err не удалось перенести лоты шарда " + std::to_string(i) + "\n";
+                break;
+            }
+            moved += items;
+        }
+        if (!failure.empty()) {
+            dropShard();
+            for (size_t owner : exported) {
+                string file = moveFile(owner);
+                if (!ok(call(owner, "", "import " + file))) {
+                    return "err лоты шарда " + std::to_string(owner) + " не возвращены, они в " + file + "\n";
+                }
+                std::remove(file.c_str());
+            }
+            return failure;
+        }
+        for (size_t owner : exported) {
+            std::remove(moveFile(owner).c_str());
+        }
+        ring = HashRing(workers.size());
+        saveCount();
+        return "ok " + std::to_string(workers.size()) + " " + std::to_string(moved) + "\n";
+    }
+
+public:
+    Router() {
+        char buffer[4096];
+        home = ::getcwd(buffer, sizeof(buffer)) ? buffer : ".";
+    }
+
+    Router(const Router &) = delete;
+    Router &operator=(const Router &) = delete;
+
+    ~Router() {
+        for (Worker &worker : workers) {
+            ::close(worker.fd);
+            ::kill(worker.pid, SIGTERM);
+        }
+        for (Worker &worker : workers) {
+            ::waitpid(worker.pid, nullptr, 0);
+        }
+    }
+
+    // Запускает шарды; прежнее число из router.shards, если оно больше.
+    bool start(size_t shards) {
+        std::ifstream file(kCountFile);
+        size_t saved = 0;
+        if (file >> saved) {
+            shards = std::max(shards, saved);
+        }
+        for (size_t i = 0; i < shards; ++i) {
+            if (!spawn(i)) {
+                return false;
+            }
+        }
+        ring = HashRing(workers.size());
+        saveCount();
+        vector<string> answers(workers.size());
+        for (size_t i = 0; i < workers.size(); ++i) {
+            send(i, "next", &answers[i], false);
+        }
+        exchange();
+        for (const string &answer : answers) {
+            ItemId next = 1;
+            if (ok(answer) && csv::parseNumber(std::string_view(answer).substr(3, answer.size() - 4), next)) {
+                nextId = std::max(nextId, next);
+            }
+        }
+        return true;
+    }
+
+    size_t shardCount() const { return workers.size(); }
+
+    void handle(std::string_view line, batch::Session &session, OutputBuffer &out) override {
+        if (line.substr(0, line.find_last_not_of(" \t\r") + 1) == "shard add") {
+            string answer = addShard();
+            reply(out, move(answer));
+            finish();
+            return;
+        }
+        batch::Command command = batch::parse(line);
+        using batch::Op;
+        const string &user = session.name;
+        bool byId = command.id != kNoItem;
+        bool needsUser = command.op == Op::Add || command.op == Op::Bid || command.op == Op::Proxy ||
+                         command.op == Op::Buy || command.op == Op::Message || command.op == Op::Watch ||
+                         command.op == Op::Unwatch || command.op == Op::Events;
+        if (needsUser && user.empty()) {
+            reply(out, "err требуется вход\n");
+            return;
+        }
+        switch (command.op) {
+        case Op::Register: {
+            finish();
+            // Пользователь нужен на всех шардах: отказ любого — ошибка.
+            Request &request = enqueue(out, Merge::All, workers.size());
+            for (size_t i = 0; i < workers.size(); ++i) {
+                send(i, line, &request.parts[i], false);
+            }
+            finish();
+            break;
+        }
+        case Op::Login: {
+            string answer = call(0, "", line);
+            // Вход сменил пользователя сеанса шарда: следующий запрос
+            // от чужого имени должен переключить его заново.
+            workers[0].as = "\n";
+            if (ok(answer)) {
+                session.name = string(command.name);
+            }
+            reply(out, move(answer));
+            break;
+        }
+        case Op::Logout:
+            session.name.clear();
+            reply(out, "ok\n");
+            break;
+        case Op::Add: {
+            ItemId id = nextId++;
+            std::string_view rest = line;
+            batch::nextToken(rest);
+            forward(user, ring.owner(id), "put " + std::to_string(id) + string(rest), out);
+            break;
+        }
+        case Op::Bid:
+        case Op::Proxy:
+        case Op::Buy: {
+            if (byId) {
+                forward(user, ring.owner(command.id), line, out);
+                break;
+            }
+            ItemId id = lookup(command.name);
+            if (id == kNoItem) {
+                reply(out, "err товар не найден\n");
+                break;
+            }
+            std::string_view rest = line;
+            std::string_view verb = batch::nextToken(rest);
+            batch::nextToken(rest);
+            forward(user, ring.owner(id), string(verb) + " #" + std::to_string(id) + string(rest), out);
+            break;
+        }
+        case Op::Message:
+        case Op::Chat:
+        case Op::Bids:
+            forward(user, ring.owner(command.id), line, out, command.op != Op::Message);
+            break;
+        case Op::Watch:
+        case Op::Unwatch:
+            if (command.name.empty()) {
+                forward(user, ring.owner(command.id), line, out);
+            } else {
+                broadcast(user, line, out, Merge::First, SIZE_MAX, false);
+            }
+            break;
+        case Op::List:
+        case Op::Search:
+            broadcast(user, line, out, Merge::ById, command.count, true);
+            break;
+        case Op::Chats:
+            broadcast(user, line, out, Merge::ByChat, command.count, true);
+            break;
+        case Op::Range:
+        case Op::Seller:
+        case Op::Ending:
+            broadcast(user, line, out, Merge::Cheapest, command.count, true);
+            break;
+        case Op::Top:
+            broadcast(user, line, out, Merge::Dearest, command.count, true);
+            break;
+        case Op::Events:
+            broadcast(user, line, out, Merge::Concat, SIZE_MAX, true);
+            break;
+        case Op::Stats:
+            broadcast(user, line, out, Merge::Stats, SIZE_MAX, true);
+            break;
+        case Op::Invalid:
+            reply(out, "err неизвестная команда: " + string(command.text) + "\n");
+            break;
+        default:
+            reply(out, "err служебная команда шарда\n");
+            break;
+        }
+    }
+
+    void finish() override {
+        if (round.empty()) {
+            return;
+        }
+        exchange();
+        for (Request &request : round) {
+            render(request);
+        }
+        round.clear();
+        discard.clear();
+    }
+};
+
+// ./auction route [путь сокета] [--shards=N]
+int route(int argc, char **argv) {
+    string socketPath = "auction.sock";
+    size_t shards = 1;
+    for (int i = 0; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 9, "--shards=") == 0) {
+            if (!csv::parseNumber(std::string_view(arg).substr(9), shards) || shards == 0 || shards > 256) {
+                cerr << "Неверное число шардов: " << arg << endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 2, "--") != 0) {
+            socketPath = arg;
+        } else {
+            cerr << "Неизвестный параметр: " << arg << endl;
+            return 1;
+        }
+    }
+    server::raiseFileLimit();
+    Router router;
+    if (!router.start(shards)) {
+        return 1;
+    }
+    {
+        server::Reactor reactor(router);
+        if (!reactor.listen(socketPath)) {
+            return 1;
+        }
+        struct sigaction action{};
+        action.sa_handler = server::requestStop;
+        ::sigaction(SIGINT, &action, nullptr);
+        ::sigaction(SIGTERM, &action, nullptr);
+        cout << "Маршрутизатор слушает " << socketPath << ", шардов: " << router.shardCount() << endl;
+        reactor.run(server::stopRequested);
+    }
+    cout << "Маршрутизатор остановлен." << endl;
+    return 0;
+}
+
+} // namespace shard
+
+namespace bench {
+
+using Clock = std::chrono::steady_clock;
+
+double nsPerOp(Clock::time_point start, size_t ops) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    return static_cast<double>(elapsed.count()) / static_cast<double>(ops);
+}
+
+double msSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Параметры запуска: --size=N (размер каталога или объём данных сценария,
+// 0 — значения сценария по умолчанию), --threads=N, --json.
+struct Options {
+    size_t size = 0;
+    size_t threads = 0;
+    bool json = false;
+
+    size_t sizeOr(size_t fallback) const { return size ? size : fallback; }
+
+    vector<size_t> sizesOr(std::initializer_list<size_t> fallback) const {
+        return size ? vector<size_t>{size} : vector<size_t>(fallback);
+    }
+};
+
+// Строка результатов сценария. Текстом печатается как "сценарий ключ=значение
+// ...", с --json — одним JSON-объектом на строку, чтобы результаты можно
+// было собирать и сравнивать от коммита к коммиту.
+class Row {
+private:
+    struct Field {
+        string key;
+        string value;
+        bool number;
+    };
+
+    string scenario;
+    vector<Field> fields;
+
+public:
+    explicit Row(string name) : scenario(move(name)) {}
+
+    Row &add(const string &key, double value) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.6g", value);
+        fields.push_back({key, text, std::isfinite(value)});
+        return *this;
+    }
+
+    Row &add(const string &key, uint64_t value) {
+        fields.push_back({key, std::to_string(value), true});
+        return *this;
+    }
+
+    Row &add(const string &key, const string &value) {
+        fields.push_back({key, value, false});
+        return *this;
+    }
+
+    Row &result(bool ok) { return add("result", ok ? "ok" : "FAIL"); }
+
+    void print(const Options &options) const {
+        if (!options.json) {
+            cout << scenario;
+            for (const auto &field : fields) {
+                cout << ' ' << field.key << '=' << field.value;
+            }
+            cout << "\n";
+            return;
+        }
+        cout << "{\"scenario\":\"" << scenario << '"';
+        for (const auto &field : fields) {
+            cout << ",\"" << field.key << "\":";
+            if (field.number) {
+                cout << field.value;
+            } else {
+                cout << '"' << field.value << '"';
+            }
+        }
+        cout << "}\n";
+    }
+};
+
+// Задержка одного промаха кэша: зависимые чтения по случайному циклу через
+// все линии буфера в bytes байт.
+double missNs(size_t bytes) {
+    const size_t stride = 64 / sizeof(uint64_t);
+    const size_t lines = bytes / 64;
+    vector<uint64_t> next(lines * stride);
+    vector<uint32_t> order(lines);
+    for (size_t i = 0; i < lines; ++i) {
+        order[i] = static_cast<uint32_t>(i);
+    }
+    std::mt19937 rng(3);
+    std::shuffle(order.begin(), order.end(), rng);
+    for (size_t i = 0; i < lines; ++i) {
+        next[order[i] * stride] = order[(i + 1) % lines] * stride;
+    }
+    const size_t steps = 2000000;
+    size_t pos = 0;
+    auto start = Clock::now();
+    for (size_t i = 0; i < steps; ++i) {
+        pos = next[pos];
+    }
+    double ns = nsPerOp(start, steps);
+    return pos < next.size() ? ns : 0;
+}
+
+// Задержка ставки и покупки по имени при росте каталога. Обе операции
+// должны стоить постоянного числа промахов кэша: прирост задержки от
+// меньшего каталога к большему переводится в промахи, и больше kBidMisses
+// для ставки (ячейка и запись имени, ячейка слота, лот, история) или
+// kBuyMisses для покупки (ещё триграммы названия) означает, что где-то
+// появился поиск или проход, растущий с каталогом.
+bool catalogScaling(const Options &options) {
+    const size_t ops = 200000;
+    const double kBidMisses = 12;
+    const double kBuyMisses = 16;
+    vector<size_t> sizes = options.sizesOr({1000, 10000, 100000, 1000000});
+    double firstBid = 0;
+    double firstBuy = 0;
+    double lastBid = 0;
+    double lastBuy = 0;
+    for (size_t size : sizes) {
+        Auction auction;
+        UserId owner = UserDirectory::instance().intern("bench");
+        vector<string> names;
+        names.reserve(size);
+        for (size_t i = 0; i < size; ++i) {
+            names.push_back("lot" + std::to_string(i));
+            auction.addItem({kNoItem, names.back(), 1.0, owner});
+        }
+
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<size_t> pick(0, size - 1);
+        vector<size_t> targets(ops);
+        for (auto &target : targets) {
+            target = pick(rng);
+        }
+
+        auto start = Clock::now();
+        double price = 2.0;
+        for (size_t target : targets) {
+            auction.placeBid(names[target], price);
+            price += 0.01;
+        }
+        double bidNs = nsPerOp(start, ops);
+
+        size_t buys = std::min(ops, size / 2);
+        start = Clock::now();
+        for (size_t i = 0; i < buys; ++i) {
+            auction.removeItem(names[i * 2]);
+        }
+        double buyNs = nsPerOp(start, buys);
+
+        Row("catalog").add("size", size).add("bid_ns", bidNs).add("buy_ns", buyNs).print(options);
+        if (size == sizes.front()) {
+            firstBid = bidNs;
+            firstBuy = buyNs;
+        }
+        lastBid = bidNs;
+        lastBuy = buyNs;
+    }
+    if (sizes.size() < 2) {
+        return true;
+    }
+    double miss = missNs(size_t(128) << 20);
+    double bidMisses = (lastBid - firstBid) / miss;
+    double buyMisses = (lastBuy - firstBuy) / miss;
+    bool ok = bidMisses <= kBidMisses && buyMisses <= kBuyMisses;
+    Row("catalog").add("from", uint64_t(sizes.front())).add("to", uint64_t(sizes.back())).add("miss_ns", miss)
+        .add("bid_growth", lastBid / firstBid).add("bid_misses", bidMisses).add("buy_growth", lastBuy / firstBuy)
+        .add("buy_misses", buyMisses).result(ok).print(options);
+    return ok;
+}
+
+// Параллельные ставки и покупки: итоговая цена каждого непроданного лота
+// равна максимальной из принятых ставок, а каждый проданный лот продан ровно один раз.
+bool concurrentStress(const Options &options) {
+    const size_t threads = options.threads;
+    const size_t lots = options.sizeOr(1024);
+    const size_t opsPerThread = 200000;
+    Auction auction(threads * 4);
+    UserId owner = UserDirectory::instance().intern("bench");
+    vector<ItemId> ids;
+    vector<string> names;
+    for (size_t i = 0; i < lots; ++i) {
+        names.push_back("lot" + std::to_string(i));
+        ids.push_back(auction.addItem({kNoItem, names.back(), 1.0, owner}));
+    }
+
+    vector<vector<double>> maxBids(threads, vector<double>(lots, 1.0));
+    vector<vector<char>> bought(threads, vector<char>(lots, 0));
+    vector<std::thread> workers;
+    auto start = Clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng(static_cast<unsigned>(t + 1));
+            std::uniform_int_distribution<size_t> pick(0, lots - 1);
+            std::uniform_int_distribution<int> amount(200, 100000);
+            for (size_t i = 0; i < opsPerThread; ++i) {
+                size_t lot = pick(rng);
+                // Вторая половина лотов распродаётся прямо во время торгов.
+                if (lot >= lots / 2 && i % 64 == 0) {
+                    if (auction.removeItem(ids[lot])) {
+                        bought[t][lot] = 1;
+                    }
+                    continue;
+                }
+                double bid = amount(rng) / 100.0;
+                BidStatus status = i % 2 ? auction.placeBid(ids[lot], bid) : auction.placeBid(names[lot], bid);
+                if (status != BidStatus::NotFound) {
+                    maxBids[t][lot] = std::max(maxBids[t][lot], bid);
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double opNs = nsPerOp(start, threads * opsPerThread);
+
+    bool ok = true;
+    for (size_t lot = 0; lot < lots; ++lot) {
+        size_t sales = 0;
+        double expected = 1.0;
+        for (size_t t = 0; t < threads; ++t) {
+            sales += bought[t][lot];
+            expected = std::max(expected, maxBids[t][lot]);
+        }
+        double price = 0;
+        bool present = auction.readPrice(ids[lot], &price);
+        if (lot < lots / 2 && (!present || price != expected)) {
+            cerr << "Лот " << ids[lot] << ": цена " << price << ", ожидалось " << expected << endl;
+            ok = false;
+        }
+        if (present ? sales != 0 : sales != 1) {
+            cerr << "Лот " << ids[lot] << " продан " << sales << " раз" << endl;
+            ok = false;
+        }
+    }
+    Row("stress").add("size", lots).add("threads", threads).add("op_ns", opNs).result(ok).print(options);
+    return ok;
+}
+
+// Шквал ставок на один популярный лот: от 1 до --threads потоков поднимают
+// цену одного и того же товара. Суммы растут у всех потоков одновременно,
+// поэтому часть ставок опаздывает и отклоняется без блокировок. mode=plain —
+// обычные ставки, mode=proxy — заявки с автоповышением, которые
+// разыгрываются под полосой ставок. История обычных ставок должна совпасть
+// с принятыми ставками и идти по возрастанию цены.
+bool biddingStorm(const Options &options) {
+    const size_t opsPerThread = 500000;
+    bool ok = true;
+    for (bool proxy : {false, true}) {
+        for (size_t threads = 1; threads <= options.threads; threads *= 2) {
+            Auction auction;
+            ItemId id = auction.addItem({kNoItem, "hot", 1.0, UserDirectory::instance().intern("bench")});
+
+            std::atomic<size_t> accepted{0};
+            vector<std::thread> workers;
+            auto start = Clock::now();
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    size_t won = 0;
+                    for (size_t i = 0; i < opsPerThread; ++i) {
+                        double bid = static_cast<double>(200 + i * threads + t) / 100.0;
+                        uint32_t bidder = static_cast<uint32_t>(t);
+                        BidStatus status = proxy ? auction.placeProxyBid(id, bid, nullptr, bidder)
+                                                 : auction.placeBid(id, bid, nullptr, bidder);
+                        won += status != BidStatus::TooLow;
+                    }
+                    accepted += won;
+                });
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            double bidNs = nsPerOp(start, threads * opsPerThread);
+            bool valid = accepted.load() > 0;
+            if (!proxy) {
+                vector<BidBook::Entry> history = auction.bidHistory(id, SIZE_MAX);
+                valid = valid && history.size() == accepted.load();
+                for (size_t i = 1; i < history.size() && valid; ++i) {
+                    valid = history[i].cents < history[i - 1].cents;
+                }
+                double price = 0;
+                valid = valid && auction.readPrice(id, &price) && !history.empty() &&
+                        Item::toCents(price) == history.front().cents;
+            }
+            if (!valid) {
+                cerr << "Шквал ставок: история лота не совпала с принятыми ставками" << endl;
+            }
+            ok = ok && valid;
+            Row("storm").add("mode", proxy ? "proxy" : "plain").add("threads", threads).add("bid_ns", bidNs)
+                .add("accepted", uint64_t(accepted.load())).add("bids", uint64_t(threads * opsPerThread))
+                .result(valid).print(options);
+        }
+    }
+    return ok;
+}
+
+// Стоимость журналирования ставок при разных политиках fsync. При Always
+// потоки ждут диска, но делят один fdatasync на пачку (групповая фиксация).
+bool walThroughput(const Options &options) {
+    const size_t threads = options.threads;
+    const string path = "bench.wal";
+    const size_t opsPerThread = 20000;
+    const pair<FsyncPolicy, const char *> policies[] = {
+        {FsyncPolicy::Never, "never"}, {FsyncPolicy::Interval, "interval"}, {FsyncPolicy::Always, "always"}};
+    for (const auto &policy : policies) {
+        std::remove(path.c_str());
+        Auction auction(threads * 4);
+        vector<ItemId> ids;
+        for (size_t i = 0; i < threads; ++i) {
+            ids.push_back(auction.addItem({kNoItem, "lot" + std::to_string(i), 1.0, UserDirectory::instance().intern("bench")}));
+        }
+        auto start = Clock::now();
+        {
+            WriteAheadLog wal(path, policy.first);
+            auction.attachLog(&wal);
+            vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    for (size_t i = 0; i < opsPerThread; ++i) {
+                        auction.placeBid(ids[t], static_cast<double>(200 + i) / 100.0);
+                    }
+                });
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            wal.flush();
+            auction.attachLog(nullptr);
+        }
+        Row("wal").add("fsync", policy.second).add("threads", threads)
+            .add("bid_ns", nsPerOp(start, threads * opsPerThread)).print(options);
+    }
+    std::remove(path.c_str());
+    return true;
+}
+
+// Запуск из текстовых файлов против запуска из отображённого снимка.
+bool snapshotStartup(const Options &options) {
+    const size_t itemCount = options.sizeOr(1000000);
+    const size_t userCount = std::max<size_t>(itemCount / 10, 1);
+    const size_t messageCount = itemCount;
+    Row row("snapshot");
+    row.add("size", itemCount);
+    {
+        Auction auction;
+        Accounts accounts;
+        vector<const Buyer *> users;
+        for (size_t i = 0; i < userCount; ++i) {
+            users.push_back(accounts.add(make_unique<Buyer>("user" + std::to_string(i), size_t(i))));
+        }
+        for (size_t i = 0; i < itemCount; ++i) {
+            auction.addItem({kNoItem, "lot" + std::to_string(i), 1.0 + i % 1000, users[i % userCount]->getId()});
+        }
+        for (size_t i = 0; i < messageCount; ++i) {
+            auction.sendMessage("user" + std::to_string(i % userCount), "message text " + std::to_string(i),
+                                ItemId(i % itemCount + 1));
+        }
+        auto start = Clock::now();
+        saveUsersToFile(accounts, "bench_users.txt");
+        auction.saveItemsToFile("bench_items.txt");
+        auction.saveMessagesToFile("bench_messages.txt");
+        row.add("save_text_ms", msSince(start));
+        start = Clock::now();
+        saveSnapshot(auction, accounts, "bench.snap");
+        row.add("save_snap_ms", msSince(start));
+    }
+    {
+        Auction auction;
+        Accounts accounts;
+        auto start = Clock::now();
+        loadUsersFromFile(accounts, "bench_users.txt");
+        auction.loadItemsFromFile("bench_items.txt");
+        auction.loadMessagesFromFile("bench_messages.txt");
+        row.add("load_text_ms", msSince(start));
+    }
+    {
+        Auction auction;
+        Accounts accounts;
+        auto start = Clock::now();
+        loadSnapshot(auction, accounts, "bench.snap");
+        row.add("load_snap_ms", msSince(start));
+        start = Clock::now();
+        std::streambuf *saved = cout.rdbuf(nullptr);
+        {
+            StreamWriter sink(cout);
+            auction.displayChat(42, sink);
+        }
+        cout.rdbuf(saved);
+        row.add("first_chat_ms", msSince(start));
+    }
+    for (const char *name : {"bench_users.txt", "bench_items.txt", "bench_messages.txt", "bench.snap"}) {
+        std::remove(name);
+    }
+    row.print(options);
+    return true;
+}
+
+// Разбор CSV против простого чтения того же файла в память (оба из кэша ОС).
+// Каждое восьмое сообщение многострочное. Тот же файл затем разбирается на
+// 2..8 кусков, и каждая запись должна вернуться ровно такой, какой была
+// записана; хотя бы одна граница куска должна попасть внутрь многострочного
+// поля (reparsed), иначе повторный разбор не проверен.
+bool csvImport(const Options &options) {
+    const size_t rows = options.sizeOr(3000000);
+    const string path = "bench_import.txt";
+    auto content = [](size_t i) -> string {
+        if (i % 8 == 1) {
+            return "line " + std::to_string(i) + "\nnext, \"quoted\"\r\n\nlast";
+        }
+        return i % 4 ? "message number " + std::to_string(i) : "with, comma \"and quotes\"";
+    };
+    {
+        std::ofstream out(path);
+        for (size_t i = 0; i < rows; ++i) {
+            csv::writeField(out, "user" + std::to_string(i % 50000));
+            out << ",";
+            csv::writeField(out, content(i));
+            out << "," << i % 100000 << "\n";
+        }
+    }
+    auto start = Clock::now();
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    string buffer(static_cast<size_t>(in.tellg()), '\0');
+    in.seekg(0);
+    in.read(&buffer[0], static_cast<std::streamsize>(buffer.size()));
+    in.close();
+    double readMs = msSince(start);
+    double megabytes = static_cast<double>(buffer.size()) / (1 << 20);
+    string().swap(buffer);
+
+    start = Clock::now();
+    csv::Import<csv::MessageRow> import;
+    csv::importFile(path, csv::parseMessage, import);
+    double parseMs = msSince(start);
+
+    start = Clock::now();
+    Auction auction;
+    auction.loadMessagesFromFile(path);
+    double loadMs = msSince(start);
+
+    bool ok = true;
+    size_t reparsed = 0;
+    size_t chunked = 0;
+    for (size_t threads = 2; threads <= 8 && ok; ++threads) {
+        csv::Import<csv::MessageRow> check;
+        ok = csv::importFile(path, csv::parseMessage, check, threads) && check.rejected == 0 && check.rows() == rows;
+        chunked += check.chunks.size() > 1;
+        reparsed += check.reparsed;
+        size_t i = 0;
+        check.forEach([&](const csv::MessageRow &message) {
+            ok = ok && message.from == "user" + std::to_string(i % 50000) && message.content == content(i) &&
+                 message.itemId == i % 100000;
+            ++i;
+        });
+    }
+    ok = ok && (chunked == 0 || reparsed > 0);
+
+    Row("import").add("mb", megabytes).add("rows", uint64_t(import.rows())).add("read_mb_s", megabytes / readMs * 1000)
+        .add("parse_mb_s", megabytes / parseMs * 1000).add("load_ms", loadMs).add("reparsed", uint64_t(reparsed))
+        .result(ok).print(options);
+    std::remove(path.c_str());
+    return ok;
+}
+
+// Открытие чата (последняя страница) и листание назад при росте хранилища.
+bool chatPaging(const Options &options) {
+    const size_t pageSize = 50;
+    const size_t opens = 100000;
+    for (size_t total : options.sizesOr({1000, 100000, 3000000})) {
+        Auction auction;
+        const size_t lots = std::max<size_t>(total / 200, 1);
+        for (size_t i = 0; i < total; ++i) {
+            auction.sendMessage("u" + std::to_string(i % 997), "msg " + std::to_string(i), ItemId(i % lots));
+        }
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<size_t> pick(0, lots - 1);
+        vector<Message> page;
+        auto start = Clock::now();
+        for (size_t i = 0; i < opens; ++i) {
+            page.clear();
+            size_t cursor = auction.chatHistory(ItemId(pick(rng)), Auction::kChatEnd, pageSize, page);
+            if (cursor > 0) {
+                auction.chatHistory(ItemId(pick(rng)), cursor, pageSize, page);
+            }
+        }
+        Row("chat").add("messages", total).add("open_and_page_ns", nsPerOp(start, opens)).print(options);
+    }
+    return true;
+}
+
+// Память под 10M сообщений: имя отправителя строкой в каждом сообщении (как
+// было) против ID из общего справочника.
+bool internedMemory(const Options &options) {
+    const size_t count = options.sizeOr(10000000);
+    Row row("interning");
+    row.add("messages", count);
+    struct LegacyMessage {
+        string fromUser;
+        string content;
+        int itemId;
+    };
+    const size_t senders = 100000;
+    auto senderName = [](size_t i) { return "customer.account." + std::to_string(i); };
+    auto content = [](size_t i) { return "bid ok #" + std::to_string(i % 1000); };
+
+    ::malloc_trim(0);
+    size_t base = residentBytes();
+    {
+        vector<LegacyMessage> messages;
+        messages.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            messages.push_back({senderName(i % senders), content(i), static_cast<int>(i % 100000)});
+        }
+        row.add("string_mb", (residentBytes() - base) / double(1 << 20));
+    }
+    ::malloc_trim(0);
+    base = residentBytes();
+    {
+        UserDirectory &directory = UserDirectory::instance();
+        vector<Message> messages;
+        messages.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            messages.emplace_back(directory.intern(senderName(i % senders)), content(i), ItemId(i % 100000));
+        }
+        row.add("interned_mb", (residentBytes() - base) / double(1 << 20));
+    }
+    row.print(options);
+    return true;
+}
+
+// Обход каталога и оборот лотов (покупка + выставление нового) на слэбах.
+// После прогрева освободившиеся слоты переиспользуются, и ID купленных лотов
+// больше не находятся, хотя их слоты уже заняты новыми лотами.
+bool slabChurn(const Options &options) {
+    const size_t size = options.sizeOr(1000000);
+    const size_t ops = 1000000;
+    Auction auction(16);
+    UserId owner = UserDirectory::instance().intern("bench");
+    vector<ItemId> ids;
+    ids.reserve(size);
+    auto start = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        ids.push_back(auction.addItem({kNoItem, "lot" + std::to_string(i), 1.0, owner}));
+    }
+    double addNs = nsPerOp(start, size);
+
+    start = Clock::now();
+    double total = 0;
+    auction.forEachItem([&total](const Item &item) { total += item.getPrice(); });
+    double scanNs = nsPerOp(start, size);
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<size_t> pick(0, size - 1);
+    bool ok = total == static_cast<double>(size);
+    start = Clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        size_t slot = pick(rng);
+        ItemId sold = ids[slot];
+        auction.removeItem(sold);
+        ids[slot] = auction.addItem({kNoItem, "lot" + std::to_string(size + i), 1.0, owner});
+        if (auction.hasItem(sold)) {
+            ok = false;
+        }
+    }
+    double churnNs = nsPerOp(start, ops);
+    ok = ok && auction.itemCount() == size;
+    Row("slab").add("size", size).add("add_ns", addNs).add("scan_ns", scanNs).add("churn_ns", churnNs).result(ok)
+        .print(options);
+    return ok;
+}
+
+// Ставки вперемешку с запросами по индексам цены и срока. У половины лотов
+// есть срок. Для сравнения ценовой диапазон выбирается полным обходом
+// каталога с сортировкой.
+bool priceIndex(const Options &options) {
+    // Один поток всегда занят запросами, остальные ставят.
+    const size_t threads = std::max<size_t>(options.threads, 2);
+    const size_t size = options.sizeOr(1000000);
+    const size_t sellers = 1000;
+    const size_t bidsPerThread = 200000;
+    const size_t queries = 2000;
+    Auction auction(threads * 4);
+    vector<ItemId> ids;
+    ids.reserve(size);
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<int> startPrice(100, 1000000);
+    for (size_t i = 0; i < size; ++i) {
+        UserId owner = UserDirectory::instance().intern("seller" + std::to_string(i % sellers));
+        uint64_t endsAt = i % 2 ? auction.now() + 3600000 + i : 0;
+        ids.push_back(auction.addItem({kNoItem, "lot" + std::to_string(i), startPrice(rng) / 100.0, owner,
+                                       Item::kNoBidder, endsAt}));
+    }
+
+    auto start = Clock::now();
+    vector<pair<uint64_t, ItemId>> scanned;
+    auction.forEachItem([&scanned](const Item &item) {
+        if (item.getCents() >= 500000 && item.getCents() <= 501000) {
+            scanned.emplace_back(item.getCents(), item.getId());
+        }
+    });
+    std::sort(scanned.begin(), scanned.end());
+    double scanUs = msSince(start) * 1000.0;
+
+    vector<std::thread> workers;
+    start = Clock::now();
+    for (size_t t = 0; t + 1 < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937 local(static_cast<unsigned>(t + 1));
+            std::uniform_int_distribution<size_t> pick(0, size - 1);
+            std::uniform_int_distribution<int> raise(1, 5000);
+            for (size_t i = 0; i < bidsPerThread; ++i) {
+                ItemId id = ids[pick(local)];
+                double price = 0;
+                if (auction.readPrice(id, &price)) {
+                    auction.placeBid(id, price + raise(local) / 100.0);
+                }
+            }
+        });
+    }
+    bool ok = true;
+    auto runQueries = [&] {
+        std::mt19937 local(99);
+        std::uniform_int_distribution<int> low(100, 990000);
+        std::uniform_int_distribution<size_t> seller(0, sellers - 1);
+        auto queryStart = Clock::now();
+        for (size_t i = 0; i < queries; ++i) {
+            vector<ItemListing> listings;
+            if (i % 4 == 0) {
+                double from = low(local) / 100.0;
+                listings = auction.itemsInPriceRange(from, from + 10.0, 50);
+            } else if (i % 4 == 1) {
+                listings = auction.mostExpensive(50);
+            } else if (i % 4 == 2) {
+                listings = auction.cheapestBySeller("seller" + std::to_string(seller(local)), 50);
+            } else {
+                listings = auction.endingSoonest(50);
+                ok = ok && listings.size() == 50;
+            }
+            for (size_t j = 1; j < listings.size(); ++j) {
+                const ItemListing &a = listings[j - 1];
+                const ItemListing &b = listings[j];
+                bool ordered = i % 4 == 1 ? a.cents >= b.cents : i % 4 == 3 ? a.endsAt <= b.endsAt : a.cents <= b.cents;
+                ok = ok && ordered;
+            }
+        }
+        return msSince(queryStart) * 1000.0 / static_cast<double>(queries);
+    };
+    double mixedUs = 0;
+    std::thread reader([&] { mixedUs = runQueries(); });
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    reader.join();
+    double bidNs = nsPerOp(start, (threads - 1) * bidsPerThread);
+    double quietUs = runQueries();
+
+    uint64_t maxCents = 0;
+    auction.forEachItem([&maxCents](const Item &item) { maxCents = std::max(maxCents, item.getCents()); });
+    vector<ItemListing> top = auction.mostExpensive(1);
+    vector<ItemListing> all = auction.itemsInPriceRange(0, Item::fromCents(Item::kMaxCents));
+    ok = ok && !top.empty() && top[0].cents == maxCents && all.size() == size &&
+         std::is_sorted(all.begin(), all.end(),
+                        [](const ItemListing &a, const ItemListing &b) { return a.cents < b.cents; });
+    for (const auto &listing : all) {
+        double price = 0;
+        ok = ok && auction.readPrice(listing.id, &price) && Item::toCents(price) == listing.cents;
+    }
+    vector<ItemListing> ending = auction.endingSoonest(SIZE_MAX);
+    ok = ok && ending.size() == size / 2 && std::is_sorted(ending.begin(), ending.end(), [](const auto &a, const auto &b) {
+             return a.endsAt < b.endsAt;
+         });
+    Row("index").add("size", size).add("threads", threads).add("bid_ns", bidNs).add("query_us", quietUs)
+        .add("mixed_query_us", mixedUs).add("scan_range_us", scanUs).result(ok).print(options);
+    return ok;
+}
+
+// Пропускная способность пакетного режима на сценарии из миллиона команд:
+// регистрации и входы, выставление лотов, ставки, покупки, сообщения и
+// запросы. Все ставки выше предыдущих, поэтому ошибок быть не должно.
+bool batchThroughput(const Options &options) {
+    const size_t users = 1000;
+    const size_t lots = options.sizeOr(100000);
+    const size_t bids = 750000;
+    const size_t buys = lots / 2;
+    const size_t messages = 50000;
+    const string path = "bench_batch.txt";
+    {
+        std::ofstream script(path);
+        for (size_t i = 0; i < users; ++i) {
+            script << "register buser" << i << " pw" << i << "\n";
+        }
+        script << "login buser0 pw0\n";
+        for (size_t i = 0; i < lots; ++i) {
+            script << "add blot" << i << " 1\n";
+        }
+        std::mt19937 rng(5);
+        std::uniform_int_distribution<size_t> pick(0, lots - 1);
+        for (size_t i = 0; i < bids; ++i) {
+            if (i % 100 == 0) {
+                size_t user = i / 100 % users;
+                script << "login buser" << user << " pw" << user << "\n";
+            }
+            script << "bid blot" << pick(rng) << " " << 2 + i / 100 << (i % 100 < 10 ? ".0" : ".") << i % 100 << "\n";
+            if (i % 1000 == 0) {
+                script << "top 10\n";
+            }
+        }
+        for (size_t i = 0; i < buys; ++i) {
+            script << "buy blot" << i * 2 << "\n";
+        }
+        for (size_t i = 0; i < messages; ++i) {
+            script << "msg " << i % lots + 1 << " message " << i << "\n";
+        }
+    }
+
+    Auction auction(16);
+    Accounts accounts;
+    int inFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    int outFd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    auto start = Clock::now();
+    batch::Result result = batch::run(auction, accounts, inFd, outFd);
+    double seconds = msSince(start) / 1000.0;
+    ::close(inFd);
+    ::close(outFd);
+    std::remove(path.c_str());
+    bool ok = result.failures == 0 && auction.itemCount() == lots - buys;
+    Row("batch").add("commands", uint64_t(result.commands))
+        .add("ops_per_sec", static_cast<double>(result.commands) / seconds)
+        .add("failures", uint64_t(result.failures)).result(ok).print(options);
+    return ok;
+}
+
+int connectUnix(const string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Отправляет запрос и ждёт однострочный ответ.
+bool roundTrip(int fd, std::string_view request, string &reply) {
+    if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+        return false;
+    }
+    reply.clear();
+    char chunk[256];
+    while (reply.empty() || reply.back() != '\n') {
+        ssize_t got = ::read(fd, chunk, sizeof(chunk));
+        if (got <= 0) {
+            return false;
+        }
+        reply.append(chunk, static_cast<size_t>(got));
+    }
+    return true;
+}
+
+// Сервер в дочернем процессе держит idle простаивающих соединений, пока
+// clients клиентов делают ставки запрос-ответ. В конце каждое простаивающее
+// соединение должно ответить на запрос.
+bool serverLatency(const Options &options) {
+    const string path = "bench.sock";
+    const size_t clients = options.threads;
+    const size_t idle = options.sizeOr(10000);
+    const size_t bidsPerClient = 20000;
+    server::raiseFileLimit();
+    pid_t child = ::fork();
+    if (child == 0) {
+        Auction auction(16);
+        Accounts accounts;
+        const Buyer *owner = accounts.add(make_unique<Buyer>("bench", "pw"));
+        for (size_t t = 0; t < clients; ++t) {
+            auction.addItem({kNoItem, "srvlot" + std::to_string(t), 1.0, owner->getId()});
+        }
+        batch::Executor executor(auction, accounts);
+        server::Reactor reactor(executor);
+        if (!reactor.listen(path)) {
+            ::_exit(1);
+        }
+        std::signal(SIGTERM, server::requestStop);
+        reactor.run(server::stopRequested);
+        ::_exit(0);
+    }
+
+    int probe = -1;
+    for (int attempt = 0; attempt < 500 && probe < 0; ++attempt) {
+        probe = connectUnix(path);
+        if (probe < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    bool ok = probe >= 0;
+    vector<int> idleFds;
+    if (ok) {
+        idleFds.push_back(probe);
+    }
+    while (ok && idleFds.size() < idle) {
+        int fd = connectUnix(path);
+        ok = fd >= 0;
+        if (ok) {
+            idleFds.push_back(fd);
+        }
+    }
+
+    vector<vector<uint64_t>> latencies(clients);
+    std::atomic<size_t> failures{0};
+    auto start = Clock::now();
+    if (ok) {
+        vector<std::thread> workers;
+        for (size_t t = 0; t < clients; ++t) {
+            workers.emplace_back([&, t] {
+                int fd = connectUnix(path);
+                string reply;
+                if (fd < 0 || !roundTrip(fd, "login bench pw\n", reply) || reply != "ok\n") {
+                    ++failures;
+                    return;
+                }
+                latencies[t].reserve(bidsPerClient);
+                string request;
+                for (size_t i = 0; i < bidsPerClient; ++i) {
+                    request = "bid srvlot" + std::to_string(t) + " " + std::to_string(2 + i) + "\n";
+                    auto sent = Clock::now();
+                    if (!roundTrip(fd, request, reply) || reply.compare(0, 3, "ok ") != 0) {
+                        ++failures;
+                        break;
+                    }
+                    latencies[t].push_back(static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent).count()));
+                }
+                ::close(fd);
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+    double seconds = msSince(start) / 1000.0;
+
+    size_t idleAlive = 0;
+    string reply;
+    for (int fd : idleFds) {
+        if (roundTrip(fd, "logout\n", reply) && reply == "ok\n") {
+            ++idleAlive;
+        }
+        ::close(fd);
+    }
+    ::kill(child, SIGTERM);
+    int status = 0;
+    ::waitpid(child, &status, 0);
+
+    vector<uint64_t> all;
+    for (const auto &part : latencies) {
+        all.insert(all.end(), part.begin(), part.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        return all.empty() ? 0.0 : static_cast<double>(all[static_cast<size_t>(p * static_cast<double>(all.size() - 1))]) / 1000.0;
+    };
+    ok = ok && failures == 0 && idleAlive == idle && all.size() == clients * bidsPerClient;
+    Row("server").add("idle", uint64_t(idleAlive)).add("clients", clients)
+        .add("bids_per_sec", static_cast<double>(all.size()) / seconds).add("p50_us", percentile(0.5))
+        .add("p99_us", percentile(0.99)).add("p999_us", percentile(0.999)).result(ok).print(options);
+    return ok;
+}
+
+// Микробенчмарки отдельных операций на каталоге из --size лотов: методы
+// Auction, проверка пароля и каждая функция сохранения и загрузки.
+bool microOperations(const Options &options) {
+    const size_t size = options.sizeOr(100000);
+    const size_t userCount = std::max<size_t>(size / 100, 1);
+    auto report = [&options, size](const string &op, const char *unit, double value) {
+        Row("micro").add("op", op).add("size", size).add(unit, value).print(options);
+    };
+    std::streambuf *saved = cout.rdbuf();
+
+    Auction auction;
+    Accounts accounts;
+    vector<const Buyer *> buyers;
+    for (size_t i = 0; i < userCount; ++i) {
+        buyers.push_back(accounts.add(make_unique<Buyer>("muser" + std::to_string(i), "pw" + std::to_string(i))));
+    }
+    vector<string> names;
+    names.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        names.push_back("mlot" + std::to_string(i));
+    }
+    vector<ItemId> ids;
+    ids.reserve(size);
+    auto start = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        ids.push_back(auction.addItem({kNoItem, names[i], 1.0, buyers[i % userCount]->getId()}));
+    }
+    report("addItem", "ns_per_op", nsPerOp(start, size));
+
+    std::mt19937 rng(3);
+    std::uniform_int_distribution<size_t> pick(0, size - 1);
+    cout.rdbuf(nullptr);
+    start = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        auction.bidItem(names[pick(rng)], 2.0 + static_cast<double>(i) / 100.0, buyers[i % userCount]);
+    }
+    double bidNs = nsPerOp(start, size);
+    start = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        auction.sendMessage(buyers[i % userCount]->getUsername(), "message " + std::to_string(i), ids[pick(rng)]);
+    }
+    double messageNs = nsPerOp(start, size);
+    StreamWriter sink(cout);
+    start = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        auction.displayChat(ids[pick(rng)], sink);
+    }
+    double chatNs = nsPerOp(start, size);
+    cout.rdbuf(saved);
+    report("bidItem", "ns_per_op", bidNs);
+    report("sendMessage", "ns_per_op", messageNs);
+    report("displayChat", "ns_per_op", chatNs);
+
+    const size_t checks = 1000000;
+    size_t matched = 0;
+    const string password = "pw0";
+    start = Clock::now();
+    for (size_t i = 0; i < checks; ++i) {
+        matched += buyers[0]->checkPassword(password);
+    }
+    report("checkPassword", "ns_per_op", nsPerOp(start, checks));
+
+    auto timed = [&report](const string &op, const std::function<void()> &action) {
+        auto begin = Clock::now();
+        action();
+        report(op, "ms", msSince(begin));
+    };
+    timed("saveUsersToFile", [&] { saveUsersToFile(accounts, "bench_users.txt"); });
+    timed("saveItemsToFile", [&] { auction.saveItemsToFile("bench_items.txt"); });
+    timed("saveMessagesToFile", [&] { auction.saveMessagesToFile("bench_messages.txt"); });
+    timed("saveSnapshot", [&] { saveSnapshot(auction, accounts, "bench.snap"); });
+    {
+        Accounts loaded;
+        timed("loadUsersFromFile", [&] { loadUsersFromFile(loaded, "bench_users.txt"); });
+    }
+    {
+        Auction loaded;
+        timed("loadItemsFromFile", [&] { loaded.loadItemsFromFile("bench_items.txt"); });
+        timed("loadMessagesFromFile", [&] { loaded.loadMessagesFromFile("bench_messages.txt"); });
+    }
+    {
+        Auction loaded;
+        Accounts loadedAccounts;
+        timed("loadSnapshot", [&] { loadSnapshot(loaded, loadedAccounts, "bench.snap"); });
+    }
+    for (const char *name : {"bench_users.txt", "bench_items.txt", "bench_messages.txt", "bench.snap"}) {
+        std::remove(name);
+    }
+
+    cout.rdbuf(nullptr);
+    start = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        auction.buyItem(names[i], buyers[i % userCount]);
+    }
+    double buyNs = nsPerOp(start, size);
+    cout.rdbuf(saved);
+    report("buyItem", "ns_per_op", buyNs);
+    return matched == checks && auction.itemCount() == 0;
+}
+
+// Длинный хвост: --size лотов, популярность которых падает по степенному
+// закону, так что большая часть ставок приходится на холодные лоты вне кэша.
+// Каждая сотая операция — покупка лота и выставление нового на его место.
+bool longTail(const Options &options) {
+    const size_t size = options.sizeOr(1000000);
+    const size_t threads = options.threads;
+    const size_t opsPerThread = 200000;
+    Auction auction(threads * 4);
+    UserId owner = UserDirectory::instance().intern("bench");
+    vector<std::atomic<ItemId>> ids(size);
+    for (size_t i = 0; i < size; ++i) {
+        ids[i] = auction.addItem({kNoItem, "tail" + std::to_string(i), 1.0, owner});
+    }
+    std::atomic<size_t> accepted{0};
+    std::atomic<size_t> relisted{0};
+    vector<std::thread> workers;
+    auto start = Clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng(static_cast<unsigned>(t + 17));
+            std::uniform_real_distribution<double> unit(0.0, 1.0);
+            size_t won = 0;
+            for (size_t i = 0; i < opsPerThread; ++i) {
+                double u = unit(rng);
+                size_t slot = std::min(size - 1, static_cast<size_t>(u * u * u * static_cast<double>(size)));
+                ItemId id = ids[slot].load();
+                if (i % 100 == 99) {
+                    if (auction.removeItem(id)) {
+                        ids[slot] = auction.addItem({kNoItem, "tail" + std::to_string(size + t * opsPerThread + i), 1.0, owner});
+                        ++relisted;
+                    }
+                    continue;
+                }
+                double price = 0;
+                if (auction.readPrice(id, &price) &&
+                    auction.placeBid(id, price + 0.01, nullptr, static_cast<uint32_t>(t)) == BidStatus::Accepted) {
+                    ++won;
+                }
+            }
+            accepted += won;
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double opNs = nsPerOp(start, threads * opsPerThread);
+    bool ok = auction.itemCount() == size;
+    Row("longtail").add("size", size).add("threads", threads).add("op_ns", opNs)
+        .add("accepted", uint64_t(accepted.load())).add("relisted", uint64_t(relisted.load())).result(ok).print(options);
+    return ok;
+}
+
+// Чат-нагрузка: потоки пишут в чаты --size лотов и открывают последние
+// страницы чатов, четыре сообщения на одно чтение. В конце число сообщений
+// в хранилище сверяется с числом отправленных.
+bool chatHeavy(const Options &options) {
+    const size_t lots = options.sizeOr(100000);
+    const size_t threads = options.threads;
+    const size_t opsPerThread = 200000;
+    Auction auction;
+    std::atomic<size_t> sent{0};
+    vector<std::thread> workers;
+    auto start = Clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng(static_cast<unsigned>(t + 29));
+            std::uniform_int_distribution<size_t> pick(1, lots);
+            string sender = "chatter" + std::to_string(t);
+            vector<Message> page;
+            size_t written = 0;
+            for (size_t i = 0; i < opsPerThread; ++i) {
+                if (i % 5 == 4) {
+                    page.clear();
+                    auction.chatHistory(pick(rng), Auction::kChatEnd, 50, page);
+                    continue;
+                }
+                auction.sendMessage(sender, "message " + std::to_string(i), pick(rng));
+                ++written;
+            }
+            sent += written;
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double opNs = nsPerOp(start, threads * opsPerThread);
+    size_t stored = 0;
+    auction.forEachMessage([&stored](const Message &) { ++stored; });
+    bool ok = stored == sent.load();
+    Row("chatty").add("lots", lots).add("threads", threads).add("op_ns", opNs).add("messages", uint64_t(stored))
+        .result(ok).print(options);
+    return ok;
+}
+
+// Торги со сроками на модельных часах: --size лотов со сроками от минуты до
+// недели, ставки с продлением за последние 30 секунд, время идёт шагами по
+// минуте, а ставки «в последний момент» двигают его точно к своему времени.
+// Каждый итог сверяется с моделью: лот закрыт ровно один раз, в срок с
+// учётом продлений и за последним принятым участником. Прогон делается
+// дважды, последовательности итогов должны совпасть.
+bool timedExpiry(const Options &options) {
+    const size_t size = options.sizeOr(1000000);
+    const uint64_t start = 1700000000000ull;
+    const uint64_t step = 60 * 1000;
+    const uint64_t window = 30 * 1000;
+    const uint64_t week = 7 * 24 * 3600 * 1000ull;
+    const size_t bidders = 1000;
+    vector<UserId> bidderIds;
+    for (size_t i = 0; i < bidders; ++i) {
+        bidderIds.push_back(UserDirectory::instance().intern("bidder" + std::to_string(i)));
+    }
+    UserId owner = UserDirectory::instance().intern("seller");
+
+    Row row("expiry");
+    row.add("size", size);
+    auto runOnce = [&](bool report, uint64_t &digest) {
+        Auction auction(16);
+        auction.setAntiSniping(window, window);
+        auction.advanceClock(start);
+        std::mt19937_64 rng(17);
+        vector<uint64_t> ends(size);
+        vector<uint64_t> cents(size, 100);
+        vector<UserId> leader(size, kNoUser);
+        vector<uint8_t> closed(size, 0);
+        ItemId first = kNoItem;
+        for (size_t i = 0; i < size; ++i) {
+            ends[i] = start + step + rng() % week;
+            ItemId id = auction.addItem({kNoItem, "lot" + std::to_string(i), 1.0, owner, Item::kNoBidder, ends[i]});
+            first = i == 0 ? id : first;
+        }
+        bool ok = true;
+        digest = 0;
+        auction.onSettlement([&](const Settlement &settlement) {
+            size_t index = static_cast<size_t>(settlement.id - first);
+            if (index >= size || closed[index]++ || settlement.closedAt != ends[index] ||
+                settlement.winner != leader[index] || settlement.cents != cents[index]) {
+                ok = false;
+            }
+            digest = digest * 1099511628211ull ^ (index * 31 + settlement.closedAt);
+        });
+
+        // Ставка по модели: принимается, пока срок не вышел, и продлевает
+        // торги, если до конца меньше window.
+        size_t accepted = 0;
+        auto bid = [&](size_t index) {
+            uint64_t now = auction.now();
+            UserId bidder = bidderIds[rng() % bidders];
+            BidStatus status = auction.placeBid(first + index, Item::fromCents(cents[index] + 1), nullptr, bidder);
+            bool open = now < ends[index];
+            if ((status == BidStatus::Accepted) != open) {
+                ok = false;
+            }
+            if (status == BidStatus::Accepted) {
+                ++accepted;
+                cents[index] += 1;
+                leader[index] = bidder;
+                if (ends[index] - now < window) {
+                    ends[index] = std::max(ends[index], now + window);
+                }
+            }
+        };
+
+        // Пустые продвижения: таймеров миллион, но ни один не срабатывает.
+        const size_t idleSteps = 100000;
+        auto idleStart = Clock::now();
+        for (size_t i = 1; i <= idleSteps; ++i) {
+            auction.advanceClock(start + i % step);
+        }
+        double idleNs = nsPerOp(idleStart, idleSteps);
+
+        // Ставки «в последний момент» на каждый сотый лот за 10 секунд до срока.
+        vector<pair<uint64_t, size_t>> snipes;
+        for (size_t i = 0; i < size; i += 100) {
+            snipes.emplace_back(ends[i] - 10000, i);
+        }
+        std::sort(snipes.begin(), snipes.end());
+        size_t nextSnipe = 0;
+        const size_t steps = week / step + 2;
+        const size_t bidsPerStep = std::max<size_t>(size / steps, 1);
+        double advanceNs = 0;
+        for (size_t s = 1; s <= steps + 1; ++s) {
+            uint64_t target = start + s * step;
+            for (size_t b = 0; b < bidsPerStep; ++b) {
+                bid(rng() % size);
+            }
+            auto advanceStart = Clock::now();
+            while (nextSnipe < snipes.size() && snipes[nextSnipe].first <= target) {
+                auction.advanceClock(std::max(snipes[nextSnipe].first, auction.now()));
+                bid(snipes[nextSnipe++].second);
+            }
+            auction.advanceClock(target);
+            advanceNs += std::chrono::duration<double, std::nano>(Clock::now() - advanceStart).count();
+        }
+        ok = ok && auction.itemCount() == 0 && auction.pendingDeadlines() == 0 &&
+             std::count(closed.begin(), closed.end(), 1) == static_cast<std::ptrdiff_t>(size);
+        if (report) {
+            row.add("idle_advance_ns", idleNs).add("expire_ns", advanceNs / static_cast<double>(size))
+                .add("bids_accepted", uint64_t(accepted));
+        }
+        return ok;
+    };
+    uint64_t firstDigest = 0;
+    uint64_t secondDigest = 0;
+    bool ok = runOnce(true, firstDigest);
+
+    // Само колесо без аукциона: постановка и срабатывание одного таймера.
+    TimerWheel wheel;
+    std::mt19937_64 rng(23);
+    size_t fired = 0;
+    uint64_t last = 0;
+    wheel.advance(start, [](const TimerWheel::Timer &) {});
+    auto wheelStart = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        wheel.schedule(start + 1 + rng() % week, i);
+    }
+    for (uint64_t now = start; now <= start + week + step; now += step) {
+        wheel.advance(now, [&](const TimerWheel::Timer &timer) {
+            ok = ok && timer.deadline >= last && timer.deadline <= now;
+            last = timer.deadline;
+            ++fired;
+        });
+    }
+    row.add("wheel_ns", nsPerOp(wheelStart, size));
+    ok = ok && fired == size && wheel.size() == 0;
+    ok = runOnce(false, secondDigest) && ok && firstDigest == secondDigest;
+    row.result(ok).print(options);
+    return ok;
+}
+
+// Регистрация и вход при росте числа аккаунтов. Вход замеряется при
+// тысячной доле каталога и при полном каталоге и должен стоить одинаково;
+// регистрация — одна запись журнала, из которого аккаунты потом
+// восстанавливаются. Последний замер — вход из --threads потоков сразу.
+bool accountScaling(const Options &options) {
+    const size_t size = std::max<size_t>(options.sizeOr(1000000), 1000);
+    const size_t logins = 200000;
+    const size_t threads = std::max<size_t>(options.threads, 1);
+    const string walPath = "bench_accounts.wal";
+    std::remove(walPath.c_str());
+    vector<string> names;
+    names.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        names.push_back("acct" + std::to_string(i));
+    }
+    const string password = "secret";
+
+    Accounts accounts;
+    std::atomic<bool> ok{true};
+    auto loginNs = [&](size_t registered) {
+        std::mt19937 rng(5);
+        std::uniform_int_distribution<size_t> pick(0, registered - 1);
+        auto start = Clock::now();
+        for (size_t i = 0; i < logins; ++i) {
+            if (!accounts.login(names[pick(rng)], password)) {
+                ok = false;
+            }
+        }
+        return nsPerOp(start, logins);
+    };
+
+    Row row("accounts");
+    row.add("size", size);
+    {
+        WriteAheadLog wal(walPath, FsyncPolicy::Never);
+        accounts.attachLog(&wal);
+        const size_t small = size / 1000;
+        auto start = Clock::now();
+        for (size_t i = 0; i < small; ++i) {
+            accounts.registerUser(names[i], password);
+        }
+        auto elapsed = Clock::now() - start;
+        row.add("login_small_ns", loginNs(small));
+        start = Clock::now();
+        for (size_t i = small; i < size; ++i) {
+            accounts.registerUser(names[i], password);
+        }
+        elapsed += Clock::now() - start;
+        row.add("register_ns", std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(size));
+        row.add("login_full_ns", loginNs(size));
+        if (accounts.registerUser(names[0], "other") || !accounts.login(names[0], password) ||
+            accounts.login(names[0], "other") || accounts.size() != size) {
+            ok = false;
+        }
+        wal.flush();
+        accounts.attachLog(nullptr);
+    }
+    struct stat info{};
+    ::stat(walPath.c_str(), &info);
+    row.add("wal_bytes_per_user", static_cast<double>(info.st_size) / static_cast<double>(size));
+
+    Accounts restored;
+    WriteAheadLog::replay(walPath, [&restored](const WalRecord &record) {
+        restored.add(make_unique<Buyer>(record.name, static_cast<size_t>(record.passwordHash)));
+    });
+    std::remove(walPath.c_str());
+    if (restored.size() != size || !restored.login(names[size - 1], password)) {
+        ok = false;
+    }
+
+    vector<std::thread> workers;
+    auto start = Clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&] { loginNs(size); });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    row.add("parallel_logins_per_sec", static_cast<double>(threads * logins) / (msSince(start) / 1000.0));
+    row.result(ok).print(options);
+    return ok;
+}
+
+// Цена записи метрик: пустой замер Timer и запись готового значения в
+// одном потоке и в --threads потоках. Время потоков берётся по их
+// собственным часам CPU, чтобы на малом числе ядер не считать ожидание.
+// Заодно проверяется, что чтение сводит счётчики всех потоков без потерь.
+// Timer дороже kTimerBudgetNs в одном или в нескольких потоках — провал.
+bool metricsOverhead(const Options &options) {
+    // Столько наносекунд в среднем может стоить Timer на событие.
+    const double kTimerBudgetNs = 50;
+    const size_t events = options.sizeOr(10000000);
+    const size_t threads = std::max<size_t>(options.threads, 1);
+    auto countOf = [](const char *name) {
+        for (const auto &op : metrics::collect().ops) {
+            if (std::strcmp(op.name, name) == 0) {
+                return op.count;
+            }
+        }
+        return uint64_t(0);
+    };
+    auto cpuNs = [] {
+        timespec now{};
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return static_cast<double>(now.tv_sec) * 1e9 + static_cast<double>(now.tv_nsec);
+    };
+    uint64_t before = countOf("query");
+
+    double start = cpuNs();
+    for (size_t i = 0; i < events; ++i) {
+        metrics::Timer timer(metrics::Op::Query);
+    }
+    double timerNs = (cpuNs() - start) / static_cast<double>(events);
+
+    start = cpuNs();
+    for (size_t i = 0; i < events; ++i) {
+        metrics::record(metrics::Op::Query, i & 0xFFFF);
+    }
+    double recordNs = (cpuNs() - start) / static_cast<double>(events);
+
+    vector<double> perThread(threads);
+    vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            double begin = cpuNs();
+            for (size_t i = 0; i < events / threads; ++i) {
+                metrics::Timer timer(metrics::Op::Query);
+            }
+            perThread[t] = (cpuNs() - begin) / static_cast<double>(events / threads);
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double parallelNs = *std::max_element(perThread.begin(), perThread.end());
+
+    auto collectStart = Clock::now();
+    uint64_t after = countOf("query");
+    double collectMs = msSince(collectStart);
+    bool ok = after - before == 2 * events + threads * (events / threads) && timerNs <= kTimerBudgetNs &&
+              parallelNs <= kTimerBudgetNs;
+    Row("metrics").add("events", events).add("threads", threads).add("timer_ns", timerNs).add("record_ns", recordNs)
+        .add("parallel_timer_ns", parallelNs).add("collect_ms", collectMs).result(ok).print(options);
+    return ok;
+}
+
+// История ставок и заявки с автоповышением. Сначала на --size/100 лотов
+// подаются заявки от разных участников в случайном порядке, у половины лотов
+// есть резервная цена. Отклонить можно только заявку не выше цены; итог
+// лота по принятым заявкам сверяется с моделью: лидирует наибольшая заявка
+// (при равенстве — более ранняя), цена — вторая заявка плюс шаг, но не выше
+// первой и не ниже резерва, если первая его покрывает.
+// Затем --size ручных ставок вперемешку с заявками идут на сотню горячих
+// лотов: история каждого должна расти монотонно и кончаться ценой и лидером
+// лота. Память считается на ставку, чтение последних ставок — на горячем лоте.
+bool bidLedger(const Options &options) {
+    const size_t size = std::max<size_t>(options.sizeOr(1000000), 1000);
+    const size_t proxyLots = size / 100;
+    const size_t hotLots = 100;
+    const size_t bidders = 1000;
+    vector<UserId> bidderIds;
+    for (size_t i = 0; i < bidders; ++i) {
+        bidderIds.push_back(UserDirectory::instance().intern("bidder" + std::to_string(i)));
+    }
+    UserId owner = UserDirectory::instance().intern("seller");
+    auto increment = [](uint64_t cents) { return std::max<uint64_t>(1, cents / 100); };
+    std::mt19937_64 rng(29);
+    bool ok = true;
+    Row row("ledger");
+    row.add("size", size);
+
+    Auction proxyAuction(16);
+    size_t proxies = 0;
+    auto proxyStart = Clock::now();
+    for (size_t lot = 0; lot < proxyLots; ++lot) {
+        uint64_t reserve = lot % 2 ? 0 : 100 + rng() % 5000;
+        ItemId id = proxyAuction.addItem({kNoItem, "proxy" + std::to_string(lot), 1.0, owner, Item::kNoBidder, 0,
+                                          Item::fromCents(reserve)});
+        size_t count = 1 + rng() % 8;
+        vector<pair<uint64_t, size_t>> submitted;
+        for (size_t k = 0; k < count; ++k) {
+            uint64_t max = 101 + rng() % 5000;
+            double current = 0;
+            if (proxyAuction.placeProxyBid(id, Item::fromCents(max), &current, bidderIds[(lot + k) % bidders]) ==
+                BidStatus::TooLow) {
+                ok = ok && max <= Item::toCents(current);
+            } else {
+                submitted.emplace_back(max, k);
+            }
+        }
+        proxies += count;
+        std::stable_sort(submitted.begin(), submitted.end(),
+                         [](const auto &a, const auto &b) { return a.first > b.first; });
+        uint64_t top = submitted[0].first;
+        uint64_t price = submitted.size() == 1 ? std::min(top, 100 + increment(100))
+                         : top == submitted[1].first ? top
+                                                     : std::min(top, submitted[1].first + increment(submitted[1].first));
+        if (reserve > price && top >= reserve) {
+            price = reserve;
+        }
+        vector<BidBook::Entry> last = proxyAuction.bidHistory(id, 1);
+        double current = 0;
+        proxyAuction.readPrice(id, &current);
+        if (last.empty() || Item::toCents(current) != price || last[0].cents != price ||
+            last[0].bidder != bidderIds[(lot + submitted[0].second) % bidders]) {
+            ok = false;
+        }
+    }
+    row.add("proxy_ns", nsPerOp(proxyStart, proxies));
+
+    // Горячие лоты: каждая десятая ставка — заявка с запасом до 5 рублей.
+    Auction auction(16);
+    vector<ItemId> hot;
+    for (size_t i = 0; i < hotLots; ++i) {
+        hot.push_back(auction.addItem({kNoItem, "hot" + std::to_string(i), 1.0, owner}));
+    }
+    vector<uint64_t> cents(hotLots, 100);
+    auto bidStart = Clock::now();
+    for (size_t i = 0; i < size; ++i) {
+        size_t lot = rng() % hotLots;
+        UserId bidder = bidderIds[rng() % bidders];
+        uint64_t amount = cents[lot] + 1 + rng() % (i % 10 == 0 ? 500 : 100);
+        double current = 0;
+        if (i % 10 == 0) {
+            auction.placeProxyBid(hot[lot], Item::fromCents(amount), &current, bidder);
+        } else {
+            auction.placeBid(hot[lot], Item::fromCents(amount), &current, bidder);
+        }
+        cents[lot] = Item::toCents(current);
+    }
+    row.add("bid_ns", nsPerOp(bidStart, size));
+
+    pair<size_t, size_t> usage = auction.bidLedgerUsage();
+    row.add("bids", uint64_t(usage.second))
+        .add("bytes_per_bid", static_cast<double>(usage.first) / static_cast<double>(usage.second));
+    for (size_t lot = 0; lot < hotLots && ok; ++lot) {
+        vector<BidBook::Entry> entries = auction.bidHistory(hot[lot], SIZE_MAX);
+        for (size_t i = 1; i < entries.size(); ++i) {
+            ok = ok && entries[i].cents <= entries[i - 1].cents;
+        }
+        double current = 0;
+        auction.readPrice(hot[lot], &current);
+        ok = ok && !entries.empty() && entries[0].cents == Item::toCents(current);
+    }
+
+    const size_t reads = 1000000;
+    vector<BidBook::Entry> recent;
+    uint64_t checksum = 0;
+    auto readStart = Clock::now();
+    for (size_t i = 0; i < reads; ++i) {
+        recent = auction.bidHistory(hot[i % 4], 10);
+        checksum += recent[0].cents;
+    }
+    row.add("recent10_ns", nsPerOp(readStart, reads));
+    ok = ok && checksum != 0;
+    row.result(ok).print(options);
+    return ok;
+}
+
+// Поиск по названиям: --size лотов с названиями вида «Красная лампа Philips
+// м4821»; редкий запрос — артикул лота из середины каталога. Каждый запрос замеряется на полном каталоге и сверяется с полным
+// перебором названий, потом треть лотов покупается и сверка повторяется на
+// обновлённом индексе.
+bool nameSearch(const Options &options) {
+    const size_t size = options.sizeOr(1000000);
+    const size_t limit = 20;
+    const vector<string> adjectives = {"Красная", "Синий", "Старинная", "Новый", "Деревянный", "Ёлочная",
+                                       "Стеклянная", "Медный", "Детский", "Большая", "Винтажный", "Белая"};
+    const vector<string> nouns = {"лампа", "стол", "стул", "ваза", "игрушка", "лампочка", "книга", "часы",
+                                  "зеркало", "шкатулка", "комод", "кресло", "самовар", "картина", "Lamp", "Chair"};
+    const vector<string> brands = {"Philips", "IKEA", "Гжель", "Хохлома", "Braun", "Zepter", "Лофт", "Bosch"};
+    std::mt19937_64 rng(31);
+    UserId owner = UserDirectory::instance().intern("seller");
+    Auction auction(16);
+    vector<string> names;
+    names.reserve(size);
+    vector<ItemRecord> batch;
+    for (size_t i = 0; i < size; ++i) {
+        names.push_back(adjectives[rng() % adjectives.size()] + " " + nouns[rng() % nouns.size()] + " " +
+                        brands[rng() % brands.size()] + " м" + std::to_string(rng() % 100000));
+    }
+    auto start = Clock::now();
+    ItemId first = kNoItem;
+    for (size_t i = 0; i < size; ++i) {
+        ItemId id = auction.addItem({kNoItem, names[i], 1.0, owner});
+        first = i == 0 ? id : first;
+    }
+    Row row("search");
+    row.add("size", size).add("add_ns", nsPerOp(start, size));
+    pair<size_t, size_t> usage = auction.searchIndexUsage();
+    row.add("index_bytes_per_lot", static_cast<double>(usage.first) / static_cast<double>(size))
+        .add("bytes_per_posting", static_cast<double>(usage.first) / static_cast<double>(usage.second));
+
+    const vector<pair<const char *, string>> queries = {
+        {"word", "самовар"}, {"prefix", "лам"}, {"letter", "к"}, {"and", "ёлочная игр гжель"},
+        {"substring", "*ампоч"}, {"rare", names[size / 2].substr(names[size / 2].rfind(' ') + 1)}, {"latin", "PHIL"}, {"miss", "самолёт"}};
+    vector<bool> alive(size, true);
+    auto check = [&](const string &text) {
+        search::Query query(text);
+        vector<ItemId> expected;
+        for (size_t i = 0; i < size && expected.size() < limit; ++i) {
+            if (alive[i] && query.matches(names[i])) {
+                expected.push_back(first + i);
+            }
+        }
+        vector<ItemListing> found = auction.searchItems(text, limit);
+        bool same = found.size() == expected.size();
+        for (size_t i = 0; same && i < found.size(); ++i) {
+            same = found[i].id == expected[i];
+        }
+        return same;
+    };
+    bool ok = true;
+    for (const auto &query : queries) {
+        const size_t runs = 2000;
+        size_t found = 0;
+        auto queryStart = Clock::now();
+        for (size_t r = 0; r < runs; ++r) {
+            found += auction.searchItems(query.second, limit).size();
+        }
+        row.add(string(query.first) + "_us", nsPerOp(queryStart, runs) / 1000.0);
+        ok = ok && check(query.second) && (found != 0) == (string(query.first) != "miss");
+    }
+    for (size_t i = 0; i < size; i += 3) {
+        auction.removeItem(first + i);
+        alive[i] = false;
+    }
+    for (const auto &query : queries) {
+        ok = ok && check(query.second);
+    }
+    row.result(ok).print(options);
+    return ok;
+}
+
+// Вывод каталога из --size лотов в /dev/null: построчно через поток с endl,
+// как раньше выводило меню, против страниц listItems через StreamWriter со
+// сбросом на границе страницы. Отдельно — цена первой и глубокой страницы и
+// список чатов. В конце каталог пролистывается, пока между страницами
+// удаляется каждый третий лот: лоты, прожившие весь обход, должны прийти
+// ровно по разу и по возрастанию ID.
+bool catalogListing(const Options &options) {
+    const size_t size = options.sizeOr(200000);
+    UserId owner = UserDirectory::instance().intern("seller");
+    Auction auction(16);
+    ItemId first = kNoItem;
+    for (size_t i = 0; i < size; ++i) {
+        ItemId id = auction.addItem({kNoItem, "Лот каталога № " + std::to_string(i), 1.0 + double(i % 1000), owner});
+        first = i == 0 ? id : first;
+        if (i % 10 == 0) {
+            auction.sendMessage("u" + std::to_string(i % 97), "вопрос по лоту", id);
+        }
+    }
+    Row row("listing");
+    row.add("size", size);
+    std::ofstream sink("/dev/null");
+    auto rowsPerSecond = [](Clock::time_point start, size_t rows) {
+        return static_cast<double>(rows) * 1e9 / std::max(nsPerOp(start, 1), 1.0);
+    };
+
+    auto start = Clock::now();
+    size_t rows = 0;
+    auction.forEachItem([&](const Item &item) {
+        sink << "ID: " << item.getId() << ", Товар: " << item.getName() << ", Цена: " << item.getPrice()
+             << ", Продавец: " << item.getOwner() << endl;
+        ++rows;
+    });
+    row.add("endl_rows_per_s", rowsPerSecond(start, rows));
+    {
+        StreamWriter out(sink);
+        start = Clock::now();
+        auction.displayItems(out);
+        row.add("paged_rows_per_s", rowsPerSecond(start, size));
+        start = Clock::now();
+        auction.displayMessages(out);
+        row.add("chat_rows_per_s", rowsPerSecond(start, (size + 9) / 10));
+    }
+
+    vector<ItemListing> page;
+    const size_t runs = 1000;
+    for (auto depth : {pair<const char *, ItemId>{"first_page_us", kNoItem}, {"deep_page_us", first + size * 9 / 10}}) {
+        start = Clock::now();
+        for (size_t r = 0; r < runs; ++r) {
+            auction.listItems(depth.second, 50, page);
+        }
+        row.add(depth.first, nsPerOp(start, runs) / 1000.0);
+    }
+
+    bool ok = true;
+    vector<bool> seen(size, false);
+    ItemId cursor = kNoItem;
+    ItemId previous = kNoItem;
+    size_t removeAt = 0;
+    do {
+        cursor = auction.listItems(cursor, Auction::kListPage, page);
+        for (const auto &listing : page) {
+            size_t index = static_cast<size_t>(listing.id - first);
+            ok = ok && listing.id > previous && index < size && !seen[index];
+            previous = listing.id;
+            seen[std::min(index, size - 1)] = true;
+        }
+        for (size_t k = 0; k < Auction::kListPage && removeAt < size; ++k, removeAt += 3) {
+            auction.removeItem(first + removeAt);
+        }
+    } while (cursor != kNoItem);
+    for (size_t i = 0; i < size; ++i) {
+        ok = ok && (seen[i] || i % 3 == 0);
+    }
+    row.result(ok).print(options);
+    return ok;
+}
+
+// Холодный ярус чатов: --size чатов по 10 сообщений, затем бюджет RSS
+// ставится так, чтобы в памяти осталась примерно четверть истории, и одна
+// проверка ChatBudget вытесняет остальное. Замеряются RSS до и после,
+// степень сжатия сегментов, чтение горячего и холодного чата, а в конце
+// сверяются тексты вернувшихся в память чатов и полный обход истории.
+bool chatTiering(const Options &options) {
+    const size_t size = options.sizeOr(200000);
+    const size_t perChat = 10;
+    const vector<string> phrases = {"Добрый день! Лот ещё доступен?", "Можно забрать сегодня вечером?",
+                                    "Отправите почтой в другой город?", "Предлагаю свою цену, подумайте.",
+                                    "Есть ли документы и коробка?", "Спасибо, ставку сделал."};
+    auto text = [&phrases](size_t chat, size_t i) {
+        return phrases[(chat + i) % phrases.size()] + " #" + std::to_string(chat * 31 + i);
+    };
+    Row row("tiering");
+    row.add("chats", size);
+    ::malloc_trim(0);
+    size_t base = residentBytes();
+    // Аукцион закрывается до удаления каталога: его сегменты удаляет он сам.
+    bool ok = true;
+    {
+        Auction auction;
+        auction.enableColdChats("bench.cold");
+        for (size_t i = 0; i < perChat; ++i) {
+            for (size_t chat = 1; chat <= size; ++chat) {
+                auction.sendMessage("u" + std::to_string((chat + i) % 500), text(chat, i), ItemId(chat));
+            }
+        }
+        // Последняя десятая часть чатов — свежие: они останутся в памяти.
+        vector<Message> page;
+        uint64_t recent = auction.chatTick();
+        for (size_t chat = size - size / 10 + 1; chat <= size; ++chat) {
+            page.clear();
+            auction.chatHistory(ItemId(chat), Auction::kChatEnd, 1, page);
+        }
+        size_t before = residentBytes();
+        size_t budget = base + (before - base) / 4;
+        row.add("rss_mb", (before - base) / double(1 << 20)).add("budget_mb", (budget - base) / double(1 << 20));
+        auto start = Clock::now();
+        {
+            ChatBudget limiter(auction, budget, std::chrono::hours(1));
+            limiter.enforce(recent);
+        }
+        row.add("evict_ms", msSince(start));
+        size_t after = residentBytes();
+        Auction::ChatTiers tiers = auction.chatTiers();
+        row.add("rss_after_mb", (after - base) / double(1 << 20))
+            .add("cold_chats", uint64_t(tiers.coldChats))
+            .add("ratio", double(tiers.coldOriginalBytes) / double(std::max<uint64_t>(tiers.coldDiskBytes, 1)));
+
+        const size_t reads = std::min<size_t>(10000, tiers.coldChats);
+        start = Clock::now();
+        for (size_t i = 0; i < reads; ++i) {
+            page.clear();
+            auction.chatHistory(ItemId(size - i % (size / 10)), Auction::kChatEnd, perChat, page);
+        }
+        row.add("hot_read_us", nsPerOp(start, std::max<size_t>(reads, 1)) / 1000.0);
+        ok = tiers.coldChats > 0 && after < before;
+        std::mt19937 rng(5);
+        start = Clock::now();
+        for (size_t i = 0; i < reads; ++i) {
+            // Холодные чаты — первые по ID; шаг 7 раскидывает чтения по блокам.
+            ItemId chat = ItemId(1 + (i * 7919 + rng() % 7) % (tiers.coldChats));
+            page.clear();
+            auction.chatHistory(chat, Auction::kChatEnd, perChat, page);
+            for (size_t k = 0; k < page.size(); ++k) {
+                ok = ok && page[k].getContent() == text(chat, k) && page.size() == perChat;
+            }
+        }
+        row.add("cold_read_us", nsPerOp(start, std::max<size_t>(reads, 1)) / 1000.0);
+        size_t total = 0;
+        auction.forEachMessage([&total](const Message &) { ++total; });
+        ok = ok && total == size * perChat;
+    }
+    row.result(ok).print(options);
+    ::rmdir("bench.cold");
+    return ok;
+}
+
+// Контрольные точки на каталоге из --size лотов со ставками и чатами. Первая
+// точка пишет всё, следующие — только разделы, задетые ставками по свежим
+// лотам, вместе с их историей ставок; для сравнения в конце замеряется
+// полный снимок. Потоки ставят без перерыва
+// сначала без точек, потом с ними подряд, и сравнивается хвост задержки
+// ставки. В конце состояние поднимается из точки и журнала и сверяется с
+// памятью.
+bool checkpointPause(const Options &options) {
+    const size_t size = options.sizeOr(1000000);
+    const size_t threads = options.threads;
+    const size_t bidsPerThread = 50000;
+    const size_t hotLots = 1000;
+    const string dir = "bench.ckpt";
+    const string walPath = "bench_ckpt.wal";
+    auto cleanup = [&] {
+        if (DIR *listing = ::opendir(dir.c_str())) {
+            while (dirent *entry = ::readdir(listing)) {
+                string name = entry->d_name;
+                if (name != "." && name != "..") {
+                    ::unlink((dir + "/" + name).c_str());
+                }
+            }
+            ::closedir(listing);
+        }
+        ::rmdir(dir.c_str());
+        WriteAheadLog::dropSegments(walPath, UINT64_MAX);
+        std::remove(walPath.c_str());
+        std::remove("bench.snap");
+    };
+    cleanup();
+
+    UserDirectory &directory = UserDirectory::instance();
+    UserId owner = directory.intern("seller");
+    vector<UserId> bidders;
+    Accounts accounts;
+    for (size_t i = 0; i < 64; ++i) {
+        string name = "bidder" + std::to_string(i);
+        bidders.push_back(accounts.add(make_unique<Buyer>(name, "pw"))->getId());
+    }
+    std::mt19937_64 rng(37);
+    Auction auction(16);
+    vector<ItemId> ids;
+    ids.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        ids.push_back(auction.addItem({kNoItem, "lot" + std::to_string(i), 1.0, owner}));
+        if (i % 10 == 0) {
+            for (size_t b = 0; b < 4; ++b) {
+                auction.placeBid(ids.back(), 2.0 + static_cast<double>(b), nullptr, bidders[rng() % bidders.size()]);
+            }
+        }
+        if (i % 50 == 0) {
+            auction.sendMessage("seller", "Лот " + std::to_string(i) + " ещё в продаже", ids.back());
+        }
+    }
+
+    bool ok = true;
+    Row row("checkpoint");
+    row.add("size", size);
+    {
+        WriteAheadLog wal(walPath, FsyncPolicy::Never);
+        auction.attachLog(&wal);
+        accounts.attachLog(&wal);
+        auction.markAllChanged();
+        Checkpointer checkpointer(auction, accounts, wal, dir, walPath, CheckpointManifest(), std::chrono::milliseconds(0));
+        auto fullStart = Clock::now();
+        ok = checkpointer.checkpoint();
+        row.add("full_ms", msSince(fullStart)).add("full_kb", checkpointer.lastWrittenBytes() / 1024);
+
+        // Ставки по самым свежим лотам, каждая сотая — с сообщением в чат.
+        vector<std::atomic<uint64_t>> cents(hotLots);
+        for (auto &value : cents) {
+            value = 1000;
+        }
+        auto bidRound = [&](bool withCheckpoints, size_t &checkpoints, uint64_t &bytes, double &checkpointMs) {
+            vector<vector<uint32_t>> latencies(threads);
+            std::atomic<bool> done{false};
+            std::thread background;
+            if (withCheckpoints) {
+                background = std::thread([&] {
+                    while (!done.load()) {
+                        auto start = Clock::now();
+                        if (checkpointer.checkpoint()) {
+                            checkpointMs += msSince(start);
+                            bytes += checkpointer.lastWrittenBytes();
+                            ++checkpoints;
+                        }
+                    }
+                });
+            }
+            vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    std::mt19937_64 local(t + 1);
+                    latencies[t].reserve(bidsPerThread);
+                    for (size_t i = 0; i < bidsPerThread; ++i) {
+                        size_t lot = local() % hotLots;
+                        uint64_t amount = cents[lot].fetch_add(20) + 20;
+                        ItemId id = ids[size - 1 - lot];
+                        auto start = Clock::now();
+                        auction.placeBid(id, Item::fromCents(amount), nullptr, bidders[local() % bidders.size()]);
+                        latencies[t].push_back(static_cast<uint32_t>(
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+                        if (i % 100 == 0) {
+                            auction.sendMessage("bidder0", "ставка " + std::to_string(amount), id);
+                        }
+                    }
+                });
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            done = true;
+            if (background.joinable()) {
+                background.join();
+            }
+            vector<uint32_t> all;
+            for (const auto &part : latencies) {
+                all.insert(all.end(), part.begin(), part.end());
+            }
+            std::sort(all.begin(), all.end());
+            return pair<double, double>(static_cast<double>(all[all.size() * 99 / 100]) / 1000.0,
+                                        static_cast<double>(all[all.size() * 9999 / 10000]) / 1000.0);
+        };
+        size_t checkpoints = 0;
+        uint64_t bytes = 0;
+        double checkpointMs = 0;
+        pair<double, double> quiet = bidRound(false, checkpoints, bytes, checkpointMs);
+        pair<double, double> busy = bidRound(true, checkpoints, bytes, checkpointMs);
+        row.add("checkpoints", uint64_t(checkpoints))
+            .add("incremental_ms", checkpoints ? checkpointMs / static_cast<double>(checkpoints) : 0.0)
+            .add("incremental_kb", checkpoints ? bytes / checkpoints / 1024 : 0)
+            .add("bid_p99_us", quiet.first)
+            .add("bid_p99_us_ckpt", busy.first)
+            .add("bid_p9999_us", quiet.second)
+            .add("bid_p9999_us_ckpt", busy.second);
+        ok = ok && checkpoints > 0;
+        auto snapshotStart = Clock::now();
+        saveSnapshot(auction, accounts, "bench.snap");
+        struct stat st;
+        row.add("snapshot_ms", msSince(snapshotStart))
+            .add("snapshot_kb", ::stat("bench.snap", &st) == 0 ? static_cast<uint64_t>(st.st_size) / 1024 : 0);
+
+        // Хвост после последней точки остаётся только в журнале.
+        ok = ok && checkpointer.checkpoint();
+        for (size_t lot = 0; lot < 10; ++lot) {
+            auction.placeBid(ids[lot], 1000.0, nullptr, bidders[lot]);
+            auction.sendMessage("bidder1", "после точки", ids[lot]);
+        }
+        accounts.registerUser("late", "pw");
+        wal.flush();
+        auction.attachLog(nullptr);
+        accounts.attachLog(nullptr);
+    }
+
+    Auction restored(16);
+    Accounts restoredAccounts;
+    CheckpointManifest manifest;
+    auto loadStart = Clock::now();
+    ok = ok && Checkpointer::load(restored, restoredAccounts, dir, manifest);
+    WriteAheadLog::replaySegments(walPath, manifest.segment, [&](const WalRecord &record) {
+        if (record.type == WalRecordType::Register) {
+            restoredAccounts.add(make_unique<Buyer>(record.name, static_cast<size_t>(record.passwordHash)));
+        } else {
+            restored.applyLogRecord(record);
+        }
+    });
+    row.add("load_ms", msSince(loadStart));
+    {
+        Auction fromSnapshot(16);
+        Accounts snapshotAccounts;
+        auto snapshotLoad = Clock::now();
+        loadSnapshot(fromSnapshot, snapshotAccounts, "bench.snap");
+        row.add("snapshot_load_ms", msSince(snapshotLoad));
+    }
+    ok = ok && restored.itemCount() == auction.itemCount() && restoredAccounts.size() == accounts.size();
+    vector<Message> expected;
+    vector<Message> actual;
+    for (size_t i = 0; i < size && ok; ++i) {
+        double a = 0;
+        double b = 0;
+        ok = auction.readPrice(ids[i], &a) && restored.readPrice(ids[i], &b) && a == b &&
+             auction.bidHistory(ids[i], SIZE_MAX).size() == restored.bidHistory(ids[i], SIZE_MAX).size();
+        expected.clear();
+        actual.clear();
+        auction.chatHistory(ids[i], Auction::kChatEnd, SIZE_MAX, expected);
+        restored.chatHistory(ids[i], Auction::kChatEnd, SIZE_MAX, actual);
+        ok = ok && expected.size() == actual.size() &&
+             (expected.empty() || expected.back().getContent() == actual.back().getContent());
+    }
+    row.result(ok).print(options);
+    cleanup();
+    return ok;
+}
+
+// Рассылка уведомлений: --size подписчиков по 10 подписок на лоты
+// (каждый десятый вместо одной из них следит за продавцом), поток ставок
+// с темпом 105k в секунду и потоки-читатели, которые забирают из ready
+// подписчиков с новыми событиями и читают ящики быстрых из них. Каждый
+// десятый подписчик не читает до конца замера — его события сливаются.
+// Сравнивается хвост задержки ставки без рассылки и с ней. Провал, если
+// рассылка, считая дочитывание очереди после последней ставки (drain_ms),
+// разослала меньше kWatchEventsPerSec событий в секунду, если 99-й
+// перцентиль задержки доставки быстрым подписчикам больше
+// kWatchDeliveryP99Us или если медленные подписчики в конце не увидели
+// последнюю цену каждого своего лота.
+bool watchFanOut(const Options &options) {
+    const size_t subscribers = options.sizeOr(100000);
+    const size_t perSubscriber = 10;
+    const size_t lots = subscribers;
+    const size_t readers =
+        std::max<size_t>(1, std::min<size_t>(options.threads, std::thread::hardware_concurrency()) / 2);
+    const size_t rate = 105000;
+    const size_t bids = 210000;
+    // Столько событий в секунду должна разослать рассылка, считая и
+    // дочитывание очереди после последней ставки.
+    const double kWatchEventsPerSec = 100000;
+    // Граница 99-го перцентиля задержки доставки быстрым подписчикам, мкс.
+    // Хвост задают не очереди рассылки, а планировщик: на одном ядре ставки,
+    // рассылка и читатели делят процессор квантами по несколько миллисекунд.
+    const double kWatchDeliveryP99Us = 100000;
+    UserDirectory &directory = UserDirectory::instance();
+    vector<UserId> sellers;
+    for (size_t i = 0; i < subscribers / 10; ++i) {
+        sellers.push_back(directory.intern("watch_seller" + std::to_string(i)));
+    }
+    vector<UserId> users(subscribers);
+    for (size_t i = 0; i < subscribers; ++i) {
+        users[i] = directory.intern("watcher" + std::to_string(i));
+    }
+    Auction auction(16);
+    vector<ItemId> ids(lots);
+    for (size_t i = 0; i < lots; ++i) {
+        ids[i] = auction.addItem({kNoItem, "watched" + std::to_string(i), 1.0, sellers[i % sellers.size()]});
+    }
+    auto watched = [&](size_t user, size_t k) { return (user * 7919 + k * 104729) % lots; };
+    auto slow = [](size_t user) { return user % 10 == 9; };
+
+    // Ставки идут от имени отдельных участников, чтобы не подписывать
+    // подписчиков на лишние лоты. Участников по одному на десять
+    // подписчиков: сделавший ставку сам подписывается на лот, и горстка
+    // участников на весь поток ставок собрала бы подписки на весь каталог.
+    vector<UserId> bidders;
+    for (size_t i = 0; i < std::max<size_t>(subscribers / 10, 1); ++i) {
+        bidders.push_back(directory.intern("watch_bidder" + std::to_string(i)));
+    }
+    auto bidRound = [&](uint64_t firstCents, vector<uint32_t> &latencies) {
+        std::mt19937_64 rng(11);
+        latencies.clear();
+        latencies.reserve(bids);
+        auto start = Clock::now();
+        for (size_t i = 0; i < bids; ++i) {
+            // Засыпаем, только опередив график на миллисекунду: короткий сон
+            // дольше интервала между ставками.
+            auto due = start + std::chrono::nanoseconds(i * 1000000000ull / rate);
+            if (Clock::now() + std::chrono::milliseconds(1) < due) {
+                std::this_thread::sleep_until(due);
+            }
+            size_t lot = rng() % lots;
+            auto begin = Clock::now();
+            auction.placeBid(ids[lot], Item::fromCents(firstCents + i), nullptr, bidders[i % bidders.size()]);
+            latencies.push_back(static_cast<uint32_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count()));
+        }
+        std::sort(latencies.begin(), latencies.end());
+        return msSince(start);
+    };
+
+    Row row("watch");
+    vector<uint32_t> quiet;
+    bidRound(200, quiet);
+
+    watch::Dispatcher events(size_t(1) << 18);
+    auto subscribeStart = Clock::now();
+    for (size_t user = 0; user < subscribers; ++user) {
+        for (size_t k = 0; k < perSubscriber; ++k) {
+            if (k == 0 && user % 10 == 0) {
+                events.watchSeller(users[user], sellers[user % sellers.size()]);
+            } else {
+                events.watchItem(users[user], ids[watched(user, k)]);
+            }
+        }
+    }
+    row.add("subscriptions", uint64_t(events.stats().subscriptions))
+        .add("subscribe_ns", nsPerOp(subscribeStart, subscribers * perSubscriber));
+    auction.attachEvents(&events);
+
+    // Читатели получают ID пользователей, поэтому медленные отмечены по ID.
+    vector<char> slowUsers(*std::max_element(users.begin(), users.end()) + 1, 0);
+    for (size_t user = 0; user < subscribers; ++user) {
+        slowUsers[users[user]] = slow(user);
+    }
+    // Список готовых включается первым вызовом ready — до первой ставки.
+    vector<UserId> none;
+    events.ready(none);
+    std::atomic<bool> done{false};
+    // Место под задержки занято заранее: перевыделение посреди замера
+    // задержало бы читателя и само дало бы хвост.
+    vector<vector<uint32_t>> delays(readers);
+    for (auto &part : delays) {
+        part.reserve(bids * perSubscriber * 2 / readers);
+    }
+    vector<std::thread> pollers;
+    double perUs = metrics::ticksPerNs() * 1000.0;
+    for (size_t t = 0; t < readers; ++t) {
+        pollers.emplace_back([&, t] {
+            vector<UserId> ready;
+            vector<watch::Event> inbox;
+            while (!done.load(std::memory_order_relaxed)) {
+                if (events.ready(ready) == 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    continue;
+                }
+                for (size_t i = 0; i < ready.size(); ++i) {
+                    for (int step = 0; step < 3; ++step) {
+                        if (i + 12 - 4 * step < ready.size()) {
+                            events.prefetch(ready[i + 12 - 4 * step], step);
+                        }
+                    }
+                    UserId user = ready[i];
+                    if (user < slowUsers.size() && slowUsers[user]) {
+                        continue;
+                    }
+                    inbox.clear();
+                    events.poll(user, inbox, watch::Dispatcher::kInbox);
+                    uint64_t now = metrics::ticks();
+                    for (const auto &event : inbox) {
+                        delays[t].push_back(static_cast<uint32_t>(
+                            static_cast<double>(now > event.published ? now - event.published : 0) / perUs));
+                    }
+                }
+            }
+        });
+    }
+    vector<uint32_t> busy;
+    auto publishStart = Clock::now();
+    bidRound(1000000, busy);
+    // Дожидаемся, пока поток рассылки разберёт очередь: темп считается по
+    // разосланным событиям, а не по опубликованным.
+    auto drainStart = Clock::now();
+    while (events.stats().handled + events.stats().rejected < bids) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double elapsedMs = msSince(publishStart);
+    row.add("drain_ms", msSince(drainStart));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    done = true;
+    for (auto &poller : pollers) {
+        poller.join();
+    }
+    vector<uint32_t> all;
+    for (const auto &part : delays) {
+        all.insert(all.end(), part.begin(), part.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [](const vector<uint32_t> &sorted, double p) {
+        return sorted.empty() ? 0.0 : static_cast<double>(sorted[static_cast<size_t>(p * (sorted.size() - 1))]);
+    };
+
+    // Медленные подписчики дочитывают ящики: слитые события приходят по мере
+    // освобождения места, и последней по каждому лоту должна быть его цена.
+    double perSecond = static_cast<double>(bids) / elapsedMs * 1000.0;
+    bool ok = events.stats().rejected == 0 && perSecond >= kWatchEventsPerSec &&
+              percentile(all, 0.99) <= kWatchDeliveryP99Us;
+    vector<watch::Event> inbox;
+    for (size_t user = 9; user < subscribers && ok; user += 100) {
+        std::unordered_map<ItemId, uint64_t> latest;
+        for (size_t idle = 0; idle < 20;) {
+            inbox.clear();
+            if (events.poll(users[user], inbox, watch::Dispatcher::kInbox) == 0) {
+                ++idle;
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            idle = 0;
+            for (const auto &event : inbox) {
+                latest[event.itemId] = event.cents;
+            }
+        }
+        for (size_t k = 0; k < perSubscriber && ok; ++k) {
+            ItemId id = ids[watched(user, k)];
+            double price = 0;
+            auction.readPrice(id, &price);
+            auto seen = latest.find(id);
+            ok = price < Item::fromCents(1000000) || (seen != latest.end() && seen->second == Item::toCents(price));
+        }
+    }
+    auction.attachEvents(nullptr);
+    watch::Dispatcher::Stats stats = events.stats();
+    row.add("events_per_sec", perSecond)
+        .add("bid_p99_us", percentile(quiet, 0.99) / 1000.0)
+        .add("bid_p99_us_watch", percentile(busy, 0.99) / 1000.0)
+        .add("delivered", stats.delivered)
+        .add("coalesced", stats.coalesced)
+        .add("rejected", stats.rejected)
+        .add("delivery_p50_us", percentile(all, 0.5))
+        .add("delivery_p99_us", percentile(all, 0.99))
+        .add("delivery_max_us", all.empty() ? 0.0 : static_cast<double>(all.back()))
+        .result(ok)
+        .print(options);
+    return ok;
+}
+
+// Удаляет каталог со всем содержимым.
+void removeTree(const string &path) {
+    if (DIR *listing = ::opendir(path.c_str())) {
+        while (dirent *entry = ::readdir(listing)) {
+            string name = entry->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            string child = path + "/" + name;
+            struct stat st;
+            if (::lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                removeTree(child);
+            } else {
+                ::unlink(child.c_str());
+            }
+        }
+        ::closedir(listing);
+    }
+    ::rmdir(path.c_str());
+}
+
+// Шлёт пачку запросов и ждёт lines строк ответа.
+bool exchangeLines(int fd, std::string_view request, size_t lines, string &reply) {
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t written = ::send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(written);
+    }
+    reply.clear();
+    size_t seen = 0;
+    char chunk[65536];
+    while (seen < lines) {
+        ssize_t got = ::read(fd, chunk, sizeof(chunk));
+        if (got <= 0) {
+            return false;
+        }
+        seen += static_cast<size_t>(std::count(chunk, chunk + got, '\n'));
+        reply.append(chunk, static_cast<size_t>(got));
+    }
+    return true;
+}
+
+// Маршрутизатор с 1, 2, 4 и 8 процессами-шардами (или с --size шардами):
+// --threads клиентов шлют ставки по всему каталогу пачками по 256 строк.
+// Рост пропускной способности с числом шардов ограничен числом ядер
+// (cores), так как маршрутизатор, шарды и клиенты делят одну машину.
+// После замера добавляется ещё один шард, и каталог сверяется целиком.
+bool shardScaling(const Options &options) {
+    const size_t clients = options.threads;
+    const size_t lots = 20000;
+    const size_t burst = 256;
+    const size_t bidsPerClient = 40000;
+    const string dir = "bench.route";
+    const string path = dir + "/r.sock";
+    bool ok = true;
+    double baseline = 0;
+    for (size_t shards : options.sizesOr({1, 2, 4, 8})) {
+        removeTree(dir);
+        ::mkdir(dir.c_str(), 0755);
+        pid_t router = ::fork();
+        if (router == 0) {
+            int null = ::open("/dev/null", O_WRONLY);
+            ::dup2(null, STDOUT_FILENO);
+            string count = "--shards=" + std::to_string(shards);
+            if (::chdir(dir.c_str()) == 0) {
+                ::execl("/proc/self/exe", "auction", "route", "r.sock", count.c_str(), static_cast<char *>(nullptr));
+            }
+            ::_exit(127);
+        }
+        int control = -1;
+        for (int attempt = 0; attempt < 3000 && control < 0; ++attempt) {
+            control = connectUnix(path);
+            if (control < 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        string reply;
+        bool round = control >= 0 && exchangeLines(control, "register bench pw\nlogin bench pw\n", 2, reply);
+        for (size_t first = 0; round && first < lots; first += burst) {
+            string request;
+            size_t count = std::min(burst, lots - first);
+            for (size_t i = 0; i < count; ++i) {
+                request += "add shardlot" + std::to_string(first + i) + " 1\n";
+            }
+            round = exchangeLines(control, request, count, reply) && reply.find("err") == string::npos;
+        }
+
+        std::atomic<size_t> failures{0};
+        auto start = Clock::now();
+        vector<std::thread> workers;
+        for (size_t t = 0; round && t < clients; ++t) {
+            workers.emplace_back([&, t] {
+                int fd = connectUnix(path);
+                string answer;
+                if (fd < 0 || !exchangeLines(fd, "login bench pw\n", 1, answer)) {
+                    ++failures;
+                    return;
+                }
+                std::mt19937_64 rng(t + 1);
+                string request;
+                for (size_t sent = 0; sent < bidsPerClient; sent += burst) {
+                    request.clear();
+                    for (size_t i = 0; i < burst; ++i) {
+                        request += "bid #" + std::to_string(1 + rng() % lots) + " " +
+                                   std::to_string(2 + (sent + i) * clients + t) + "\n";
+                    }
+                    if (!exchangeLines(fd, request, burst, answer) || answer.find("err") != string::npos) {
+                        ++failures;
+                        break;
+                    }
+                }
+                ::close(fd);
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        double seconds = msSince(start) / 1000.0;
+        double rate = static_cast<double>(clients * bidsPerClient) / seconds;
+        if (baseline == 0) {
+            baseline = rate;
+        }
+
+        auto rebalanceStart = Clock::now();
+        round = round && exchangeLines(control, "shard add\n", 1, reply);
+        double rebalanceMs = msSince(rebalanceStart);
+        uint64_t moved = 0;
+        csv::parseNumber(reply.substr(reply.rfind(' ') + 1, reply.size() - reply.rfind(' ') - 2), moved);
+        const string tail = "end " + std::to_string(lots) + "\n";
+        round = round && reply.compare(0, 3, "ok ") == 0 && exchangeLines(control, "list\n", lots + 1, reply) &&
+                reply.size() >= tail.size() && reply.compare(reply.size() - tail.size(), tail.size(), tail) == 0;
+        ok = ok && round && failures == 0;
+        if (control >= 0) {
+            ::close(control);
+        }
+        ::kill(router, SIGTERM);
+        ::waitpid(router, nullptr, 0);
+        Row("shards")
+            .add("shards", uint64_t(shards))
+            .add("cores", uint64_t(std::thread::hardware_concurrency()))
+            .add("clients", clients)
+            .add("bids_per_sec", rate)
+            .add("speedup", rate / baseline)
+            .add("rebalance_ms", rebalanceMs)
+            .add("moved", moved)
+            .result(round && failures == 0)
+            .print(options);
+    }
+    removeTree(dir);
+    return ok;
+}
+
+// Запись файлов состояния: блокирующий ofstream с fsync, как было, против
+// движков aio. save — большой CSV, форматирование которого идёт, пока
+// предыдущие буферы пишутся на диск; parts — 256 файлов по 64 КБ с fsync
+// каждого, как разделы контрольной точки; read — файл целиком, как журнал
+// при запуске.
+bool persistEngines(const Options &options) {
+    const size_t rows = options.sizeOr(1000000);
+    const size_t parts = 256;
+    const string part(64 << 10, 'x');
+    const string path = "bench_persist.txt";
+    auto format = [rows](std::ostream &out) {
+        for (size_t i = 0; i < rows; ++i) {
+            out << i << ",item " << i << ",";
+            csv::writeNumber(out, static_cast<double>(i % 10000) / 100);
+            out << ",user" << i % 50000 << "\n";
+        }
+    };
+    auto partPath = [](size_t i) { return "bench_part." + std::to_string(i); };
+
+    auto start = Clock::now();
+    {
+        std::ofstream out(path + ".tmp", std::ios::trunc);
+        format(out);
+    }
+    commitFile(path);
+    double saveMs = msSince(start);
+    start = Clock::now();
+    for (size_t i = 0; i < parts; ++i) {
+        {
+            std::ofstream out(partPath(i) + ".tmp", std::ios::binary | std::ios::trunc);
+            out.write(part.data(), static_cast<std::streamsize>(part.size()));
+        }
+        commitFile(partPath(i));
+    }
+    double partsMs = msSince(start);
+    start = Clock::now();
+    std::ifstream in(path, std::ios::binary);
+    string reference((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    double readMs = msSince(start);
+    double megabytes = static_cast<double>(reference.size()) / (1 << 20);
+    Row("persist")
+        .add("engine", "ofstream")
+        .add("mb", megabytes)
+        .add("save_ms", saveMs)
+        .add("save_mb_s", megabytes / saveMs * 1000)
+        .add("parts_ms", partsMs)
+        .add("read_ms", readMs)
+        .print(options);
+
+    bool ok = true;
+    for (aio::Backend backend : {aio::Backend::Threads, aio::Backend::Uring}) {
+        unique_ptr<aio::Engine> engine = aio::Engine::create(backend);
+        start = Clock::now();
+        bool saved;
+        {
+            aio::File file(path, *engine);
+            std::ostream out(&file);
+            format(out);
+            saved = file.commit();
+        }
+        saveMs = msSince(start);
+        start = Clock::now();
+        aio::Wait written;
+        for (size_t i = 0; i < parts; ++i) {
+            aio::File file(partPath(i), *engine);
+            file.sputn(part.data(), static_cast<std::streamsize>(part.size()));
+            file.commit(written.add());
+        }
+        bool partsOk = written.wait() == static_cast<int64_t>(parts * part.size());
+        partsMs = msSince(start);
+        start = Clock::now();
+        string data;
+        bool read = aio::readFile(path, data, *engine);
+        readMs = msSince(start);
+        bool round = saved && partsOk && read && data == reference;
+        ok = ok && round;
+        Row("persist")
+            .add("engine", engine->name())
+            .add("mb", megabytes)
+            .add("save_ms", saveMs)
+            .add("save_mb_s", megabytes / saveMs * 1000)
+            .add("parts_ms", partsMs)
+            .add("read_ms", readMs)
+            .result(round)
+            .print(options);
+    }
+    std::remove(path.c_str());
+    for (size_t i = 0; i < parts; ++i) {
+        std::remove(partPath(i).c_str());
+    }
+    return ok;
+}
+
+struct Scenario {
+    const char *name;
+    const char *description;
+    bool (*run)(const Options &);
+};
+
+const Scenario kScenarios[] = {
+    {"micro", "отдельные операции Auction, проверка пароля, сохранение и загрузка", microOperations},
+    {"catalog", "ставка и покупка по имени при росте каталога", catalogScaling},
+    {"stress", "параллельные ставки и покупки с проверкой итоговых цен", concurrentStress},
+    {"storm", "шквал ставок на один лот от 1 до --threads потоков", biddingStorm},
+    {"longtail", "ставки по длинному хвосту лотов с оборотом", longTail},
+    {"chatty", "чат-нагрузка: запись и чтение страниц чатов", chatHeavy},
+    {"wal", "ставки с журналом при разных политиках fsync", walThroughput},
+    {"snapshot", "запуск из текстовых файлов против снимка", snapshotStartup},
+    {"import", "разбор CSV против чтения файла", csvImport},
+    {"chat", "открытие и листание чата при росте хранилища", chatPaging},
+    {"interning", "память под сообщения со строками и с ID отправителей", internedMemory},
+    {"slab", "обход и оборот лотов в слэбах", slabChurn},
+    {"index", "ставки вперемешку с запросами по цене", priceIndex},
+    {"batch", "пропускная способность пакетного режима", batchThroughput},
+    {"server", "задержка ставок через сервер при 10k простаивающих соединений", serverLatency},
+    {"expiry", "закрытие торгов по срокам на модельных часах", timedExpiry},
+    {"accounts", "регистрация и вход при росте числа аккаунтов", accountScaling},
+    {"metrics", "цена записи метрик в одном и нескольких потоках", metricsOverhead},
+    {"ledger", "история ставок, заявки с автоповышением и резервная цена", bidLedger},
+    {"search", "поиск по словам, началам слов и подстрокам названий", nameSearch},
+    {"checkpoint", "инкрементальные контрольные точки под потоком ставок", checkpointPause},
+    {"listing", "постраничный вывод каталога и чатов против построчного endl", catalogListing},
+    {"tiering", "вытеснение холодных чатов в сжатые сегменты под бюджетом RSS", chatTiering},
+    {"watch", "рассылка уведомлений по 1M подписок при 100k событий в секунду", watchFanOut},
+    {"shards", "ставки через маршрутизатор при 1-8 процессах-шардах и добавление шарда", shardScaling},
+    {"persist", "запись и чтение файлов состояния: ofstream против io_uring и пула потоков", persistEngines},
+};
+
+// ./auction bench [сценарий|all|list] [--size=N] [--threads=N] [--json]
+int run(int argc, char **argv) {
+    string scenario = "all";
+    Options options;
+    options.threads = std::max(4u, std::thread::hardware_concurrency());
+    for (int i = 0; i < argc; ++i) {
+        string arg = argv[i];
+        size_t value = 0;
+        if (arg.compare(0, 7, "--size=") == 0 && csv::parseNumber(std::string_view(arg).substr(7), value)) {
+            options.size = value;
+        } else if (arg.compare(0, 10, "--threads=") == 0 && csv::parseNumber(std::string_view(arg).substr(10), value) &&
+                   value > 0) {
+            options.threads = value;
+        } else if (arg == "--json") {
+            options.json = true;
+        } else if (arg.compare(0, 2, "--") != 0) {
+            scenario = arg;
+        } else {
+            cerr << "Неизвестный параметр: " << arg << endl;
+            return 1;
+        }
+    }
+    if (scenario == "list") {
+        for (const auto &entry : kScenarios) {
+            cout << entry.name << " - " << entry.description << "\n";
+        }
+        return 0;
+    }
+    bool ok = true;
+    bool found = false;
+    for (const auto &entry : kScenarios) {
+        if (scenario == entry.name || scenario == "all") {
+            found = true;
+            ok = entry.run(options) && ok;
+        }
+    }
+    if (!found) {
+        cerr << "Неизвестный сценарий: " << scenario << endl;
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
+
+} // namespace bench
+
+// Синтетическая нагрузка. generate пишет детерминированный по зерну набор
+// пользователей, лотов и сообщений в текстовом формате и трассу операций;
+// replay проигрывает трассу против Auction с записанной скоростью или
+// максимально быстро, так что любое изменение производительности можно
+// воспроизвести на одних и тех же данных.
+//
+// Трасса — строки "<время, мкс> <сеанс> <команда пакетного режима>". Каждый
+// сеанс начинается со своей команды login; строки с '#' — комментарии.
+namespace workload {
+
+// Равномерное число из [0, 1). Свои преобразования вместо std::*_distribution,
+// чтобы одно и то же зерно давало одни и те же данные с любой стандартной библиотекой.
+double unit(std::mt19937_64 &rng) { return static_cast<double>(rng() >> 11) * 0x1.0p-53; }
+
+uint64_t below(std::mt19937_64 &rng, uint64_t bound) {
+    return std::min(bound - 1, static_cast<uint64_t>(unit(rng) * static_cast<double>(bound)));
+}
+
+// Распределение Ципфа на [0, n): номер 0 самый популярный. Метод Грея и др.
+// (как в YCSB): подготовка O(n), выборка O(1). Номера перемешиваются
+// перестановкой, чтобы популярность не совпадала с порядком создания.
+class Zipf {
+private:
+    uint64_t n;
+    double theta;
+    double alpha = 0;
+    double zetan = 0;
+    double eta = 0;
+    double half = 0;
+    vector<uint32_t> order;
+
+public:
+    Zipf(uint64_t count, std::mt19937_64 &rng, double skew = 0.99) : n(count), theta(skew), order(count) {
+        for (uint64_t i = 1; i <= n; ++i) {
+            zetan += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        alpha = 1.0 / (1.0 - theta);
+        if (n > 2) {
+            eta = (1.0 - std::pow(2.0 / static_cast<double>(n), 1.0 - theta)) / (1.0 - zeta2 / zetan);
+        }
+        half = 1.0 + std::pow(0.5, theta);
+        for (uint64_t i = 0; i < n; ++i) {
+            order[i] = static_cast<uint32_t>(i);
+        }
+        for (uint64_t i = n; i > 1; --i) {
+            std::swap(order[i - 1], order[below(rng, i)]);
+        }
+    }
+
+    uint64_t operator()(std::mt19937_64 &rng) const {
+        if (n <= 2) {
+            return order[below(rng, n)];
+        }
+        double u = unit(rng);
+        double uz = u * zetan;
+        uint64_t rank;
+        if (uz < 1.0) {
+            rank = 0;
+        } else if (uz < half) {
+            rank = 1;
+        } else {
+            rank = std::min(n - 1, static_cast<uint64_t>(static_cast<double>(n) * std::pow(eta * u - eta + 1.0, alpha)));
+        }
+        return order[rank];
+    }
+};
+
+struct Config {
+    uint64_t seed = 1;
+    size_t users = 10000;
+    size_t items = 100000;
+    size_t messages = 200000;
+    size_t events = 1000000;
+    double duration = 60;
+    string dir = ".";
+};
+
+template <typename T> bool numberOption(const string &arg, const char *name, T &value) {
+    size_t length = std::strlen(name);
+    return arg.compare(0, length, name) == 0 && csv::parseNumber(std::string_view(arg).substr(length), value);
+}
+
+const char *const kNouns[] = {"Лампа", "Ваза", "Стул", "Часы", "Картина", "Книга", "Монета", "Марка",
+                              "Кресло", "Зеркало", "Самовар", "Шкатулка", "Гитара", "Фотоаппарат", "Велосипед", "Сервиз"};
+const char *const kMaterials[] = {"латунь", "дуб", "серебро", "фарфор", "бронза", "стекло", "кожа", "хрусталь"};
+const char *const kPhrases[] = {"Какое состояние?", "Возможен самовывоз?", "Есть ли документы?", "Отправите почтой?",
+                                "Торг уместен?", "Можно больше фото?", "Какой год выпуска?", "Беру, если ещё доступно"};
+
+string priceText(uint64_t cents) {
+    string text = std::to_string(cents / 100) + ".";
+    text += static_cast<char>('0' + cents / 10 % 10);
+    text += static_cast<char>('0' + cents % 10);
+    return text;
+}
+
+struct TraceEvent {
+    uint64_t time;
+    uint32_t session;
+    string command;
+};
+
+// Торги по лоту заканчиваются в момент end; ставки сгущаются к концу, как
+// в эндшпиле аукциона: три четверти ставок приходятся на последние 10% торгов.
+int generate(int argc, char **argv) {
+    Config config;
+    for (int i = 0; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 6, "--dir=") == 0) {
+            config.dir = arg.substr(6);
+        } else if (!numberOption(arg, "--seed=", config.seed) && !numberOption(arg, "--users=", config.users) &&
+                   !numberOption(arg, "--items=", config.items) && !numberOption(arg, "--messages=", config.messages) &&
+                   !numberOption(arg, "--events=", config.events) && !numberOption(arg, "--duration=", config.duration)) {
+            cerr << "Неизвестный параметр: " << arg << endl;
+            return 1;
+        }
+    }
+    if (config.users == 0 || config.items == 0 || config.duration <= 0) {
+        cerr << "Нужны хотя бы один пользователь, один лот и положительная длительность." << endl;
+        return 1;
+    }
+    std::mt19937_64 rng(config.seed);
+    Zipf lots(config.items, rng);
+    Zipf bidders(config.users, rng);
+
+    Accounts accounts;
+    vector<const Buyer *> buyers;
+    accounts.reserve(config.users);
+    for (size_t i = 0; i < config.users; ++i) {
+        buyers.push_back(accounts.add(make_unique<Buyer>("user" + std::to_string(i), "pw" + std::to_string(i))));
+    }
+    Auction auction;
+    vector<uint64_t> cents(config.items);
+    vector<ItemRecord> batch;
+    batch.reserve(config.items);
+    for (size_t i = 0; i < config.items; ++i) {
+        string name = string(kNouns[below(rng, std::size(kNouns))]) + " " + kMaterials[below(rng, std::size(kMaterials))] +
+                      " " + std::to_string(i + 1);
+        // Стартовые цены логарифмически равномерны от 1 до 10000.
+        cents[i] = Item::toCents(std::exp(unit(rng) * std::log(10000.0)));
+        batch.push_back({ItemId(i + 1), move(name), Item::fromCents(cents[i]), buyers[below(rng, config.users)]->getId()});
+    }
+    auction.addItems(move(batch));
+    for (size_t i = 0; i < config.messages; ++i) {
+        auction.sendMessage(buyers[bidders(rng)]->getUsername(), kPhrases[below(rng, std::size(kPhrases))],
+                            ItemId(lots(rng) + 1));
+    }
+    saveUsersToFile(accounts, config.dir + "/users.txt");
+    auction.saveItemsToFile(config.dir + "/items.txt");
+    auction.saveMessagesToFile(config.dir + "/messages.txt");
+
+    const uint64_t span = static_cast<uint64_t>(config.duration * 1e6);
+    vector<uint64_t> ends(config.items);
+    for (auto &end : ends) {
+        end = static_cast<uint64_t>(static_cast<double>(span) * (0.2 + 0.8 * unit(rng)));
+    }
+    // Ставки получают суммы после сортировки по времени, поэтому пока
+    // хранят только номер лота.
+    struct Pending {
+        uint64_t time;
+        uint32_t session;
+        uint32_t lot;
+        char kind;
+        string command;
+    };
+    vector<Pending> pending;
+    pending.reserve(config.events);
+    for (size_t i = 0; i < config.events; ++i) {
+        uint32_t session = static_cast<uint32_t>(bidders(rng));
+        double roll = unit(rng);
+        if (roll < 0.80) {
+            uint32_t lot = static_cast<uint32_t>(lots(rng));
+            uint64_t time = static_cast<uint64_t>(static_cast<double>(ends[lot]) * (1.0 - std::pow(unit(rng), 8)));
+            pending.push_back({time, session, lot, 'b', {}});
+            continue;
+        }
+        uint64_t time = below(rng, span);
+        if (roll < 0.92) {
+            pending.push_back({time, session, 0, 'c',
+                               "msg " + std::to_string(lots(rng) + 1) + " " + kPhrases[below(rng, std::size(kPhrases))]});
+        } else if (roll < 0.95) {
+            pending.push_back({time, session, 0, 'c',
+                               "add " + string(kNouns[below(rng, std::size(kNouns))]) + " " +
+                                   priceText(Item::toCents(std::exp(unit(rng) * std::log(10000.0))))});
+        } else if (roll < 0.98) {
+            pending.push_back({time, session, 0, 'c', "top 20"});
+        } else {
+            uint64_t low = Item::toCents(std::exp(unit(rng) * std::log(10000.0)));
+            pending.push_back({time, session, 0, 'c', "range " + priceText(low) + " " + priceText(low * 11 / 10) + " 50"});
+        }
+    }
+    std::stable_sort(pending.begin(), pending.end(), [](const Pending &a, const Pending &b) { return a.time < b.time; });
+
+    // Большинство ставок поднимают цену на 1–5%, каждая десятая запаздывает
+    // и оказывается ниже текущей. Лот покупает последний принятый участник
+    // сразу после окончания торгов.
+    vector<uint32_t> leader(config.items, UINT32_MAX);
+    vector<TraceEvent> trace;
+    trace.reserve(pending.size() + config.items / 4);
+    for (auto &event : pending) {
+        if (event.kind == 'c') {
+            trace.push_back({event.time, event.session, move(event.command)});
+            continue;
+        }
+        uint64_t &current = cents[event.lot];
+        uint64_t amount;
+        if (unit(rng) < 0.1) {
+            amount = current - current * below(rng, 3) / 100;
+        } else {
+            amount = current + current * (1 + below(rng, 5)) / 100 + 1;
+            current = amount;
+            leader[event.lot] = event.session;
+        }
+        trace.push_back({event.time, event.session, "bid #" + std::to_string(event.lot + 1) + " " + priceText(amount)});
+    }
+    size_t sold = 0;
+    for (size_t lot = 0; lot < config.items; ++lot) {
+        if (leader[lot] != UINT32_MAX) {
+            trace.push_back({ends[lot] + 1, leader[lot], "buy #" + std::to_string(lot + 1)});
+            ++sold;
+        }
+    }
+    std::stable_sort(trace.begin(), trace.end(), [](const TraceEvent &a, const TraceEvent &b) { return a.time < b.time; });
+
+    const string tracePath = config.dir + "/trace.txt";
+    std::ofstream out(tracePath);
+    if (!out.is_open()) {
+        cerr << "Не удалось открыть " << tracePath << " для записи." << endl;
+        return 1;
+    }
+    out << "# seed=" << config.seed << " users=" << config.users << " items=" << config.items
+        << " events=" << trace.size() << "\n";
+    vector<bool> loggedIn(config.users, false);
+    for (const auto &event : trace) {
+        if (!loggedIn[event.session]) {
+            loggedIn[event.session] = true;
+            out << event.time << ' ' << event.session << " login user" << event.session << " pw" << event.session << "\n";
+        }
+        out << event.time << ' ' << event.session << ' ' << event.command << "\n";
+    }
+    out.close();
+    cout << "Сгенерировано: пользователей " << config.users << ", лотов " << config.items << ", сообщений "
+         << config.messages << ", событий трассы " << trace.size() << " (продаж " << sold << ")." << endl;
+    return 0;
+}
+
+struct ReplayEvent {
+    uint64_t time;
+    uint32_t session;
+    batch::Command command;
+};
+
+// ./auction replay [трасса] [--dir=каталог] [--speed=max|recorded|<множитель>] [--json]
+// Состояние берётся из текстовых файлов каталога и в файлы не сохраняется.
+int replay(int argc, char **argv) {
+    string tracePath;
+    string dir = ".";
+    double speed = 0;
+    bench::Options options;
+    for (int i = 0; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 6, "--dir=") == 0) {
+            dir = arg.substr(6);
+        } else if (arg.compare(0, 8, "--speed=") == 0) {
+            string value = arg.substr(8);
+            if (value == "max") {
+                speed = 0;
+            } else if (value == "recorded") {
+                speed = 1;
+            } else if (!csv::parseNumber(value, speed) || speed <= 0) {
+                cerr << "Неверная скорость: " << value << endl;
+                return 1;
+            }
+        } else if (arg == "--json") {
+            options.json = true;
+        } else if (arg.compare(0, 2, "--") != 0 && tracePath.empty()) {
+            tracePath = arg;
+        } else {
+            cerr << "Неизвестный параметр: " << arg << endl;
+            return 1;
+        }
+    }
+    if (tracePath.empty()) {
+        tracePath = dir + "/trace.txt";
+    }
+    auto file = MappedFile::open(tracePath, true);
+    if (!file) {
+        cerr << "Не удалось открыть трассу " << tracePath << "." << endl;
+        return 1;
+    }
+    vector<ReplayEvent> events;
+    uint32_t sessions = 0;
+    std::string_view text(file->data(), file->size());
+    while (!text.empty()) {
+        size_t newline = text.find('\n');
+        std::string_view line = text.substr(0, newline);
+        text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        ReplayEvent event;
+        std::string_view time = batch::nextToken(line);
+        std::string_view session = batch::nextToken(line);
+        if (!csv::parseNumber(time, event.time) || !csv::parseNumber(session, event.session)) {
+            cerr << "Неверная строка трассы: " << time << ' ' << session << ' ' << line << endl;
+            return 1;
+        }
+        size_t begin = line.find_first_not_of(" \t");
+        event.command = batch::parse(begin == std::string_view::npos ? std::string_view() : line.substr(begin));
+        sessions = std::max(sessions, event.session + 1);
+        events.push_back(event);
+    }
+
+    Auction auction;
+    Accounts accounts;
+    loadUsersFromFile(accounts, dir + "/users.txt");
+    auction.loadItemsFromFile(dir + "/items.txt");
+    auction.loadMessagesFromFile(dir + "/messages.txt");
+    batch::Executor executor(auction, accounts);
+    vector<batch::Session> states(sessions);
+    int sink = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    vector<uint32_t> latencies;
+    latencies.reserve(events.size());
+    double maxLateMs = 0;
+    {
+        BufferedWriter out(sink);
+        auto start = bench::Clock::now();
+        for (const auto &event : events) {
+            auto now = bench::Clock::now();
+            if (speed > 0) {
+                auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(static_cast<double>(event.time) * 1000.0 / speed));
+                if (now < due) {
+                    std::this_thread::sleep_until(due);
+                    now = bench::Clock::now();
+                } else {
+                    maxLateMs = std::max(maxLateMs, std::chrono::duration<double, std::milli>(now - due).count());
+                }
+            }
+            executor.execute(event.command, states[event.session], out);
+            latencies.push_back(static_cast<uint32_t>(
+                std::min<int64_t>(UINT32_MAX, std::chrono::duration_cast<std::chrono::nanoseconds>(bench::Clock::now() - now).count())));
+        }
+        double elapsedMs = bench::msSince(start);
+        out.flush();
+        size_t failures = 0;
+        for (const auto &state : states) {
+            failures += state.result.failures;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double p) {
+            return latencies.empty() ? 0.0
+                                     : latencies[static_cast<size_t>(p * static_cast<double>(latencies.size() - 1))] / 1000.0;
+        };
+        bench::Row("replay").add("events", uint64_t(events.size())).add("speed", speed).add("elapsed_ms", elapsedMs)
+            .add("ops_per_sec", static_cast<double>(events.size()) / elapsedMs * 1000.0).add("p50_us", percentile(0.5))
+            .add("p99_us", percentile(0.99)).add("p999_us", percentile(0.999)).add("max_late_ms", maxLateMs)
+            .add("errors", uint64_t(failures)).print(options);
+    }
+    ::close(sink);
+    return 0;
+}
+
+} // namespace workload
+
+int main(int argc, char **argv) {
+    if (argc > 1 && string(argv[1]) == "bench") {
+        return bench::run(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "generate") {
+        return workload::generate(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "replay") {
+        return workload::replay(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "route") {
+        return shard::route(argc - 2, argv + 2);
+    }
+    // Перевод текстовых файлов в снимок и обратно.
+    // Если есть контрольная точка, export берёт состояние из неё.
+    if (argc > 1 && (string(argv[1]) == "convert" || string(argv[1]) == "export")) {
+        Auction auction;
+        Accounts accounts;
+        CheckpointManifest manifest;
+        if (string(argv[1]) == "convert") {
+            loadUsersFromFile(accounts, "users.txt");
+            auction.loadItemsFromFile("items.txt");
+            auction.loadMessagesFromFile("messages.txt");
+            return saveSnapshot(auction, accounts, "auction.snap") ? 0 : 1;
+        }
+        if (Checkpointer::exists("auction.ckpt") ? Checkpointer::load(auction, accounts, "auction.ckpt", manifest)
+                                                 : loadSnapshot(auction, accounts, "auction.snap")) {
+            bool saved = saveUsersToFile(accounts, "users.txt");
+            saved = auction.saveItemsToFile("items.txt") && saved;
+            saved = auction.saveMessagesToFile("messages.txt") && saved;
+            return saved ? 0 : 1;
+        }
+        cout << "Снимок auction.snap не найден." << endl;
+        return 1;
+    }
+
+    // ./auction batch [файл команд] — пакетный режим, без файла команды читаются из stdin.
+    // ./auction serve [путь сокета] — сервер, по умолчанию на auction.sock.
+    // --stats-file=путь — раз в --stats-interval=N секунд (по умолчанию 10)
+    // записывать туда метрики, с --stats-json — в JSON.
+    // --anti-snipe=N — ставка за последние N секунд продлевает торги на N секунд.
+    // --checkpoint=N — раз в N секунд фоновая контрольная точка в auction.ckpt
+    // вместо полного снимка при выходе. Если точка там уже есть, режим
+    // включается сам, по умолчанию раз в минуту.
+    // --chat-budget=N — держать процесс в N МБ, вытесняя давно не читанные
+    // чаты сжатыми в auction.cold.
+    // ./auction route [путь сокета] [--shards=N] — маршрутизатор к N
+    // процессам-шардам; шард — serve --shard, он понимает служебные команды.
+    // --io=uring|threads — чем писать снимки и файлы состояния; по умолчанию
+    // io_uring, если ядро его даёт, иначе пул потоков.
+    bool batchMode = argc > 1 && string(argv[1]) == "batch";
+    bool serveMode = argc > 1 && string(argv[1]) == "serve";
+    string modeArgument;
+    FsyncPolicy fsyncPolicy = FsyncPolicy::Interval;
+    string statsFile;
+    unsigned statsInterval = 10;
+    bool statsJson = false;
+    unsigned antiSnipe = 0;
+    unsigned checkpointInterval = 0;
+    size_t chatBudgetMb = 0;
+    bool shardMode = false;
+    for (int i = batchMode || serveMode ? 2 : 1; i < argc; ++i) {
+        string arg = argv[i];
+        if ((batchMode || serveMode) && modeArgument.empty() && arg.compare(0, 2, "--") != 0) {
+            modeArgument = arg;
+        } else if (arg == "--fsync=always") {
+            fsyncPolicy = FsyncPolicy::Always;
+        } else if (arg == "--fsync=interval") {
+            fsyncPolicy = FsyncPolicy::Interval;
+        } else if (arg == "--fsync=never") {
+            fsyncPolicy = FsyncPolicy::Never;
+        } else if (arg.compare(0, 13, "--stats-file=") == 0 && arg.size() > 13) {
+            statsFile = arg.substr(13);
+        } else if (arg.compare(0, 17, "--stats-interval=") == 0) {
+            if (!csv::parseNumber(std::string_view(arg).substr(17), statsInterval) || statsInterval == 0) {
+                cerr << "Неверный интервал метрик: " << arg << endl;
+                return 1;
+            }
+        } else if (arg == "--stats-json") {
+            statsJson = true;
+        } else if (arg.compare(0, 13, "--anti-snipe=") == 0) {
+            if (!csv::parseNumber(std::string_view(arg).substr(13), antiSnipe)) {
+                cerr << "Неверное время продления: " << arg << endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 13, "--checkpoint=") == 0) {
+            if (!csv::parseNumber(std::string_view(arg).substr(13), checkpointInterval)) {
+                cerr << "Неверный интервал контрольных точек: " << arg << endl;
+                return 1;
+            }
+        } else if (serveMode && arg == "--shard") {
+            shardMode = true;
+        } else if (arg == "--io=uring") {
+            aio::Engine::prefer(aio::Backend::Uring);
+        } else if (arg == "--io=threads") {
+            aio::Engine::prefer(aio::Backend::Threads);
+        } else if (arg.compare(0, 14, "--chat-budget=") == 0) {
+            if (!csv::parseNumber(std::string_view(arg).substr(14), chatBudgetMb) || chatBudgetMb == 0) {
+                cerr << "Неверный бюджет памяти: " << arg << endl;
+                return 1;
+            }
+        } else {
+            cerr << "Неизвестный параметр: " << arg << endl;
+            return 1;
+        }
+    }
+
+    // В пакетном режиме stdout занят ответами, служебные сообщения идут в stderr.
+    if (batchMode) {
+        cout.rdbuf(cerr.rdbuf());
+    }
+
+    Auction auction;
+    Accounts accounts;
+
+    const string checkpointDir = "auction.ckpt";
+    CheckpointManifest manifest;
+    uint64_t walLsn = 0;
+    bool fromCheckpoint = Checkpointer::exists(checkpointDir);
+    if (fromCheckpoint) {
+        if (!Checkpointer::load(auction, accounts, checkpointDir, manifest)) {
+            cerr << "Контрольная точка в " << checkpointDir << " повреждена." << endl;
+            return 1;
+        }
+    } else if (!loadSnapshot(auction, accounts, "auction.snap", &walLsn)) {
+        loadUsersFromFile(accounts, "users.txt");
+        auction.loadItemsFromFile("items.txt");
+        auction.loadMessagesFromFile("messages.txt");
+    }
+    bool checkpointing = fromCheckpoint || checkpointInterval != 0;
+    if (checkpointing && !fromCheckpoint) {
+        auction.markAllChanged();
+    }
+
+    // Всё, что изменилось после последнего сохранения, лежит в журнале.
+    WriteAheadLog::replaySegments("auction.wal", manifest.segment, [&](const WalRecord &record) {
+        if (record.type == WalRecordType::Register) {
+            accounts.add(make_unique<Buyer>(record.name, static_cast<size_t>(record.passwordHash)));
+        } else {
+            auction.applyLogRecord(record);
+        }
+    }, &walLsn);
+    WriteAheadLog wal("auction.wal", fsyncPolicy, std::chrono::milliseconds(50), manifest.segment, walLsn);
+    auction.attachLog(&wal);
+    accounts.attachLog(&wal);
+    unique_ptr<Checkpointer> checkpointer;
+    if (checkpointing) {
+        checkpointer = make_unique<Checkpointer>(auction, accounts, wal, checkpointDir, "auction.wal", manifest,
+                                                 std::chrono::seconds(checkpointInterval ? checkpointInterval : 60));
+    }
+    // При выходе: последняя контрольная точка или полный снимок с очисткой
+    // журнала. Если записать не вышло, журнал остаётся как есть и при
+    // следующем запуске восстанавливает всё, что в нём есть.
+    auto saveState = [&] {
+        if (checkpointer) {
+            return checkpointer->checkpoint();
+        }
+        if (!saveSnapshot(auction, accounts, "auction.snap", wal.lastLsn())) {
+            cerr << "Состояние не сохранено, журнал auction.wal оставлен." << endl;
+            return false;
+        }
+        wal.reset();
+        return true;
+    };
+
+    metrics::Gauge itemsGauge("catalog_items", [&auction] { return static_cast<double>(auction.itemCount()); });
+    metrics::Gauge walGauge("wal_backlog", [&wal] { return static_cast<double>(wal.backlog()); });
+    metrics::Gauge deadlinesGauge("pending_deadlines",
+                                  [&auction] { return static_cast<double>(auction.pendingDeadlines()); });
+    // Уведомления подписчикам; подключаются после проигрывания журнала и
+    // живут дольше таймера, который закрывает лоты.
+    watch::Dispatcher events;
+    auction.attachEvents(&events);
+    metrics::Gauge watchGauge("subscriptions", [&events] { return static_cast<double>(events.stats().subscriptions); });
+    unique_ptr<metrics::Dumper> statsDumper;
+    if (!statsFile.empty()) {
+        statsDumper = make_unique<metrics::Dumper>(statsFile, std::chrono::seconds(statsInterval), statsJson);
+    }
+
+    // Итоги торгов дописываются в settlements.log строками
+    // "<время мс> <ID> <победитель|-> <цена> <продавец> <название>", а история
+    // ставок закрытого лота — в bids.log строками
+    // "<ID> <время мс> <участник> <цена> <manual|auto>" для разбора споров.
+    std::ofstream settlementLog("settlements.log", std::ios::app);
+    std::ofstream bidLog("bids.log", std::ios::app);
+    std::mutex settlementMutex;
+    bool interactive = !batchMode && !serveMode;
+    auction.onSettlement([&](const Settlement &settlement) {
+        const UserDirectory &directory = UserDirectory::instance();
+        const string &winner = settlement.winner == kNoUser ? string("-") : directory.name(settlement.winner);
+        std::lock_guard<std::mutex> lock(settlementMutex);
+        settlementLog << settlement.closedAt << ' ' << settlement.id << ' ' << winner << ' '
+                      << Item::fromCents(settlement.cents) << ' ' << directory.name(settlement.seller) << ' '
+                      << settlement.name << endl;
+        if (settlement.bids) {
+            for (size_t i = 0; i < settlement.bids->size(); ++i) {
+                BidBook::Entry entry = settlement.bids->entry(i);
+                bidLog << settlement.id << ' ' << entry.time << ' ' << directory.name(entry.bidder) << ' '
+                       << Item::fromCents(entry.cents) << (entry.proxy ? " auto\n" : " manual\n");
+            }
+            bidLog.flush();
+        }
+        if (interactive) {
+            cout << "\nТорги по товару " << settlement.name << " (ID " << settlement.id << ") завершены: "
+                 << (settlement.winner != kNoUser ? "победил " + winner
+                     : settlement.bids           ? "резервная цена не достигнута"
+                                                 : "ставок не было")
+                 << endl;
+        }
+    });
+    auction.setAntiSniping(antiSnipe * 1000ull, antiSnipe * 1000ull);
+    // Лоты, чей срок вышел, пока программа не работала, закрываются сразу.
+    Ticker ticker(auction);
+    unique_ptr<ChatBudget> chatBudget;
+    unique_ptr<metrics::Gauge> coldGauge;
+    if (chatBudgetMb) {
+        auction.enableColdChats("auction.cold");
+        chatBudget = make_unique<ChatBudget>(auction, chatBudgetMb << 20);
+        coldGauge = make_unique<metrics::Gauge>(
+            "cold_chats", [&auction] { return static_cast<double>(auction.chatTiers().coldChats); });
+    }
+
+    if (batchMode) {
+        int inFd = modeArgument.empty() ? STDIN_FILENO : ::open(modeArgument.c_str(), O_RDONLY | O_CLOEXEC);
+        if (inFd < 0) {
+            cerr << "Не удалось открыть файл команд " << modeArgument << "." << endl;
+            return 1;
+        }
+        batch::Result result = batch::run(auction, accounts, inFd, STDOUT_FILENO);
+        if (inFd != STDIN_FILENO) {
+            ::close(inFd);
+        }
+        cerr << "Команд: " << result.commands << ", ошибок: " << result.failures << endl;
+        return saveState() ? 0 : 1;
+    }
+
+    if (serveMode) {
+        string socketPath = modeArgument.empty() ? "auction.sock" : modeArgument;
+        server::raiseFileLimit();
+        batch::Executor executor(auction, accounts);
+        if (shardMode) {
+            executor.allowInternal(saveState);
+        }
+        {
+            server::Reactor reactor(executor);
+            if (!reactor.listen(socketPath)) {
+                return 1;
+            }
+            struct sigaction action{};
+            action.sa_handler = server::requestStop;
+            ::sigaction(SIGINT, &action, nullptr);
+            ::sigaction(SIGTERM, &action, nullptr);
+            cout << "Сервер слушает " << socketPath << endl;
+            reactor.run(server::stopRequested);
+        }
+        bool saved = saveState();
+        cout << "Сервер остановлен." << endl;
+        return saved ? 0 : 1;
+    }
+
+    // Общий буфер вывода меню: списки уходят в cout постранично.
+    StreamWriter view(cout);
+    vector<watch::Event> notices;
+    while (true) {
+        cout << "\nМеню:\n";
+        cout << "1. Войти\n";
+        cout << "2. Зарегистрироваться\n";
+        cout << "3. Выход\n";
+        cout << "Выберите действие: ";
+
+        int mainChoice;
+        cin >> mainChoice;
+
+        if (mainChoice == 1) {
+            string username, password;
+            cout << "Введите имя пользователя: ";
+            cin >> username;
+            cout << "Введите пароль: ";
+            cin >> password;
+
+            const Buyer *buyer = accounts.login(username, password);
+            if (buyer) {
+                cout << "Вход выполнен!" << endl;
+
+                bool loggedIn = true;
+                while (loggedIn) {
+                    notices.clear();
+                    events.poll(buyer->getId(), notices, 20);
+                    if (!notices.empty()) {
+                        view << "\nУведомления:\n";
+                        for (const auto &event : notices) {
+                            watch::display(view, event);
+                        }
+                        view.flush();
+                    }
+                    cout << "\nМеню:\n";
+                    cout << "1. Добавить товар\n";
+                    cout << "2. Просмотреть товары\n";
+                    cout << "3. Сделать ставку на товар\n";
+                    cout << "4. Купить товар\n";
+                    cout << "5. Отправить сообщение\n";
+                    cout << "6. Просмотреть чаты\n";
+                    cout << "7. Товары в диапазоне цен\n";
+                    cout << "8. Самые дорогие товары\n";
+                    cout << "9. Самые дешёвые товары продавца\n";
+                    cout << "10. Ставка с автоповышением\n";
+                    cout << "11. История ставок по товару\n";
+                    cout << "12. Поиск товаров\n";
+                    cout << "13. Следить за товаром или продавцом\n";
+                    cout << "14. Выход\n";
+                    cout << "Выберите действие: ";
+
+                    int choice;
+                    cin >> choice;
+
+                    if (choice == 1) {
+                        string itemName;
+                        double itemPrice;
+                        cout << "Введите название товара: ";
+                        cin >> itemName;
+                        cout << "Введите начальную цену товара: ";
+                        cin >> itemPrice;
+                        uint64_t seconds;
+                        cout << "Длительность торгов в секундах (0 - без срока): ";
+                        cin >> seconds;
+                        double reserve;
+                        cout << "Резервная цена (0 - без резерва): ";
+                        cin >> reserve;
+
+                        uint64_t endsAt = seconds ? auction.now() + seconds * 1000 : 0;
+                        ItemId added = auction.addItem(
+                            {kNoItem, itemName, itemPrice, buyer->getId(), Item::kNoBidder, endsAt, reserve});
+                        if (added == kNoItem) {
+                            cout << "Товар не добавлен." << endl;
+                        } else {
+                            cout << "Товар добавлен!" << endl;
+                        }
+
+                    } else if (choice == 2) {
+                        auction.displayItems(view);
+
+                    } else if (choice == 3) {
+                        string itemName;
+                        double bidPrice;
+                        cout << "Введите название товара для ставки: ";
+                        cin >> itemName;
+                        cout << "Введите вашу ставку: ";
+                        cin >> bidPrice;
+
+                        auction.bidItem(itemName, bidPrice, buyer);
+
+                    } else if (choice == 4) {
+                        string itemName;
+                        cout << "Введите название товара для покупки: ";
+                        cin >> itemName;
+
+                        auction.buyItem(itemName, buyer);
+
+                    } else if (choice == 5) {
+                        ItemId itemId;
+                        string messageContent;
+                        cout << "Введите ID товара, к которому хотите отправить сообщение: ";
+                        cin >> itemId;
+                        cout << "Введите ваше сообщение: ";
+                        cin.ignore();
+                        std::getline(cin, messageContent);
+
+                        if (auction.sendMessage(buyer->getUsername(), messageContent, itemId)) {
+                            cout << "Сообщение отправлено!" << endl;
+                        } else {
+                            cout << "Не удалось отправить сообщение: чат не читается." << endl;
+                        }
+
+                    } else if (choice == 6) {
+                        auction.displayMessages(view);
+
+                        ItemId chatChoice;
+                        cout << "Введите номер ID товара для открытия чата: ";
+                        cin >> chatChoice;
+
+                        auction.displayChat(chatChoice, view);
+
+                    } else if (choice == 7) {
+                        double minPrice, maxPrice;
+                        cout << "Введите минимальную и максимальную цену: ";
+                        cin >> minPrice >> maxPrice;
+
+                        Auction::displayListings(auction.itemsInPriceRange(minPrice, maxPrice), view);
+
+                    } else if (choice == 8) {
+                        size_t count;
+                        cout << "Сколько товаров показать: ";
+                        cin >> count;
+
+                        Auction::displayListings(auction.mostExpensive(count), view);
+
+                    } else if (choice == 9) {
+                        string seller;
+                        size_t count;
+                        cout << "Введите имя продавца: ";
+                        cin >> seller;
+                        cout << "Сколько товаров показать: ";
+                        cin >> count;
+
+                        Auction::displayListings(auction.cheapestBySeller(seller, count), view);
+
+                    } else if (choice == 10) {
+                        string itemName;
+                        double maxPrice;
+                        cout << "Введите название товара: ";
+                        cin >> itemName;
+                        cout << "Максимальная цена, до которой повышать ставку: ";
+                        cin >> maxPrice;
+
+                        auction.bidItem(itemName, maxPrice, buyer, true);
+
+                    } else if (choice == 11) {
+                        string itemName;
+                        size_t count;
+                        cout << "Введите название товара: ";
+                        cin >> itemName;
+                        cout << "Сколько последних ставок показать: ";
+                        cin >> count;
+
+                        auction.displayBids(itemName, count, view);
+
+                    } else if (choice == 12) {
+                        string query;
+                        cout << "Введите слова или начала слов из названия (*часть — в любом месте слова): ";
+                        cin.ignore();
+                        std::getline(cin, query);
+
+                        Auction::displayListings(auction.searchItems(query, 20), view);
+
+                    } else if (choice == 13) {
+                        string target;
+                        cout << "Введите ID товара или имя продавца: ";
+                        cin >> target;
+
+                        ItemId itemId;
+                        UserId seller = UserDirectory::instance().find(target);
+                        if (csv::parseNumber(target, itemId) && !auction.hasItem(itemId)) {
+                            cout << "Товар ID " << itemId << " не найден." << endl;
+                        } else if (csv::parseNumber(target, itemId)) {
+                            events.watchItem(buyer->getId(), itemId);
+                            cout << "Вы будете получать уведомления о товаре ID " << itemId << "." << endl;
+                        } else if (seller != kNoUser) {
+                            events.watchSeller(buyer->getId(), seller);
+                            cout << "Вы будете получать уведомления о товарах продавца " << target << "." << endl;
+                        } else {
+                            cout << "Продавец " << target << " не найден." << endl;
+                        }
+
+                    } else if (choice == 14) {
+                        loggedIn = false;
+                    } else {
+                        cout << "Неверный выбор. Попробуйте снова." << endl;
+                    }
+                }
+            } else {
+                cout << "Неверное имя пользователя или пароль." << endl;
+            }
+
+        } else if (mainChoice == 2) {
+            string username, password;
+            cout << "Введите имя пользователя: ";
+            cin >> username;
+            cout << "Введите пароль: ";
+            cin >> password;
+
+            if (!UserDirectory::instance().accepts(username)) {
+                cout << "Справочник пользователей переполнен." << endl;
+            } else if (accounts.registerUser(username, password)) {
+                cout << "Аккаунт создан!" << endl;
+            } else {
+                cout << "Имя " << username << " уже занято." << endl;
+            }
 
         } else if (mainChoice == 3) {
-            saveUsersToFile(buyers, "users.txt");
-            auction.saveItemsToFile("items.txt");
-            auction.saveMessagesToFile("messages.txt");
+            saveState();
             cout << "Выход из программы." << endl;
             break;
 